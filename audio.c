@@ -0,0 +1,92 @@
+/**----------------------------------------------------------------------------
+ *	audio.c
+ *  host audio output: lock free single producer/single consumer sample ring
+ *  feeding the SDL audio callback
+ *
+ *	The emulation thread produces one frame worth of samples at a time and appends them
+ *	to the ring, the SDL audio thread pulls them out in its callback. The read and write
+ *	indices are only ever written by their owning side, so no locks are needed.
+ **/
+
+#include <stdatomic.h>
+#include <string.h>
+
+#include "sdlut.h"
+#include "audio.h"
+
+#define RING_MASK	(AUDIO_RING_SIZE - 1)
+
+static float RING[AUDIO_RING_SIZE];
+static atomic_uint RING_READ;		// owned by the consumer (audio callback)
+static atomic_uint RING_WRITE;		// owned by the producer (emulation)
+
+static int SAMPLE_RATE = SDLUT_DEFAULT_AUDIO_SAMPLE_RATE;
+static float LAST_SAMPLE = 0.0f;	// repeated on underrun (avoids clicks)
+
+
+// Append samples to the ring: returns the number of samples actually written
+// (samples that don't fit are dropped)
+int audio_ring_write(const float *samples, int count) {
+	unsigned int w = atomic_load_explicit(&RING_WRITE, memory_order_relaxed);
+	unsigned int r = atomic_load_explicit(&RING_READ, memory_order_acquire);
+
+	int space = AUDIO_RING_SIZE - 1 - (int)(w - r);
+	if (count > space)
+		count = space;
+
+	// at most two chunks: up to the end of the ring and from its start
+	int first = AUDIO_RING_SIZE - (int)(w & RING_MASK);
+	if (first > count)
+		first = count;
+	memcpy(&RING[w & RING_MASK], samples, first * sizeof(float));
+	memcpy(&RING[0], samples + first, (count - first) * sizeof(float));
+
+	atomic_store_explicit(&RING_WRITE, w + count, memory_order_release);
+	return count;
+}
+
+// number of samples currently queued for playback
+int audio_ring_fill() {
+	unsigned int w = atomic_load_explicit(&RING_WRITE, memory_order_acquire);
+	unsigned int r = atomic_load_explicit(&RING_READ, memory_order_acquire);
+	return (int)(w - r);
+}
+
+// SDL audio callback: runs on the SDL audio thread (see InitSDLAudio() in sdlut.c)
+void AudioCallback(void *userdata, Uint8 *stream, int len) {
+	float *out = (float *)stream;
+	int count = len / (int)sizeof(float);
+
+	unsigned int r = atomic_load_explicit(&RING_READ, memory_order_relaxed);
+	unsigned int w = atomic_load_explicit(&RING_WRITE, memory_order_acquire);
+
+	int avail = (int)(w - r);
+	int n = (avail < count) ? avail : count;
+
+	int first = AUDIO_RING_SIZE - (int)(r & RING_MASK);
+	if (first > n)
+		first = n;
+	memcpy(out, &RING[r & RING_MASK], first * sizeof(float));
+	memcpy(out + first, &RING[0], (n - first) * sizeof(float));
+
+	if (n > 0)
+		LAST_SAMPLE = out[n - 1];
+
+	// underrun: hold the last level
+	for (int i = n; i < count; i++)
+		out[i] = LAST_SAMPLE;
+
+	atomic_store_explicit(&RING_READ, r + n, memory_order_release);
+}
+
+void audio_init(int sample_rate) {
+	SAMPLE_RATE = sample_rate;
+	atomic_store(&RING_READ, 0);
+	atomic_store(&RING_WRITE, 0);
+}
+
+int audio_get_sample_rate() {
+	return SAMPLE_RATE;
+}
+
+// audio.c
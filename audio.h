@@ -0,0 +1,28 @@
+#pragma once
+
+/**----------------------------------------------------------------------------
+ *	audio.c
+ *  host audio output: lock free single producer/single consumer sample ring
+ *  feeding the SDL audio callback
+ **/
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define AUDIO_RING_SIZE		8192		// samples (mono float), must be a power of 2
+
+void audio_init(int sample_rate);
+int audio_get_sample_rate();
+
+// producer side (emulation thread)
+int audio_ring_write(const float *samples, int count);
+int audio_ring_fill();
+
+#ifdef __cplusplus
+}
+#endif
+
+// audio.h
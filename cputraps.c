@@ -1,9 +1,42 @@
 
 
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "spectrum.h"
+#include "tapcatalog.h"
+#include "spectrum_basic.h"
+#include "spectrum_autotype.h"
 #include "z80cpu.h"
 #include "cputraps.h"
 #include "text_box_l.h"
 
+// 48k rom system variables and addresses
+#define T_ADDR			0x5C74
+#define STKEND			0x5C65
+#define SA_LD_RET		0x053F		// exit of SA-BYTES and LD-BYTES
+#define SA_CONTRL_SAVE	0x0984		// SA-CONTRL after the "press any key" prompt
+#define SA_1_SEC_END	0x0994		// after the HALT loop of SA-1-SEC
+
+// only a plain .tap can have the saved blocks appended (a .tzx has a block structure of its own,
+// .gz and .zip are compressed, "zip.zip:entry.tap" names an entry inside an archive)
+static bool _is_writable_tap(const char *file_name) {
+	size_t len = strlen(file_name);
+	return len > 4 && !strcasecmp(file_name + len - 4, ".tap") && !strchr(file_name, ':');
+}
+
+// a tape name comes from the spectrum program: it must name a file in the tape directory
+static bool _is_tap_dir_name(const char *name) {
+	return name[0] != '.' && !strchr(name, '/') && !strchr(name, '\\');
+}
+
+// SAVE goes to the tape file: one SAVE "$name" has just named, or a mounted plain .tap
+static bool _save_to_tap(const tap_t *tap) {
+	return tap->state == TAP_REQUEST_CREATE || (tap->state == TAP_MOUNTED && tap->b_writable);
+}
+
 // The 48k rom entry point for save, load, verify, merge
 // 0x0621 actually traps SA-SPACE: at that point the rom has moved the filename to the calc. stack
 // This trap does not change the ROM execution path: all we do is snatch the filename
@@ -11,244 +44,202 @@
 // was found clean up the filename:
 //		For '$' we remove the prefix but leave the name as is
 //		For '#' we remove the name entirely: this is for loading multi file .taps
+//		LOAD "$" on its own loads the tape catalog (a listing of the tape directory)
+//		LOAD "$zip:entry" mounts a tape inside zip.zip (and looks for entry)
+// Names that could reach outside the tape directory ('/', '\\', a leading '.') stay plain names.
+// The name is cleaned up in the calculator stack entry (start and length), not in memory:
+// a literal name lives in the basic line.
 void _trap_SA_SPACE(Z80 *z80) {
-	ltb_printf("CPU trap: entering 48k ROM routine \"SA-SPACE\"\n");
+	z80_mmu_t *mmu = &ZXSPECTRUM.mmu;
+	tap_t *tap = &ZXSPECTRUM.auto_mount_tap;
+	(void)z80;
+
+	// T-ADDR: 0 save, 1 load, 2 verify, 3 merge (SAVE-ETC has made it so)
+	uint8_t command = z80_mmu_GetByte(mmu, T_ADDR);
 
 	// 0x5C65: end of rom calculator stack / workspace (STKEND): this is NOT the machine stack!
-	// we replicate STK-FETCH here: get the last 5 byte values from the calculator stack
+	// the last 5 bytes there are the string A, DE (address), BC (length) as STK-FETCH would get them
 	// unlike the ROM routine we leave the data there though (we are letting the ROM code run here)
-#if 0
-	uint16_t stk_end = zx_MMU_GetWord(&zx->mmu, 0x5C65);	
-	uint8_t b5 = zx_MMU_GetByte(&zx->mmu, --stk_end);	// register B
-	uint8_t b4 = zx_MMU_GetByte(&zx->mmu, --stk_end);	// register C	: name len 
-	uint16_t name_len_addr = stk_end;					// save the va of the name len byte
-	uint8_t b3 = zx_MMU_GetByte(&zx->mmu, --stk_end);	// register D	: name address hi
-	uint8_t b2 = zx_MMU_GetByte(&zx->mmu, --stk_end);	// register E	: name address lo
-	uint8_t b1 = zx_MMU_GetByte(&zx->mmu, --stk_end);	// register A	: no idea
-
-	char tapname[15];				// max size is 10 + 4 (".tap") + 0 terminator
-	uint16_t va = b3 * 256 + b2;	// name address (virtual)
-	for (int i = 0; i < b4; i++) {
-		uint8_t *addr = (uint8_t*)zx_MMU_GetPhysicalAddress(&zx->mmu, va++);
-		tapname[i] = *addr;
+	uint16_t entry = z80_mmu_GetWord(mmu, STKEND) - 5;
+	uint16_t va = z80_mmu_GetWord(mmu, entry + 1);
+	uint16_t name_len = z80_mmu_GetWord(mmu, entry + 3);
+	uint8_t prefix = name_len ? z80_mmu_GetByte(mmu, va) : 0;
+
+	tap->b_save_data = false;
+
+	if (command == 1 && prefix == '$' && name_len == 1) {
+		// an empty name: the rom takes the catalog's header whatever its name
+		TAP_CatalogRefresh();
+		tap->state = TAP_REQUEST_DIRECTORY;
+		z80_mmu_PutWord(mmu, 0, entry + 3);
+		return;
 	}
-	tapname[b4] = 0;
-
-	if (tapname[0] == '$' || tapname[0] == '#') {
-		strcpy(zx->auto_mount_tap.tap_base_name, &tapname[1]);
-		strcpy(zx->auto_mount_tap.tap_file_name, zx->auto_mount_tap.tap_base_name);
-		strcat(zx->auto_mount_tap.tap_file_name, ".tap");
-
-		zx_CON_Printf("\tprefixed [$#] name found: requesting automount=\"%s\"\n", zx->auto_mount_tap.tap_file_name);
-
-		zx->auto_mount_tap.state = TAP_REQUEST_MOUNT;
-
-		// fixup the name stored in zx memory for the rom: remove the $ prefix
-		// or remove name completely (by setting len to 0) if the prefix was #
-		uint16_t va = b3 * 256 + b2;		// name address (virtual)
-		if(tapname[0] == '$') {
-			for (int i = 0; i < b4; i++) {
-				uint8_t b = zx_MMU_GetByte(&zx->mmu, va+1);
-				zx_MMU_PutByte(&zx->mmu, b, va);
-				va++;
-			}
-			zx_MMU_PutByte(&zx->mmu, ' ', va);				// overwrite the previous last char with a blank
-			zx_MMU_PutByte(&zx->mmu, b4-1, name_len_addr);	// fix name len
+
+	bool b_tap_name = (prefix == '$' || prefix == '#') && name_len >= 2 && name_len <= MAX_TAP_NAME_SIZE + 1;
+	char name[MAX_TAP_NAME_SIZE + 1] = { 0 };
+	int colon = -1;
+	for (int i = 0; b_tap_name && i < name_len - 1; i++) {
+		name[i] = z80_mmu_GetByte(mmu, va + 1 + i);
+		if (name[i] == ':' && colon < 0)
+			colon = i;
+	}
+	if (b_tap_name && !_is_tap_dir_name(name)) {
+		ltb_printf("CPU trap: \"%s\" is outside the tape directory\n", name);
+		b_tap_name = false;
+	}
+
+	if (!b_tap_name) {
+		// a plain name: goes to the mounted .tap (if any), a SAVE "$name" that failed is forgotten
+		// a mounted tape that can't be appended to is unmounted: the rom saves as usual
+		if (tap->state == TAP_REQUEST_CREATE || tap->state == TAP_REQUEST_DIRECTORY)
+			tap->state = TAP_UN_MOUNTED;
+		else if (command == 0 && tap->state == TAP_MOUNTED && !tap->b_writable)
+			tap->state = TAP_UN_MOUNTED;
+		return;
+	}
+
+	memcpy(tap->tap_base_name, name, sizeof(tap->tap_base_name));
+	snprintf(tap->tap_file_name, sizeof(tap->tap_file_name), "%s.tap", tap->tap_base_name);
+
+	if (command == 0) {
+		tap->state = TAP_REQUEST_CREATE;
+		tap->b_writable = true;
+		ltb_printf("CPU trap: SAVE to \"%s/%s\"\n", SPECTRUM_TAP_DIR, tap->tap_file_name);
+	}
+	else {
+		// no name.tap: there might be a name.tzx, or either of them compressed
+		// "zip:entry" picks a tape out of zip.zip
+		static const char *EXTS[] = { ".tzx", ".tap.gz", ".tzx.gz", ".zip" };
+		char path[SPECTRUM_MAX_FILE_DIR_LEN];
+		if (colon >= 0) {
+			snprintf(tap->tap_file_name, sizeof(tap->tap_file_name), "%.*s.zip:%s",
+				colon, tap->tap_base_name, tap->tap_base_name + colon + 1);
 		}
-		else {
-			zx_MMU_PutByte(&zx->mmu, 0, name_len_addr);		// set name len to 0
+		int num_exts = (int)(sizeof(EXTS) / sizeof(EXTS[0]));
+		for (int e = 0; colon < 0 && e <= num_exts; e++) {
+			snprintf(path, sizeof(path), "%s/%s", SPECTRUM_TAP_DIR, tap->tap_file_name);
+			if (access(path, R_OK) == 0)
+				break;
+			// none of them: back to name.tap (for the error message)
+			snprintf(tap->tap_file_name, sizeof(tap->tap_file_name), "%s%s", tap->tap_base_name, e < num_exts ? EXTS[e] : ".tap");
 		}
+		tap->state = TAP_REQUEST_MOUNT;
+		tap->read_index = 0;
+		tap->b_writable = _is_writable_tap(tap->tap_file_name);
+		ltb_printf("CPU trap: mounting \"%s/%s\"\n", SPECTRUM_TAP_DIR, tap->tap_file_name);
+	}
+
+	if (prefix == '$') {
+		// "$zip:entry": the rom looks for entry
+		z80_mmu_PutWord(mmu, va + 2 + colon, entry + 1);
+		z80_mmu_PutWord(mmu, name_len - 2 - colon, entry + 3);
 	}
 	else {
-		zx_CON_Printf("\tname=\"%s\" (no new automount)\n", &tapname[0]);
+		z80_mmu_PutWord(mmu, 0, entry + 3);
 	}
-#endif
+}
+
+
+// 48k KEY-INPUT: the editor (or INPUT) waits for a key
+// A BASIC listing loaded from text goes into the program area now (see spectrum_basic.c),
+// text being typed goes into the keyboard buffer (see spectrum_autotype.c)
+void _trap_KEY_INPUT(Z80 *z80) {
+	(void)z80;
+	spectrum_basic_inject();
+	spectrum_autotype_key_input();
 }
 
 
 // 48k Load Bytes Trap
 // This is used to actually load blocks of data in both: 48k and 128k modes
+// Coming in here with
+//		A block type to load (00 header, ff data)
+//		carry set=load, reset=verify
+//		DE block len
+//		IX target address
 void _trap_LD_BYTES(Z80 *z80) {
-    
-   	//ltb_printf("CPU trap: entering 48k ROM routine \"LD-BYTES\" (carry flag:%d)\n", zx->cpu.f & Z80_CF);
-   	ltb_printf("CPU trap: entering 48k ROM routine \"LD-BYTES\"\n");
-
-#if 0
-	int err = TAP_OK;
-
-	// coming in here with
-	// A block type to load (00 header, ff data)
-	// carry set=load, reset=verify
-	// DE block len
-	// IX target address
-
-	if (zx->auto_mount_tap.state == TAP_REQUEST_MOUNT || zx->auto_mount_tap.state == TAP_MOUNTED) {
-
-		if (zx->cpu.a == 0x00) {
-			// header block
-			// mount tap if needed
-			if (zx->auto_mount_tap.state == TAP_REQUEST_MOUNT) {
-				zx->auto_mount_tap.read_index = zx->auto_mount_tap.write_index = 0;
-				zx->auto_mount_tap.state = TAP_MOUNTED;
-			}
-
-			zx_CON_Printf("\tloading HEADER from automount file: %s... ", zx->auto_mount_tap.tap_file_name);
-			
-			uint16_t va = zx->cpu.ix;
-			err = zx_TAP_LoadBlock(zx, &zx->auto_mount_tap, zx->cpu.a, zx->cpu.de, va);
-			if(err != TAP_OK) 
-				zx_CON_Printf("\tTAP ERROR: %d", err);
-
-		}
-		else {
-			// data block
-			zx_CON_Printf("\tloading DATA (len=%d) from automount file: %s... ", zx->cpu.de, zx->auto_mount_tap.tap_file_name);
-
-			uint16_t va = zx->cpu.ix;
-			err = zx_TAP_LoadBlock(zx, &zx->auto_mount_tap, zx->cpu.a, zx->cpu.de, va);
-			if (err != TAP_OK)
-				zx_CON_Printf("\tTAP ERROR: %d", err);
-		}
-
-		// adapt z80 registers
-		//zx->cpu.hl = zx->cpu.ix;	// test test test
-		zx->cpu.ix += zx->cpu.de;	// move pointer in ix as if the rom loader had actually run
-		zx->cpu.de = 0;				// no remaining bytes to be loaded
-
-		if (err != TAP_OK) {
-			zx->cpu.f &= ~Z80_CF;			// clear carry (indicates an error)
-			zx_CON_Printf("error: TAP error, code=%d\n", err);
-		}
-		else {
-			zx->cpu.f |= Z80_CF;			// set carry (success)
-			//printf("success.\n");
+	tap_t *tap = &ZXSPECTRUM.auto_mount_tap;
+	uint8_t block_type = Z80_A(*z80);
+	uint16_t block_len = Z80_DE(*z80);
+	bool b_verify = !(Z80_F(*z80) & Z80_CF);
+	int err;
+
+	switch (tap->state) {
+	case TAP_REQUEST_MOUNT:
+		tap->read_index = 0;
+		tap->state = TAP_MOUNTED;
+		// fall through
+	case TAP_MOUNTED:
+		err = TAP_LoadBlock(&ZXSPECTRUM, tap, block_type, block_len, Z80_IX(*z80), b_verify);
+		if (err == TAP_ERR_END_OF_TAPE || err == TAP_ERR_FILE_ERROR) {
+			// back to the tape deck: the rom waits for a real tape (or BREAK)
+			ltb_printf("CPU trap: LD-BYTES: %s \"%s\"\n", err == TAP_ERR_FILE_ERROR ? "can't read" : "end of", tap->tap_file_name);
+			tap->state = TAP_UN_MOUNTED;
+			return;
 		}
-		// 053F SA/LD-RET
-		z80_prefetch(&zx->cpu, 0x053F);		// continue at ROM LD-BYTES routine exit point (original: 05e2)
-
-	}
-	else if (zx->auto_mount_tap.state == TAP_REQUEST_DIRECTORY) {
-		// I believe this is unfinished business: was supposed to be able so issue something like
-		// 'load "$"' in order to produce a listing of .tap files in the current directory
-		// not clear as to how&when I'll follow this up
-		if (zx->cpu.a == 0x00) {
-			zx_CON_Printf("\tprocessing directory request (header)");
-			// create a fake header block
-			static char name[] = "DIRECTORY";
-			zx_TAP_CreateHeaderBlock(zx, 0, zx->cpu.ix, name, 0, 0, 0);
-			zx->cpu.ix += zx->cpu.de;		// move pointer in ix as if the rom loader had actually loaded a header
-		}
-		else {
-			// not doing anything here
-			zx_CON_Printf("\tprocessing directory request (data)");
-		}
-		zx->cpu.de = 0;					// no remaining bytes to be loaded
-		zx->cpu.f |= Z80_CF;			// set carry flag (success)
-		z80_prefetch(&zx->cpu, 0x053F);	// continue at ROM LD-BYTES routine exit point (053F SA/LD-RET)
+		break;
+	case TAP_REQUEST_DIRECTORY:
+		err = TAP_CatalogLoadBlock(&ZXSPECTRUM, block_type, block_len, Z80_IX(*z80));
+		if (block_type != 0x00)
+			tap->state = TAP_UN_MOUNTED;
+		break;
+	default:
+		// no tap mount: just passing on to ROM...
+		return;
 	}
-	else {
-		zx_CON_Printf("\tno tap mount: just passing on to ROM...");
-	}
-#endif
+
+	// blocks of the other type pass by while the rom looks for a header (or its data)
+	if (err != TAP_OK && err != TAP_ERR_BLOCK_TYPE)
+		ltb_printf("CPU trap: LD-BYTES: TAP error, code=%d\n", err);
+
+	// continue at the routine's exit SA/LD-RET as if the rom loader had actually run
+	Z80_IX(*z80) += block_len;
+	Z80_DE(*z80) = 0;
+	if (err == TAP_OK)
+		Z80_F(*z80) |= Z80_CF;			// set carry (success)
+	else
+		Z80_F(*z80) &= ~Z80_CF;			// clear carry (indicates an error)
+	Z80_PC(*z80) = SA_LD_RET;
 }
 
 // 48k spectrum ROM save bytes routine trap
 // called on 48k and 128k
 // This relies on _trap_SA_SPACE having detected our special filename prefixes
-// and cleaned them up if required
+// Each SAVE comes here twice: A is 0x00 for the header, 0xff for the data block,
+// IX and DE are the block's address and length
 void _trap_SA_BYTES(Z80 *z80) {
+	tap_t *tap = &ZXSPECTRUM.auto_mount_tap;
 
-   	ltb_printf("CPU trap: entering 48k ROM routine \"SA-BYTES\"");
-
-#if 0
-	// each "Save" will cause two calls into this function:
-	// one for the header and one for the actual data 
-	// we thus keep the file open between the two calls and verify the correct order
-
-	static uint8_t block_type;
-	uint8_t check;
-
-
-	// DE holds the size of the block to save, IX its address 
-	// and A a flag value (either 0x00 (header) or 0xff (program/data))
-
-	/* Format https://worldofspectrum.org/faq/reference/48kreference.htm */
-
-
-	if (zx->cpu.a == 0x00) {
-		block_type = 0x00;
-		check = block_type;
-
-		// header: DE points to a 17 bytes block of data containing the file type byte (0,1,2,3)
-		// 10 bytes name (blanks padded)
-		// 2 bytes length of the data block to follow (msb first)
-		// 4 bytes "parameters" (which we don't need to concern ourselves with here)
+	if (!_save_to_tap(tap)) {
+		// no tap mount (or not one to append to): just passing on to ROM...
+		return;
+	}
 
-		uint8_t header[17];
-		uint16_t va = zx->cpu.ix;				// start address (virtual)
-		uint16_t header_block_len = zx->cpu.de;	// should always be 17 for header blocks
-		//uint16_t file_block_len = header_block_len + 2;
-		for (int i = 0; i < header_block_len; i++) {
-			pointer_t addr = zx_MMU_GetPhysicalAddress(&zx->mmu, va++);
-			header[i] = *((uint8_t *)addr);
-			check = check ^ header[i];
-		}
-	
-		if (zx->auto_mount_tap.state == TAP_REQUEST_MOUNT) {
-			// if we come here with state=TAP_REQUEST_MOUNT then the user has issued
-			// a save "$name" request (the details regarding "name" are stored in the automount info in ZX)
-			// we just pass on the filename to the WriteBlock() function which in turn will call 
-			// P_FileWrite() which will create the file and cache name&filehandle 
-			zx_CON_Printf("\t writing header block: requested automount filename=%s, length=%d", zx->auto_mount_tap.tap_file_name, zx->cpu.de);
-			zx_TAP_WriteBlock(zx, zx->auto_mount_tap.tap_file_name, block_type, header_block_len, check, (pointer_t)header);
-			zx->auto_mount_tap.state = TAP_MOUNTED;
-		}
-		else if (zx->auto_mount_tap.state == TAP_MOUNTED) {
-			// the user has issued a SAVE "$" command (no name specified): we are supposed to save using the details
-			// of a previous automount (this also works if that has been a LOAD command)
-			// In this case though the header data as stored by the BASIC ROM will just contain the "$" character as
-			// the name: we need to fix this by replacing it with the data we have stored inside the automount info
-			// and re-doing the checksum before we can write the header to the file 
-			check = block_type;
-			for (int i = 0; i < header_block_len; i++) {
-				// fixup the name inside the header
-				if(i > 0 && i <= 10 && zx->auto_mount_tap.tap_base_name[i - 1] != 0)
-					header[i] = zx->auto_mount_tap.tap_base_name[i - 1];
-				// update new checksum
-				check = check ^ header[i];
-			}
-
-			zx_CON_Printf("\twriting header block: existing automount filename=%s, length=%d", zx->auto_mount_tap.tap_file_name, zx->cpu.de);
-			zx_TAP_WriteBlock(zx, zx->auto_mount_tap.tap_file_name, block_type, header_block_len, check, (pointer_t)header);
+	uint8_t block_type = Z80_A(*z80);
+	uint16_t block_len = Z80_DE(*z80);
+	int err = TAP_WriteBlock(&ZXSPECTRUM, tap->tap_file_name, tap->state == TAP_REQUEST_CREATE, block_type, block_len, Z80_IX(*z80));
+	if (err != TAP_OK)
+		ltb_printf("CPU trap: SA-BYTES: TAP error, code=%d\n", err);
+	tap->state = TAP_MOUNTED;
+	tap->b_save_data = block_type == 0x00;
+
+	// skip the tape signal: continue at the routine's exit SA/LD-RET (border, BREAK test, EI)
+	// with the registers as if the block had gone out
+	Z80_IX(*z80) += block_len;
+	Z80_DE(*z80) = 0;
+	Z80_PC(*z80) = SA_LD_RET;
+}
 
-		}
-		else {
-			zx_CON_Printf("\tno tap mount: just passing save request on to the BASIC ROM...");
-		}
-	}
-	else if (zx->cpu.a == 0xff) {
-		assert(block_type == 0x00);		// previous block must have been a header
-
-		// DATA BLOCK
-		block_type = 0xff;
-		check = block_type;			// init checksum with block type
-		uint16_t va = zx->cpu.ix;	// start address
-		uint16_t data_block_len = zx->cpu.de;
-		
-		if (zx->auto_mount_tap.state == TAP_MOUNTED) {
-			zx_CON_Printf("\twriting data block to current automount: length=%d", data_block_len);
-			zx_TAP_WriteBlock(zx, zx->auto_mount_tap.tap_file_name, block_type, data_block_len, check, (pointer_t)va);
-		}
-		else {
-			zx_CON_Printf("\tno tap mount: just passing save request to ROM...");
-		}
-	}
+// SA-CONTRL: "Start tape, then press any key." has no point when saving to a .tap
+void _trap_SA_CONTRL(Z80 *z80) {
+	if (_save_to_tap(&ZXSPECTRUM.auto_mount_tap))
+		Z80_PC(*z80) = SA_CONTRL_SAVE;
+}
 
-	// short cut to the exit of the ROM routine setting the counter 
-	// for the final delay wait in there (register b) to 0
-	zx->cpu.b = 0;
-	z80_prefetch(&zx->cpu, 0x53c);
-#endif
+// SA-1-SEC: the pause between a header and its data block
+void _trap_SA_1_SEC(Z80 *z80) {
+	if (ZXSPECTRUM.auto_mount_tap.b_save_data)
+		Z80_PC(*z80) = SA_1_SEC_END;
 }
 
 // cputraps.c
@@ -1,18 +1,23 @@
 #pragma once
 
 #include <stdint.h>
+#include <stdbool.h>
 
 
 typedef struct {
     uint16_t trap_addr;
     void (*trap_func)(Z80 *z80);
     uint8_t rom_no;
+    bool b_refetch;         // the trap pages memory in or sets PC: the opcode is fetched again (at PC)
 } cpu_trap_t;
 
 
 void _trap_SA_SPACE(Z80 *z80);
 void _trap_LD_BYTES(Z80 *z80);
 void _trap_SA_BYTES(Z80 *z80);
+void _trap_SA_CONTRL(Z80 *z80);
+void _trap_SA_1_SEC(Z80 *z80);
+void _trap_KEY_INPUT(Z80 *z80);
 
 
 // cputraps.h
\ No newline at end of file
@@ -0,0 +1,254 @@
+/**----------------------------------------------------------------------------
+ *	instream.c
+ *  Sequential input from a plain, gzipped or zipped file, decompressed on the fly
+ *
+ *	The file is mmap()'d and read front to back: a plain file (or a stored zip entry) is
+ *	copied straight out of the mapping, gzip and deflated zip entries go through zlib's
+ *	inflate with the mapping as its input. Either way the only memory on top of the caller's
+ *	buffer is the inflate state and its 32k window: nothing gets extracted to disk and
+ *	archives don't get read into memory as a whole.
+ *
+ *	Zip: the entry is picked through the central directory, either by name ("games.zip:jsw",
+ *	matched against the full name, the name without its directory or without its extension,
+ *	ignoring case) or, without a name, the first entry with one of the extensions the
+ *	caller is interested in. Only stored and deflated entries can be read (no zip64).
+ **/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "instream.h"
+
+#define ZIP_LOCAL_SIG		0x04034b50
+#define ZIP_CENTRAL_SIG		0x02014b50
+#define ZIP_END_SIG			0x06054b50
+#define ZIP_END_SIZE		22
+#define ZIP_MAX_COMMENT		0xFFFF
+
+#define ZIP_STORED			0
+#define ZIP_DEFLATED		8
+
+#define R16(p)	((uint32_t)(p)[0] | (uint32_t)(p)[1] << 8)
+#define R32(p)	(R16(p) | R16((p) + 2) << 16)
+
+static void _set_name(instream_t *s, const char *name, size_t len) {
+	if (len >= sizeof(s->name))
+		len = sizeof(s->name) - 1;
+	memcpy(s->name, name, len);
+	s->name[len] = 0;
+}
+
+static bool _has_ext(const char *name, size_t len, const char *ext) {
+	size_t ext_len = strlen(ext);
+	return len > ext_len && !strncasecmp(name + len - ext_len, ext, ext_len);
+}
+
+// does the zip entry name[len] match the name asked for: full name, without directory or extension
+static bool _entry_matches(const char *name, size_t len, const char *entry) {
+	size_t entry_len = strlen(entry);
+	const char *base = name;
+	for (size_t i = 0; i < len; i++)
+		if (name[i] == '/')
+			base = name + i + 1;
+	size_t base_len = len - (base - name);
+
+	if ((len == entry_len && !strncasecmp(name, entry, len))
+		|| (base_len == entry_len && !strncasecmp(base, entry, base_len)))
+		return true;
+	return base_len > entry_len && base[entry_len] == '.' && !strncasecmp(base, entry, entry_len)
+		&& !memchr(base + entry_len + 1, '.', base_len - entry_len - 1);
+}
+
+// find the entry in the central directory and point data at its bytes as stored
+static bool _open_zip_entry(instream_t *s, const char *entry, const char *const *exts) {
+	const uint8_t *map = s->map;
+	size_t size = s->map_size;
+
+	// the end of central directory record is at the very end, unless there's a comment
+	if (size < ZIP_END_SIZE)
+		return false;
+	size_t end = size - ZIP_END_SIZE;
+	size_t lowest = size > ZIP_END_SIZE + ZIP_MAX_COMMENT ? size - ZIP_END_SIZE - ZIP_MAX_COMMENT : 0;
+	while (R32(map + end) != ZIP_END_SIG)
+		if (end-- == lowest)
+			return false;
+
+	uint32_t num_entries = R16(map + end + 10);
+	size_t pos = R32(map + end + 16);
+
+	for (uint32_t i = 0; i < num_entries; i++) {
+		if (pos + 46 > size || R32(map + pos) != ZIP_CENTRAL_SIG)
+			return false;
+		const uint8_t *cd = map + pos;
+		const char *name = (const char *)cd + 46;
+		size_t name_len = R16(cd + 28);
+		pos += 46 + name_len + R16(cd + 30) + R16(cd + 32);
+		if (pos > size || name_len == 0 || name[name_len - 1] == '/')
+			continue;
+
+		bool b_match = false;
+		if (entry)
+			b_match = _entry_matches(name, name_len, entry);
+		else if (!exts)
+			b_match = true;
+		else
+			for (int e = 0; exts[e] && !b_match; e++)
+				b_match = _has_ext(name, name_len, exts[e]);
+		if (!b_match)
+			continue;
+
+		// the local header repeats name and extra field (the extra field may differ)
+		uint32_t method = R16(cd + 10);
+		size_t local = R32(cd + 42);
+		if ((method != ZIP_STORED && method != ZIP_DEFLATED) || local + 30 > size || R32(map + local) != ZIP_LOCAL_SIG)
+			return false;
+		size_t data = local + 30 + R16(map + local + 26) + R16(map + local + 28);
+		s->data_size = R32(cd + 20);
+		if (data > size || s->data_size > size - data)
+			return false;
+		s->data = map + data;
+		s->size = R32(cd + 24);
+		s->b_inflate = method == ZIP_DEFLATED;
+		_set_name(s, name, name_len);
+		return !s->b_inflate || inflateInit2(&s->z, -MAX_WBITS) == Z_OK;
+	}
+	return false;
+}
+
+// Open path for reading: a zip entry can be picked as "path:entry", without one it's the first
+// entry ending in one of exts (NULL terminated, NULL: any entry)
+// s->name is the name of what's actually read: the zip entry, the gzipped file without its .gz
+bool instream_open(instream_t *s, const char *path, const char *const *exts) {
+	char file[1024];
+	const char *entry = NULL;
+
+	memset(s, 0, sizeof(*s));
+
+	const char *zip = strchr(path, ':');
+	while (zip && !(zip - path >= 4 && !strncasecmp(zip - 4, ".zip", 4)))
+		zip = strchr(zip + 1, ':');
+	if (zip && (size_t)(zip - path) < sizeof(file)) {
+		zip -= 4;
+		memcpy(file, path, zip - path + 4);
+		file[zip - path + 4] = 0;
+		entry = zip + 5;
+		path = file;
+	}
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		close(fd);
+		return false;
+	}
+	s->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (s->map == MAP_FAILED) {
+		s->map = NULL;
+		return false;
+	}
+	s->map_size = st.st_size;
+	madvise(s->map, s->map_size, MADV_SEQUENTIAL);
+
+	const char *base = strrchr(path, '/');
+	base = base ? base + 1 : path;
+	bool b_ok = true;
+
+	if (s->map_size >= 4 && R32(s->map) == ZIP_LOCAL_SIG) {
+		b_ok = _open_zip_entry(s, entry, exts);
+	}
+	else if (s->map_size >= 18 && s->map[0] == 0x1F && s->map[1] == 0x8B) {
+		// gzip: zlib reads the header, the trailer ends in the size (modulo 4G)
+		s->data = s->map;
+		s->data_size = s->map_size;
+		s->size = R32(s->map + s->map_size - 4);
+		s->b_inflate = true;
+		size_t len = strlen(base);
+		_set_name(s, base, _has_ext(base, len, ".gz") ? len - 3 : len);
+		b_ok = inflateInit2(&s->z, 16 + MAX_WBITS) == Z_OK;
+	}
+	else {
+		s->data = s->map;
+		s->data_size = s->size = s->map_size;
+		_set_name(s, base, strlen(base));
+	}
+
+	if (!b_ok) {
+		munmap(s->map, s->map_size);
+		s->map = NULL;
+		return false;
+	}
+	if (s->b_inflate) {
+		s->z.next_in = (Bytef *)s->data;
+		s->z.avail_in = (uInt)s->data_size;
+	}
+	return true;
+}
+
+// Read up to len bytes, less only at the end of the data (or if it's corrupt)
+size_t instream_read(instream_t *s, void *buf, size_t len) {
+	size_t n;
+
+	if (!s->b_inflate) {
+		n = s->data_size - s->data_pos;
+		if (n > len)
+			n = len;
+		if (buf)
+			memcpy(buf, s->data + s->data_pos, n);
+		s->data_pos += n;
+	}
+	else {
+		if (s->b_end)
+			return 0;
+		s->z.next_out = buf;
+		s->z.avail_out = (uInt)len;
+		while (s->z.avail_out) {
+			int err = inflate(&s->z, Z_NO_FLUSH);
+			if (err != Z_OK) {
+				// Z_STREAM_END, or an error: either way there's nothing more to come
+				s->b_end = true;
+				break;
+			}
+		}
+		n = len - s->z.avail_out;
+	}
+
+	s->position += n;
+	return n;
+}
+
+// Skip len bytes: stored data just moves on, compressed data has to be inflated anyway
+size_t instream_skip(instream_t *s, size_t len) {
+	if (!s->b_inflate)
+		return instream_read(s, NULL, len);
+
+	uint8_t scratch[4096];
+	size_t skipped = 0;
+	while (skipped < len) {
+		size_t chunk = len - skipped < sizeof(scratch) ? len - skipped : sizeof(scratch);
+		size_t n = instream_read(s, scratch, chunk);
+		skipped += n;
+		if (n < chunk)
+			break;
+	}
+	return skipped;
+}
+
+void instream_close(instream_t *s) {
+	if (!s->map)
+		return;
+	if (s->b_inflate)
+		inflateEnd(&s->z);
+	munmap(s->map, s->map_size);
+	s->map = NULL;
+}
+
+// instream.c
@@ -0,0 +1,42 @@
+#pragma once
+
+/**----------------------------------------------------------------------------
+ *	instream.c
+ *  Sequential input from a plain, gzipped or zipped file (one zip entry), decompressed on the fly
+ **/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <zlib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define INSTREAM_NAME_SIZE	128
+
+typedef struct {
+	uint8_t *map;				// the whole file, mmap()'d
+	size_t map_size;
+	const uint8_t *data;		// the bytes of the file or zip entry as stored
+	size_t data_size;
+	size_t data_pos;			// stored data: read position
+	bool b_inflate;
+	bool b_end;
+	z_stream z;
+	size_t size;				// uncompressed size (0: unknown)
+	size_t position;			// uncompressed bytes read so far
+	char name[INSTREAM_NAME_SIZE];	// zip: the entry's name
+} instream_t;
+
+bool instream_open(instream_t *s, const char *path, const char *const *exts);
+size_t instream_read(instream_t *s, void *buf, size_t len);
+size_t instream_skip(instream_t *s, size_t len);
+void instream_close(instream_t *s);
+
+#ifdef __cplusplus
+}
+#endif
+
+// instream.h
@@ -1,18 +1,159 @@
 
 
+#include <stdio.h>
+#include <string.h>
+
 #include "spectrum.h"
 #include "text_box_l.h"
 #include "sdlut.h"
 #include "sdlevent.h"
+#include "spectrum_persist.h"
+#include "spectrum_snapshot.h"
+#include "spectrum_basic.h"
+#include "spectrum_autotype.h"
+#include "audio.h"
+
+// dynamic rate control: maximum deviation of the audio resampling ratio
+#define DRC_MAX_DELTA		0.005
+#define MAX_FRAMES_PER_LOOP	3		// catch up limit after stalls
+#define WARP_FRAMES_PER_LOOP	25		// frames per display frame while autotyping
+
+static void _usage(const char *name) {
+	printf("usage: %s [-m 48|128|zxx|plus3] [-p ramfile] [-d sdimage] [-f dskfile] [-i] [-M mdrfile] [-Q] [-s snapshot] [-b listing] [-a] [-c]\n", name);
+	printf("  -m model     machine model: 48 (default), 128 or zxx (these need %s/%s and %s)\n", SPECTRUM_ROM_DIR, SPECTRUM_128K_ROM0_FILE, SPECTRUM_128K_ROM1_FILE);
+	printf("               or plus3 (needs %s/" SPECTRUM_PLUS3_ROM_FILE " to " SPECTRUM_PLUS3_ROM_FILE ")\n", SPECTRUM_ROM_DIR, 0, 3);
+	printf("  -p ramfile   back spectrum memory with ramfile and resume the previous session from it\n");
+	printf("  -d sdimage   attach a divmmc with sdimage as its sd card (needs %s/%s)\n", SPECTRUM_ROM_DIR, SPECTRUM_DIVMMC_ROM_FILE);
+	printf("  -f dskfile   +3: insert the DSK image dskfile into drive A:\n");
+	printf("  -i           +3: instant disk access (no seek, rotation and transfer timing)\n");
+	printf("  -M mdrfile   attach an interface 1 and insert mdrfile into the next microdrive (up to %d,\n", IF1_MAX_DRIVES);
+	printf("               needs %s/%s)\n", SPECTRUM_ROM_DIR, SPECTRUM_IF1_ROM_FILE);
+	printf("  -Q           fast microdrives (no tape speed)\n");
+	printf("  -s snapshot  load a .sna or .z80 snapshot, also gzipped or zipped (file.zip:entry picks one)\n");
+	printf("  -b listing   put the BASIC program of the text file listing into memory (48k basic)\n");
+	printf("  -a           pace emulation by the audio clock instead of the display (no vsync)\n");
+	printf("  -c           emulate ula memory and i/o contention\n");
+}
+
+// Audio buffer level we aim for: enough to survive one late frame on top of the
+// device buffer, and no more than that (latency)
+static int _audio_target_fill() {
+	int frame_samples = (int)(audio_get_sample_rate() / spectrum_frames_per_second());
+	return 2 * SDLDATA.audio_buffer_samples + frame_samples;
+}
+
+// Nudge the beeper resampling ratio so that the audio buffer level stays at target:
+// slightly fewer samples per frame when it runs full, slightly more when it drains.
+// The deviation is kept small enough (0.5%) to be inaudible.
+static void _audio_rate_control(int target) {
+	double error = (double)(audio_ring_fill() - target) / target;
+	if (error > 1.0) error = 1.0;
+	if (error < -1.0) error = -1.0;
+	zx_beeper_set_rate_ratio(&ZXSPECTRUM.beeper, 1.0 - DRC_MAX_DELTA * error);
+}
+
+// number of emulated frames due now
+// audio pacing: run frames for as long as the audio buffer is below target
+// display pacing: run frames as the wall clock advances (the display refresh rate is not 50Hz)
+static int _frames_due(bool b_audio_paced) {
+	static Uint64 last_t = 0;
+	static double time_acc = 0.0;
+
+	if (b_audio_paced) {
+		// frames are produced one at a time so the buffer level is re-checked after each
+		return (audio_ring_fill() < _audio_target_fill()) ? 1 : 0;
+	}
+
+	Uint64 now_t = SDL_GetPerformanceCounter();
+	if (last_t == 0)
+		last_t = now_t;
+	time_acc += (double)(now_t - last_t) / (double)SDL_GetPerformanceFrequency();
+	last_t = now_t;
+
+	const double frame_time = 1.0 / spectrum_frames_per_second();
+	int frames = (int)(time_acc / frame_time);
+	if (frames > MAX_FRAMES_PER_LOOP) {
+		frames = MAX_FRAMES_PER_LOOP;
+		time_acc = 0.0;		// we're lagging behind: don't try to catch up
+	}
+	else {
+		time_acc -= frames * frame_time;
+	}
+	return frames;
+}
 
 int main(int argc, char *argv[]) {
 
+	const char *persist_file = NULL;
+	const char *sd_image = NULL;
+	const char *dsk_file = NULL;
+	bool b_instant_disk = false;
+	const char *mdr_files[IF1_MAX_DRIVES];
+	int num_mdr_files = 0;
+	bool b_fast_microdrives = false;
+	const char *snapshot_file = NULL;
+	const char *basic_file = NULL;
+	bool b_audio_paced = false;
+	bool b_contention = false;
+	zx_type_t zx_type = ZX_TYPE_48K;
+
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-p") && i + 1 < argc) {
+			persist_file = argv[++i];
+		} else if (!strcmp(argv[i], "-d") && i + 1 < argc) {
+			sd_image = argv[++i];
+		} else if (!strcmp(argv[i], "-f") && i + 1 < argc) {
+			dsk_file = argv[++i];
+		} else if (!strcmp(argv[i], "-i")) {
+			b_instant_disk = true;
+		} else if (!strcmp(argv[i], "-M") && i + 1 < argc && num_mdr_files < IF1_MAX_DRIVES) {
+			mdr_files[num_mdr_files++] = argv[++i];
+		} else if (!strcmp(argv[i], "-Q")) {
+			b_fast_microdrives = true;
+		} else if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+			snapshot_file = argv[++i];
+		} else if (!strcmp(argv[i], "-b") && i + 1 < argc) {
+			basic_file = argv[++i];
+		} else if (!strcmp(argv[i], "-m") && i + 1 < argc) {
+			i++;
+			if (!strcmp(argv[i], "48")) {
+				zx_type = ZX_TYPE_48K;
+			} else if (!strcmp(argv[i], "128")) {
+				zx_type = ZX_TYPE_128K;
+			} else if (!strcmp(argv[i], "zxx")) {
+				zx_type = ZX_TYPE_ZXX;
+			} else if (!strcmp(argv[i], "plus3")) {
+				zx_type = ZX_TYPE_PLUS3;
+			} else {
+				_usage(argv[0]);
+				return 1;
+			}
+		} else if (!strcmp(argv[i], "-a")) {
+			b_audio_paced = true;
+		} else if (!strcmp(argv[i], "-c")) {
+			b_contention = true;
+		} else {
+			_usage(argv[0]);
+			return 1;
+		}
+	}
+
 	// SDL setup and init: using trusty old sdlut.c
 	SDLDATA.v_width = FRAME_WIDTH;		// virtual dimensions as required by the application
 	SDLDATA.v_height = FRAME_HEIGHT;		
 	SDLDATA.width = FRAME_WIDTH*2;		// actual display dimensions: the display will be scaled up to this size
 	SDLDATA.height = FRAME_HEIGHT*2;	
 	SDLDATA.v_depth = 32;		
+
+	// audio comes first: pacing by it needs a device, and whether it paces decides over vsync
+	SDL_InitSubSystem(SDL_INIT_AUDIO);
+	InitSDLAudio(SDLUT_DEFAULT_AUDIO_SAMPLE_RATE);
+	if (b_audio_paced && SDLDATA.audio_device_id == 0) {
+		printf("no audio device: pacing by the display instead\n");
+		b_audio_paced = false;
+	}
+	audio_init(SDLDATA.audio_sample_rate);
+	SDLDATA.no_vsync = b_audio_paced;	// the audio clock is in charge: present frames when they're ready
 	InitSDL();
 
 	// always do these after calling InitSDL()
@@ -20,43 +161,64 @@ int main(int argc, char *argv[]) {
 	USetWindowTitle(SPECTRUM_EMU_VERSION_STRING);
 
 	// initialize the spectrum emulation
-	init_spectrum();
+	init_spectrum(zx_type);
+	z80cpu_set_contention(b_contention);
 	init_spectrum_keyboard();
 	ltb_init();
 	spectrum_power(1);
 
+	if (sd_image)
+		zx_divmmc_attach(&ZXSPECTRUM.divmmc, sd_image);
+
+	ZXSPECTRUM.fdc.b_instant = b_instant_disk;
+	if (dsk_file && ZXSPECTRUM.zx_type == ZX_TYPE_PLUS3)
+		zx_fdc_insert(&ZXSPECTRUM.fdc, 0, dsk_file);
+
+	ZXSPECTRUM.if1.b_fast = b_fast_microdrives;
+	if (num_mdr_files && zx_if1_attach(&ZXSPECTRUM.if1)) {
+		for (int drive = 0; drive < num_mdr_files; drive++)
+			zx_if1_insert(&ZXSPECTRUM.if1, drive, mdr_files[drive]);
+	}
+
+	// file backed memory: picks up cpu and memory state from the previous session if there is one
+	if (persist_file)
+		spectrum_persist_open(persist_file);
+
+	if (snapshot_file)
+		spectrum_snapshot_load(snapshot_file);
+
+	// tokenized now, in memory as soon as the rom is ready for it
+	if (basic_file)
+		spectrum_basic_load_file(basic_file);
+
 	ltb_printf( "%s - %s\n", SPECTRUM_EMU_VERSION_STRING, __DATE__);
 
 	// Drive the display and the emulator
-	uint32_t LINEBUF[FRAME_WIDTH];
 	uint32_t* screen = SDLDATA.display_surface->pixels;
 
 	while (SDLDATA.runloop) {
 		BeginSDLFrame();
 
-		for(int scanline = 0; scanline < DISPLAY_HEIGHT; scanline++) {
-
-			// drive the zx spectrum display: render a single scanline
-			render_spectrum_scanline(scanline, LINEBUF); 
-
-			// scanline doubler
-			int frame_scanline = scanline * 2;
-			memcpy(screen+FRAME_WIDTH*frame_scanline, (void*)LINEBUF, sizeof(LINEBUF));
-			memcpy(screen+FRAME_WIDTH*(frame_scanline+1), (void*)LINEBUF, sizeof(LINEBUF));
-
-			// drive the z80 cpu
-			// currently this happens at scanline granularity
-			if(scanline == 0) {	
-				// scanline just flipped back over to 0: frame complete
-				// ==> we need to vblank
-				z80_int(ZXSPECTRUM.cpu, 1);
-				z80cpu_step(32);
-				z80_int(ZXSPECTRUM.cpu, 0);
-				z80cpu_step(SPECTRUM_SCANLINE_TSTATES - 32);
-			}
-			else {
-				z80cpu_step(SPECTRUM_SCANLINE_TSTATES);
-			}
+		// warp while there's text being typed: the keys are paced by the rom, not the clock
+		// (the audio that doesn't fit into the ring gets dropped)
+		bool b_warp = spectrum_autotype_busy();
+		int frames = 0;
+		int due = b_warp ? WARP_FRAMES_PER_LOOP : _frames_due(b_audio_paced);
+		while (due > 0 && frames < (b_warp ? WARP_FRAMES_PER_LOOP : MAX_FRAMES_PER_LOOP)) {
+			_audio_rate_control(_audio_target_fill());
+			spectrum_run_frame(screen);
+			SDLDATA.last_run_t = SDL_GetTicks();	// host events are placed relative to this
+			frames++;
+			if (b_warp)
+				due = spectrum_autotype_busy() ? due - 1 : 0;
+			else
+				due = b_audio_paced ? _frames_due(true) : due - 1;
+		}
+
+		if (frames == 0 && b_audio_paced) {
+			// nothing to present yet: wait for the audio device to drain a bit
+			SDL_Delay(1);
+			continue;
 		}
 
 		ltb_render_overlay(screen);
@@ -64,7 +226,14 @@ int main(int argc, char *argv[]) {
 		EndSDLFrame();
 	}
 
-	// unreachable 
+	// session state first: detaching pages the devices out
+	spectrum_persist_close();
+	zx_divmmc_detach(&ZXSPECTRUM.divmmc);
+	zx_if1_detach(&ZXSPECTRUM.if1);
+	TAP_Close();
+	for (int unit = 0; unit < FDC_MAX_DRIVES; unit++)
+		zx_fdc_eject(&ZXSPECTRUM.fdc, unit);
+
 	return 0;
 }
 
@@ -2,19 +2,61 @@
 #include <stdbool.h>
 #include "sdlut.h"
 #include "spectrum.h"
+#include "spectrum_autotype.h"
+#include "spectrum_input.h"
 #include "text_box_l.h"
 
 
+// Where in the next frame an event goes: as far into it as the event came after the last
+// emulated frame was run (main.c records when), one frame's time per frame. That doesn't depend
+// on how often the events get polled: once per display frame, or every ms with audio pacing
+// (SDL timestamps are in ms)
+static double _frame_position(Uint32 timestamp) {
+    double frame_ms = 1000.0 / spectrum_frames_per_second();
+    return (double)(Sint32)(timestamp - SDLDATA.last_run_t) / frame_ms;
+}
+
 void sdl_event_callback(SDL_Event e) {
 
+    // cursor keys and right ctrl: kempston joystick
+    if (e.type == SDL_KEYDOWN || e.type == SDL_KEYUP) {
+        uint8_t bit = 0;
+        switch (e.key.keysym.scancode) {
+            case SDL_SCANCODE_RIGHT: bit = 0x01; break;
+            case SDL_SCANCODE_LEFT:  bit = 0x02; break;
+            case SDL_SCANCODE_DOWN:  bit = 0x04; break;
+            case SDL_SCANCODE_UP:    bit = 0x08; break;
+            case SDL_SCANCODE_RCTRL: bit = 0x10; break;
+            default: break;
+        }
+        if (bit) {
+            spectrum_input_push(e.type == SDL_KEYDOWN ? INPUT_KEMPSTON_DOWN : INPUT_KEMPSTON_UP,
+                bit, 0, _frame_position(e.key.timestamp));
+            return;
+        }
+    }
+
+    // left ctrl+v: paste, typed by the autotyper
+    if ((e.type == SDL_KEYDOWN || e.type == SDL_KEYUP)
+        && e.key.keysym.sym == SDLK_v && (e.key.keysym.mod & KMOD_LCTRL)) {
+        if (e.type == SDL_KEYDOWN && !e.key.repeat && SDL_HasClipboardText()) {
+            char *text = SDL_GetClipboardText();
+            spectrum_autotype(text);
+            SDL_free(text);
+        }
+        return;
+    }
+
     if (e.type == SDL_KEYDOWN) {
         if(e.key.keysym.scancode == SDL_SCANCODE_F12) {
             ltb_toggle_overlay();
         } else {
-            spectrum_process_key(e.key.keysym.sym, e.key.keysym.mod, true);
+            spectrum_input_push(INPUT_KEY_DOWN, (uint8_t)e.key.keysym.sym, e.key.keysym.mod,
+                _frame_position(e.key.timestamp));
         }
     } else if (e.type == SDL_KEYUP) {
-        spectrum_process_key(e.key.keysym.sym, e.key.keysym.mod, false);
+        spectrum_input_push(INPUT_KEY_UP, (uint8_t)e.key.keysym.sym, e.key.keysym.mod,
+            _frame_position(e.key.timestamp));
     }
 
 }
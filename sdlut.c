@@ -26,7 +26,7 @@ void PrintSDLError() {
 // ----------------------------------------------------------------------------
 // AUDIO
 
-// SDL Audio is not actually being used 
+// pull method: the callback runs on the SDL audio thread
 extern void AudioCallback(void *userdata, Uint8 *stream, int len);	// implemented in audio.c
 
 void InitSDLAudio(int samplerate) {
@@ -34,21 +34,23 @@ void InitSDLAudio(int samplerate) {
 	SDL_AudioSpec want, have;
 
 	SDL_memset(&want, 0, sizeof(want)); /* or SDL_zero(want) */
-	want.freq = SDLUT_DEFAULT_AUDIO_SAMPLE_RATE;
+	want.freq = samplerate;			// 44100 or 48000
 	want.format = AUDIO_F32;
 	want.channels = 1;
-	want.samples = 2048;			// 512 to 8192 (needs some trial&error)
-	want.callback = NULL; //AudioCallback;	// set to NULL for using push method via SDL_QueueAudio()
+	want.samples = 512;				// 512 to 8192 (needs some trial&error)
+	want.callback = AudioCallback;	// set to NULL for using push method via SDL_QueueAudio()
 
-	SDLDATA.audio_device_id = SDL_OpenAudioDevice(NULL, 0, &want, &have, SDL_AUDIO_ALLOW_FORMAT_CHANGE);
+	// the callback only knows how to produce mono float samples
+	SDLDATA.audio_device_id = SDL_OpenAudioDevice(NULL, 0, &want, &have, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE);
 	if (SDLDATA.audio_device_id == 0) {
 		printf("Couldn't open SDL audio: %s\n", SDL_GetError());
+		SDLDATA.audio_sample_rate = samplerate;
+		SDLDATA.audio_buffer_samples = want.samples;
 		return;
 	}
 	else {
-		if (have.format != want.format) {	/* we let this one thing change. */
-			SDL_Log("We didn't get Float32 audio format.");
-		}
+		SDLDATA.audio_sample_rate = have.freq;
+		SDLDATA.audio_buffer_samples = have.samples;
 		SDL_PauseAudioDevice(SDLDATA.audio_device_id, 0);		/* start audio playing. */
 	}
 
@@ -134,9 +136,11 @@ int InitSDL() {
 
 	// 2d SDL renderer
 	//printf("SDL_CreateRenderer\n");
-	// NOTE: we enforce VSYNC here and that means (these days) 60Hz 
-	SDLDATA.renderer = SDL_CreateRenderer(SDLDATA.screen, -1,
-		SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC | SDL_RENDERER_TARGETTEXTURE);
+	// NOTE: unless told otherwise we enforce VSYNC here and that means (these days) 60Hz 
+	Uint32 renderflags = SDL_RENDERER_ACCELERATED | SDL_RENDERER_TARGETTEXTURE;
+	if (!SDLDATA.no_vsync)
+		renderflags |= SDL_RENDERER_PRESENTVSYNC;
+	SDLDATA.renderer = SDL_CreateRenderer(SDLDATA.screen, -1, renderflags);
 
 	if (SDLDATA.renderer == NULL) {
 		PrintSDLError();
@@ -166,8 +170,8 @@ int InitSDL() {
 	_last_t = SDL_GetTicks();
 
 	// init audio
-	// NOT using SDL audio at this point (using SOKOL instead)
-	// InitSDLAudio(P_DEFAULT_AUDIO_SAMPLE_RATE);
+	// left to the application: call InitSDLAudio() after InitSDL()
+	// (or before it, after SDL_InitSubSystem(SDL_INIT_AUDIO))
 
 	//printf("InitSDL() done\n");
 
@@ -69,12 +69,16 @@ struct SDLData {
 	int width, height;			// actual dimensions: the display will be scaled up to this size
 
 	SDL_AudioDeviceID audio_device_id;
+	int audio_sample_rate;		// actual rate as granted by the audio device
+	int audio_buffer_samples;	// size of the device buffer (samples per callback)
 
 	Uint8 bg_r, bg_g, bg_b, bg_a;
 	bool runloop;
+	bool no_vsync;				// set before InitSDL(): present frames immediately
 	bool abort;
 
 	Uint32 last_frame_t;	// ms since last BeginFrame()
+	Uint32 last_run_t;		// SDL_GetTicks() when the application last ran an emulated frame
 
 	SDL_Thread *ITHREAD;
 
@@ -1,4 +1,5 @@
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
@@ -7,6 +8,9 @@
 #include "spectrum.h"
 #include "spectrum_keyboard.h"
 #include "spectrum_palettes.h"
+#include "spectrum_autotype.h"
+#include "spectrum_input.h"
+#include "audio.h"
 
 #include "gw03.h"		// gosh wonderful rom
 
@@ -19,14 +23,291 @@
 
 zx_spectrum_t ZXSPECTRUM;
 
+// per model frame timings
+static const zx_timing_t TIMINGS[] = {
+	[ZX_TYPE_48K] = { SPECTRUM_CPU_CLOCK_48K, SPECTRUM_SCANLINE_TSTATES, SPECTRUM_FRAME_LINES, 
+		SPECTRUM_FRAME_TSTATES, SPECTRUM_INT_TSTATES, SPECTRUM_FIRST_DISPLAY_LINE, SPECTRUM_CONTENTION_START,
+		{ 6, 5, 4, 3, 2, 1, 0, 0 }, true },
+	[ZX_TYPE_128K] = { SPECTRUM_128K_CPU_CLOCK, SPECTRUM_128K_SCANLINE_TSTATES, SPECTRUM_128K_FRAME_LINES,
+		SPECTRUM_128K_FRAME_LINES * SPECTRUM_128K_SCANLINE_TSTATES, SPECTRUM_128K_INT_TSTATES, SPECTRUM_128K_FIRST_DISPLAY_LINE,
+		SPECTRUM_128K_CONTENTION_START, { 6, 5, 4, 3, 2, 1, 0, 0 }, true },
+	[ZX_TYPE_ZXX] = { SPECTRUM_128K_CPU_CLOCK, SPECTRUM_128K_SCANLINE_TSTATES, SPECTRUM_128K_FRAME_LINES,
+		SPECTRUM_128K_FRAME_LINES * SPECTRUM_128K_SCANLINE_TSTATES, SPECTRUM_128K_INT_TSTATES, SPECTRUM_128K_FIRST_DISPLAY_LINE,
+		SPECTRUM_128K_CONTENTION_START, { 6, 5, 4, 3, 2, 1, 0, 0 }, true },
+	[ZX_TYPE_PLUS3] = { SPECTRUM_128K_CPU_CLOCK, SPECTRUM_128K_SCANLINE_TSTATES, SPECTRUM_128K_FRAME_LINES,
+		SPECTRUM_128K_FRAME_LINES * SPECTRUM_128K_SCANLINE_TSTATES, SPECTRUM_128K_INT_TSTATES, SPECTRUM_128K_FIRST_DISPLAY_LINE,
+		SPECTRUM_PLUS3_CONTENTION_START, { 1, 0, 7, 6, 5, 4, 3, 2 }, false },
+};
+
 
 
 
+/**----------------------------------------------------------------------------
+ *	I/O DEVICES
+ */
+
+// ULA: all even ports
+static uint8_t _ula_read(void *ctx, uint16_t port) {
+	zx_spectrum_t *zx = (zx_spectrum_t*)ctx;
+	uint8_t row_mask = (uint8_t)~(port >> 8);
+	return zx_ULA_get_key_row(&zx->ula, row_mask) & 0xBF;
+}
+
+static void _ula_write(void *ctx, uint16_t port, uint8_t value) {
+	zx_spectrum_t *zx = (zx_spectrum_t*)ctx;
+	(void)port;
+	// bits 0-2 border, bit 3 MIC, bit 4 EAR: the renderer and the beeper pick these up from the log
+	zx->border = value & 7;
+	zx_ULA_out(&zx->ula, spectrum_tstate(), value);
+}
+
+// 0x7FFD: 128k memory paging
+static void _paging_write(void *ctx, uint16_t port, uint8_t value) {
+	zx_spectrum_t *zx = (zx_spectrum_t*)ctx;
+	(void)port;
+	_zx_MMU_update_memory_map_zx128(&zx->mmu, value);
+	zx_divmmc_paging_changed(&zx->divmmc);
+	zx_if1_paging_changed(&zx->if1);
+}
+
+// 0x1FFD: +3 rom/special paging, bit 3 disk motor
+static void _plus3_paging_write(void *ctx, uint16_t port, uint8_t value) {
+	zx_spectrum_t *zx = (zx_spectrum_t*)ctx;
+	(void)port;
+	_zx_MMU_update_memory_map_plus3(&zx->mmu, value);
+	zx_fdc_motor(&zx->fdc, (value & 0x08) != 0);
+	zx_divmmc_paging_changed(&zx->divmmc);
+	zx_if1_paging_changed(&zx->if1);
+}
+
+// +3 floppy disk controller: 0x2FFD main status, 0x3FFD data
+static uint8_t _fdc_status(void *ctx, uint16_t port) {
+	zx_spectrum_t *zx = (zx_spectrum_t*)ctx;
+	(void)port;
+	return zx_fdc_read_status(&zx->fdc, spectrum_tstate());
+}
+
+static uint8_t _fdc_read(void *ctx, uint16_t port) {
+	zx_spectrum_t *zx = (zx_spectrum_t*)ctx;
+	(void)port;
+	return zx_fdc_read_data(&zx->fdc, spectrum_tstate());
+}
+
+static void _fdc_write(void *ctx, uint16_t port, uint8_t value) {
+	zx_spectrum_t *zx = (zx_spectrum_t*)ctx;
+	(void)port;
+	zx_fdc_write_data(&zx->fdc, spectrum_tstate(), value);
+}
+
+// AY: 0xFFFD register select/read, 0xBFFD register write
+static uint8_t _ay_read(void *ctx, uint16_t port) {
+	zx_spectrum_t *zx = (zx_spectrum_t*)ctx;
+	(void)port;
+	return zx_ay_read(&zx->ay);
+}
+
+static void _ay_select(void *ctx, uint16_t port, uint8_t value) {
+	zx_spectrum_t *zx = (zx_spectrum_t*)ctx;
+	(void)port;
+	zx_ay_select(&zx->ay, value);
+}
+
+static void _ay_write(void *ctx, uint16_t port, uint8_t value) {
+	zx_spectrum_t *zx = (zx_spectrum_t*)ctx;
+	(void)port;
+	zx_ay_write(&zx->ay, spectrum_tstate(), value);
+}
+
+// timex display mode: port 0xFF (ZXX)
+static uint8_t _timex_read(void *ctx, uint16_t port) {
+	zx_spectrum_t *zx = (zx_spectrum_t*)ctx;
+	(void)port;
+	return zx->timex_port;
+}
+
+static void _timex_write(void *ctx, uint16_t port, uint8_t value) {
+	(void)ctx; (void)port;
+	spectrum_set_display_mode(value);
+}
+
+// ULAplus: 0xBF3B register select, 0xFF3B data
+static void _ulaplus_select(void *ctx, uint16_t port, uint8_t value) {
+	(void)ctx; (void)port;
+	spectrum_ulaplus_select(value);
+}
+
+static uint8_t _ulaplus_read(void *ctx, uint16_t port) {
+	(void)ctx; (void)port;
+	return spectrum_ulaplus_read();
+}
+
+static void _ulaplus_write(void *ctx, uint16_t port, uint8_t value) {
+	(void)ctx; (void)port;
+	spectrum_ulaplus_write(value);
+}
+
+// ZXX sprites: 0x303B slot select, 0x57 attributes, 0x5B patterns
+static void _sprite_select(void *ctx, uint16_t port, uint8_t value) {
+	zx_spectrum_t *zx = (zx_spectrum_t*)ctx;
+	(void)port;
+	zx_sprites_select(&zx->sprites, value);
+}
+
+static void _sprite_attr(void *ctx, uint16_t port, uint8_t value) {
+	zx_spectrum_t *zx = (zx_spectrum_t*)ctx;
+	(void)port;
+	zx_sprites_write_attr(&zx->sprites, value);
+}
+
+static void _sprite_pattern(void *ctx, uint16_t port, uint8_t value) {
+	zx_spectrum_t *zx = (zx_spectrum_t*)ctx;
+	(void)port;
+	zx_sprites_write_pattern(&zx->sprites, value);
+}
+
+// ZXX layer 2: 0x123B
+static uint8_t _layer2_read(void *ctx, uint16_t port) {
+	zx_spectrum_t *zx = (zx_spectrum_t*)ctx;
+	(void)port;
+	return zx->layers.layer2_port;
+}
+
+static void _layer2_write(void *ctx, uint16_t port, uint8_t value) {
+	zx_spectrum_t *zx = (zx_spectrum_t*)ctx;
+	(void)port;
+	zx_layer2_write(&zx->layers, value);
+}
+
+// ZXX next registers: 0x243B register select, 0x253B register data
+static uint8_t _nextreg_selected(void *ctx, uint16_t port) {
+	zx_spectrum_t *zx = (zx_spectrum_t*)ctx;
+	(void)port;
+	return zx->nextreg.selected;
+}
+
+static void _nextreg_select(void *ctx, uint16_t port, uint8_t value) {
+	zx_spectrum_t *zx = (zx_spectrum_t*)ctx;
+	(void)port;
+	zx_nextreg_select(&zx->nextreg, value);
+}
+
+static uint8_t _nextreg_read(void *ctx, uint16_t port) {
+	zx_spectrum_t *zx = (zx_spectrum_t*)ctx;
+	(void)port;
+	return zx_nextreg_read(&zx->nextreg);
+}
+
+static void _nextreg_write(void *ctx, uint16_t port, uint8_t value) {
+	zx_spectrum_t *zx = (zx_spectrum_t*)ctx;
+	(void)port;
+	zx_nextreg_write(&zx->nextreg, value);
+}
+
+// ZXX dma: 0x6B
+static uint8_t _dma_read(void *ctx, uint16_t port) {
+	zx_spectrum_t *zx = (zx_spectrum_t*)ctx;
+	(void)port;
+	return zx_dma_read(&zx->dma);
+}
+
+static void _dma_write(void *ctx, uint16_t port, uint8_t value) {
+	zx_spectrum_t *zx = (zx_spectrum_t*)ctx;
+	(void)port;
+	zx_dma_write(&zx->dma, value);
+}
+
+// kempston joystick: port 0x1F
+static uint8_t _kempston_read(void *ctx, uint16_t port) {
+	zx_spectrum_t *zx = (zx_spectrum_t*)ctx;
+	(void)port;
+	return zx->kempston;
+}
+
+// All port devices of the model, partially decoded like the real hardware
+static void _register_io_devices(zx_spectrum_t *zx) {
+	z80_io_bus_t *io = &zx->io;
+
+	z80_io_Init(io);
+	z80_io_Register(io, "ula", 0x0001, 0x0000, _ula_read, _ula_write, zx);
+	z80_io_Register(io, "kempston", 0x00E0, 0x0000, _kempston_read, NULL, zx);
+	z80_io_Register(io, "ulaplus select", 0xFFFF, 0xBF3B, NULL, _ulaplus_select, zx);
+	z80_io_Register(io, "ulaplus data", 0xFFFF, 0xFF3B, _ulaplus_read, _ulaplus_write, zx);
+
+	if (zx->zx_type == ZX_TYPE_PLUS3) {
+		// the +3 decodes more address lines: 0x1FFD would look like 0x7FFD to a 128k
+		z80_io_Register(io, "128k paging", 0xC002, 0x4000, NULL, _paging_write, zx);
+		z80_io_Register(io, "+3 paging", 0xF002, 0x1000, NULL, _plus3_paging_write, zx);
+		z80_io_Register(io, "fdc status", 0xF002, 0x2000, _fdc_status, NULL, zx);
+		z80_io_Register(io, "fdc data", 0xF002, 0x3000, _fdc_read, _fdc_write, zx);
+	}
+	else if (zx->zx_type != ZX_TYPE_48K)
+		z80_io_Register(io, "128k paging", 0x8002, 0x0000, NULL, _paging_write, zx);
+	if (zx->zx_type != ZX_TYPE_48K) {
+		z80_io_Register(io, "ay select", 0xC002, 0xC000, _ay_read, _ay_select, zx);
+		z80_io_Register(io, "ay write", 0xC002, 0x8000, NULL, _ay_write, zx);
+	}
+	if (zx->zx_type == ZX_TYPE_ZXX) {
+		z80_io_Register(io, "timex", 0x00FF, 0x00FF, _timex_read, _timex_write, zx);
+		z80_io_Register(io, "sprite select", 0xFFFF, 0x303B, NULL, _sprite_select, zx);
+		z80_io_Register(io, "sprite attributes", 0x00FF, 0x0057, NULL, _sprite_attr, zx);
+		z80_io_Register(io, "sprite patterns", 0x00FF, 0x005B, NULL, _sprite_pattern, zx);
+		z80_io_Register(io, "layer 2", 0xFFFF, 0x123B, _layer2_read, _layer2_write, zx);
+		z80_io_Register(io, "nextreg select", 0xFFFF, 0x243B, _nextreg_selected, _nextreg_select, zx);
+		z80_io_Register(io, "nextreg data", 0xFFFF, 0x253B, _nextreg_read, _nextreg_write, zx);
+		z80_io_Register(io, "dma", 0x00FF, 0x006B, _dma_read, _dma_write, zx);
+	}
+}
+
+
 /**----------------------------------------------------------------------------
  *	INITIALIZATION
  */
 
-void init_spectrum() {
+// ULA contention: during the 128 display T-states of each of the 192 display lines
+// the cpu gets held off in the repeating 6,5,4,3,2,1,0,0 pattern (+3: 1,0,7,6,5,4,3,2)
+static void _build_contention_table(zx_spectrum_t *zx) {
+	const zx_timing_t *timing = &zx->timing;
+	const uint8_t *pattern = timing->contention_pattern;
+
+	memset(zx->contention, 0, sizeof(zx->contention));
+	for (int line = 0; line < SCREENH; line++) {
+		uint32_t start = timing->contention_start + line * timing->line_tstates;
+		for (int t = 0; t < 128; t++)
+			zx->contention[start + t] = pattern[t & 7];
+	}
+}
+
+// read a rom image (16k, or 8k for peripherals) from SPECTRUM_ROM_DIR
+static bool _read_rom_file(const char *name, uint8_t *rom, size_t size) {
+	char fname[SPECTRUM_MAX_FILE_DIR_LEN];
+
+	snprintf(fname, sizeof(fname), "%s/%s", SPECTRUM_ROM_DIR, name);
+	FILE *f = fopen(fname, "rb");
+	if (!f) {
+		printf("can't open rom file \"%s\"\n", fname);
+		return false;
+	}
+	size_t n = fread(rom, 1, size, f);
+	fclose(f);
+	if (n != size) {
+		printf("rom file \"%s\" is not %d bytes\n", fname, (int)size);
+		return false;
+	}
+	return true;
+}
+
+// load a rom image (16k, or 8k for peripherals) from SPECTRUM_ROM_DIR into rom pages from page_no
+bool spectrum_load_rom_file(int page_no, const char *name, size_t size) {
+	uint8_t rom[SPECTRUM_ROM_SIZE];
+
+	if (size > SPECTRUM_ROM_SIZE || !_read_rom_file(name, rom, size))
+		return false;
+
+	z80_mmu_LoadROMPage(&ZXSPECTRUM.mmu, page_no, rom, size);
+	return true;
+}
+
+void init_spectrum(zx_type_t zx_type) {
 
    /*
 	* ZX Spectrum display memory layout:
@@ -41,14 +322,51 @@ void init_spectrum() {
 	* - attributes are stored as a straight row major array 24 rows * 32 columns 
 	*/
 
+	// the 128k and +3 roms have to come from disk: without them we can only be a 48k
+	// (read before the mmu gets set up for the model)
+	static uint8_t roms[4][SPECTRUM_ROM_SIZE];
+	static const int plus3_rom_pages[4] = { ROM_0_BANK * 2, ROM_4_BANK * 2, ROM_5_BANK * 2, ROM_1_BANK * 2 };
+	static const int rom_pages_128k[2] = { ROM_0_BANK * 2, ROM_1_BANK * 2 };
+	const int *rom_pages = NULL;
+	int num_roms = 0;
+	if (zx_type == ZX_TYPE_PLUS3) {
+		rom_pages = plus3_rom_pages;
+		for (num_roms = 0; num_roms < 4; num_roms++) {
+			char name[32];
+			snprintf(name, sizeof(name), SPECTRUM_PLUS3_ROM_FILE, num_roms);
+			if (!_read_rom_file(name, roms[num_roms], SPECTRUM_ROM_SIZE)) {
+				printf("+3 roms not available: falling back to 48k\n");
+				zx_type = ZX_TYPE_48K;
+				break;
+			}
+		}
+	}
+	else if (zx_type != ZX_TYPE_48K) {
+		rom_pages = rom_pages_128k;
+		num_roms = 2;
+		if (!_read_rom_file(SPECTRUM_128K_ROM0_FILE, roms[0], SPECTRUM_ROM_SIZE)
+			|| !_read_rom_file(SPECTRUM_128K_ROM1_FILE, roms[1], SPECTRUM_ROM_SIZE)) {
+			printf("128k roms not available: falling back to 48k\n");
+			zx_type = ZX_TYPE_48K;
+		}
+	}
+
 	// clear to all 0 first
 	memset(&ZXSPECTRUM, 0, sizeof(ZXSPECTRUM));
 
-	// init the mmu: for now we are always a 48k
-	z80_mmu_Init(&ZXSPECTRUM.mmu, ZX_TYPE_48K);
+	// init the mmu
+	z80_mmu_Init(&ZXSPECTRUM.mmu, zx_type);
 
 	// init palette 
 	memcpy(ZXSPECTRUM.spectrum_palette, _palette_argb32, 16 * sizeof(uint32_t));
+	spectrum_update_colour_table();
+	spectrum_set_display_mode(0);
+	zx_sprites_init(&ZXSPECTRUM.sprites);
+	zx_layers_init(&ZXSPECTRUM.layers);
+	zx_nextreg_init(&ZXSPECTRUM.nextreg);
+	zx_dma_init(&ZXSPECTRUM.dma);
+	zx_copper_init(&ZXSPECTRUM.copper);
+	zx_fdc_init(&ZXSPECTRUM.fdc);
 
 	// build the source line pointers array: this is helpful for linearizing access to
 	// the awfully confusing zx spectrum display memory segmented/interleaved structure
@@ -66,8 +384,15 @@ void init_spectrum() {
 		ZXSPECTRUM.linep[y] = offset;
 	}
 
-	// copy rom for 48k mode (using the "gosh wonderful" rom)
-	memcpy(ZXSPECTRUM.mmu.banks[ROM_2_BANK], gw03, SPECTRUM_ROM_SIZE);
+	// copy rom for 48k mode (using the "gosh wonderful" rom), then the ones read from disk
+	z80_mmu_LoadROM(&ZXSPECTRUM.mmu, ROM_2_BANK, gw03, SPECTRUM_ROM_SIZE);
+	if (zx_type != ZX_TYPE_48K) {
+		for (int rom = 0; rom < num_roms; rom++)
+			z80_mmu_LoadROMPage(&ZXSPECTRUM.mmu, rom_pages[rom], roms[rom], SPECTRUM_ROM_SIZE);
+	}
+	ZXSPECTRUM.zx_type = zx_type;
+	ZXSPECTRUM.timing = TIMINGS[zx_type];
+	_build_contention_table(&ZXSPECTRUM);
 
 	// init keyboard
 	//init_spectrum_keyboard();
@@ -77,11 +402,31 @@ void init_spectrum() {
 	ZXSPECTRUM.cpu = &Z80CPU;
 	ZXSPECTRUM.power_state = 0;
 	ZXSPECTRUM.border = 7;
+	ZXSPECTRUM.beam.border_colour = 7;
+	ZXSPECTRUM.ula.out.value = 7;
+	zx_beeper_init(&ZXSPECTRUM.beeper, audio_get_sample_rate(), ZXSPECTRUM.timing.cpu_clock);
+	zx_ay_init(&ZXSPECTRUM.ay, audio_get_sample_rate(), ZXSPECTRUM.timing.cpu_clock);
+	_register_io_devices(&ZXSPECTRUM);
 	z80cpu_init(&ZXSPECTRUM);
 }
 
 void spectrum_power(int on) {
 	if(on) {
+		// power on: fresh ram, boot mappings
+		z80_mmu_Reset(&ZXSPECTRUM.mmu, ZXSPECTRUM.zx_type);
+		spectrum_set_display_mode(0);
+		zx_sprites_init(&ZXSPECTRUM.sprites);
+		zx_layers_init(&ZXSPECTRUM.layers);
+		zx_nextreg_init(&ZXSPECTRUM.nextreg);
+		zx_dma_init(&ZXSPECTRUM.dma);
+		zx_copper_init(&ZXSPECTRUM.copper);
+		if (ZXSPECTRUM.divmmc.b_attached)
+			zx_divmmc_reset(&ZXSPECTRUM.divmmc);
+		if (ZXSPECTRUM.if1.b_attached)
+			zx_if1_reset(&ZXSPECTRUM.if1);
+		zx_fdc_reset(&ZXSPECTRUM.fdc);
+		spectrum_ulaplus_set(&(zx_ulaplus_t){ 0 });
+		zx_ay_reset(&ZXSPECTRUM.ay);
 		z80cpu_power(true);
 		ZXSPECTRUM.power_state = 1;
 	} else {
@@ -90,151 +435,471 @@ void spectrum_power(int on) {
 	}
 }
 
+// Called once per frame after the last z80cpu_step() of that frame
+// turns the frame's beeper (and AY) activity into samples for the host audio
+void spectrum_end_frame() {
+	zx_beeper_t *beeper = &ZXSPECTRUM.beeper;
+	const uint32_t frame_tstates = ZXSPECTRUM.timing.frame_tstates;
+	int count = zx_beeper_end_frame(beeper, &ZXSPECTRUM.ula.out, frame_tstates);
+	if (ZXSPECTRUM.zx_type != ZX_TYPE_48K)
+		zx_ay_mix_frame(&ZXSPECTRUM.ay, frame_tstates, beeper->out, count, beeper->out_t0, beeper->out_t_step);
+	audio_ring_write(beeper->out, count);
+
+	// carry any overshoot of the last instruction over into the next frame
+	spectrum_beam_end_frame(frame_tstates);
+	zx_ULA_end_frame(&ZXSPECTRUM.ula, frame_tstates);
+	zx_dma_end_frame(&ZXSPECTRUM.dma, frame_tstates);
+	zx_copper_end_frame(&ZXSPECTRUM.copper, frame_tstates);
+	zx_divmmc_end_frame(&ZXSPECTRUM.divmmc);
+	zx_fdc_end_frame(&ZXSPECTRUM.fdc, frame_tstates);
+	zx_if1_end_frame(&ZXSPECTRUM.if1, frame_tstates);
+	spectrum_autotype_end_frame();
+	ZXSPECTRUM.frame_tstate -= frame_tstates;
+	ZXSPECTRUM.frame_no++;
+}
+
+// Run one complete frame (timing.frame_lines scanlines)
+// The visible scanlines get rendered into framebuffer (FRAME_WIDTH x FRAME_HEIGHT, scanline doubled)
+// as soon as the cpu has finished with them
+void spectrum_run_frame(uint32_t *framebuffer) {
+
+	uint32_t LINEBUF[FRAME_WIDTH];
+	const zx_timing_t *timing = &ZXSPECTRUM.timing;
+
+	// the display (DISPLAY_HEIGHT lines) is centered around the 192 lines of the display file
+	const int first_visible_line = timing->first_display_line - (DISPLAY_HEIGHT - SCREENH) / 2;
+
+	for (int line = 0; line < (int)timing->frame_lines; line++) {
+
+		// drive the z80 cpu: scanline granularity
+		// targets are absolute frame T-states so that instruction overshoot doesn't accumulate
+		uint32_t line_end = (line + 1) * timing->line_tstates;
+		spectrum_beam_begin_line(line);
+		if (line == 0) {
+			// start of frame: vblank interrupt
+			z80_int(ZXSPECTRUM.cpu, 1);
+			if (ZXSPECTRUM.frame_tstate < timing->int_tstates)
+				z80cpu_step(timing->int_tstates - ZXSPECTRUM.frame_tstate);
+			z80_int(ZXSPECTRUM.cpu, 0);
+		}
+
+		// the copper's register writes and queued input land between cpu steps split at
+		// the copper's WAIT positions and the input events' T-states
+		for (;;) {
+			uint32_t next = ZXSPECTRUM.copper.next_tstate;
+			uint32_t input = spectrum_input_next_tstate();
+			if (input < next)
+				next = input;
+			if (next >= line_end)
+				break;
+			if (ZXSPECTRUM.frame_tstate < next)
+				z80cpu_step(next - ZXSPECTRUM.frame_tstate);
+			zx_copper_run(&ZXSPECTRUM.copper, ZXSPECTRUM.frame_tstate);
+			spectrum_input_run(ZXSPECTRUM.frame_tstate);
+		}
+		if (ZXSPECTRUM.frame_tstate < line_end)
+			z80cpu_step(line_end - ZXSPECTRUM.frame_tstate);
+
+		// paced dma bursts steal their bus cycles at scanline granularity
+		if (ZXSPECTRUM.dma.b_active)
+			zx_dma_run(&ZXSPECTRUM.dma, ZXSPECTRUM.frame_tstate);
+
+		// drive the zx spectrum display: render the scanline just completed
+		int scanline = line - first_visible_line;
+		if (scanline >= 0 && scanline < DISPLAY_HEIGHT) {
+			uint32_t *dp = framebuffer + FRAME_WIDTH * scanline * 2;
+			render_spectrum_scanline(scanline, LINEBUF);
+			if (ZXSPECTRUM.zx_type == ZX_TYPE_ZXX)
+				spectrum_compose_scanline(scanline, LINEBUF);
+
+			// scanline doubler
+			memcpy(dp, (void*)LINEBUF, sizeof(LINEBUF));
+			memcpy(dp + FRAME_WIDTH, (void*)LINEBUF, sizeof(LINEBUF));
+		}
+	}
+
+	// frame done: flush audio
+	spectrum_end_frame();
+}
+
 /**----------------------------------------------------------------------------
  *	DISPLAY
+ *
+ *  Lines are rendered as soon as the cpu has finished with them. Anything that
+ *  changed while the beam was on the line (border OUTs, display file writes to the
+ *  line's bytes) has been logged with its T-state in ZXSPECTRUM.beam: lines without
+ *  events take the whole line path, the others get rendered in segments between events.
  **/
 
 static bool flash = 0;
 static uint32_t spectrum_framecount = 0;
 
-static void _memset_16(uint16_t *dest, uint16_t value, size_t len) {
+// ink (0) and paper (1) for every attribute byte and both flash phases
+static uint32_t ATTR_COLOURS[2][256][2];
+
+// border colours (standard palette or ULAplus)
+static uint32_t BORDER_COLOURS[8];
+
+// colours of the linear 256 colour mode: RRRGGGBB
+static uint32_t LINEAR_COLOURS[256];
+
+// the beam leaves the left border 16 T-states before the first pixel of a line is fetched
+#define BORDER_LEFT_TSTATES		16
+#define BORDER_LEFT_PIXELS		32		// virtual (320 wide) pixels: 2 per T-state
+#define DISPLAY_PIXELS			256
+
+static void _memset_32(uint32_t *dest, uint32_t value, size_t len) {
 	while(len--) {
 		*dest++ = value;
 	}
 }
 
+// Rebuild the attribute colour table (after palette or ULAplus mode changes)
+// the renderer never needs to know whether ULAplus is active: it's all in here
+void spectrum_update_colour_table() {
+	const uint32_t *palette = ZXSPECTRUM.spectrum_palette;
+	const uint32_t *plus = palette + SPECTRUM_ULAPLUS_PALETTE;
+	const bool b_ulaplus = (ZXSPECTRUM.ulaplus.mode & 1) != 0;
+
+	for (int c = 0; c < 256; c++)
+		LINEAR_COLOURS[c] = spectrum_rgb332_argb32(c);
+
+	for (int attr = 0; attr < 256; attr++) {
+		uint32_t ink, paper;
+		bool b_flash;
+
+		if (b_ulaplus) {
+			// flash and bright select one of 4 groups of 8 ink + 8 paper colours, no flashing
+			int group = (attr >> 6) * 16;
+			ink = plus[group + (attr & 0x7)];
+			paper = plus[group + 8 + ((attr & 0x38) >> 3)];
+			b_flash = false;
+		}
+		else {
+			int bright = (attr & 0x40) >> 3;		// bright bit shifted to provide a +8 offset
+			ink = palette[(attr & 0x7) + bright];
+			paper = palette[((attr & 0x38) >> 3) + bright];
+			b_flash = (attr & 0x80) != 0;
+		}
+
+		ATTR_COLOURS[0][attr][0] = ink;
+		ATTR_COLOURS[0][attr][1] = paper;
+		ATTR_COLOURS[1][attr][0] = b_flash ? paper : ink;
+		ATTR_COLOURS[1][attr][1] = b_flash ? ink : paper;
+	}
+
+	// ULAplus border: paper colours of the first group
+	for (int c = 0; c < 8; c++)
+		BORDER_COLOURS[c] = b_ulaplus ? plus[8 + c] : palette[c];
+}
+
+/**----------------------------------------------------------------------------
+ *	ULAPLUS
+ */
+
+// ULAplus colours are GGGRRRBB, the missing blue bit is the or of the other two
+static uint32_t _ulaplus_argb32(uint8_t grb) {
+	uint32_t g = (grb >> 5) & 7;
+	uint32_t r = (grb >> 2) & 7;
+	uint32_t b = ((grb & 3) << 1) | ((grb >> 1) & 1) | (grb & 1);
+	return 0xff000000 | ((r * 255 / 7) << 16) | ((g * 255 / 7) << 8) | (b * 255 / 7);
+}
+
+// port 0xBF3B: bits 6-7 register group (0 palette, 1 mode), bits 0-5 palette entry
+void spectrum_ulaplus_select(uint8_t value) {
+	ZXSPECTRUM.ulaplus.reg = value;
+}
+
+// port 0xFF3B: palette entry or mode, whatever has been selected
+void spectrum_ulaplus_write(uint8_t value) {
+	zx_ulaplus_t *ulaplus = &ZXSPECTRUM.ulaplus;
+
+	switch (ulaplus->reg >> 6) {
+	case 0:
+		ulaplus->palette[ulaplus->reg & 0x3F] = value;
+		ZXSPECTRUM.spectrum_palette[SPECTRUM_ULAPLUS_PALETTE + (ulaplus->reg & 0x3F)] = _ulaplus_argb32(value);
+		break;
+	case 1:
+		ulaplus->mode = value;
+		break;
+	default:
+		return;
+	}
+	spectrum_update_colour_table();
+}
+
+uint8_t spectrum_ulaplus_read() {
+	const zx_ulaplus_t *ulaplus = &ZXSPECTRUM.ulaplus;
+	return (ulaplus->reg >> 6) == 0 ? ulaplus->palette[ulaplus->reg & 0x3F] : ulaplus->mode;
+}
+
+// (re)load all of the ULAplus state (reset, session resume)
+void spectrum_ulaplus_set(const zx_ulaplus_t *ulaplus) {
+	ZXSPECTRUM.ulaplus = *ulaplus;
+	for (int i = 0; i < SPECTRUM_ULAPLUS_COLOURS; i++)
+		ZXSPECTRUM.spectrum_palette[SPECTRUM_ULAPLUS_PALETTE + i] = _ulaplus_argb32(ulaplus->palette[i]);
+	spectrum_update_colour_table();
+}
+
+/**
+ *	Display mode kernels: one per mode, selected through ZXSPECTRUM.display_kernel
+ *	whenever the mode changes (spectrum_set_display_mode()). Each renders the 256
+ *	(virtual) display pixels of a line from two source rows a and b (see _display_offsets()).
+ *	None of them looks at the mode: no branches per pixel, the compiler is free to vectorise.
+ */
+
+// 32 character cells of 8 pixels, attribute per cell (standard, and 8x1 timex hi-colour)
+static void _render_cells(uint32_t *dp, const uint8_t *pixels, const uint8_t *attrs) {
+	const uint32_t (*colours)[2] = ATTR_COLOURS[flash];
+
+	for (int x = 0; x < 32; x++) {
+		const uint32_t paper = colours[attrs[x]][1];
+		const uint32_t diff = colours[attrs[x]][0] ^ paper;
+		const uint8_t p = pixels[x];
+
+		for (int i = 0; i < 8; i++) {
+			uint32_t c = paper ^ (diff & (0u - ((p >> (7 - i)) & 1)));
+			dp[2*i] = c;
+			dp[2*i+1] = c;
+		}
+		dp += 16;
+	}
+}
+
+// timex hi-res: 64 columns of 8 pixels alternating between both screens, one pixel per physical pixel
+static void _render_hires(uint32_t *dp, const uint8_t *screen0, const uint8_t *screen1) {
+	const uint32_t paper = ZXSPECTRUM.hires_paper;
+	const uint32_t diff = ZXSPECTRUM.hires_ink ^ paper;
+
+	for (int x = 0; x < 32; x++) {
+		const uint8_t p0 = screen0[x];
+		const uint8_t p1 = screen1[x];
+		for (int i = 0; i < 8; i++) {
+			dp[i] = paper ^ (diff & (0u - ((p0 >> (7 - i)) & 1)));
+			dp[8 + i] = paper ^ (diff & (0u - ((p1 >> (7 - i)) & 1)));
+		}
+		dp += 16;
+	}
+}
+
+// linear 256x192, one byte per pixel from the ULAX banks
+static void _render_linear(uint32_t *dp, const uint8_t *pixels, const uint8_t *unused) {
+	(void)unused;
+	for (int x = 0; x < DISPLAY_PIXELS; x++) {
+		uint32_t c = LINEAR_COLOURS[pixels[x]];
+		dp[2*x] = c;
+		dp[2*x+1] = c;
+	}
+}
+
+// Select the display mode from a write to the timex port 0xFF (bits 0-2 mode, bits 3-5 hi-res ink)
+//   000: standard (screen 0)       001: standard (screen 1 at 0x6000)
+//   010: hi-colour (8x1 attributes from 0x6000)
+//   110: hi-res 512x192 (columns alternate between 0x4000 and 0x6000)
+//   100: ZXX linear 256 colours from the ULAX banks (unused on the timex)
+void spectrum_set_display_mode(uint8_t timex_port) {
+	ZXSPECTRUM.timex_port = timex_port;
+	ZXSPECTRUM.display_screen_offset = 0;
+
+	switch (timex_port & 7) {
+	case 1:
+		ZXSPECTRUM.display_mode = ZX_DISPLAY_STANDARD;
+		ZXSPECTRUM.display_screen_offset = SPECTRUM_SCREEN_1_OFFSET;
+		ZXSPECTRUM.display_kernel = _render_cells;
+		break;
+	case 2:
+		ZXSPECTRUM.display_mode = ZX_DISPLAY_HICOLOUR;
+		ZXSPECTRUM.display_kernel = _render_cells;
+		break;
+	case 6: {
+		int ink = (timex_port >> 3) & 7;
+		ZXSPECTRUM.display_mode = ZX_DISPLAY_HIRES;
+		ZXSPECTRUM.hires_ink = ZXSPECTRUM.spectrum_palette[ink];
+		ZXSPECTRUM.hires_paper = ZXSPECTRUM.spectrum_palette[7 - ink];
+		ZXSPECTRUM.display_kernel = _render_hires;
+		break;
+	}
+	case 4:
+		if (ZXSPECTRUM.zx_type == ZX_TYPE_ZXX) {
+			ZXSPECTRUM.display_mode = ZX_DISPLAY_LINEAR;
+			ZXSPECTRUM.display_kernel = _render_linear;
+			break;
+		}
+		// fall through
+	default:
+		ZXSPECTRUM.display_mode = ZX_DISPLAY_STANDARD;
+		ZXSPECTRUM.display_kernel = _render_cells;
+		break;
+	}
+}
+
+// Offsets of a display line's source rows into the display bank (all but the linear mode)
+// these are also the bytes that get logged for beam racing
+static bool _display_offsets(int display_line, uint16_t *a, uint16_t *b) {
+	const int line = ZXSPECTRUM.linep[display_line];
+
+	switch (ZXSPECTRUM.display_mode) {
+	case ZX_DISPLAY_STANDARD:
+		*a = ZXSPECTRUM.display_screen_offset + line;
+		*b = ZXSPECTRUM.display_screen_offset + SPECTRUM_ATTRIBUTES_OFFSET + (display_line >> 3) * 32;
+		return true;
+	case ZX_DISPLAY_HICOLOUR:
+	case ZX_DISPLAY_HIRES:
+		*a = line;
+		*b = SPECTRUM_SCREEN_1_OFFSET + line;
+		return true;
+	default:
+		return false;
+	}
+}
+
+// beam T-state of a virtual pixel of the line whose first display pixel is at line_t0
+static inline uint32_t _beam_tstate(uint32_t line_t0, int vx) {
+	return line_t0 - BORDER_LEFT_TSTATES + vx / 2;
+}
+
+// the ula latches the border colour every 4 T-states (8 pixels)
+static inline uint32_t _border_latch_tstate(uint32_t tstate) {
+	return (tstate + 3) & ~3u;
+}
+
+// apply the border changes the beam has passed by tstate
+static inline void _consume_border_events(zx_beam_t *beam, uint32_t tstate) {
+	const zx_ula_out_t *e;
+	while ((e = zx_ULA_next_out(&ZXSPECTRUM.ula.out, &beam->border_read, tstate)))
+		beam->border_colour = e->value & 7;
+}
+
+// border virtual pixels vx0..vx1, in segments between border changes
+static void _render_border(uint32_t *LINEBUF, int vx0, int vx1, uint32_t line_t0) {
+	zx_beam_t *beam = &ZXSPECTRUM.beam;
+	const zx_ula_log_t *log = &ZXSPECTRUM.ula.out;
+	const uint32_t t_left = line_t0 - BORDER_LEFT_TSTATES;		// multiple of 4 for all models
+
+	// a change becomes visible at the next 4 T-state boundary: the beam is on one at vx0
+	_consume_border_events(beam, _beam_tstate(line_t0, vx0) + 1);
+
+	if (beam->border_read == log->head) {
+		// nothing pending: single colour
+		_memset_32(LINEBUF + vx0 * 2, BORDER_COLOURS[beam->border_colour], (vx1 - vx0) * 2);
+		return;
+	}
+
+	while (vx0 < vx1) {
+		int vx_end = vx1;
+		if (beam->border_read != log->head) {
+			uint32_t t = _border_latch_tstate(log->events[beam->border_read & (ULA_OUT_LOG_SIZE - 1)].tstate);
+			if (t < _beam_tstate(line_t0, vx1))
+				vx_end = t > t_left ? (int)(t - t_left) * 2 : 0;
+		}
+		if (vx_end > vx0) {
+			_memset_32(LINEBUF + vx0 * 2, BORDER_COLOURS[beam->border_colour], (vx_end - vx0) * 2);
+			vx0 = vx_end;
+		}
+		// the changes latched at vx0
+		_consume_border_events(beam, _beam_tstate(line_t0, vx0) + 1);
+	}
+}
+
+// Undo the display writes the beam hadn't seen yet: a cell fetched at t shows
+// the value from before the first write at or after t
+static void _rewind_display_writes(const zx_beam_t *beam, uint32_t line_t0, uint8_t *a, uint8_t *b) {
+	for (int i = beam->num_writes - 1; i >= 0; i--) {
+		const zx_display_write_t *w = &beam->writes[i];
+		bool b_second = (uint16_t)(w->offset - beam->attr_offset) < 32;
+		int x = w->offset - (b_second ? beam->attr_offset : beam->pixel_offset);
+		if (w->tstate >= line_t0 + x * 4) {
+			if (b_second)
+				b[x] = w->old_value;
+			else
+				a[x] = w->old_value;
+		}
+	}
+}
+
 void render_spectrum_scanline(int scanline, uint32_t *LINEBUF) {
 
 	if(ZXSPECTRUM.power_state == 0)
 		return;
 
-	//scanline = (scanline+1) % SCREENH;
-
 	if(scanline == 0) {
 		spectrum_framecount++;
-		// at 60 Hz this is one full cycle (on off on) every 0.64s
-		if(!(spectrum_framecount%19))		
+		// as on the real thing: swap ink and paper every 16 frames (at 50 Hz)
+		if(!(spectrum_framecount%16))		
 			flash = !flash;
 	}
 
-	uint32_t *dp = LINEBUF;
-
-	// hard coded display file always assumed to be in bank 5
-	uint8_t *attributes = ZXSPECTRUM.mmu.banks[RAM_5_BANK] + SPECTRUM_ATTRIBUTES_OFFSET;
+	zx_beam_t *beam = &ZXSPECTRUM.beam;
+	const zx_timing_t *timing = &ZXSPECTRUM.timing;
 
-	uint8_t pixels = 0;
-	uint8_t attrib = 0;
-	uint8_t bright = 0;
+	// frame line and the T-state at which its first display pixel gets fetched
+	const int display_line = scanline - (DISPLAY_HEIGHT - SCREENH) / 2;
+	const uint32_t line_t0 = (timing->first_display_line + display_line) * timing->line_tstates;
 
-	if(scanline < 24 || scanline >= 216) {
+	if(display_line < 0 || display_line >= SCREENH) {
 		// upper & lower border
-		memset(dp, ZXSPECTRUM.spectrum_palette[ZXSPECTRUM.border], FRAME_WIDTH*sizeof(uint32_t));
-	} else {
+		_render_border(LINEBUF, 0, DISPLAY_WIDTH, line_t0);
+		return;
+	}
 
-		int spectrum_scanline = scanline - 24;
-		
-		// hard coded display file always assumed to be in bank 5
-		uint8_t *l_sp = ZXSPECTRUM.mmu.banks[RAM_5_BANK] + ZXSPECTRUM.linep[spectrum_scanline];
-		int attrib_row_index = (spectrum_scanline >> 3) << 5;	// (scanline / 8) * 32
+	_render_border(LINEBUF, 0, BORDER_LEFT_PIXELS, line_t0);
 
-		// left border
-		memset(dp, ZXSPECTRUM.spectrum_palette[ZXSPECTRUM.border], 64*sizeof(uint32_t));
-		dp += 64;
+	uint32_t *dp = LINEBUF + BORDER_LEFT_PIXELS * 2;
+	uint16_t a_offset, b_offset;
 
-		for (int x = 0; x < 32; x++) {
-			pixels = *l_sp++;
-			attrib = attributes[attrib_row_index + x];	// get attribute
+	if (!_display_offsets(display_line, &a_offset, &b_offset)) {
+		// linear mode: 3 ULAX banks of 64 lines each
+		const uint8_t *row = ZXSPECTRUM.mmu.banks[ULAX_0_BANK + display_line / 64] + (display_line % 64) * DISPLAY_PIXELS;
+		ZXSPECTRUM.display_kernel(dp, row, NULL);
+	}
+	else {
+		// display file: bank 5, or the shadow screen in bank 7 (128k, port 0x7FFD bit 3)
+		const uint8_t *display_file = ZXSPECTRUM.mmu.banks[ZXSPECTRUM.mmu.display_bank];
+		const uint8_t *a = display_file + a_offset;
+		const uint8_t *b = display_file + b_offset;
+
+		if (beam->num_writes == 0 || a_offset != beam->pixel_offset || b_offset != beam->attr_offset) {
+			// nothing happened to this line while the beam was on it (or the mode changed under it)
+			ZXSPECTRUM.display_kernel(dp, a, b);
+		}
+		else {
+			uint8_t seen_a[32], seen_b[32];
+			memcpy(seen_a, a, 32);
+			memcpy(seen_b, b, 32);
+			_rewind_display_writes(beam, line_t0, seen_a, seen_b);
+			ZXSPECTRUM.display_kernel(dp, seen_a, seen_b);
+		}
+	}
 
-			bright = (attrib & 0x40)>>3;		// bright bit shifted to provide a +8 offset
-			uint32_t ink = ZXSPECTRUM.spectrum_palette[(attrib & 0x7) + bright];
-			uint32_t paper = ZXSPECTRUM.spectrum_palette[((attrib & 0x38) >> 3) + bright];
+	_render_border(LINEBUF, BORDER_LEFT_PIXELS + DISPLAY_PIXELS, DISPLAY_WIDTH, line_t0);
+}
 
-			if((attrib&0b10000000) && flash) {
-				uint16_t t = ink;
-				ink = paper;
-				paper = t;
-			}
+// Set up display write logging for the frame line the cpu is about to run
+void spectrum_beam_begin_line(int line) {
+	zx_beam_t *beam = &ZXSPECTRUM.beam;
+	int display_line = line - (int)ZXSPECTRUM.timing.first_display_line;
 
-			// unrolled inner loop 
-			// 0 
-			if (pixels & 0b10000000) {
-				*dp++ = ink;
-				*dp++ = ink;
-			}
-			else {
-				*dp++ = paper;
-				*dp++ = paper;
-			}
-			// 1
-			if (pixels & 0b01000000) {
-				*dp++ = ink;
-				*dp++ = ink;
-			}
-			else {
-				*dp++ = paper;
-				*dp++ = paper;
-			}
-			// 2 
-			if (pixels & 0b00100000) {
-				*dp++ = ink;
-				*dp++ = ink;
-			}
-			else {
-				*dp++ = paper;
-				*dp++ = paper;
-			}
-			// 3
-			if (pixels & 0b00010000) {
-				*dp++ = ink;
-				*dp++ = ink;
-			}
-			else {
-				*dp++ = paper;
-				*dp++ = paper;
-			}
-			// 4
-			if (pixels & 0b00001000) {
-				*dp++ = ink;
-				*dp++ = ink;
-			}
-			else {
-				*dp++ = paper;
-				*dp++ = paper;
-			}
-			// 5
-			if (pixels & 0b00000100) {
-				*dp++ = ink;
-				*dp++ = ink;
-			}
-			else {
-				*dp++ = paper;
-				*dp++ = paper;
-			}
-			// 6 
-			if (pixels & 0b00000010) {
-				*dp++ = ink;
-				*dp++ = ink;
-			}
-			else {
-				*dp++ = paper;
-				*dp++ = paper;
-			}
-			// 7
-			if (pixels & 0b00000001) {
-				*dp++ = ink;
-				*dp++ = ink;
-			}
-			else {
-				*dp++ = paper;
-				*dp++ = paper;
-			}
-		}
+	beam->num_writes = 0;
+	beam->b_display_line = display_line >= 0 && display_line < SCREENH
+		&& _display_offsets(display_line, &beam->pixel_offset, &beam->attr_offset);
+}
 
-		// right border
-		memset(dp, ZXSPECTRUM.spectrum_palette[ZXSPECTRUM.border], 64*sizeof(uint32_t));
+// Slow path of spectrum_display_write(): a byte of the line being scanned is about to change
+void spectrum_record_display_write(uint16_t offset, uint8_t old_value) {
+	zx_beam_t *beam = &ZXSPECTRUM.beam;
+	if (beam->num_writes == SPECTRUM_MAX_LINE_WRITES)
+		return;
+	zx_display_write_t *w = &beam->writes[beam->num_writes++];
+	w->tstate = spectrum_tstate();
+	w->offset = offset;
+	w->old_value = old_value;
+}
 
-	}
+// End of frame: catch up with the rest of this frame's border changes
+// (changes during the last instruction's overshoot belong to the next frame, see zx_ULA_end_frame())
+void spectrum_beam_end_frame(uint32_t frame_tstates) {
+	_consume_border_events(&ZXSPECTRUM.beam, frame_tstates);
 }
 
 
-// spectrum.c
\ No newline at end of file
+// spectrum.c
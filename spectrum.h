@@ -8,10 +8,52 @@
 #include "spectrum_ula.h"
 #include "spectrum_text_overlay.h"
 #include "spectrum_keyboard.h"
+#include "spectrum_beeper.h"
+#include "spectrum_ay.h"
+#include "z80io.h"
+#include "spectrum_sprites.h"
+#include "spectrum_layers.h"
+#include "spectrum_nextreg.h"
+#include "spectrum_dma.h"
+#include "spectrum_copper.h"
+#include "spectrum_divmmc.h"
+#include "spectrum_fdc.h"
+#include "spectrum_if1.h"
+#include "tapfile.h"
 
 #define SPECTRUM_EMU_VERSION_STRING "SpectrumGS 1.0.0"
 
+// 48k frame timing (see zx_timing_t for the per model values)
 #define SPECTRUM_SCANLINE_TSTATES   224
+#define SPECTRUM_CPU_CLOCK_48K      3500000
+#define SPECTRUM_FRAME_LINES        312         // 64 lines top border/vblank, 192 display, 56 bottom border/vblank
+#define SPECTRUM_FRAME_TSTATES      (SPECTRUM_FRAME_LINES * SPECTRUM_SCANLINE_TSTATES)
+#define SPECTRUM_INT_TSTATES        32          // length of the ULA interrupt pulse
+#define SPECTRUM_FIRST_DISPLAY_LINE 64          // frame line of the first display file line
+#define SPECTRUM_CONTENTION_START   14335       // first contended T-state of the frame
+
+// 128k frame timing
+#define SPECTRUM_128K_SCANLINE_TSTATES   228
+#define SPECTRUM_128K_CPU_CLOCK          3546900
+#define SPECTRUM_128K_FRAME_LINES        311
+#define SPECTRUM_128K_INT_TSTATES        36
+#define SPECTRUM_128K_FIRST_DISPLAY_LINE 63
+#define SPECTRUM_128K_CONTENTION_START   14361
+
+// +3 frame timing: 128k timing, gate array contention
+#define SPECTRUM_PLUS3_CONTENTION_START  14365
+
+// ula contention delays per frame T-state (power of 2: indexed with a mask, frames are shorter)
+#define SPECTRUM_CONTENTION_TABLE_SIZE   0x20000
+
+// 128k roms (not distributed with the emulator)
+#define SPECTRUM_ROM_DIR            "./roms"
+#define SPECTRUM_TAP_DIR            "./tap"         // .tap files of the tape traps (SAVE "$name")
+#define SPECTRUM_128K_ROM0_FILE     "128-0.rom"     // 128k editor/menu
+#define SPECTRUM_128K_ROM1_FILE     "128-1.rom"     // 48k basic
+#define SPECTRUM_DIVMMC_ROM_FILE    "esxmmc.bin"    // divmmc: 8k esxdos rom
+#define SPECTRUM_IF1_ROM_FILE       "if1-2.rom"     // interface 1: 8k shadow rom (issue 2)
+#define SPECTRUM_PLUS3_ROM_FILE     "plus3-%d.rom"  // +3 roms 0-3: editor, syntax, +3DOS, 48k basic
 
 // zx spectrum mode (2) display dimensions
 #define SCREENH 192
@@ -31,6 +73,7 @@
 // offset of attributes storage from start of display memory
 #define SPECTRUM_DISPLAY_OFFSET     16384   // from start of memory
 #define SPECTRUM_ATTRIBUTES_OFFSET  6144    // from start of display ram
+#define SPECTRUM_SCREEN_1_OFFSET    0x2000  // timex second display file (0x6000)
 
 // maximum length of file/directory paths for disk operations
 #define SPECTRUM_MAX_FILE_DIR_LEN   256
@@ -53,29 +96,162 @@ typedef enum {
     ZX_TYPE_48K,
     ZX_TYPE_128K,
     ZX_TYPE_ZXX,
+    ZX_TYPE_PLUS3,
 } zx_type_t;
 
 #include "z80mmu.h"
 
+typedef struct {
+    uint32_t cpu_clock;
+    uint32_t line_tstates;
+    uint32_t frame_lines;
+    uint32_t frame_tstates;
+    uint32_t int_tstates;
+    uint32_t first_display_line;
+    uint32_t contention_start;
+    uint8_t contention_pattern[8];  // delays over the 8 T-states of each 8 pixel cell
+    bool b_io_contention;           // the +3 gate array doesn't contend i/o
+} zx_timing_t;
+
+// ULAplus: 64 colour palette (ports 0xBF3B/0xFF3B)
+#define SPECTRUM_ULAPLUS_COLOURS    64
+#define SPECTRUM_ULAPLUS_PALETTE    16      // first ULAplus entry in spectrum_palette
+#define SPECTRUM_PALETTE_SIZE       (SPECTRUM_ULAPLUS_PALETTE + SPECTRUM_ULAPLUS_COLOURS)
+
+typedef struct {
+    uint8_t reg;                // last register select (bits 6-7 group, bits 0-5 palette entry)
+    uint8_t mode;               // bit 0: ULAplus palette on
+    uint8_t palette[SPECTRUM_ULAPLUS_COLOURS];     // as written: GGGRRRBB
+} zx_ulaplus_t;
+
+// display modes (timex port 0xFF, see spectrum_set_display_mode())
+typedef enum {
+    ZX_DISPLAY_STANDARD,        // 256x192, 8x8 attributes (screen 0 or screen 1)
+    ZX_DISPLAY_HICOLOUR,        // timex 8x1 attributes
+    ZX_DISPLAY_HIRES,           // timex 512x192, two colours
+    ZX_DISPLAY_LINEAR,          // ZXX 256x192, 256 colours from the ULAX banks
+} zx_display_mode_t;
+
+// renders the display pixels of one line from the mode's two source rows
+typedef void (*zx_display_kernel_t)(uint32_t *dp, const uint8_t *a, const uint8_t *b);
+
+// display file write to the line currently being scanned
+typedef struct {
+    uint32_t tstate;
+    uint16_t offset;            // offset into the display bank
+    uint8_t old_value;
+} zx_display_write_t;
+
+#define SPECTRUM_MAX_LINE_WRITES    256
+
+// beam racing: display affecting events with their T-state (see render_spectrum_scanline())
+typedef struct {
+    // display writes: only logged for the bytes of the display line the cpu is running
+    bool b_display_line;
+    uint16_t pixel_offset;
+    uint16_t attr_offset;
+    int num_writes;
+    zx_display_write_t writes[SPECTRUM_MAX_LINE_WRITES];
+
+    // border: read index into the ula port log, and the colour where the renderer has got to
+    uint32_t border_read;
+    uint8_t border_colour;
+} zx_beam_t;
+
 typedef struct zx_spectrum {
 
     zx_type_t zx_type;
+    zx_timing_t timing;
     Z80 *cpu;
     z80_mmu_t mmu;
     zx_ula_t ula;
     int power_state;
 
-    uint8_t border;
-    uint32_t spectrum_palette[16];
+    zx_beeper_t beeper;
+    zx_ay_t ay;                 // 128k and up only
+
+    z80_io_bus_t io;            // I/O port devices (see _register_io_devices())
+    uint8_t kempston;           // kempston joystick: bit 0 right, 1 left, 2 down, 3 up, 4 fire (1 = active)
+
+    uint8_t contention[SPECTRUM_CONTENTION_TABLE_SIZE];    // see z80cpu_set_contention()
+
+    uint32_t frame_tstate;      // T-states of the current frame executed by previous z80cpu_step() calls
+    uint32_t frame_no;          // frames run so far: the frame input events are stamped with
+
+    uint8_t border;             // last border colour written
+    zx_beam_t beam;
+
+    uint8_t timex_port;         // display mode register (ZXX)
+    zx_display_mode_t display_mode;
+    zx_display_kernel_t display_kernel;
+    uint16_t display_screen_offset;
+    uint32_t hires_ink, hires_paper;
+
+    zx_sprites_t sprites;       // ZXX only
+    zx_layers_t layers;         // ZXX only
+    zx_nextreg_t nextreg;       // ZXX only
+    zx_dma_t dma;               // ZXX only
+    zx_copper_t copper;         // ZXX only
+    zx_divmmc_t divmmc;         // optional, see zx_divmmc_attach()
+    zx_fdc_t fdc;               // +3 only
+    zx_if1_t if1;               // optional, see zx_if1_attach()
+    tap_t auto_mount_tap;       // tape traps: .tap file named by a '$' prefixed filename
+
+    zx_ulaplus_t ulaplus;
+    uint32_t spectrum_palette[SPECTRUM_PALETTE_SIZE];   // 16 standard colours followed by the 64 ULAplus colours
     int linep[SCREENH];
 
 } zx_spectrum_t;
 
 extern zx_spectrum_t ZXSPECTRUM;
 
-void init_spectrum();
+// current T-state relative to the start of the frame: valid inside cpu callbacks too
+static inline uint32_t spectrum_tstate() {
+    return ZXSPECTRUM.frame_tstate + (uint32_t)Z80CPU.cycles;
+}
+
+// RRRGGGBB colour (linear mode, layer 2, sprites)
+static inline uint32_t spectrum_rgb332_argb32(uint8_t c) {
+    uint32_t r = ((c >> 5) & 7) * 255 / 7;
+    uint32_t g = ((c >> 2) & 7) * 255 / 7;
+    uint32_t b = (c & 3) * 255 / 3;
+    return 0xff000000 | (r << 16) | (g << 8) | b;
+}
+
+static inline double spectrum_frames_per_second() {
+    return (double)ZXSPECTRUM.timing.cpu_clock / ZXSPECTRUM.timing.frame_tstates;     // ~50Hz
+}
+
+void spectrum_record_display_write(uint16_t offset, uint8_t old_value);
+
+// cpu write: log writes to the bytes of the display line being scanned
+// (call before the write takes place, only while beam.b_display_line is set)
+static inline void spectrum_display_write(zx_spectrum_t *zx, uint16_t address) {
+    const zx_beam_t *beam = &zx->beam;
+    int page_no = zx->mmu.visible_pages[address >> MEM_SLOT_SHIFT].index;
+    uint16_t offset = ((page_no & 1) << MEM_SLOT_SHIFT) | (address & (MEM_PAGE_SIZE - 1));
+
+    if ((uint16_t)(offset - beam->pixel_offset) >= 32 && (uint16_t)(offset - beam->attr_offset) >= 32)
+        return;
+    if (page_no / 2 != zx->mmu.display_bank)
+        return;
+    spectrum_record_display_write(offset, z80_mmu_GetByte(&zx->mmu, address));
+}
+
+void init_spectrum(zx_type_t zx_type);
+bool spectrum_load_rom_file(int page_no, const char *name, size_t size);
 void spectrum_power(int on);
 void render_spectrum_scanline(int scanline, uint32_t *LINEBUF);
+void spectrum_update_colour_table();
+void spectrum_set_display_mode(uint8_t timex_port);
+void spectrum_ulaplus_select(uint8_t value);
+void spectrum_ulaplus_write(uint8_t value);
+uint8_t spectrum_ulaplus_read();
+void spectrum_ulaplus_set(const zx_ulaplus_t *ulaplus);
+void spectrum_beam_begin_line(int line);
+void spectrum_beam_end_frame(uint32_t frame_tstates);
+void spectrum_end_frame();
+void spectrum_run_frame(uint32_t *framebuffer);
 uint8_t *spectrum_get_current_bank_ptr();
 uint8_t *spectrum_get_screen_0_ptr();
 
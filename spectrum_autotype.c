@@ -0,0 +1,203 @@
+/**----------------------------------------------------------------------------
+ *	spectrum_autotype.c
+ *  Typing text into the spectrum (clipboard paste, API), paced by the rom's keyboard state
+ *
+ *	Nothing here goes by the clock: each key goes in as soon as the rom is ready for it,
+ *	and main.c runs the machine in warp for as long as there's text left to type.
+ *	- keyboard buffer: while the 48k basic reads keys through KEY-INPUT (editor, INPUT) the
+ *	  next key goes straight into LAST-K with FLAGS bit 5 set, once the rom has taken the last
+ *	  one. In the editor a line goes in tokenized, keywords as K mode would have given them.
+ *	- key matrix: anything else (the 128k editor, programs scanning the keyboard themselves)
+ *	  gets key presses, with caps or symbol shift as the keyboard tables have them. A key is
+ *	  held until the rom's keyboard routine has it in one of its two KSTATE sets and the next
+ *	  one goes down when a set is free (a key typed twice waits for its set to be freed).
+ *	  Programs without the rom's keyboard scan get every key for AUTOTYPE_HOLD_FRAMES.
+ **/
+
+#include <string.h>
+#include <ctype.h>
+
+#include "spectrum.h"
+#include "spectrum_keyboard.h"
+#include "spectrum_basic.h"
+#include "spectrum_autotype.h"
+#include "text_box_l.h"
+
+// 48k rom system variables
+#define KSTATE			0x5C00		// two 4 byte key sets: main key code (bit 7: set free), ...
+#define LAST_K			0x5C08
+#define FLAGS			0x5C3B		// bit 5: a new key in LAST-K
+#define FLAGX			0x5C71		// bit 5: INPUT mode
+
+#define FLAGS_NEW_KEY	0x20
+#define FLAGX_INPUT		0x20
+
+#define CODE_DELETE		0x0C		// key codes as KEY-INPUT returns them
+#define CODE_ENTER		0x0D
+
+#define AUTOTYPE_HOLD_FRAMES	8		// keys the rom doesn't take are let go after this
+#define AUTOTYPE_IDLE_FRAMES	50		// no KEY-INPUT for this long: key presses take over
+
+// the text still to type (0 terminated)
+static char TEXT[AUTOTYPE_MAX_TEXT + 1];
+static int TEXT_LEN, TEXT_POS;
+
+// the current line going into the keyboard buffer
+static uint8_t LINE[AUTOTYPE_MAX_TEXT + 1];
+static int LINE_LEN, LINE_POS;
+
+// the current line going in as key presses
+static bool b_matrix_line;
+static uint8_t HELD_KEY, HELD_SHIFT;
+static int HOLD_FRAMES, WAIT_FRAMES;
+
+static bool b_key_input;		// the rom went through KEY-INPUT during this frame
+static int IDLE_FRAMES;
+
+static uint8_t _peek(uint16_t address) {
+	return z80_mmu_GetByte(&ZXSPECTRUM.mmu, address);
+}
+
+// Type text, after whatever is still waiting to be typed: '\n' is ENTER, '\b' DELETE
+bool spectrum_autotype(const char *text) {
+	int len = strlen(text);
+
+	memmove(TEXT, TEXT + TEXT_POS, TEXT_LEN - TEXT_POS);
+	TEXT_LEN -= TEXT_POS;
+	TEXT_POS = 0;
+	if (TEXT_LEN + len > AUTOTYPE_MAX_TEXT) {
+		ltb_printf("autotype: text too long\n");
+		TEXT[TEXT_LEN] = 0;
+		return false;
+	}
+	memcpy(TEXT + TEXT_LEN, text, len);
+	TEXT_LEN += len;
+	TEXT[TEXT_LEN] = 0;
+	return true;
+}
+
+bool spectrum_autotype_busy() {
+	return TEXT_POS < TEXT_LEN || LINE_POS < LINE_LEN || HELD_KEY;
+}
+
+/**----------------------------------------------------------------------------
+ *	KEYBOARD BUFFER
+ **/
+
+// the next line of text as key codes: tokenized for the editor, as it is for INPUT
+static void _next_line() {
+	const char *p = TEXT + TEXT_POS;
+	const char *end = p + strcspn(p, "\n");
+
+	LINE_LEN = LINE_POS = 0;
+	if (!(_peek(FLAGX) & FLAGX_INPUT)) {
+		LINE_LEN = spectrum_basic_tokenize_keyed(p, LINE, AUTOTYPE_MAX_TEXT);
+	}
+	else {
+		for (; p < end; p++) {
+			uint8_t c = *p;
+			if (c == '\t')
+				c = ' ';
+			if (c >= 0x20 && c < 0x80)
+				LINE[LINE_LEN++] = c;
+			else if (c == '\b')
+				LINE[LINE_LEN++] = CODE_DELETE;
+		}
+	}
+	if (*end == '\n') {
+		LINE[LINE_LEN++] = CODE_ENTER;
+		end++;
+	}
+	TEXT_POS = end - TEXT;
+}
+
+// The 48k rom asks for a key (KEY-INPUT trap): hand it the next one if it has taken the last
+void spectrum_autotype_key_input() {
+	z80_mmu_t *mmu = &ZXSPECTRUM.mmu;
+
+	b_key_input = true;
+	if (b_matrix_line || HELD_KEY || (_peek(FLAGS) & FLAGS_NEW_KEY))
+		return;
+	if (LINE_POS == LINE_LEN) {
+		if (TEXT_POS == TEXT_LEN)
+			return;
+		_next_line();
+		if (LINE_LEN == 0)
+			return;
+	}
+	z80_mmu_PutByte(mmu, LINE[LINE_POS++], LAST_K);
+	z80_mmu_PutByte(mmu, _peek(FLAGS) | FLAGS_NEW_KEY, FLAGS);
+}
+
+/**----------------------------------------------------------------------------
+ *	KEY MATRIX
+ **/
+
+// the code the rom's K-TEST has for a key: what goes into KSTATE
+static uint8_t _main_code(uint8_t key) {
+	return toupper(key);
+}
+
+static bool _kstate_has(uint8_t code) {
+	return _peek(KSTATE) == code || _peek(KSTATE + 4) == code;
+}
+
+// the rom takes the key as a new one: a set is free and neither holds the key already
+static bool _kstate_ready(uint8_t code) {
+	return ((_peek(KSTATE) & 0x80) || (_peek(KSTATE + 4) & 0x80)) && !_kstate_has(code);
+}
+
+static void _release_key() {
+	zx_ULA_key_up(&ZXSPECTRUM.ula, HELD_KEY);
+	if (HELD_SHIFT != SPECTRUM_KEY_SHIFT_NONE)
+		zx_ULA_key_up(&ZXSPECTRUM.ula, HELD_SHIFT);
+	HELD_KEY = 0;
+}
+
+// the spectrum key for the text character c
+static bool _key_for(char c, uint8_t *key, uint8_t *shift) {
+	if (c == '\r')
+		return false;
+	if (c == '\n')
+		c = 13;
+	else if (c == '\t')
+		c = ' ';
+	return spectrum_key_for_char(c, key, shift);
+}
+
+// Frame done: let go of a key the rom has taken and press the next one when it's ready for it
+void spectrum_autotype_end_frame() {
+	IDLE_FRAMES = b_key_input ? 0 : IDLE_FRAMES + 1;
+	b_key_input = false;
+
+	if (HELD_KEY) {
+		if (!_kstate_has(_main_code(HELD_KEY)) && ++HOLD_FRAMES < AUTOTYPE_HOLD_FRAMES)
+			return;
+		_release_key();
+	}
+
+	// lines already started in the keyboard buffer are finished there, new lines go in as key
+	// presses only when the rom has stopped asking for keys through KEY-INPUT
+	if (LINE_POS < LINE_LEN || (!b_matrix_line && IDLE_FRAMES < AUTOTYPE_IDLE_FRAMES))
+		return;
+
+	uint8_t key, shift;
+	while (TEXT_POS < TEXT_LEN && !_key_for(TEXT[TEXT_POS], &key, &shift))
+		TEXT_POS++;
+	if (TEXT_POS == TEXT_LEN) {
+		b_matrix_line = false;
+		return;
+	}
+	if (!_kstate_ready(_main_code(key)) && ++WAIT_FRAMES < AUTOTYPE_HOLD_FRAMES)
+		return;
+
+	if (shift != SPECTRUM_KEY_SHIFT_NONE)
+		zx_ULA_key_down(&ZXSPECTRUM.ula, shift);
+	zx_ULA_key_down(&ZXSPECTRUM.ula, key);
+	HELD_KEY = key;
+	HELD_SHIFT = shift;
+	HOLD_FRAMES = WAIT_FRAMES = 0;
+	b_matrix_line = TEXT[TEXT_POS++] != '\n';
+}
+
+// spectrum_autotype.c
@@ -0,0 +1,27 @@
+#pragma once
+
+/**----------------------------------------------------------------------------
+ *	spectrum_autotype.c
+ *  Typing text into the spectrum (clipboard paste, API), paced by the rom's keyboard state
+ **/
+
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define AUTOTYPE_MAX_TEXT	0x10000
+
+bool spectrum_autotype(const char *text);
+bool spectrum_autotype_busy();
+
+// hooks: the KEY-INPUT trap and the end of every frame
+void spectrum_autotype_key_input();
+void spectrum_autotype_end_frame();
+
+#ifdef __cplusplus
+}
+#endif
+
+// spectrum_autotype.h
@@ -0,0 +1,318 @@
+/**----------------------------------------------------------------------------
+ *	spectrum_ay.c
+ *  AY-3-8912 sound chip (128k and up): ports 0xFFFD (register select/read) and 0xBFFD (data)
+ *
+ *	- register writes coming in through the ports are only logged (with their T-state)
+ *	- once per frame the chip gets rendered in one batch at its internal rate (one sample
+ *	  every AY_TSTATES_PER_TICK T-states = 8 chip clocks), the logged writes are applied
+ *	  at their exact tick
+ *	- the internal rate output is then decimated to the host rate through a polyphase FIR
+ *	  filter (SSE/NEON dot products) and added to the beeper samples in the same pass
+ *
+ *	Reference: General Instrument AY-3-8910/8912 data manual
+ **/
+
+#include <math.h>
+#include <string.h>
+
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "spectrum_ay.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#define AY_VOLUME		0.25f		// per channel (three channels mixed to mono)
+#define AY_HISTORY		(AY_FIR_TAPS * 2)
+#define DC_BLOCK_R		0.9995f		// dc blocker pole (~18Hz at the internal rate)
+
+// logarithmic dac levels
+static const float VOLUMES[16] = {
+	0.0f, 0.00999465934234f, 0.0144502937362f, 0.0210574502174f,
+	0.0307011520562f, 0.0455481803616f, 0.0644998855573f, 0.107362478065f,
+	0.126588845655f, 0.20498970016f, 0.292210269322f, 0.372838941024f,
+	0.492530708782f, 0.635324635691f, 0.805584802014f, 1.0f
+};
+
+// usable bits per register
+static const uint8_t REG_MASK[16] = {
+	0xff, 0x0f, 0xff, 0x0f, 0xff, 0x0f, 0x1f, 0xff,
+	0x1f, 0x1f, 0x1f, 0xff, 0xff, 0x0f, 0xff, 0xff
+};
+
+// decimation filter: one row per sub sample phase (shared by all instances)
+static _Alignas(16) float FIR_KERNEL[AY_FIR_PHASES][AY_FIR_TAPS];
+static int fir_sample_rate = 0;
+
+// windowed sinc (blackman window) low pass just below the host nyquist frequency
+static void _build_kernel(int sample_rate, int cpu_clock) {
+	const double input_rate = (double)cpu_clock / AY_TSTATES_PER_TICK;
+	const double cutoff = 0.45 * sample_rate / input_rate;	// cycles per input sample
+
+	for (int phase = 0; phase < AY_FIR_PHASES; phase++) {
+		double sum = 0.0;
+		double row[AY_FIR_TAPS];
+		for (int i = 0; i < AY_FIR_TAPS; i++) {
+			double d = (double)(i - AY_FIR_TAPS / 2 + 1) - (double)phase / AY_FIR_PHASES;
+			double x = 2.0 * M_PI * cutoff * d;
+			double sinc = (d == 0.0) ? 1.0 : sin(x) / x;
+			double w = (d + AY_FIR_TAPS / 2) / AY_FIR_TAPS;
+			double window = 0.42 - 0.5 * cos(2 * M_PI * w) + 0.08 * cos(4 * M_PI * w);
+			row[i] = sinc * window;
+			sum += row[i];
+		}
+		for (int i = 0; i < AY_FIR_TAPS; i++)
+			FIR_KERNEL[phase][i] = (float)(row[i] / sum);
+	}
+	fir_sample_rate = sample_rate;
+}
+
+static inline float _fir_dot(const float *x, const float *k) {
+#if defined(__SSE__)
+	__m128 acc = _mm_setzero_ps();
+	for (int i = 0; i < AY_FIR_TAPS; i += 4)
+		acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(x + i), _mm_load_ps(k + i)));
+	acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+	acc = _mm_add_ss(acc, _mm_shuffle_ps(acc, acc, 1));
+	return _mm_cvtss_f32(acc);
+#elif defined(__ARM_NEON)
+	float32x4_t acc = vdupq_n_f32(0.0f);
+	for (int i = 0; i < AY_FIR_TAPS; i += 4)
+		acc = vmlaq_f32(acc, vld1q_f32(x + i), vld1q_f32(k + i));
+	float32x2_t sum = vadd_f32(vget_low_f32(acc), vget_high_f32(acc));
+	return vget_lane_f32(vpadd_f32(sum, sum), 0);
+#else
+	float acc = 0.0f;
+	for (int i = 0; i < AY_FIR_TAPS; i++)
+		acc += x[i] * k[i];
+	return acc;
+#endif
+}
+
+/**----------------------------------------------------------------------------
+ *	CHIP
+ **/
+
+static void _env_restart(zx_ay_t *ay) {
+	ay->env_count = 0;
+	ay->env_step = 0;
+	ay->env_holding = 0;
+	ay->env_attack = (ay->rregs[13] & 0x04) ? 0x00 : 0x0f;	// ATTACK: count up
+	ay->env_volume = ay->env_step ^ ay->env_attack;
+}
+
+static void _env_step(zx_ay_t *ay) {
+	if (ay->env_holding)
+		return;
+
+	if (++ay->env_step < 16) {
+		ay->env_volume = ay->env_step ^ ay->env_attack;
+		return;
+	}
+
+	// end of cycle: CONTINUE, ATTACK, ALTERNATE, HOLD
+	uint8_t shape = ay->rregs[13];
+	if (!(shape & 0x08)) {
+		// not continuing: drop to 0 and stay there
+		ay->env_holding = 1;
+		ay->env_volume = 0;
+	}
+	else if (shape & 0x01) {
+		// hold at the final level (or its opposite when alternating)
+		ay->env_holding = 1;
+		ay->env_volume = (shape & 0x02) ? ay->env_attack : (0x0f ^ ay->env_attack);
+	}
+	else {
+		ay->env_step = 0;
+		if (shape & 0x02)
+			ay->env_attack ^= 0x0f;
+		ay->env_volume = ay->env_step ^ ay->env_attack;
+	}
+}
+
+static void _apply_write(zx_ay_t *ay, uint8_t reg, uint8_t value) {
+	ay->rregs[reg] = value;
+	if (reg == 13)
+		_env_restart(ay);
+}
+
+// advance the chip by one tick (8 chip clocks) and return its output
+static inline float _tick(zx_ay_t *ay) {
+	const uint8_t *r = ay->rregs;
+
+	for (int ch = 0; ch < 3; ch++) {
+		uint16_t period = r[ch*2] | (r[ch*2+1] << 8);
+		if (++ay->tone_count[ch] >= period) {	// period 0 behaves like 1
+			ay->tone_count[ch] = 0;
+			ay->tone_out[ch] ^= 1;
+		}
+	}
+
+	// the noise generator runs at half the tone rate: 17 bit lfsr, taps 0 and 3
+	uint16_t noise_period = r[6] ? r[6] : 1;
+	if (++ay->noise_count >= noise_period * 2) {
+		ay->noise_count = 0;
+		ay->noise_lfsr = (ay->noise_lfsr >> 1) | (((ay->noise_lfsr ^ (ay->noise_lfsr >> 3)) & 1) << 16);
+		ay->noise_out = ay->noise_lfsr & 1;
+	}
+
+	// 16 envelope steps per 256 * period chip clocks
+	uint32_t env_period = r[11] | (r[12] << 8);
+	if (++ay->env_count >= (env_period ? env_period : 1) * 2u) {
+		ay->env_count = 0;
+		_env_step(ay);
+	}
+
+	// mixer: a disabled tone/noise source counts as permanently high
+	float out = 0.0f;
+	for (int ch = 0; ch < 3; ch++) {
+		uint8_t tone = ay->tone_out[ch] | (r[7] >> ch);
+		uint8_t noise = ay->noise_out | (r[7] >> (ch + 3));
+		if (tone & noise & 1) {
+			uint8_t vol = (r[8+ch] & 0x10) ? ay->env_volume : (r[8+ch] & 0x0f);
+			out += VOLUMES[vol];
+		}
+	}
+	return out * AY_VOLUME;
+}
+
+// render the frame at the internal rate into ay->samples (after the history)
+// returns the number of ticks rendered
+static int _render_frame(zx_ay_t *ay, uint32_t frame_tstates) {
+	float *out = &ay->samples[AY_HISTORY];
+	float dc_in = ay->dc_in, dc_out = ay->dc_out;
+	int w = 0;
+	int ticks = 0;
+
+	for (uint32_t t = ay->tick_tstate; t < frame_tstates && ticks < AY_MAX_FRAME_TICKS; t += AY_TSTATES_PER_TICK) {
+
+		while (w < ay->num_writes && ay->writes[w].tstate <= t) {
+			_apply_write(ay, ay->writes[w].reg, ay->writes[w].value);
+			w++;
+		}
+
+		float s = _tick(ay);
+		dc_out = s - dc_in + DC_BLOCK_R * dc_out;
+		dc_in = s;
+		out[ticks++] = dc_out;
+	}
+
+	// anything logged past the last tick (instruction overshoot) still belongs to this frame
+	for (; w < ay->num_writes; w++)
+		_apply_write(ay, ay->writes[w].reg, ay->writes[w].value);
+	ay->num_writes = 0;
+
+	ay->dc_in = dc_in;
+	ay->dc_out = dc_out;
+	ay->tick_tstate += ticks * AY_TSTATES_PER_TICK;
+	ay->tick_tstate -= (ay->tick_tstate >= frame_tstates) ? frame_tstates : ay->tick_tstate;
+	return ticks;
+}
+
+// Render the frame and add it to the host rate samples in mix (usually the beeper output)
+// out sample i is at frame relative T-state t0 + i * t_step 
+void zx_ay_mix_frame(zx_ay_t *ay, uint32_t frame_tstates, float *mix, int count, double t0, double t_step) {
+
+	double tick_t0 = ay->tick_tstate;		// T-state of the first tick of this frame
+	int ticks = _render_frame(ay, frame_tstates);
+
+	if (fir_sample_rate == 0 || ticks == 0)
+		return;
+
+	// the filter is centered AY_FIR_TAPS/2 ticks behind the output position
+	// so that it never needs samples that haven't been rendered yet
+	const double pos_step = t_step / AY_TSTATES_PER_TICK;
+	double pos = (t0 - tick_t0) / AY_TSTATES_PER_TICK - AY_FIR_TAPS / 2;
+
+	for (int i = 0; i < count; i++, pos += pos_step) {
+		double ipos = floor(pos);
+		int index = AY_HISTORY + (int)ipos - AY_FIR_TAPS / 2 + 1;
+		if (index < 0)
+			index = 0;
+		if (index > AY_HISTORY + ticks - AY_FIR_TAPS)
+			index = AY_HISTORY + ticks - AY_FIR_TAPS;
+		int phase = (int)((pos - ipos) * AY_FIR_PHASES);
+
+		mix[i] += _fir_dot(&ay->samples[index], FIR_KERNEL[phase]);
+	}
+
+	// keep the tail as history for the next frame
+	memmove(ay->samples, &ay->samples[ticks], AY_HISTORY * sizeof(float));
+}
+
+/**----------------------------------------------------------------------------
+ *	PORTS
+ **/
+
+// 0xFFFD write
+void zx_ay_select(zx_ay_t *ay, uint8_t reg) {
+	ay->selected = reg & 0x0f;
+}
+
+// 0xBFFD write: takes effect in the rendered output at tstate
+void zx_ay_write(zx_ay_t *ay, uint32_t tstate, uint8_t value) {
+	uint8_t reg = ay->selected;
+	value &= REG_MASK[reg];
+	ay->regs[reg] = value;
+
+	if (ay->num_writes == AY_MAX_WRITES) {
+		// log full: apply right away (only happens for pathological code)
+		_apply_write(ay, reg, value);
+		return;
+	}
+
+	ay_write_t *w = &ay->writes[ay->num_writes++];
+	w->tstate = tstate;
+	w->reg = reg;
+	w->value = value;
+}
+
+// 0xFFFD read
+uint8_t zx_ay_read(zx_ay_t *ay) {
+	return ay->regs[ay->selected];
+}
+
+// A resumed session: after its registers have been written back the envelope carries on
+// from where it was instead of from the start the write to R13 gives it
+void zx_ay_restore_envelope(zx_ay_t *ay, uint32_t count, uint8_t step, uint8_t attack, uint8_t holding) {
+	for (int w = 0; w < ay->num_writes; w++)
+		_apply_write(ay, ay->writes[w].reg, ay->writes[w].value);
+	ay->num_writes = 0;
+
+	ay->env_count = count;
+	ay->env_step = step & 0x0f;
+	ay->env_attack = attack & 0x0f;
+	ay->env_holding = holding;
+	if (!holding)
+		ay->env_volume = ay->env_step ^ ay->env_attack;
+	else if (!(ay->rregs[13] & 0x08))
+		ay->env_volume = 0;
+	else
+		ay->env_volume = (ay->rregs[13] & 0x02) ? ay->env_attack : (0x0f ^ ay->env_attack);
+}
+
+void zx_ay_reset(zx_ay_t *ay) {
+	memset(ay->regs, 0, sizeof(ay->regs));
+	memset(ay->rregs, 0, sizeof(ay->rregs));
+	ay->regs[7] = ay->rregs[7] = 0xff;		// everything off
+	ay->regs[14] = ay->rregs[14] = 0xff;	// (unconnected) io port pulled high
+	ay->selected = 0;
+	ay->num_writes = 0;
+	ay->noise_lfsr = 1;
+	_env_restart(ay);
+}
+
+void zx_ay_init(zx_ay_t *ay, int sample_rate, int cpu_clock) {
+	if (fir_sample_rate != sample_rate)
+		_build_kernel(sample_rate, cpu_clock);
+
+	memset(ay, 0, sizeof(zx_ay_t));
+	zx_ay_reset(ay);
+}
+
+// spectrum_ay.c
@@ -0,0 +1,68 @@
+#pragma once
+
+/**----------------------------------------------------------------------------
+ *	spectrum_ay.c
+ *  AY-3-8912 sound chip (128k and up): ports 0xFFFD (register select/read) and 0xBFFD (data)
+ **/
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define AY_TSTATES_PER_TICK		16			// the chip runs at cpu clock/2, tone/noise/envelope units are 8 chip clocks
+#define AY_MAX_WRITES			1024		// register writes per frame
+#define AY_MAX_FRAME_TICKS		4608		// internal samples per frame (70908/16 on the 128k)
+#define AY_FIR_TAPS				32			// decimation filter length (multiple of 4)
+#define AY_FIR_PHASES			64			// sub sample resolution of the decimation filter
+
+typedef struct {
+	uint32_t tstate;	// frame relative
+	uint8_t reg;
+	uint8_t value;
+} ay_write_t;
+
+typedef struct {
+
+	// cpu side view: register contents as written/read through the ports
+	uint8_t selected;
+	uint8_t regs[16];
+
+	// register writes of the current frame (in T-state order), applied while rendering
+	ay_write_t writes[AY_MAX_WRITES];
+	int num_writes;
+
+	// render side chip state
+	uint8_t rregs[16];
+	uint16_t tone_count[3];
+	uint8_t tone_out[3];
+	uint16_t noise_count;
+	uint32_t noise_lfsr;
+	uint8_t noise_out;
+	uint32_t env_count;
+	uint8_t env_step;			// 0..15 inside the current envelope cycle
+	uint8_t env_attack;			// current direction: xor mask for env_step (0 when counting up, 0x0f when down)
+	uint8_t env_holding;
+	uint8_t env_volume;
+	float dc_in, dc_out;		// dc blocker state
+
+	// internal rate output: 2*AY_FIR_TAPS samples of history followed by the current frame
+	uint32_t tick_tstate;		// frame relative T-state of the next tick
+	float samples[AY_FIR_TAPS * 2 + AY_MAX_FRAME_TICKS];
+
+} zx_ay_t;
+
+void zx_ay_init(zx_ay_t *ay, int sample_rate, int cpu_clock);
+void zx_ay_reset(zx_ay_t *ay);
+void zx_ay_select(zx_ay_t *ay, uint8_t reg);
+void zx_ay_write(zx_ay_t *ay, uint32_t tstate, uint8_t value);
+uint8_t zx_ay_read(zx_ay_t *ay);
+void zx_ay_restore_envelope(zx_ay_t *ay, uint32_t count, uint8_t step, uint8_t attack, uint8_t holding);
+void zx_ay_mix_frame(zx_ay_t *ay, uint32_t frame_tstates, float *mix, int count, double t0, double t_step);
+
+#ifdef __cplusplus
+}
+#endif
+
+// spectrum_ay.h
@@ -0,0 +1,462 @@
+/**----------------------------------------------------------------------------
+ *	spectrum_basic.c
+ *  BASIC listings from text: tokenized and put straight into the program area
+ *
+ *	- the tokenizer turns a plain text listing into the program format of the 48k rom:
+ *	  [line number hi/lo][length lo/hi][tokens and text][0x0D] for every line, with numeric
+ *	  literals followed by their hidden 5 byte form (0x0E marker) the way the editor stores them
+ *	- keywords are recognized without regard to case, "GOTO" as well as "GO TO", but not inside
+ *	  names ("total" is no TO): spaces around keywords are dropped, the listing puts them back
+ *	- lines can come in any order, a line number that shows up twice keeps the last one
+ *	- the program goes in when the rom next waits for a key (the KEY-INPUT trap): the editor
+ *	  is idle then, so the program area and the system variables after it can be rebuilt
+ *	  as if the program had just been loaded (no variables, empty edit line)
+ *	- a line can also be tokenized the way it would be keyed in (for the autotyper): keywords
+ *	  are the tokens K mode gives, the rest stays text and ENTER adds the hidden numbers
+ **/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+
+#include "spectrum.h"
+#include "spectrum_basic.h"
+#include "text_box_l.h"
+
+// 48k rom system variables
+#define E_PPC			0x5C49		// line number of the current line (listing cursor)
+#define VARS			0x5C4B
+#define PROG			0x5C53
+#define NXTLIN			0x5C55
+#define DATADD			0x5C57
+#define E_LINE			0x5C59
+#define K_CUR			0x5C5B
+#define CH_ADD			0x5C5D
+#define X_PTR			0x5C5F
+#define WORKSP			0x5C61
+#define STKBOT			0x5C63
+#define STKEND			0x5C65
+
+#define BASIC_MAX_LINE	9999
+#define NUMBER_MARKER	0x0E
+#define TOKEN_FIRST		0xA5		// RND: the 48k tokens run up to 0xFF (COPY)
+#define TOKEN_BIN		0xC4
+#define TOKEN_DEF_FN	0xCE
+#define TOKEN_REM		0xEA
+#define STACK_RESERVE	256			// room left between the work space and the machine stack
+
+// a space in a keyword matches any number of spaces (none included)
+static const char *KEYWORDS[] = {
+	"RND", "INKEY$", "PI", "FN", "POINT", "SCREEN$", "ATTR", "AT", "TAB", "VAL$", "CODE",
+	"VAL", "LEN", "SIN", "COS", "TAN", "ASN", "ACS", "ATN", "LN", "EXP", "INT", "SQR", "SGN",
+	"ABS", "PEEK", "IN", "USR", "STR$", "CHR$", "NOT", "BIN", "OR", "AND", "<=", ">=", "<>",
+	"LINE", "THEN", "TO", "STEP", "DEF FN", "CAT", "FORMAT", "MOVE", "ERASE", "OPEN #",
+	"CLOSE #", "MERGE", "VERIFY", "BEEP", "CIRCLE", "INK", "PAPER", "FLASH", "BRIGHT",
+	"INVERSE", "OVER", "OUT", "LPRINT", "LLIST", "STOP", "READ", "DATA", "RESTORE", "NEW",
+	"BORDER", "CONTINUE", "DIM", "REM", "FOR", "GO TO", "GO SUB", "INPUT", "LOAD", "LIST",
+	"LET", "PAUSE", "NEXT", "POKE", "PRINT", "PLOT", "RUN", "SAVE", "RANDOMIZE", "IF", "CLS",
+	"DRAW", "CLEAR", "RETURN", "COPY",
+};
+
+// the tokenized program waiting for the rom to be ready for it
+static uint8_t PROGRAM[BASIC_MAX_PROGRAM];
+static int PROGRAM_SIZE = -1;
+static uint16_t FIRST_LINE;
+
+/**----------------------------------------------------------------------------
+ *	TOKENIZER
+ **/
+
+typedef struct {
+	uint8_t *out;
+	int size, max_size;
+	int line_no;				// of the source text, for error messages
+	bool b_error;
+	bool b_keyed;				// as keyed into the editor: no hidden numbers, no complaints
+} basic_build_t;
+
+static void _emit(basic_build_t *b, uint8_t byte) {
+	if (b->size < b->max_size)
+		b->out[b->size++] = byte;
+	else
+		b->b_error = true;
+}
+
+// the 5 byte form: small integers as 00 sign lo hi 00, the rest as exponent and 4 mantissa bytes
+static void _emit_number(basic_build_t *b, double value) {
+	uint8_t n[5] = { 0 };
+	if (value == floor(value) && value <= 65535) {
+		n[2] = (uint32_t)value & 0xFF;
+		n[3] = (uint32_t)value >> 8;
+	}
+	else {
+		int exponent;
+		double mantissa = frexp(value, &exponent);		// 0.5 <= mantissa < 1
+		uint64_t m = (uint64_t)llround(ldexp(mantissa, 32));
+		if (m >> 32) {
+			m >>= 1;
+			exponent++;
+		}
+		if (exponent + 128 < 1 || exponent + 128 > 255) {
+			ltb_printf("basic: line %d: number out of range\n", b->line_no);
+			b->b_error = true;
+			return;
+		}
+		n[0] = exponent + 128;
+		n[1] = (m >> 24) & 0x7F;		// the always set top bit holds the sign (positive)
+		n[2] = m >> 16;
+		n[3] = m >> 8;
+		n[4] = m;
+	}
+	_emit(b, NUMBER_MARKER);
+	for (int i = 0; i < 5; i++)
+		_emit(b, n[i]);
+}
+
+// length of the keyword's match at p, 0 if it doesn't match
+static int _match_keyword(const char *p, const char *keyword) {
+	const char *start = p;
+	for (; *keyword; keyword++) {
+		if (*keyword == ' ') {
+			while (*p == ' ')
+				p++;
+		}
+		else if (toupper((unsigned char)*p) == *keyword) {
+			p++;
+		}
+		else {
+			return 0;
+		}
+	}
+	// a keyword ending in a letter mustn't run on into a name
+	if (isalpha((unsigned char)keyword[-1]) && isalpha((unsigned char)*p))
+		return 0;
+	return (int)(p - start);
+}
+
+// token (and its length) of the longest keyword at p
+// b_in_name: p continues a name, only <=, >= and <> can start there
+static int _keyword(const char *p, bool b_in_name, int *len) {
+	int token = 0;
+	*len = 0;
+	for (int i = 0; i < (int)(sizeof(KEYWORDS) / sizeof(KEYWORDS[0])); i++) {
+		if (b_in_name && isalpha((unsigned char)KEYWORDS[i][0]))
+			continue;
+		int n = _match_keyword(p, KEYWORDS[i]);
+		if (n > *len) {
+			*len = n;
+			token = TOKEN_FIRST + i;
+		}
+	}
+	return token;
+}
+
+// a numeric literal at p: its text goes in as typed, its value follows
+static const char *_number(basic_build_t *b, const char *p, bool b_binary) {
+	const char *start = p;
+	double value = 0;
+
+	if (b_binary) {
+		while (*p == '0' || *p == '1')
+			value = value * 2 + (*p++ - '0');
+	}
+	else {
+		while (isdigit((unsigned char)*p) || *p == '.')
+			p++;
+		if ((*p == 'e' || *p == 'E')
+			&& (isdigit((unsigned char)p[1]) || ((p[1] == '+' || p[1] == '-') && isdigit((unsigned char)p[2])))) {
+			p += 2;
+			while (isdigit((unsigned char)*p))
+				p++;
+		}
+		value = strtod(start, NULL);
+	}
+	for (const char *c = start; c < p; c++)
+		_emit(b, *c);
+	if (!b->b_keyed)
+		_emit_number(b, value);
+	return p;
+}
+
+// text characters: the spectrum has £ and © where ascii has ` and DEL
+static const char *_character(basic_build_t *b, const char *p) {
+	unsigned char c = *p;
+	if (c == '\t') {
+		_emit(b, ' ');
+		return p + 1;
+	}
+	if (c >= 0x20 && c < 0x80) {
+		_emit(b, c);
+		return p + 1;
+	}
+	if (c == 0xC2 && ((unsigned char)p[1] == 0xA3 || (unsigned char)p[1] == 0xA9)) {
+		_emit(b, (unsigned char)p[1] == 0xA3 ? 0x60 : 0x7F);
+		return p + 2;
+	}
+	if (b->b_keyed)
+		return p + 1;
+	ltb_printf("basic: line %d: can't use character 0x%02X\n", b->line_no, c);
+	b->b_error = true;
+	return p + 1;
+}
+
+// drop the spaces just emitted ahead of a keyword (keep: where the last string or token ended)
+static void _trim(basic_build_t *b, int keep) {
+	while (b->size > keep && b->out[b->size - 1] == ' ')
+		b->size--;
+}
+
+// DEF FN name(a,b$): every parameter gets a (zero) 5 byte slot for its value
+static const char *_def_fn(basic_build_t *b, const char *p) {
+	while (*p == ' ')
+		p++;
+	while (isalpha((unsigned char)*p) || *p == '$')
+		_emit(b, *p++);
+	while (*p == ' ')
+		p++;
+	if (*p != '(')
+		return p;
+	_emit(b, *p++);
+	while (*p && *p != ')' && *p != '\n' && *p != '\r') {
+		if (*p == ' ') {
+			p++;
+			continue;
+		}
+		bool b_param = isalpha((unsigned char)*p);
+		_emit(b, *p++);
+		if (*p == '$')
+			_emit(b, *p++);
+		if (b_param) {
+			_emit(b, NUMBER_MARKER);
+			for (int i = 0; i < 5; i++)
+				_emit(b, 0);
+		}
+	}
+	return p;
+}
+
+// tokenize one source line (after its number) up to the end of the line
+static const char *_line(basic_build_t *b, const char *p) {
+	bool b_string = false;
+	int keep = b->size;
+	int last_token = 0;
+	bool b_name = false;		// inside a name: keywords and numbers don't start here
+
+	while (*p && *p != '\n' && *p != '\r') {
+		unsigned char c = *p;
+
+		if (b_string || c == '"') {
+			if (c == '"')
+				b_string = !b_string;
+			p = _character(b, p);
+			keep = b->size;
+			continue;
+		}
+
+		int len, token = _keyword(p, b_name, &len);
+		if (token) {
+			_trim(b, keep);
+			_emit(b, token);
+			p += len;
+			last_token = token;
+			if (token == TOKEN_REM) {
+				// the rest of the line is the remark, as it is
+				if (*p == ' ')
+					p++;
+				while (*p && *p != '\n' && *p != '\r')
+					p = _character(b, p);
+				keep = b->size;
+				break;
+			}
+			while (*p == ' ')
+				p++;
+			if (token == TOKEN_DEF_FN && !b->b_keyed)
+				p = _def_fn(b, p);
+			keep = b->size;
+			b_name = false;
+			continue;
+		}
+
+		if (!b_name && (isdigit(c) || (c == '.' && isdigit((unsigned char)p[1])))) {
+			p = _number(b, p, last_token == TOKEN_BIN);
+			last_token = 0;
+			continue;
+		}
+
+		p = _character(b, p);
+		b_name = isalpha(c) || (b_name && (isdigit(c) || c == '$'));
+		if (c != ' ')
+			last_token = 0;
+	}
+
+	if (b_string && !b->b_keyed) {
+		ltb_printf("basic: line %d: string not closed\n", b->line_no);
+		b->b_error = true;
+	}
+	_trim(b, keep);
+	return p;
+}
+
+// Tokenize a text listing into program (at most max_size bytes, in line number order)
+// Returns the size of the program, -1 on errors (which go to the text box)
+int spectrum_basic_tokenize(const char *text, uint8_t *program, int max_size) {
+	static uint8_t lines[BASIC_MAX_PROGRAM];
+	static int32_t line_at[BASIC_MAX_LINE + 1];
+	basic_build_t b = { lines, 0, sizeof(lines), 0, false };
+	const char *p = text;
+
+	for (int n = 0; n <= BASIC_MAX_LINE; n++)
+		line_at[n] = -1;
+
+	while (*p && !b.b_error) {
+		b.line_no++;
+		while (*p == ' ' || *p == '\t')
+			p++;
+		if (*p == '\n' || *p == '\r' || !*p) {
+			// empty line
+			p += *p == '\r' && p[1] == '\n' ? 2 : *p ? 1 : 0;
+			continue;
+		}
+
+		char *end;
+		long number = strtol(p, &end, 10);
+		if (end == p || number < 0 || number > BASIC_MAX_LINE) {
+			ltb_printf("basic: line %d: needs a line number (0-%d)\n", b.line_no, BASIC_MAX_LINE);
+			b.b_error = true;
+			break;
+		}
+		p = end;
+		while (*p == ' ' || *p == '\t')
+			p++;
+		if (*p == '\n' || *p == '\r' || !*p) {
+			// just the number: deletes the line, as in the editor
+			line_at[number] = -1;
+			continue;
+		}
+
+		// [number hi][number lo][length lo][length hi][text][0x0D]
+		int start = b.size;
+		_emit(&b, number >> 8);
+		_emit(&b, number & 0xFF);
+		_emit(&b, 0);
+		_emit(&b, 0);
+		p = _line(&b, p);
+		_emit(&b, 0x0D);
+		int len = b.size - start - 4;
+		if (!b.b_error) {
+			lines[start + 2] = len & 0xFF;
+			lines[start + 3] = len >> 8;
+			line_at[number] = start;
+		}
+		p += *p == '\r' && p[1] == '\n' ? 2 : *p ? 1 : 0;
+	}
+	if (b.b_error) {
+		if (b.size >= b.max_size)
+			ltb_printf("basic: program too big\n");
+		return -1;
+	}
+
+	// in line number order
+	int size = 0;
+	for (int n = 0; n <= BASIC_MAX_LINE; n++) {
+		if (line_at[n] < 0)
+			continue;
+		const uint8_t *line = lines + line_at[n];
+		int line_size = 4 + (line[2] | line[3] << 8);
+		if (size + line_size > max_size) {
+			ltb_printf("basic: program too big\n");
+			return -1;
+		}
+		memcpy(program + size, line, line_size);
+		size += line_size;
+	}
+	return size;
+}
+
+// Tokenize one line (up to its end) as it would be keyed into the 48k editor: keywords become
+// their tokens, numbers and everything else stay text as typed
+// Returns the number of bytes put into out (at most max_size)
+int spectrum_basic_tokenize_keyed(const char *line, uint8_t *out, int max_size) {
+	basic_build_t b = { .out = out, .max_size = max_size, .b_keyed = true };
+	_line(&b, line);
+	return b.size;
+}
+
+/**----------------------------------------------------------------------------
+ *	PROGRAM AREA
+ **/
+
+// Tokenize a listing now, it goes into the program area when the rom next waits for a key
+bool spectrum_basic_load(const char *text) {
+	int size = spectrum_basic_tokenize(text, PROGRAM, sizeof(PROGRAM));
+	if (size < 0)
+		return false;
+	PROGRAM_SIZE = size;
+	FIRST_LINE = size ? PROGRAM[0] << 8 | PROGRAM[1] : 0;
+	return true;
+}
+
+bool spectrum_basic_load_file(const char *path) {
+	FILE *f = fopen(path, "rb");
+	if (!f) {
+		ltb_printf("basic: can't open \"%s\"\n", path);
+		return false;
+	}
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	char *text = malloc(size + 1);
+	bool b_ok = false;
+	if (text) {
+		text[fread(text, 1, size, f)] = 0;
+		b_ok = spectrum_basic_load(text);
+		free(text);
+	}
+	fclose(f);
+	return b_ok;
+}
+
+// From the KEY-INPUT trap: the editor waits for a key, put a pending program in
+// Rebuilds everything from PROG on: program, (no) variables, empty edit line, empty work space
+bool spectrum_basic_inject() {
+	z80_mmu_t *mmu = &ZXSPECTRUM.mmu;
+
+	if (PROGRAM_SIZE < 0)
+		return false;
+	int size = PROGRAM_SIZE;
+	PROGRAM_SIZE = -1;
+
+	uint16_t prog = z80_mmu_GetWord(mmu, PROG);
+	uint32_t vars = prog + size;
+	uint32_t e_line = vars + 1;
+	uint32_t worksp = e_line + 2;
+	if (worksp + STACK_RESERVE > Z80_SP(*ZXSPECTRUM.cpu)) {
+		ltb_printf("basic: no room for %d bytes of program\n", size);
+		return false;
+	}
+
+	for (int i = 0; i < size; i++)
+		z80_mmu_PutByte(mmu, PROGRAM[i], prog + i);
+	z80_mmu_PutByte(mmu, 0x80, vars);				// end of the variables
+	z80_mmu_PutByte(mmu, 0x0D, e_line);			// the edit line: empty
+	z80_mmu_PutByte(mmu, 0x80, e_line + 1);
+
+	z80_mmu_PutWord(mmu, vars, VARS);
+	z80_mmu_PutWord(mmu, vars, NXTLIN);
+	z80_mmu_PutWord(mmu, prog - 1, DATADD);		// RESTORE
+	z80_mmu_PutWord(mmu, e_line, E_LINE);
+	z80_mmu_PutWord(mmu, e_line, K_CUR);
+	z80_mmu_PutWord(mmu, e_line, CH_ADD);
+	z80_mmu_PutWord(mmu, 0, X_PTR);
+	z80_mmu_PutWord(mmu, worksp, WORKSP);
+	z80_mmu_PutWord(mmu, worksp, STKBOT);
+	z80_mmu_PutWord(mmu, worksp, STKEND);
+	z80_mmu_PutWord(mmu, FIRST_LINE, E_PPC);
+
+	ltb_printf("basic: %d bytes of program at %u\n", size, prog);
+	return true;
+}
+
+// spectrum_basic.c
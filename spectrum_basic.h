@@ -0,0 +1,27 @@
+#pragma once
+
+/**----------------------------------------------------------------------------
+ *	spectrum_basic.c
+ *  BASIC listings from text: tokenized and put straight into the program area
+ **/
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BASIC_MAX_PROGRAM	0xA000		// more than fits between PROG and RAMTOP
+
+int spectrum_basic_tokenize(const char *text, uint8_t *program, int max_size);
+int spectrum_basic_tokenize_keyed(const char *line, uint8_t *out, int max_size);
+bool spectrum_basic_load(const char *text);
+bool spectrum_basic_load_file(const char *path);
+bool spectrum_basic_inject();
+
+#ifdef __cplusplus
+}
+#endif
+
+// spectrum_basic.h
@@ -0,0 +1,131 @@
+/**----------------------------------------------------------------------------
+ *	spectrum_beeper.c
+ *  ULA beeper (EAR) and MIC output with band limited step synthesis
+ *
+ *	Writes to the ULA port are logged with their frame relative T-state by the ULA
+ *	(the renderer draws the border from the same log). At the end of the frame the
+ *	MIC (bit 3) and EAR (bit 4) changes get turned into host rate
+ *	samples: each level change adds a band limited step (BLEP) at its exact sub sample 
+ *	position into a delta buffer, which is then integrated into the final samples.
+ *
+ *	Cost is BLEP_TAPS multiply-adds per level change plus a couple of operations per output 
+ *	sample: even a 20kHz square wave stays far below 1% of a host core.
+ **/
+
+#include <math.h>
+#include <string.h>
+
+#include "spectrum_beeper.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#define BEEPER_VOLUME	0.5f
+#define DC_BLOCK_R		0.995f		// dc blocker pole (~35Hz at 44.1kHz)
+
+// output amplitude for the combinations of EAR (bit 1) and MIC (bit 0)
+// the MIC line only contributes a small part to the speaker signal 
+static const float LEVELS[4] = { 0.0f, 0.07f, 0.93f, 1.0f };
+
+// band limited impulse: one row per sub sample phase, each row sums up to 1.0
+// (shared by all beeper instances)
+static float BLEP_KERNEL[BLEP_PHASES][BLEP_TAPS];
+static int b_kernel_ready = 0;
+
+// windowed sinc (blackman window) slightly below nyquist
+static void _build_kernel() {
+	const double cutoff = 0.9;
+
+	for (int phase = 0; phase < BLEP_PHASES; phase++) {
+		double sum = 0.0;
+		for (int i = 0; i < BLEP_TAPS; i++) {
+			double t = (double)(i - BLEP_TAPS / 2 + 1) - (double)phase / BLEP_PHASES;
+			double x = M_PI * cutoff * t;
+			double sinc = (t == 0.0) ? 1.0 : sin(x) / x;
+			double w = (t + BLEP_TAPS / 2) / BLEP_TAPS;		// 0..1 over the kernel
+			double window = 0.42 - 0.5 * cos(2 * M_PI * w) + 0.08 * cos(4 * M_PI * w);
+			BLEP_KERNEL[phase][i] = (float)(sinc * window);
+			sum += sinc * window;
+		}
+		for (int i = 0; i < BLEP_TAPS; i++)
+			BLEP_KERNEL[phase][i] = (float)(BLEP_KERNEL[phase][i] / sum);
+	}
+	b_kernel_ready = 1;
+}
+
+void zx_beeper_init(zx_beeper_t *beeper, int sample_rate, int cpu_clock) {
+
+	if (!b_kernel_ready)
+		_build_kernel();
+
+	memset(beeper, 0, sizeof(zx_beeper_t));
+	beeper->base_step = ((uint64_t)sample_rate << 32) / (uint64_t)cpu_clock;
+	beeper->step = beeper->base_step;
+}
+
+// Resampling ratio for dynamic rate control: >1.0 produces more samples per frame
+void zx_beeper_set_rate_ratio(zx_beeper_t *beeper, double ratio) {
+	beeper->step = (uint64_t)((double)beeper->base_step * ratio);
+}
+
+// Synthesise the frame from the ULA port writes (bits 3 and 4) logged before frame_tstates
+// returns the number of samples produced into beeper->out
+int zx_beeper_end_frame(zx_beeper_t *beeper, const zx_ula_log_t *log, uint32_t frame_tstates) {
+
+	beeper->out_t0 = -(double)beeper->frac / (double)beeper->step;
+	beeper->out_t_step = 4294967296.0 / (double)beeper->step;
+
+	uint64_t end = beeper->frac + (uint64_t)frame_tstates * beeper->step;
+	int count = (int)(end >> 32);
+	if (count > BEEPER_MAX_FRAME_SAMPLES)
+		count = BEEPER_MAX_FRAME_SAMPLES;
+
+	// add the band limited steps
+	const zx_ula_out_t *e;
+	while ((e = zx_ULA_next_out(log, &beeper->log_read, frame_tstates))) {
+		uint8_t level = (e->value >> 3) & 0x03;
+		if (level == beeper->level)
+			continue;		// border change
+		beeper->level = level;
+
+		uint64_t pos = beeper->frac + (uint64_t)e->tstate * beeper->step;
+
+		int index = (int)(pos >> 32);
+		if (index >= BEEPER_MAX_FRAME_SAMPLES)
+			index = BEEPER_MAX_FRAME_SAMPLES - 1;
+		int phase = (int)(((pos & 0xffffffff) * BLEP_PHASES) >> 32);
+
+		float amplitude = LEVELS[level];
+		float delta = amplitude - beeper->amplitude;
+		beeper->amplitude = amplitude;
+
+		const float *k = BLEP_KERNEL[phase];
+		float *d = &beeper->delta[index];
+		for (int i = 0; i < BLEP_TAPS; i++)
+			d[i] += delta * k[i];
+	}
+
+	// integrate and remove dc
+	float acc = beeper->integrator;
+	float hp_in = beeper->hp_in;
+	float hp_out = beeper->hp_out;
+	for (int i = 0; i < count; i++) {
+		acc += beeper->delta[i];
+		hp_out = acc - hp_in + DC_BLOCK_R * hp_out;
+		hp_in = acc;
+		beeper->out[i] = hp_out * BEEPER_VOLUME;
+	}
+	beeper->integrator = acc;
+	beeper->hp_in = hp_in;
+	beeper->hp_out = hp_out;
+
+	// keep the kernel tails reaching into the next frame
+	memmove(beeper->delta, &beeper->delta[count], BLEP_TAPS * sizeof(float));
+	memset(&beeper->delta[BLEP_TAPS], 0, count * sizeof(float));
+
+	beeper->frac = end - ((uint64_t)count << 32);
+	return count;
+}
+
+// spectrum_beeper.c
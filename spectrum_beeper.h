@@ -0,0 +1,50 @@
+#pragma once
+
+/**----------------------------------------------------------------------------
+ *	spectrum_beeper.c
+ *  ULA beeper (EAR) and MIC output with band limited step synthesis
+ **/
+
+#include <stdint.h>
+
+#include "spectrum_ula.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BEEPER_MAX_FRAME_SAMPLES	2048	// output samples per frame
+#define BLEP_PHASES					32		// sub sample resolution of level changes
+#define BLEP_TAPS					16		// length of the band limited step kernel
+
+typedef struct {
+
+	// level changes come from the ULA port log
+	uint32_t log_read;			// read index into zx_ula_log_t
+	uint8_t level;				// bit 1: EAR, bit 0: MIC (as last synthesised)
+
+	// synthesis
+	float amplitude;			// amplitude of the level last synthesised
+	uint64_t base_step;			// output samples per T-state at the nominal rate (32.32 fixed point)
+	uint64_t step;				// actual step (base_step adjusted by the rate control ratio)
+	uint64_t frac;				// sub sample position of the frame start (32.32 fixed point)
+	float integrator;			// running sum of the delta buffer
+	float hp_in, hp_out;		// dc blocker state
+	float delta[BEEPER_MAX_FRAME_SAMPLES + BLEP_TAPS];
+
+	// output of the last zx_beeper_end_frame()
+	// sample i is at frame relative T-state out_t0 + i * out_t_step (for other sound sources to line up)
+	float out[BEEPER_MAX_FRAME_SAMPLES];
+	double out_t0, out_t_step;
+
+} zx_beeper_t;
+
+void zx_beeper_init(zx_beeper_t *beeper, int sample_rate, int cpu_clock);
+void zx_beeper_set_rate_ratio(zx_beeper_t *beeper, double ratio);
+int zx_beeper_end_frame(zx_beeper_t *beeper, const zx_ula_log_t *log, uint32_t frame_tstates);
+
+#ifdef __cplusplus
+}
+#endif
+
+// spectrum_beeper.h
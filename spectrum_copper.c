@@ -0,0 +1,133 @@
+/**----------------------------------------------------------------------------
+ *	spectrum_copper.c
+ *  ZXX copper
+ *
+ *	The program is a list of 16 bit instructions (high byte first):
+ *
+ *	WAIT	1hhhhhhv vvvvvvvv	wait for display line v (0: first line of the 256x192 display,
+ *								lines past the bottom border wrap around to the top border),
+ *								horizontal position h in units of 8 pixels from the left display edge
+ *	MOVE	0rrrrrrr vvvvvvvv	write v to next register r (MOVE 0,0 is a NOP)
+ *
+ *	Next registers: 0x60 program data (auto increment), 0x61 program address lo,
+ *	0x62 control (bits 7-6 mode, bits 2-0 program address hi), 0x63 program data as 0x60.
+ *
+ *	The copper does not run alongside the cpu: the frame scheduler (spectrum_run_frame()) splits
+ *	the cpu steps at the copper's WAIT positions and the MOVEs get applied in between, so raster
+ *	effects cost a few function calls per split instead of cycle exact polling loops.
+ *	Registers that feed the renderer (palettes, layer 2 scroll, layer setup) get picked up
+ *	by the next scanline rendered, ie. changes take effect at line granularity.
+ **/
+
+#include <string.h>
+
+#include "spectrum.h"
+#include "spectrum_copper.h"
+
+#define COPPER_INSTRUCTIONS	(COPPER_PROGRAM_SIZE / 2)
+#define COPPER_NONE			UINT32_MAX
+
+
+void zx_copper_init(zx_copper_t *copper) {
+	memset(copper, 0, sizeof(zx_copper_t));
+	copper->mode = ZX_COPPER_STOP;
+	copper->next_tstate = COPPER_NONE;
+}
+
+// 0x60/0x63
+void zx_copper_write_data(zx_copper_t *copper, uint8_t value) {
+	copper->program[copper->write_addr] = value;
+	copper->write_addr = (copper->write_addr + 1) & (COPPER_PROGRAM_SIZE - 1);
+}
+
+// 0x61
+void zx_copper_write_addr_lo(zx_copper_t *copper, uint8_t value) {
+	copper->write_addr = (copper->write_addr & 0x700) | value;
+}
+
+// 0x62: only a change of mode (re)starts or stops the copper
+void zx_copper_write_control(zx_copper_t *copper, uint8_t value) {
+	zx_copper_mode_t mode = (zx_copper_mode_t)(value >> 6);
+
+	copper->write_addr = ((value & 0x07) << 8) | (copper->write_addr & 0xFF);
+	if (mode == copper->mode)
+		return;
+
+	copper->mode = mode;
+	if (mode == ZX_COPPER_STOP) {
+		copper->next_tstate = COPPER_NONE;
+		return;
+	}
+	if (mode != ZX_COPPER_RUN)
+		copper->pc = 0;
+	copper->next_tstate = spectrum_tstate();
+}
+
+uint8_t zx_copper_control(const zx_copper_t *copper) {
+	return (uint8_t)((copper->mode << 6) | (copper->write_addr >> 8));
+}
+
+// frame T-state of a WAIT position
+static uint32_t _wait_tstate(uint16_t instruction) {
+	const zx_timing_t *timing = &ZXSPECTRUM.timing;
+	uint32_t h = (instruction >> 9) & 0x3F;
+	uint32_t v = instruction & 0x1FF;
+
+	if (v >= timing->frame_lines)
+		return COPPER_NONE;
+	uint32_t line = timing->first_display_line + v;
+	if (line >= timing->frame_lines)
+		line -= timing->frame_lines;
+	return line * timing->line_tstates + h * 4;		// 2 pixels per T-state
+}
+
+// Execute the program up to the next WAIT that lies ahead of tstate
+// A WAIT is satisfied once the beam is at or past its position, a position more than a line
+// behind the beam means waiting for the next frame
+void zx_copper_run(zx_copper_t *copper, uint32_t tstate) {
+	const zx_timing_t *timing = &ZXSPECTRUM.timing;
+
+	if (copper->next_tstate > tstate)
+		return;
+
+	while (copper->mode != ZX_COPPER_STOP && copper->pc < COPPER_INSTRUCTIONS) {
+		const uint8_t *p = copper->program + copper->pc * 2;
+		uint16_t instruction = (p[0] << 8) | p[1];
+		copper->pc++;
+
+		if (instruction & 0x8000) {
+			uint32_t t = _wait_tstate(instruction);
+			if (t == COPPER_NONE)
+				break;
+			if (t + timing->line_tstates <= tstate)
+				t += timing->frame_tstates;
+			if (t > tstate) {
+				copper->next_tstate = t;
+				return;
+			}
+		}
+		else if (instruction) {
+			// the copper can't reprogram itself
+			uint8_t reg = instruction >> 8;
+			if (reg < NEXTREG_COPPER_DATA || reg > NEXTREG_COPPER_DATA_16)
+				zx_nextreg_set(&ZXSPECTRUM.nextreg, reg, instruction & 0xFF);
+		}
+	}
+
+	// end of program (or HALT): wait for a restart
+	copper->next_tstate = COPPER_NONE;
+}
+
+// carry a pending WAIT over into the next frame, restart the frame mode program
+void zx_copper_end_frame(zx_copper_t *copper, uint32_t frame_tstates) {
+	if (copper->mode == ZX_COPPER_RUN_FRAMES) {
+		copper->pc = 0;
+		copper->next_tstate = 0;
+	}
+	else if (copper->next_tstate != COPPER_NONE) {
+		copper->next_tstate = copper->next_tstate > frame_tstates ? copper->next_tstate - frame_tstates : 0;
+	}
+}
+
+
+// spectrum_copper.c
@@ -0,0 +1,47 @@
+#pragma once
+
+/**----------------------------------------------------------------------------
+ *	spectrum_copper.c
+ *  ZXX copper: a tiny coprocessor writing next registers at set beam positions,
+ *  programmed through next registers 0x60-0x63
+ **/
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define COPPER_PROGRAM_SIZE		2048		// bytes: 1024 16 bit instructions
+#define COPPER_HALT				0xFFFF		// WAIT 63,511: never reached
+
+// next register 0x62 bits 7-6
+typedef enum {
+	ZX_COPPER_STOP,
+	ZX_COPPER_RUN_ONCE,			// start from instruction 0
+	ZX_COPPER_RUN,				// resume at the current instruction
+	ZX_COPPER_RUN_FRAMES,		// start from instruction 0, restart at every frame
+} zx_copper_mode_t;
+
+typedef struct {
+	uint8_t program[COPPER_PROGRAM_SIZE];
+	uint16_t write_addr;		// program byte written through 0x60/0x63
+	zx_copper_mode_t mode;
+	uint16_t pc;				// instruction index
+	uint32_t next_tstate;		// frame T-state the copper waits for, UINT32_MAX: stopped
+} zx_copper_t;
+
+void zx_copper_init(zx_copper_t *copper);
+void zx_copper_write_data(zx_copper_t *copper, uint8_t value);
+void zx_copper_write_addr_lo(zx_copper_t *copper, uint8_t value);
+void zx_copper_write_control(zx_copper_t *copper, uint8_t value);
+uint8_t zx_copper_control(const zx_copper_t *copper);
+void zx_copper_run(zx_copper_t *copper, uint32_t tstate);
+void zx_copper_end_frame(zx_copper_t *copper, uint32_t frame_tstates);
+
+#ifdef __cplusplus
+}
+#endif
+
+// spectrum_copper.h
@@ -0,0 +1,486 @@
+/**----------------------------------------------------------------------------
+ *	spectrum_divmmc.c
+ *  DivMMC interface with an SD card on a raw image file
+ *
+ *	Memory: the 8k esxdos rom lives in DIVMMC_ROM_PAGE, the 128k ram in the 16 pages from
+ *	DIVMMC_RAM_PAGE. While mapped, 0x0000-0x1FFF shows the rom (or ram page 3 with MAPRAM)
+ *	and 0x2000-0x3FFF the ram page selected through port 0xE3.
+ *
+ *	Automapping is done with cpu traps on the rom entry points 0x0000, 0x0008, 0x0038, 0x0066,
+ *	0x04C6 and 0x0562, the exit area 0x1FF8-0x1FFF unmaps again. Traps run after the opcode
+ *	fetch, which is the delayed mapping of the real thing. (The instant 0x3Dxx TR-DOS
+ *	entry point is not implemented.)
+ *
+ *	SD card: SPI mode, SDHC style block addressing. The image file is mmap()'d: a sector read
+ *	is one memcpy from the mapping into the response buffer, sector writes go into the mapping
+ *	and get recorded in a dirty sector bitmap. Dirty sectors are msync()'d once the card has
+ *	been idle for DIVMMC_IDLE_FRAMES frames, and on detach.
+ **/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "spectrum.h"
+#include "spectrum_divmmc.h"
+#include "text_box_l.h"
+
+// rom entry points that page the divmmc in
+static const uint16_t AUTOMAP_ADDRESSES[] = { 0x0000, 0x0008, 0x0038, 0x0066, 0x04C6, 0x0562 };
+#define UNMAP_FIRST		0x1FF8
+#define UNMAP_LAST		0x1FFF
+
+
+/**----------------------------------------------------------------------------
+ *	MEMORY MAPPING
+ */
+
+static void _update_mapping(zx_divmmc_t *divmmc) {
+	z80_mmu_t *mmu = &ZXSPECTRUM.mmu;
+	bool b_map = (divmmc->control & DIVMMC_CONMEM) || divmmc->b_automapped;
+
+	if (!b_map) {
+		if (divmmc->b_mapped) {
+			for (int slot = 0; slot < 2; slot++)
+				z80_mmu_PageMap(mmu, slot, divmmc->saved_pages[slot], divmmc->saved_types[slot]);
+			divmmc->b_mapped = false;
+		}
+		return;
+	}
+
+	// remember what the divmmc covers up
+	if (!divmmc->b_mapped) {
+		for (int slot = 0; slot < 2; slot++) {
+			divmmc->saved_pages[slot] = mmu->visible_pages[slot].index;
+			divmmc->saved_types[slot] = mmu->visible_pages[slot].mapping_type;
+		}
+		divmmc->b_mapped = true;
+	}
+
+	int page = divmmc->control & DIVMMC_BANK_MASK;
+	bool b_mapram = (divmmc->control & DIVMMC_MAPRAM) && !(divmmc->control & DIVMMC_CONMEM);
+
+	z80_mmu_PageMap(mmu, 0, b_mapram ? DIVMMC_RAM_PAGE + 3 : DIVMMC_ROM_PAGE, M_READ_ONLY);
+	z80_mmu_PageMap(mmu, 1, DIVMMC_RAM_PAGE + page, (b_mapram && page == 3) ? M_READ_ONLY : M_READ_WRITE);
+}
+
+// port 0x7FFD has just remapped the rom: that's what lies underneath now
+void zx_divmmc_paging_changed(zx_divmmc_t *divmmc) {
+	if (!divmmc->b_mapped)
+		return;
+	divmmc->b_mapped = false;
+	_update_mapping(divmmc);
+}
+
+// A persisted session has been resumed: control, b_automapped and what slots 0/1 map underneath
+// are as they were saved. Without the divmmc attached now its pages go, whatever it covered up
+// comes back (and the rom's automap entry points with it)
+void zx_divmmc_restored(zx_divmmc_t *divmmc) {
+	if (!divmmc->b_attached) {
+		divmmc->control = 0;
+		divmmc->b_automapped = false;
+	}
+	_update_mapping(divmmc);
+}
+
+static void _trap_automap(Z80 *z80) {
+	zx_divmmc_t *divmmc = &ZXSPECTRUM.divmmc;
+	(void)z80;
+	if (divmmc->b_attached && !divmmc->b_automapped) {
+		divmmc->b_automapped = true;
+		_update_mapping(divmmc);
+	}
+}
+
+static void _trap_unmap(Z80 *z80) {
+	zx_divmmc_t *divmmc = &ZXSPECTRUM.divmmc;
+	(void)z80;
+	if (divmmc->b_automapped) {
+		divmmc->b_automapped = false;
+		_update_mapping(divmmc);
+	}
+}
+
+
+/**----------------------------------------------------------------------------
+ *	SD CARD
+ */
+
+static void _queue(zx_sd_card_t *card, uint8_t value) {
+	if (card->response_len < SD_RESPONSE_SIZE)
+		card->response[card->response_len++] = value;
+}
+
+// a new response replaces whatever hasn't been read yet, it starts with one NCR stuff byte
+static void _respond(zx_sd_card_t *card, uint8_t r1) {
+	card->response_len = 0;
+	card->response_pos = 0;
+	_queue(card, 0xFF);
+	_queue(card, r1 | (card->b_ready ? 0x00 : 0x01));
+}
+
+// start token, data, dummy crc
+static void _queue_block(zx_sd_card_t *card, const uint8_t *data, int size) {
+	_queue(card, 0xFE);
+	memcpy(card->response + card->response_len, data, size);
+	card->response_len += size;
+	_queue(card, 0xFF);
+	_queue(card, 0xFF);
+}
+
+static void _queue_sector(zx_sd_card_t *card, uint32_t sector) {
+	_queue_block(card, card->image + (size_t)sector * SD_SECTOR_SIZE, SD_SECTOR_SIZE);
+}
+
+// CSD version 2 (SDHC): capacity in units of 512k
+static void _queue_csd(zx_sd_card_t *card) {
+	uint32_t c_size = (uint32_t)(card->image_size / (512 * 1024));
+	if (c_size)
+		c_size--;
+	const uint8_t csd[16] = {
+		0x40, 0x0E, 0x00, 0x32, 0x5B, 0x59, 0x00,
+		(c_size >> 16) & 0x3F, (c_size >> 8) & 0xFF, c_size & 0xFF,
+		0x7F, 0x80, 0x0A, 0x40, 0x00, 0x01
+	};
+	_queue_block(card, csd, sizeof(csd));
+}
+
+static void _queue_cid(zx_sd_card_t *card) {
+	static const uint8_t cid[16] = { 0x03, 'S', 'G', 'S', 'D', 'I', 'M', 'G', 0x10, 0, 0, 0, 1, 0x01, 0x01, 0x01 };
+	_queue_block(card, cid, sizeof(cid));
+}
+
+static void _command(zx_sd_card_t *card) {
+	uint8_t index = card->cmd[0] & 0x3F;
+	uint32_t arg = (card->cmd[1] << 24) | (card->cmd[2] << 16) | (card->cmd[3] << 8) | card->cmd[4];
+	bool b_app = card->b_app_cmd;
+	card->b_app_cmd = false;
+
+	switch (index) {
+	case 0:		// GO_IDLE_STATE
+		card->b_ready = false;
+		card->b_read_multi = false;
+		_respond(card, 0x00);
+		break;
+	case 1:		// SEND_OP_COND (mmc)
+		card->b_ready = true;
+		_respond(card, 0x00);
+		break;
+	case 8:		// SEND_IF_COND: voltage accepted, echo the check pattern
+		_respond(card, 0x00);
+		_queue(card, 0x00); _queue(card, 0x00); _queue(card, 0x01); _queue(card, arg & 0xFF);
+		break;
+	case 9:		// SEND_CSD
+		_respond(card, 0x00);
+		_queue_csd(card);
+		break;
+	case 10:	// SEND_CID
+		_respond(card, 0x00);
+		_queue_cid(card);
+		break;
+	case 12:	// STOP_TRANSMISSION
+		card->b_read_multi = false;
+		_respond(card, 0x00);
+		break;
+	case 16:	// SET_BLOCKLEN (always 512)
+	case 59:	// CRC_ON_OFF
+		_respond(card, 0x00);
+		break;
+	case 17:	// READ_SINGLE_BLOCK
+	case 18:	// READ_MULTIPLE_BLOCK
+		if (arg >= card->num_sectors) {
+			_respond(card, 0x40);
+			break;
+		}
+		_respond(card, 0x00);
+		_queue_sector(card, arg);
+		card->b_read_multi = (index == 18);
+		card->read_sector = arg + 1;
+		break;
+	case 24:	// WRITE_BLOCK
+	case 25:	// WRITE_MULTIPLE_BLOCK
+		if (arg >= card->num_sectors) {
+			_respond(card, 0x40);
+			break;
+		}
+		_respond(card, 0x00);
+		card->state = SD_WRITE_TOKEN;
+		card->b_write_multi = (index == 25);
+		card->write_sector = arg;
+		break;
+	case 41:	// SD_SEND_OP_COND (after APP_CMD)
+		if (b_app)
+			card->b_ready = true;
+		_respond(card, b_app ? 0x00 : 0x04);
+		break;
+	case 55:	// APP_CMD
+		card->b_app_cmd = true;
+		_respond(card, 0x00);
+		break;
+	case 58:	// READ_OCR: powered up, high capacity (block addressing)
+		_respond(card, 0x00);
+		_queue(card, 0xC0); _queue(card, 0xFF); _queue(card, 0x80); _queue(card, 0x00);
+		break;
+	default:	// illegal command
+		_respond(card, 0x04);
+		break;
+	}
+}
+
+static void _mark_dirty(zx_sd_card_t *card, uint32_t sector) {
+	card->dirty[sector / 64] |= 1ull << (sector % 64);
+	card->b_dirty = true;
+}
+
+static void _spi_write(zx_sd_card_t *card, uint8_t value) {
+	switch (card->state) {
+	case SD_WRITE_TOKEN:
+		if (value == 0xFE || (value == 0xFC && card->b_write_multi)) {
+			card->state = SD_WRITE_DATA;
+			card->write_pos = 0;
+		}
+		else if (value == 0xFD && card->b_write_multi) {
+			// stop token: one busy byte, then ready
+			card->state = SD_IDLE;
+			card->response_len = card->response_pos = 0;
+			_queue(card, 0xFF); _queue(card, 0x00); _queue(card, 0xFF);
+		}
+		break;
+
+	case SD_WRITE_DATA:
+		card->image[(size_t)card->write_sector * SD_SECTOR_SIZE + card->write_pos] = value;
+		if (++card->write_pos == SD_SECTOR_SIZE) {
+			_mark_dirty(card, card->write_sector);
+			card->state = SD_WRITE_CRC;
+			card->crc_left = 2;
+		}
+		break;
+
+	case SD_WRITE_CRC:
+		if (--card->crc_left == 0) {
+			// data accepted, one busy byte
+			card->response_len = card->response_pos = 0;
+			_queue(card, 0x05); _queue(card, 0x00); _queue(card, 0xFF);
+			card->write_sector++;
+			if (card->b_write_multi && card->write_sector < card->num_sectors)
+				card->state = SD_WRITE_TOKEN;
+			else
+				card->state = SD_IDLE;
+		}
+		break;
+
+	default:
+		// command frames start with 01xxxxxx, anything else in between is filler
+		if (card->cmd_len == 0 && (value & 0xC0) != 0x40)
+			break;
+		card->cmd[card->cmd_len++] = value;
+		if (card->cmd_len == 6) {
+			card->cmd_len = 0;
+			_command(card);
+		}
+		break;
+	}
+}
+
+static uint8_t _spi_read(zx_sd_card_t *card) {
+	if (card->response_pos == card->response_len) {
+		if (!card->b_read_multi)
+			return 0xFF;
+		// multiple block read: the next sector follows until CMD12
+		card->response_len = card->response_pos = 0;
+		if (card->read_sector >= card->num_sectors) {
+			card->b_read_multi = false;
+			return 0xFF;
+		}
+		_queue(card, 0xFF);
+		_queue_sector(card, card->read_sector++);
+	}
+	return card->response[card->response_pos++];
+}
+
+// msync() the dirty sectors, in runs
+void zx_divmmc_flush(zx_divmmc_t *divmmc) {
+	zx_sd_card_t *card = &divmmc->card;
+	if (!card->b_dirty)
+		return;
+
+	const size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+	uint32_t sector = 0;
+	while (sector < card->num_sectors) {
+		if (!(card->dirty[sector / 64] & (1ull << (sector % 64)))) {
+			sector++;
+			continue;
+		}
+		uint32_t first = sector;
+		while (sector < card->num_sectors && (card->dirty[sector / 64] & (1ull << (sector % 64)))) {
+			card->dirty[sector / 64] &= ~(1ull << (sector % 64));
+			sector++;
+		}
+		size_t start = (size_t)first * SD_SECTOR_SIZE / page_size * page_size;
+		size_t end = (size_t)sector * SD_SECTOR_SIZE;
+		msync(card->image + start, end - start, MS_SYNC);
+	}
+	card->b_dirty = false;
+}
+
+// once per frame: write back after the card has gone quiet
+void zx_divmmc_end_frame(zx_divmmc_t *divmmc) {
+	if (divmmc->card.b_dirty && ++divmmc->card.idle_frames >= DIVMMC_IDLE_FRAMES)
+		zx_divmmc_flush(divmmc);
+}
+
+
+/**----------------------------------------------------------------------------
+ *	I/O PORTS
+ */
+
+// 0xE3: bit 7 CONMEM, bit 6 MAPRAM, bits 0-3 ram page at 0x2000
+static void _control_write(void *ctx, uint16_t port, uint8_t value) {
+	zx_divmmc_t *divmmc = (zx_divmmc_t*)ctx;
+	(void)port;
+	divmmc->control = value | (divmmc->control & DIVMMC_MAPRAM);
+	_update_mapping(divmmc);
+}
+
+// 0xE7: bit 0 low selects the card
+static void _select_write(void *ctx, uint16_t port, uint8_t value) {
+	zx_divmmc_t *divmmc = (zx_divmmc_t*)ctx;
+	(void)port;
+	divmmc->card.b_selected = !(value & 0x01);
+	if (!divmmc->card.b_selected)
+		divmmc->card.cmd_len = 0;
+}
+
+// 0xEB: SPI data
+static uint8_t _spi_port_read(void *ctx, uint16_t port) {
+	zx_divmmc_t *divmmc = (zx_divmmc_t*)ctx;
+	(void)port;
+	divmmc->card.idle_frames = 0;
+	return divmmc->card.b_selected ? _spi_read(&divmmc->card) : 0xFF;
+}
+
+static void _spi_port_write(void *ctx, uint16_t port, uint8_t value) {
+	zx_divmmc_t *divmmc = (zx_divmmc_t*)ctx;
+	(void)port;
+	divmmc->card.idle_frames = 0;
+	if (divmmc->card.b_selected)
+		_spi_write(&divmmc->card, value);
+}
+
+
+/**----------------------------------------------------------------------------
+ *	ATTACH / DETACH
+ */
+
+// power on: paged out, card uninitialized (the mmu has just been reset)
+void zx_divmmc_reset(zx_divmmc_t *divmmc) {
+	zx_sd_card_t *card = &divmmc->card;
+
+	divmmc->control = 0;
+	divmmc->b_automapped = false;
+	divmmc->b_mapped = false;
+	card->b_selected = false;
+	card->b_ready = false;
+	card->b_app_cmd = false;
+	card->cmd_len = 0;
+	card->state = SD_IDLE;
+	card->b_read_multi = false;
+	card->response_len = card->response_pos = 0;
+}
+
+// Map the SD card image, load the esxdos rom and hook the divmmc into ports and traps
+// Call after init_spectrum() and spectrum_power()
+bool zx_divmmc_attach(zx_divmmc_t *divmmc, const char *image_file) {
+	zx_sd_card_t *card = &divmmc->card;
+
+	if (divmmc->b_attached)
+		return false;
+	memset(divmmc, 0, sizeof(zx_divmmc_t));
+
+	int fd = open(image_file, O_RDWR);
+	if (fd < 0) {
+		ltb_printf("divmmc: can't open \"%s\"\n", image_file);
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size < SD_SECTOR_SIZE) {
+		ltb_printf("divmmc: \"%s\" is not an sd card image\n", image_file);
+		close(fd);
+		return false;
+	}
+	uint8_t *image = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);		// the mapping keeps its own reference
+	if (image == MAP_FAILED) {
+		ltb_printf("divmmc: can't map \"%s\"\n", image_file);
+		return false;
+	}
+
+	uint32_t num_sectors = (uint32_t)(st.st_size / SD_SECTOR_SIZE);
+	uint64_t *dirty = (uint64_t *)calloc((num_sectors + 63) / 64, sizeof(uint64_t));
+	if (!dirty) {
+		ltb_printf("divmmc: can't allocate the dirty sector map of \"%s\"\n", image_file);
+		munmap(image, st.st_size);
+		return false;
+	}
+
+	if (!spectrum_load_rom_file(DIVMMC_ROM_PAGE, SPECTRUM_DIVMMC_ROM_FILE, MEM_PAGE_SIZE)) {
+		free(dirty);
+		munmap(image, st.st_size);
+		return false;
+	}
+
+	card->image = image;
+	card->image_size = st.st_size;
+	card->num_sectors = num_sectors;
+	card->dirty = dirty;
+
+	z80_mmu_AddDeviceBanks(&ZXSPECTRUM.mmu, DIVMMC_RAM_BANK, DIVMMC_RAM_BANKS);
+
+	z80_io_bus_t *io = &ZXSPECTRUM.io;
+	divmmc->io_devices[0] = z80_io_Register(io, "divmmc control", 0x00FF, 0x00E3, NULL, _control_write, divmmc);
+	divmmc->io_devices[1] = z80_io_Register(io, "divmmc card select", 0x00FF, 0x00E7, NULL, _select_write, divmmc);
+	divmmc->io_devices[2] = z80_io_Register(io, "divmmc spi", 0x00FF, 0x00EB, _spi_port_read, _spi_port_write, divmmc);
+
+	// entry points of whichever spectrum rom is paged in, exit area of the divmmc rom (or ram page 3)
+	static const uint8_t roms[] = { ROM_0_BANK, ROM_1_BANK, ROM_2_BANK };
+	for (size_t r = 0; r < sizeof(roms); r++) {
+		for (size_t a = 0; a < sizeof(AUTOMAP_ADDRESSES) / sizeof(uint16_t); a++)
+			z80cpu_add_trap(AUTOMAP_ADDRESSES[a], _trap_automap, roms[r]);
+	}
+	for (uint16_t address = UNMAP_FIRST; address <= UNMAP_LAST; address++) {
+		z80cpu_add_trap(address, _trap_unmap, DIVMMC_ROM_PAGE / 2);
+		z80cpu_add_trap(address, _trap_unmap, (DIVMMC_RAM_PAGE + 3) / 2);
+	}
+
+	divmmc->b_attached = true;
+	ltb_printf("divmmc: \"%s\", %u sectors\n", image_file, card->num_sectors);
+	return true;
+}
+
+// Write back and unmap the card image, page the divmmc out
+void zx_divmmc_detach(zx_divmmc_t *divmmc) {
+	zx_sd_card_t *card = &divmmc->card;
+
+	if (!divmmc->b_attached)
+		return;
+
+	zx_divmmc_flush(divmmc);
+	munmap(card->image, card->image_size);
+	free(card->dirty);
+	card->image = NULL;
+	card->dirty = NULL;
+
+	divmmc->control = 0;
+	divmmc->b_automapped = false;
+	_update_mapping(divmmc);
+	for (int i = 0; i < 3; i++)
+		z80_io_Enable(&ZXSPECTRUM.io, divmmc->io_devices[i], false);
+	divmmc->b_attached = false;
+}
+
+
+// spectrum_divmmc.c
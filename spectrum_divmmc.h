@@ -0,0 +1,87 @@
+#pragma once
+
+/**----------------------------------------------------------------------------
+ *	spectrum_divmmc.c
+ *  DivMMC interface: esxdos rom and 128k ram automapped at the rom entry points,
+ *  SD card (SPI) on a raw image file
+ *  ports 0xE3 (control), 0xE7 (card select), 0xEB (SPI data)
+ **/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SD_SECTOR_SIZE		512
+#define SD_RESPONSE_SIZE	(SD_SECTOR_SIZE + 8)		// R1, token, data, crc (plus stuff bytes)
+#define DIVMMC_IDLE_FRAMES	50							// flush dirty sectors after 1s without card access
+
+// 0xE3 control
+#define DIVMMC_CONMEM		0x80	// map in regardless of automap
+#define DIVMMC_MAPRAM		0x40	// ram bank 3 replaces the rom (read only), sticky until power off
+#define DIVMMC_BANK_MASK	0x0F
+
+typedef enum {
+	SD_IDLE,				// waiting for a command
+	SD_WRITE_TOKEN,			// CMD24/25: waiting for the data token
+	SD_WRITE_DATA,
+	SD_WRITE_CRC,
+} zx_sd_state_t;
+
+typedef struct {
+	// image
+	uint8_t *image;				// mmap()'d image file
+	size_t image_size;
+	uint32_t num_sectors;
+	uint64_t *dirty;			// bit per sector written since the last flush
+	bool b_dirty;
+	int idle_frames;
+
+	bool b_selected;			// port 0xE7 bit 0 low
+	bool b_ready;				// initialized (ACMD41/CMD1): R1 idle bit clear
+	bool b_app_cmd;				// CMD55 seen: next command is an ACMD
+	uint8_t cmd[6];
+	int cmd_len;
+
+	zx_sd_state_t state;
+	bool b_write_multi;
+	uint32_t write_sector;
+	int write_pos;
+	int crc_left;
+
+	bool b_read_multi;
+	uint32_t read_sector;
+
+	// bytes the card clocks out on the following SPI reads
+	uint8_t response[SD_RESPONSE_SIZE];
+	int response_len;
+	int response_pos;
+} zx_sd_card_t;
+
+typedef struct {
+	bool b_attached;
+	int io_devices[3];
+	uint8_t control;			// last value written to 0xE3
+	bool b_automapped;			// entry point hit (until the exit trap at 0x1FF8-0x1FFF)
+	bool b_mapped;				// divmmc memory currently in slots 0/1
+	int saved_pages[2];			// what slots 0/1 map underneath
+	int saved_types[2];
+	zx_sd_card_t card;
+} zx_divmmc_t;
+
+bool zx_divmmc_attach(zx_divmmc_t *divmmc, const char *image_file);
+void zx_divmmc_detach(zx_divmmc_t *divmmc);
+void zx_divmmc_reset(zx_divmmc_t *divmmc);
+void zx_divmmc_flush(zx_divmmc_t *divmmc);
+void zx_divmmc_end_frame(zx_divmmc_t *divmmc);
+void zx_divmmc_paging_changed(zx_divmmc_t *divmmc);
+void zx_divmmc_restored(zx_divmmc_t *divmmc);
+
+#ifdef __cplusplus
+}
+#endif
+
+// spectrum_divmmc.h
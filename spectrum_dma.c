@@ -0,0 +1,367 @@
+/**----------------------------------------------------------------------------
+ *	spectrum_dma.c
+ *  ZXX dma controller
+ *
+ *	Programmed like the zxnDMA (a subset of the Z80 DMA register set) through port 0x6B:
+ *
+ *	WR0	0ddddd01	bit 2 direction (1: A->B), bits 3-6: port A start lo/hi, length lo/hi follow
+ *	WR1	0xxxx100	port A: bit 3 io, bits 4-5 address mode (00 dec, 01 inc, 1x fixed), bit 6 timing follows
+ *	WR2	0xxxx000	port B: as WR1, the timing byte may be followed by the prescaler (timing bit 5)
+ *	WR3	1xxxxx00	bit 6 enable (mask and match bytes get skipped)
+ *	WR4	1xxxxx01	bits 5-6 mode (00 byte, 01 continuous, 10 burst), bits 2-3: port B start lo/hi follow
+ *	WR5	10xxx010	bit 5 auto restart
+ *	WR6	1xxxxx11	commands (load, continue, enable, disable, read mask/status ...)
+ *
+ *	Transfers don't go through the cpu callbacks: memory blocks get copied/filled natively
+ *	over the mmu slot pointers, one memmove/memset per 8k page crossing. The cpu is charged the
+ *	bus cycles of the whole block in one go (continuous mode), or, in burst mode with a prescaler,
+ *	the bytes get paced at scanline granularity (zx_dma_run()) and the cpu only loses the stolen cycles.
+ *	Block length is the number of bytes transferred (zxnDMA mode, not Zilog length+1).
+ **/
+
+#include <string.h>
+
+#include "spectrum.h"
+#include "spectrum_dma.h"
+
+// parameter bytes following a base register byte
+enum {
+	P_A_LO, P_A_HI, P_LEN_LO, P_LEN_HI, P_A_TIMING,
+	P_B_LO, P_B_HI, P_B_TIMING, P_PRESCALER,
+	P_READ_MASK, P_SKIP,
+};
+
+#define DMA_DEFAULT_CYCLES	3
+
+
+/**----------------------------------------------------------------------------
+ *	TRANSFERS
+ */
+
+// memory to memory, both addresses incrementing
+static void _copy_memory(zx_spectrum_t *zx, uint16_t src, uint16_t dst, uint32_t n) {
+	z80_mmu_t *mmu = &zx->mmu;
+
+	while (n) {
+		uint32_t len = n;
+		if (len > MEM_PAGE_SIZE - (src & (MEM_PAGE_SIZE - 1)))
+			len = MEM_PAGE_SIZE - (src & (MEM_PAGE_SIZE - 1));
+		if (len > MEM_PAGE_SIZE - (dst & (MEM_PAGE_SIZE - 1)))
+			len = MEM_PAGE_SIZE - (dst & (MEM_PAGE_SIZE - 1));
+
+		if (zx->beam.b_display_line) {
+			for (uint32_t i = 0; i < len; i++)
+				spectrum_display_write(zx, (uint16_t)(dst + i));
+		}
+
+		int slot = dst >> MEM_SLOT_SHIFT;
+		if (mmu->slot_write[slot] || z80_mmu_FaultWrite(mmu, slot)) {
+			const uint8_t *s = mmu->slot_read[src >> MEM_SLOT_SHIFT] + (src & (MEM_PAGE_SIZE - 1));
+			uint8_t *d = mmu->slot_write[slot] + (dst & (MEM_PAGE_SIZE - 1));
+
+			// overlapping with the destination ahead of the source: byte by byte like LDIR
+			// (this is what makes the classic "copy to address+1" fill work)
+			if (d > s && d < s + len) {
+				for (uint32_t i = 0; i < len; i++)
+					d[i] = s[i];
+			}
+			else {
+				memmove(d, s, len);
+			}
+		}
+		src += len;
+		dst += len;
+		n -= len;
+	}
+}
+
+// fixed memory source, incrementing memory destination
+static void _fill_memory(zx_spectrum_t *zx, uint8_t value, uint16_t dst, uint32_t n) {
+	z80_mmu_t *mmu = &zx->mmu;
+
+	while (n) {
+		uint32_t len = n;
+		if (len > MEM_PAGE_SIZE - (dst & (MEM_PAGE_SIZE - 1)))
+			len = MEM_PAGE_SIZE - (dst & (MEM_PAGE_SIZE - 1));
+
+		if (zx->beam.b_display_line) {
+			for (uint32_t i = 0; i < len; i++)
+				spectrum_display_write(zx, (uint16_t)(dst + i));
+		}
+
+		int slot = dst >> MEM_SLOT_SHIFT;
+		if (mmu->slot_write[slot] || z80_mmu_FaultWrite(mmu, slot))
+			memset(mmu->slot_write[slot] + (dst & (MEM_PAGE_SIZE - 1)), value, len);
+		dst += len;
+		n -= len;
+	}
+}
+
+// anything involving ports or decrementing/fixed addresses
+static void _transfer_bytes(zx_spectrum_t *zx, zx_dma_port_t *src, zx_dma_port_t *dst, uint32_t n) {
+	for (uint32_t i = 0; i < n; i++) {
+		uint8_t v = src->b_io ? z80_io_Read(&zx->io, src->addr) : z80_mmu_GetByte(&zx->mmu, src->addr);
+		if (dst->b_io) {
+			z80_io_Write(&zx->io, dst->addr, v);
+		}
+		else {
+			if (zx->beam.b_display_line)
+				spectrum_display_write(zx, dst->addr);
+			z80_mmu_PutByte(&zx->mmu, v, dst->addr);
+		}
+		src->addr += src->step;
+		dst->addr += dst->step;
+	}
+}
+
+// transfer n bytes of the block, returns the bus cycles used
+static uint32_t _transfer(zx_dma_t *dma, uint32_t n) {
+	zx_spectrum_t *zx = &ZXSPECTRUM;
+	zx_dma_port_t *src = dma->b_a_to_b ? &dma->a : &dma->b;
+	zx_dma_port_t *dst = dma->b_a_to_b ? &dma->b : &dma->a;
+
+	if (n == 0)
+		return 0;
+
+	if (!src->b_io && !dst->b_io && dst->step == 1 && src->step != -1) {
+		if (src->step == 1)
+			_copy_memory(zx, src->addr, dst->addr, n);
+		else
+			_fill_memory(zx, z80_mmu_GetByte(&zx->mmu, src->addr), dst->addr, n);
+		src->addr += src->step * n;
+		dst->addr += n;
+	}
+	else {
+		_transfer_bytes(zx, src, dst, n);
+	}
+
+	dma->counter += n;
+	dma->status |= DMA_STATUS_TRANSFER;
+	return n * (dma->a.cycles + dma->b.cycles);
+}
+
+static void _load(zx_dma_t *dma) {
+	dma->a.addr = dma->a.start;
+	dma->b.addr = dma->b.start;
+	dma->counter = 0;
+}
+
+static void _end_of_block(zx_dma_t *dma) {
+	dma->status &= ~DMA_STATUS_NOT_EOB;
+	if (dma->b_auto_restart) {
+		_load(dma);
+		// a paced transfer just keeps going (looping samples), a continuous one would never return
+		if (dma->b_active)
+			return;
+	}
+	dma->b_enabled = false;
+	dma->b_active = false;
+}
+
+static bool _paced(const zx_dma_t *dma) {
+	return dma->mode != ZX_DMA_CONTINUOUS && dma->prescaler != 0;
+}
+
+static void _enable(zx_dma_t *dma) {
+	dma->b_enabled = true;
+	if (dma->counter >= dma->length)
+		return;
+
+	if (_paced(dma)) {
+		dma->b_active = true;
+		dma->next_tstate = spectrum_tstate();
+		return;
+	}
+
+	// the cpu is held while the whole block goes through (we are inside its OUT)
+	ZXSPECTRUM.cpu->cycles += _transfer(dma, dma->length - dma->counter);
+	_end_of_block(dma);
+}
+
+// Paced burst transfers: move the bytes that have become due by tstate
+// (called at the end of each scanline), the cpu loses the bus cycles used
+void zx_dma_run(zx_dma_t *dma, uint32_t tstate) {
+	const uint32_t period = 4 * dma->prescaler;
+	uint32_t cycles = 0;
+
+	while (dma->b_active && dma->next_tstate <= tstate) {
+		cycles += _transfer(dma, 1);
+		dma->next_tstate += period;
+		if (dma->counter >= dma->length)
+			_end_of_block(dma);
+	}
+	ZXSPECTRUM.frame_tstate += cycles;
+}
+
+void zx_dma_end_frame(zx_dma_t *dma, uint32_t frame_tstates) {
+	if (dma->b_active)
+		dma->next_tstate = dma->next_tstate > frame_tstates ? dma->next_tstate - frame_tstates : 0;
+}
+
+
+/**----------------------------------------------------------------------------
+ *	REGISTERS
+ */
+
+static void _reset(zx_dma_t *dma) {
+	dma->num_params = 0;
+	dma->b_enabled = false;
+	dma->b_active = false;
+	dma->b_auto_restart = false;
+	dma->a.cycles = DMA_DEFAULT_CYCLES;
+	dma->b.cycles = DMA_DEFAULT_CYCLES;
+	dma->prescaler = 0;
+	dma->status = DMA_STATUS_INITIAL;
+	dma->read_mask = 0x7F;
+	dma->read_pos = 0;
+}
+
+void zx_dma_init(zx_dma_t *dma) {
+	memset(dma, 0, sizeof(zx_dma_t));
+	dma->a.step = 1;
+	dma->b.step = 1;
+	dma->mode = ZX_DMA_CONTINUOUS;
+	_reset(dma);
+}
+
+static void _expect(zx_dma_t *dma, uint8_t param) {
+	if (dma->num_params < (int)sizeof(dma->params))
+		dma->params[dma->num_params++] = param;
+}
+
+// timing byte: bits 0-1 cycle length 00 = 4, 01 = 3, 10 = 2
+static uint8_t _cycles(uint8_t timing) {
+	static const uint8_t cycles[4] = { 4, 3, 2, 4 };
+	return cycles[timing & 3];
+}
+
+// WR1/WR2
+static void _write_port_config(zx_dma_t *dma, zx_dma_port_t *port, uint8_t value, uint8_t timing_param) {
+	port->b_io = (value & 0x08) != 0;
+	switch ((value >> 4) & 3) {
+	case 0:		port->step = -1; break;
+	case 1:		port->step = 1; break;
+	default:	port->step = 0; break;
+	}
+	if (value & 0x40)
+		_expect(dma, timing_param);
+}
+
+static void _write_param(zx_dma_t *dma, uint8_t value) {
+	uint8_t param = dma->params[0];
+	dma->num_params--;
+	memmove(dma->params, dma->params + 1, dma->num_params);
+
+	switch (param) {
+	case P_A_LO:		dma->a.start = (dma->a.start & 0xFF00) | value; break;
+	case P_A_HI:		dma->a.start = (dma->a.start & 0x00FF) | (value << 8); break;
+	case P_B_LO:		dma->b.start = (dma->b.start & 0xFF00) | value; break;
+	case P_B_HI:		dma->b.start = (dma->b.start & 0x00FF) | (value << 8); break;
+	case P_LEN_LO:		dma->length = (dma->length & 0xFF00) | value; break;
+	case P_LEN_HI:		dma->length = (dma->length & 0x00FF) | (value << 8); break;
+	case P_A_TIMING:	dma->a.cycles = _cycles(value); break;
+	case P_B_TIMING:
+		dma->b.cycles = _cycles(value);
+		if (value & 0x20)
+			_expect(dma, P_PRESCALER);
+		break;
+	case P_PRESCALER:	dma->prescaler = value; break;
+	case P_READ_MASK:	dma->read_mask = value & 0x7F; dma->read_pos = 0; break;
+	default:			break;
+	}
+}
+
+static void _write_command(zx_dma_t *dma, uint8_t value) {
+	switch (value) {
+	case 0xC3:	_reset(dma); break;									// reset
+	case 0xC7:	dma->a.cycles = DMA_DEFAULT_CYCLES; break;			// reset port A timing
+	case 0xCB:	dma->b.cycles = DMA_DEFAULT_CYCLES; break;			// reset port B timing
+	case 0xCF:	_load(dma); dma->status |= DMA_STATUS_NOT_EOB; break;	// load
+	case 0xD3:	dma->counter = 0; dma->status |= DMA_STATUS_NOT_EOB; break;	// continue
+	case 0x87:	_enable(dma); break;								// enable dma
+	case 0x83:	dma->b_enabled = false; dma->b_active = false; break;	// disable dma
+	case 0xBB:	_expect(dma, P_READ_MASK); break;					// read mask follows
+	case 0xBF:	dma->read_mask = 0x01; dma->read_pos = 0; break;	// read status byte
+	case 0x8B:	dma->status = DMA_STATUS_INITIAL; break;			// reinitialize status byte
+	case 0xA7:	dma->read_pos = 0; break;							// initialize read sequence
+	default:	break;
+	}
+}
+
+// port 0x6B write
+void zx_dma_write(zx_dma_t *dma, uint8_t value) {
+	if (dma->num_params) {
+		_write_param(dma, value);
+		return;
+	}
+
+	if (!(value & 0x80)) {
+		if (value & 0x03) {
+			// WR0
+			dma->b_a_to_b = (value & 0x04) != 0;
+			if (value & 0x08) _expect(dma, P_A_LO);
+			if (value & 0x10) _expect(dma, P_A_HI);
+			if (value & 0x20) _expect(dma, P_LEN_LO);
+			if (value & 0x40) _expect(dma, P_LEN_HI);
+		}
+		else if (value & 0x04) {
+			_write_port_config(dma, &dma->a, value, P_A_TIMING);	// WR1
+		}
+		else {
+			_write_port_config(dma, &dma->b, value, P_B_TIMING);	// WR2
+		}
+		return;
+	}
+
+	switch (value & 0x03) {
+	case 0:
+		// WR3
+		if (value & 0x08) _expect(dma, P_SKIP);
+		if (value & 0x10) _expect(dma, P_SKIP);
+		if (value & 0x40) _enable(dma);
+		break;
+	case 1:
+		// WR4
+		dma->mode = (zx_dma_mode_t)((value >> 5) & 3);
+		if (dma->mode > ZX_DMA_BURST)
+			dma->mode = ZX_DMA_CONTINUOUS;
+		if (value & 0x04) _expect(dma, P_B_LO);
+		if (value & 0x08) _expect(dma, P_B_HI);
+		if (value & 0x10) _expect(dma, P_SKIP);
+		break;
+	case 2:
+		// WR5
+		if ((value & 0xC7) == 0x82)
+			dma->b_auto_restart = (value & 0x20) != 0;
+		break;
+	default:
+		_write_command(dma, value);
+		break;
+	}
+}
+
+// port 0x6B read: the registers selected by the read mask in turn
+// status, counter lo/hi, port A lo/hi, port B lo/hi
+uint8_t zx_dma_read(zx_dma_t *dma) {
+	if (!dma->read_mask)
+		return 0xFF;
+
+	while (!(dma->read_mask & (1 << dma->read_pos)))
+		dma->read_pos = (dma->read_pos + 1) % 7;
+
+	int reg = dma->read_pos;
+	dma->read_pos = (dma->read_pos + 1) % 7;
+
+	switch (reg) {
+	case 0:		return dma->status;
+	case 1:		return dma->counter & 0xFF;
+	case 2:		return dma->counter >> 8;
+	case 3:		return dma->a.addr & 0xFF;
+	case 4:		return dma->a.addr >> 8;
+	case 5:		return dma->b.addr & 0xFF;
+	default:	return dma->b.addr >> 8;
+	}
+}
+
+
+// spectrum_dma.c
@@ -0,0 +1,66 @@
+#pragma once
+
+/**----------------------------------------------------------------------------
+ *	spectrum_dma.c
+ *  ZXX dma controller (zxnDMA style register set on port 0x6B):
+ *  memory to memory, memory to port and port to memory block transfers
+ **/
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DMA_STATUS_INITIAL	0x3A	// end of block not reached, nothing transferred
+#define DMA_STATUS_TRANSFER	0x01	// at least one byte transferred
+#define DMA_STATUS_NOT_EOB	0x20	// cleared at the end of the block
+
+typedef enum {
+	ZX_DMA_BYTE,			// behaves like burst
+	ZX_DMA_CONTINUOUS,		// the cpu is held until the block is done
+	ZX_DMA_BURST,			// with a prescaler the cpu runs between bytes
+} zx_dma_mode_t;
+
+typedef struct {
+	uint16_t start;			// as programmed
+	uint16_t addr;			// current address
+	int step;				// -1, 0 (fixed) or +1
+	bool b_io;				// port instead of memory
+	uint8_t cycles;			// T-states per access (2-4)
+} zx_dma_port_t;
+
+typedef struct {
+	// register writes: parameter bytes still expected after a base register byte
+	uint8_t params[8];
+	int num_params;
+
+	zx_dma_port_t a, b;
+	bool b_a_to_b;
+	uint16_t length;
+	uint16_t counter;			// bytes transferred so far
+	zx_dma_mode_t mode;
+	bool b_auto_restart;
+	uint8_t prescaler;			// 0: no pacing, else one byte every 4*prescaler T-states (burst mode)
+
+	bool b_enabled;
+	bool b_active;				// paced burst running, see zx_dma_run()
+	uint32_t next_tstate;		// frame T-state of the next paced byte
+
+	uint8_t status;
+	uint8_t read_mask;
+	int read_pos;
+} zx_dma_t;
+
+void zx_dma_init(zx_dma_t *dma);
+void zx_dma_write(zx_dma_t *dma, uint8_t value);
+uint8_t zx_dma_read(zx_dma_t *dma);
+void zx_dma_run(zx_dma_t *dma, uint32_t tstate);
+void zx_dma_end_frame(zx_dma_t *dma, uint32_t frame_tstates);
+
+#ifdef __cplusplus
+}
+#endif
+
+// spectrum_dma.h
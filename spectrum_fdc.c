@@ -0,0 +1,894 @@
+/**----------------------------------------------------------------------------
+ *	spectrum_fdc.c
+ *  +3 floppy disk controller: uPD765 with standard and extended DSK images
+ *
+ *	Disk images are read into memory and parsed once on insert into a track/sector index:
+ *	finding a sector is a walk over the few sectors of one track and sector data is
+ *	used in place. Images that have been written to get saved back on eject, in their own
+ *	format unless the tracks no longer fit a standard DSK (then as extended DSK).
+ *
+ *	Timing: in instant mode seeks complete at once and the bytes of a transfer are there as
+ *	fast as the cpu takes them. The accurate mode emulates the mechanics: step times, sectors
+ *	passing under the head in physical order (300 rpm), 32us per byte (250 kbit/s) and two
+ *	revolutions before a sector is given up on. Together with the EDSK status bytes and
+ *	weak sector copies (both modes) that is what copy protection schemes look at.
+ *
+ *	The +3 connects neither TC nor the interrupt: multi sector transfers always end at EOT
+ *	("end of cylinder") and the cpu polls the main status register.
+ *	Not implemented: the scan commands, data overrun.
+ **/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "spectrum.h"
+#include "spectrum_fdc.h"
+#include "text_box_l.h"
+
+#define FDC_BYTE_US			32		// 250 kbit/s MFM
+#define FDC_REVOLUTION_MS	200		// 300 rpm
+#define FDC_STEP_UNIT_MS	2		// step rate time unit with the 4MHz controller clock
+
+// status register 0
+#define ST0_IC		0x80	// invalid command
+#define ST0_AT		0x40	// abnormal termination
+#define ST0_SE		0x20	// seek end
+#define ST0_NR		0x08	// not ready
+// status register 1
+#define ST1_EN		0x80	// end of cylinder
+#define ST1_DE		0x20	// data error (crc)
+#define ST1_ND		0x04	// no data
+#define ST1_NW		0x02	// not writable
+#define ST1_MA		0x01	// missing address mark
+// status register 2
+#define ST2_CM		0x40	// control mark: deleted data
+#define ST2_MD		0x01	// missing data address mark
+// status register 3
+#define ST3_WP		0x40	// write protected
+#define ST3_RY		0x20	// ready
+#define ST3_T0		0x10	// track 0
+#define ST3_TS		0x08	// two sided
+
+// commands: the low 5 bits, the top bits are the MT, MF and SK flags
+#define CMD_READ_TRACK		0x02
+#define CMD_SPECIFY			0x03
+#define CMD_SENSE_DRIVE		0x04
+#define CMD_WRITE_DATA		0x05
+#define CMD_READ_DATA		0x06
+#define CMD_RECALIBRATE		0x07
+#define CMD_SENSE_INT		0x08
+#define CMD_WRITE_DELETED	0x09
+#define CMD_READ_ID			0x0A
+#define CMD_READ_DELETED	0x0C
+#define CMD_FORMAT			0x0D
+#define CMD_SEEK			0x0F
+#define CMD_MASK			0x1F
+#define CMD_MT				0x80	// multi track
+#define CMD_SK				0x20	// skip sectors with the other kind of data mark
+
+// command bytes per command (0: invalid)
+static const uint8_t COMMAND_SIZES[32] = {
+	[CMD_READ_TRACK] = 9, [CMD_SPECIFY] = 3, [CMD_SENSE_DRIVE] = 2, [CMD_WRITE_DATA] = 9,
+	[CMD_READ_DATA] = 9, [CMD_RECALIBRATE] = 2, [CMD_SENSE_INT] = 1, [CMD_WRITE_DELETED] = 9,
+	[CMD_READ_ID] = 2, [CMD_READ_DELETED] = 9, [CMD_FORMAT] = 6, [CMD_SEEK] = 3,
+};
+
+static const char DSK_STANDARD[] = "MV - CPCEMU Disk-File\r\nDisk-Info\r\n";
+static const char DSK_EXTENDED[] = "EXTENDED CPC DSK File\r\nDisk-Info\r\n";
+static const char DSK_TRACK[] = "Track-Info\r\n";
+
+static void _start_sector(zx_fdc_t *fdc, uint64_t now);
+
+
+/**----------------------------------------------------------------------------
+ *	DSK IMAGES
+ */
+
+static size_t _sector_bytes(uint8_t n) {
+	return n < 8 ? 128u << n : 0x8000;
+}
+
+static bool _parse_track(zx_dsk_track_t *track, uint8_t *header, size_t track_size, bool b_extended) {
+	uint8_t *data = header + 256;
+	uint8_t *end = header + track_size;
+	int num_sectors = header[0x15] < DSK_MAX_SECTORS ? header[0x15] : DSK_MAX_SECTORS;
+
+	track->gap3 = header[0x16];
+	track->filler = header[0x17];
+	track->sectors = (zx_dsk_sector_t *)calloc(num_sectors, sizeof(zx_dsk_sector_t));
+	if (num_sectors && !track->sectors)
+		return false;
+	track->num_sectors = num_sectors;
+
+	for (int i = 0; i < num_sectors; i++) {
+		const uint8_t *info = header + 0x18 + i * 8;
+		zx_dsk_sector_t *sector = &track->sectors[i];
+		sector->c = info[0];
+		sector->h = info[1];
+		sector->r = info[2];
+		sector->n = info[3];
+		sector->st1 = info[4];
+		sector->st2 = info[5];
+
+		// standard images: all sectors have the size given by the track header
+		size_t native = _sector_bytes(sector->n);
+		size_t length = b_extended ? (size_t)(info[6] | info[7] << 8) : _sector_bytes(header[0x14]);
+		if (data + length > end)
+			length = data < end ? (size_t)(end - data) : 0;
+
+		// extended images store the copies of a weak sector back to back
+		sector->copies = 1;
+		sector->size = (uint16_t)length;
+		if (b_extended && length > native && length % native == 0 && length / native < 256) {
+			sector->copies = (uint8_t)(length / native);
+			sector->size = (uint16_t)native;
+		}
+		sector->data = data;
+		data += length;
+	}
+	return true;
+}
+
+static bool _parse_image(zx_dsk_t *disk, size_t size) {
+	uint8_t *image = disk->image;
+
+	bool b_extended = size >= 256 && !memcmp(image, "EXTENDED", 8);
+	if (size < 256 || (!b_extended && memcmp(image, "MV - CPC", 8))
+		|| image[0x31] < 1 || image[0x31] > DSK_MAX_SIDES) {
+		ltb_printf("fdc: \"%s\" is not a DSK image\n", disk->path);
+		return false;
+	}
+	disk->b_extended = b_extended;
+
+	int num_sides = image[0x31];
+	disk->num_sides = num_sides;
+	disk->num_tracks = image[0x30] < DSK_MAX_TRACKS ? image[0x30] : DSK_MAX_TRACKS;
+
+	size_t offset = 256;
+	for (int t = 0; t < disk->num_tracks; t++) {
+		for (int s = 0; s < num_sides; s++) {
+			// extended: a size per track (unformatted tracks are not stored), standard: one size
+			size_t track_size = b_extended ? (size_t)image[0x34 + t * num_sides + s] * 256
+				: (size_t)(image[0x32] | image[0x33] << 8);
+			if (offset + track_size > size)
+				return true;
+			if (track_size >= 256 && !memcmp(image + offset, "Track-Info", 10)
+				&& !_parse_track(&disk->tracks[t][s], image + offset, track_size, b_extended)) {
+				ltb_printf("fdc: can't allocate track %d of \"%s\"\n", t, disk->path);
+				return false;
+			}
+			offset += track_size;
+		}
+	}
+	return true;
+}
+
+static void _free_disk(zx_dsk_t *disk) {
+	for (int t = 0; t < DSK_MAX_TRACKS; t++) {
+		for (int s = 0; s < DSK_MAX_SIDES; s++) {
+			free(disk->tracks[t][s].sectors);
+			free(disk->tracks[t][s].format_data);
+		}
+	}
+	free(disk->image);
+	memset(disk, 0, sizeof(zx_dsk_t));
+}
+
+// bytes of a track in an extended image: header plus data, in 256 byte units
+static size_t _track_size(const zx_dsk_track_t *track) {
+	if (track->num_sectors == 0)
+		return 0;
+	size_t size = 256;
+	for (int i = 0; i < track->num_sectors; i++)
+		size += (size_t)track->sectors[i].size * track->sectors[i].copies;
+	return (size + 255) & ~(size_t)255;
+}
+
+// A standard image has one size for all tracks and all sectors of a track have the size of
+// its header's N: the track size if the disk still fits that, 0 if it doesn't
+static size_t _standard_track_size(const zx_dsk_t *disk) {
+	size_t track_size = 0;
+	for (int t = 0; t < disk->num_tracks; t++) {
+		for (int s = 0; s < disk->num_sides; s++) {
+			const zx_dsk_track_t *track = &disk->tracks[t][s];
+			for (int i = 0; i < track->num_sectors; i++) {
+				const zx_dsk_sector_t *sector = &track->sectors[i];
+				if (sector->copies != 1 || sector->size != _sector_bytes(track->sectors[0].n))
+					return 0;
+			}
+			if (_track_size(track) > track_size)
+				track_size = _track_size(track);
+		}
+	}
+	return track_size <= 0xffff ? track_size : 0;
+}
+
+// track header and sector data, padded to track_size (an unformatted track: all padding)
+static bool _write_track(FILE *f, const zx_dsk_track_t *track, int t, int s, size_t track_size, bool b_extended) {
+	static const uint8_t padding[256] = { 0 };
+	uint8_t header[256] = { 0 };
+	size_t written = 0;
+
+	if (track->num_sectors > 0) {
+		memcpy(header, DSK_TRACK, sizeof(DSK_TRACK) - 1);
+		header[0x10] = (uint8_t)t;
+		header[0x11] = (uint8_t)s;
+		header[0x14] = track->sectors[0].n;
+		header[0x15] = (uint8_t)track->num_sectors;
+		header[0x16] = track->gap3;
+		header[0x17] = track->filler;
+		for (int i = 0; i < track->num_sectors; i++) {
+			const zx_dsk_sector_t *sector = &track->sectors[i];
+			uint8_t *info = header + 0x18 + i * 8;
+			size_t length = (size_t)sector->size * sector->copies;
+			info[0] = sector->c;
+			info[1] = sector->h;
+			info[2] = sector->r;
+			info[3] = sector->n;
+			info[4] = sector->st1;
+			info[5] = sector->st2;
+			if (b_extended) {
+				info[6] = (uint8_t)length;
+				info[7] = (uint8_t)(length >> 8);
+			}
+		}
+		if (fwrite(header, sizeof(header), 1, f) != 1)
+			return false;
+		written = sizeof(header);
+		for (int i = 0; i < track->num_sectors; i++) {
+			size_t length = (size_t)track->sectors[i].size * track->sectors[i].copies;
+			if (length && fwrite(track->sectors[i].data, length, 1, f) != 1)
+				return false;
+			written += length;
+		}
+	}
+	for (; written < track_size; written += sizeof(padding)) {
+		size_t length = track_size - written < sizeof(padding) ? track_size - written : sizeof(padding);
+		if (fwrite(padding, length, 1, f) != 1)
+			return false;
+	}
+	return true;
+}
+
+// Write the disk to <path>.tmp and only then replace the image with it: a failed save leaves
+// the original as it was
+static bool _save_image(const zx_dsk_t *disk) {
+	char tmp_path[DSK_MAX_PATH + 4];
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", disk->path);
+
+	size_t standard_size = disk->b_extended ? 0 : _standard_track_size(disk);
+	bool b_extended = standard_size == 0;
+	if (b_extended && !disk->b_extended)
+		ltb_printf("fdc: \"%s\" no longer fits a standard DSK: saved as extended DSK\n", disk->path);
+
+	FILE *f = fopen(tmp_path, "wb");
+	if (!f)
+		return false;
+
+	uint8_t header[256] = { 0 };
+	if (b_extended) {
+		memcpy(header, DSK_EXTENDED, sizeof(DSK_EXTENDED) - 1);
+		for (int t = 0; t < disk->num_tracks; t++)
+			for (int s = 0; s < disk->num_sides; s++)
+				header[0x34 + t * disk->num_sides + s] = (uint8_t)(_track_size(&disk->tracks[t][s]) / 256);
+	}
+	else {
+		memcpy(header, DSK_STANDARD, sizeof(DSK_STANDARD) - 1);
+		header[0x32] = (uint8_t)standard_size;
+		header[0x33] = (uint8_t)(standard_size >> 8);
+	}
+	memcpy(header + 0x22, "SpectrumGS", 10);
+	header[0x30] = (uint8_t)disk->num_tracks;
+	header[0x31] = (uint8_t)disk->num_sides;
+	bool b_ok = fwrite(header, sizeof(header), 1, f) == 1;
+
+	for (int t = 0; t < disk->num_tracks && b_ok; t++) {
+		for (int s = 0; s < disk->num_sides && b_ok; s++) {
+			const zx_dsk_track_t *track = &disk->tracks[t][s];
+			b_ok = _write_track(f, track, t, s, b_extended ? _track_size(track) : standard_size, b_extended);
+		}
+	}
+
+	b_ok &= fclose(f) == 0;
+	if (!b_ok || rename(tmp_path, disk->path) != 0) {
+		remove(tmp_path);
+		return false;
+	}
+	return true;
+}
+
+
+/**----------------------------------------------------------------------------
+ *	DRIVE MECHANICS
+ */
+
+static uint64_t _ms(uint32_t ms) {
+	return (uint64_t)ZXSPECTRUM.timing.cpu_clock * ms / 1000;
+}
+
+static uint64_t _byte_time() {
+	return (uint64_t)ZXSPECTRUM.timing.cpu_clock * FDC_BYTE_US / 1000000;
+}
+
+static bool _ready(zx_fdc_t *fdc, int unit) {
+	return fdc->b_motor && fdc->drives[unit].disk.b_inserted;
+}
+
+// the track under the head of the current command's drive and side (NULL: beyond the image)
+static zx_dsk_track_t *_track(zx_fdc_t *fdc) {
+	zx_fdc_drive_t *drive = &fdc->drives[fdc->unit];
+	if (drive->track >= drive->disk.num_tracks || fdc->side >= drive->disk.num_sides)
+		return NULL;
+	return &drive->disk.tracks[drive->track][fdc->side];
+}
+
+// physical index of the next sector to pass under the head
+// accurate mode: the sectors of a track are evenly spaced over a revolution
+static int _next_sector(zx_fdc_t *fdc, const zx_dsk_track_t *track, uint64_t now) {
+	if (fdc->b_instant)
+		return fdc->drives[fdc->unit].next_sector % track->num_sectors;
+	uint64_t rev = _ms(FDC_REVOLUTION_MS);
+	return (int)(((now % rev) * track->num_sectors + rev - 1) / rev) % track->num_sectors;
+}
+
+// time the sector with physical index index arrives under the head
+static uint64_t _sector_arrives(zx_fdc_t *fdc, const zx_dsk_track_t *track, int index, uint64_t now) {
+	if (fdc->b_instant)
+		return now;
+	uint64_t rev = _ms(FDC_REVOLUTION_MS);
+	uint64_t angle = now % rev;
+	uint64_t at = rev * index / track->num_sectors;
+	return now + (at >= angle ? at - angle : at + rev - angle);
+}
+
+// time the controller gives up looking for a sector: after two index holes
+static uint64_t _give_up(zx_fdc_t *fdc, uint64_t now) {
+	return fdc->b_instant ? now : now + 2 * _ms(FDC_REVOLUTION_MS);
+}
+
+static void _seek(zx_fdc_t *fdc, int unit, int track, uint64_t now) {
+	zx_fdc_drive_t *drive = &fdc->drives[unit];
+	if (track >= DSK_MAX_TRACKS)
+		track = DSK_MAX_TRACKS - 1;
+	int steps = abs(track - drive->track);
+
+	drive->track = track;
+	drive->b_seeking = true;
+	drive->seek_st0 = ST0_SE | unit | (_ready(fdc, unit) ? 0 : ST0_AT | ST0_NR);
+	drive->seek_done = fdc->b_instant ? now : now + steps * _ms((16 - fdc->step_rate) * FDC_STEP_UNIT_MS);
+}
+
+
+/**----------------------------------------------------------------------------
+ *	COMMANDS
+ */
+
+static void _result(zx_fdc_t *fdc, const uint8_t *bytes, int len, uint64_t when) {
+	memcpy(fdc->result, bytes, len);
+	fdc->result_len = len;
+	fdc->result_pos = 0;
+	fdc->ready_time = when;
+	fdc->phase = FDC_RESULT;
+}
+
+// end of a read/write/format/read id command: status and the current sector id
+static void _finish(zx_fdc_t *fdc, uint64_t when) {
+	uint8_t result[7] = { fdc->st0 | (fdc->side << 2) | fdc->unit, fdc->st1, fdc->st2,
+		fdc->id[0], fdc->id[1], fdc->id[2], fdc->id[3] };
+	_result(fdc, result, 7, when);
+}
+
+static bool _is_read(uint8_t command) {
+	command &= CMD_MASK;
+	return command == CMD_READ_DATA || command == CMD_READ_DELETED || command == CMD_READ_TRACK;
+}
+
+// a sector has been transferred: on to the next one, up to EOT
+static void _sector_done(zx_fdc_t *fdc, uint64_t now) {
+	uint8_t command = fdc->command[0];
+	zx_dsk_t *disk = &fdc->drives[fdc->unit].disk;
+
+	if ((command & CMD_MASK) == CMD_READ_TRACK) {
+		if (++fdc->track_count < fdc->command[6]) {
+			fdc->id[2]++;
+			_start_sector(fdc, now);
+			return;
+		}
+	}
+	else if (fdc->st1 || (fdc->st2 & ~ST2_CM)) {
+		// data errors end the command after the sector
+		fdc->st0 |= ST0_AT;
+		_finish(fdc, now);
+		return;
+	}
+	else if (fdc->st2 & ST2_CM) {
+		// read the other kind of data mark without SK: normal end after the sector
+		_finish(fdc, now);
+		return;
+	}
+	else if (fdc->id[2] != fdc->command[6]) {
+		fdc->id[2]++;
+		_start_sector(fdc, now);
+		return;
+	}
+	else if ((command & CMD_MT) && fdc->side == 0 && disk->num_sides == DSK_MAX_SIDES) {
+		// multi track: EOT on side 0 continues with the first sector of side 1
+		fdc->side = 1;
+		fdc->id[1] ^= 1;
+		fdc->id[2] = 1;
+		_start_sector(fdc, now);
+		return;
+	}
+
+	// no TC on the +3: transfers always run into the end of the cylinder
+	fdc->st0 |= ST0_AT;
+	fdc->st1 |= ST1_EN;
+	fdc->id[0]++;
+	fdc->id[2] = 1;
+	_finish(fdc, now);
+}
+
+static void _transfer_sector(zx_fdc_t *fdc, zx_dsk_track_t *track, int index, uint64_t now) {
+	zx_dsk_sector_t *sector = &track->sectors[index];
+	uint8_t command = fdc->command[0] & CMD_MASK;
+	uint64_t when = _sector_arrives(fdc, track, index, now);
+
+	fdc->drives[fdc->unit].next_sector = index + 1;
+
+	if (sector->st2 & ST2_MD) {
+		// id field without a data field
+		fdc->st0 |= ST0_AT;
+		fdc->st1 |= ST1_MA;
+		fdc->st2 |= ST2_MD;
+		_finish(fdc, when);
+		return;
+	}
+
+	if (command == CMD_READ_DATA || command == CMD_READ_DELETED) {
+		bool b_deleted = (sector->st2 & ST2_CM) != 0;
+		if (b_deleted != (command == CMD_READ_DELETED)) {
+			// the other kind of data mark: skipped with SK, otherwise the last sector read
+			if (fdc->command[0] & CMD_SK) {
+				_sector_done(fdc, when + sector->size * _byte_time());
+				return;
+			}
+			fdc->st2 |= ST2_CM;
+		}
+		// errors recorded with the sector (crc errors of protected disks)
+		fdc->st1 |= sector->st1 & ~ST1_EN;
+		fdc->st2 |= sector->st2 & ~(ST2_CM | ST2_MD);
+	}
+
+	fdc->sector = sector;
+	fdc->filler = track->filler;
+	fdc->data = sector->data + (size_t)sector->size * sector->next_copy;
+	if (_is_read(command)) {
+		// weak sectors: every read gets the next copy
+		sector->next_copy = (uint8_t)((sector->next_copy + 1) % sector->copies);
+	}
+	else {
+		// written sectors are good sectors from now on
+		fdc->data = sector->data;
+		sector->copies = 1;
+		sector->next_copy = 0;
+		sector->st1 = 0;
+		sector->st2 = (command == CMD_WRITE_DELETED) ? ST2_CM : 0;
+		fdc->drives[fdc->unit].disk.b_dirty = true;
+	}
+
+	// N = 0: DTL gives the length
+	fdc->xfer_len = fdc->id[3] ? (int)_sector_bytes(fdc->id[3]) : fdc->command[8];
+	fdc->xfer_pos = 0;
+	fdc->ready_time = when;
+	fdc->phase = _is_read(command) ? FDC_EXECUTION_READ : FDC_EXECUTION_WRITE;
+}
+
+// find the sector with the current id on the track and start transferring it
+static void _start_sector(zx_fdc_t *fdc, uint64_t now) {
+	zx_dsk_track_t *track = _track(fdc);
+
+	if (!track || track->num_sectors == 0) {
+		fdc->st0 |= ST0_AT;
+		fdc->st1 |= ST1_MA;
+		_finish(fdc, _give_up(fdc, now));
+		return;
+	}
+
+	// READ TRACK: every sector in physical order from the index hole
+	if ((fdc->command[0] & CMD_MASK) == CMD_READ_TRACK) {
+		if (fdc->track_index >= track->num_sectors) {
+			fdc->st0 |= ST0_AT;
+			fdc->st1 |= ST1_EN;
+			_finish(fdc, now);
+			return;
+		}
+		const zx_dsk_sector_t *sector = &track->sectors[fdc->track_index];
+		if (sector->c != fdc->id[0] || sector->h != fdc->id[1] || sector->r != fdc->id[2] || sector->n != fdc->id[3])
+			fdc->st1 |= ST1_ND;
+		_transfer_sector(fdc, track, fdc->track_index++, now);
+		return;
+	}
+
+	int first = _next_sector(fdc, track, now);
+	for (int i = 0; i < track->num_sectors; i++) {
+		int index = (first + i) % track->num_sectors;
+		const zx_dsk_sector_t *sector = &track->sectors[index];
+		if (sector->c == fdc->id[0] && sector->h == fdc->id[1] && sector->r == fdc->id[2] && sector->n == fdc->id[3]) {
+			_transfer_sector(fdc, track, index, now);
+			return;
+		}
+	}
+
+	fdc->st0 |= ST0_AT;
+	fdc->st1 |= ST1_ND;
+	_finish(fdc, _give_up(fdc, now));
+}
+
+static void _read_write(zx_fdc_t *fdc, uint64_t now) {
+	uint8_t command = fdc->command[0] & CMD_MASK;
+
+	memcpy(fdc->id, fdc->command + 2, 4);
+	if (!_ready(fdc, fdc->unit)) {
+		fdc->st0 = ST0_AT | ST0_NR;
+		_finish(fdc, now);
+		return;
+	}
+	if (!_is_read(command) && fdc->drives[fdc->unit].disk.b_write_protected) {
+		fdc->st0 = ST0_AT;
+		fdc->st1 = ST1_NW;
+		_finish(fdc, now);
+		return;
+	}
+
+	fdc->track_index = 0;
+	fdc->track_count = 0;
+	_start_sector(fdc, now);
+}
+
+static void _read_id(zx_fdc_t *fdc, uint64_t now) {
+	zx_dsk_track_t *track = _track(fdc);
+
+	if (!_ready(fdc, fdc->unit)) {
+		fdc->st0 = ST0_AT | ST0_NR;
+		_finish(fdc, now);
+		return;
+	}
+	if (!track || track->num_sectors == 0) {
+		fdc->st0 = ST0_AT;
+		fdc->st1 = ST1_MA;
+		_finish(fdc, _give_up(fdc, now));
+		return;
+	}
+
+	int index = _next_sector(fdc, track, now);
+	const zx_dsk_sector_t *sector = &track->sectors[index];
+	fdc->drives[fdc->unit].next_sector = index + 1;
+	fdc->id[0] = sector->c;
+	fdc->id[1] = sector->h;
+	fdc->id[2] = sector->r;
+	fdc->id[3] = sector->n;
+	_finish(fdc, _sector_arrives(fdc, track, index, now));
+}
+
+static void _format(zx_fdc_t *fdc, uint64_t now) {
+	int num_sectors = fdc->command[3];
+
+	memset(fdc->id, 0, sizeof(fdc->id));
+	fdc->id[3] = fdc->command[2];
+	if (!_ready(fdc, fdc->unit)) {
+		fdc->st0 = ST0_AT | ST0_NR;
+		_finish(fdc, now);
+		return;
+	}
+	if (fdc->drives[fdc->unit].disk.b_write_protected) {
+		fdc->st0 = ST0_AT;
+		fdc->st1 = ST1_NW;
+		_finish(fdc, now);
+		return;
+	}
+	if (num_sectors > DSK_MAX_SECTORS)
+		num_sectors = DSK_MAX_SECTORS;
+
+	// the sector ids come in during the execution phase, starting at the index hole
+	fdc->xfer_pos = 0;
+	fdc->xfer_len = num_sectors * 4;
+	fdc->ready_time = fdc->b_instant ? now : now + _ms(FDC_REVOLUTION_MS) - now % _ms(FDC_REVOLUTION_MS);
+	fdc->phase = FDC_EXECUTION_FORMAT;
+	if (num_sectors == 0)
+		_finish(fdc, fdc->ready_time);
+}
+
+// all sector ids received: replace the track
+static void _format_track(zx_fdc_t *fdc, uint64_t now) {
+	zx_fdc_drive_t *drive = &fdc->drives[fdc->unit];
+	zx_dsk_t *disk = &drive->disk;
+	zx_dsk_track_t *track = &disk->tracks[drive->track][fdc->side];
+	int num_sectors = fdc->xfer_len / 4;
+	size_t bytes = _sector_bytes(fdc->command[2]);
+
+	// no memory for the new track: the old one stays, the command fails as if not writable
+	uint8_t *format_data = (uint8_t *)malloc(bytes * num_sectors);
+	zx_dsk_sector_t *sectors = (zx_dsk_sector_t *)calloc(num_sectors, sizeof(zx_dsk_sector_t));
+	if (!format_data || !sectors) {
+		ltb_printf("fdc: can't allocate a formatted track\n");
+		free(format_data);
+		free(sectors);
+		fdc->st0 = ST0_AT;
+		fdc->st1 = ST1_NW;
+		_finish(fdc, now);
+		return;
+	}
+	memset(format_data, fdc->command[5], bytes * num_sectors);
+
+	free(track->sectors);
+	free(track->format_data);
+	track->format_data = format_data;
+	track->sectors = sectors;
+	track->num_sectors = num_sectors;
+	track->gap3 = fdc->command[4];
+	track->filler = fdc->command[5];
+
+	for (int i = 0; i < num_sectors; i++) {
+		zx_dsk_sector_t *sector = &track->sectors[i];
+		sector->c = fdc->format_ids[i * 4];
+		sector->h = fdc->format_ids[i * 4 + 1];
+		sector->r = fdc->format_ids[i * 4 + 2];
+		sector->n = fdc->format_ids[i * 4 + 3];
+		sector->size = (uint16_t)bytes;
+		sector->copies = 1;
+		sector->data = track->format_data + i * bytes;
+	}
+
+	if (drive->track >= disk->num_tracks)
+		disk->num_tracks = drive->track + 1;
+	if (fdc->side >= disk->num_sides)
+		disk->num_sides = fdc->side + 1;
+	disk->b_dirty = true;
+
+	// done at the next index hole
+	_finish(fdc, fdc->b_instant ? now : fdc->ready_time + _ms(FDC_REVOLUTION_MS));
+}
+
+static void _sense_interrupt(zx_fdc_t *fdc, uint64_t now) {
+	for (int unit = 0; unit < FDC_MAX_DRIVES; unit++) {
+		zx_fdc_drive_t *drive = &fdc->drives[unit];
+		if (drive->b_seeking && now >= drive->seek_done) {
+			drive->b_seeking = false;
+			_result(fdc, (uint8_t[]){ drive->seek_st0, (uint8_t)drive->track }, 2, now);
+			return;
+		}
+	}
+	// nothing pending
+	_result(fdc, (uint8_t[]){ ST0_IC }, 1, now);
+}
+
+static void _sense_drive(zx_fdc_t *fdc, uint64_t now) {
+	const zx_fdc_drive_t *drive = &fdc->drives[fdc->unit];
+	uint8_t st3 = (fdc->side << 2) | fdc->unit;
+
+	if (drive->track == 0)
+		st3 |= ST3_T0;
+	if (_ready(fdc, fdc->unit))
+		st3 |= ST3_RY;
+	if (drive->disk.b_write_protected)
+		st3 |= ST3_WP;
+	if (drive->disk.num_sides == DSK_MAX_SIDES)
+		st3 |= ST3_TS;
+	_result(fdc, &st3, 1, now);
+}
+
+static void _execute(zx_fdc_t *fdc, uint64_t now) {
+	fdc->unit = fdc->command[1] & 1;			// the +3 only decodes US0
+	fdc->side = (fdc->command[1] >> 2) & 1;
+	fdc->st0 = fdc->st1 = fdc->st2 = 0;
+	fdc->phase = FDC_COMMAND;
+
+	switch (fdc->command[0] & CMD_MASK) {
+	case CMD_SPECIFY:
+		fdc->step_rate = fdc->command[1] >> 4;
+		break;
+	case CMD_SENSE_DRIVE:
+		_sense_drive(fdc, now);
+		break;
+	case CMD_RECALIBRATE:
+		_seek(fdc, fdc->unit, 0, now);
+		break;
+	case CMD_SEEK:
+		_seek(fdc, fdc->unit, fdc->command[2], now);
+		break;
+	case CMD_SENSE_INT:
+		_sense_interrupt(fdc, now);
+		break;
+	case CMD_READ_ID:
+		_read_id(fdc, now);
+		break;
+	case CMD_FORMAT:
+		_format(fdc, now);
+		break;
+	default:
+		_read_write(fdc, now);
+		break;
+	}
+}
+
+
+/**----------------------------------------------------------------------------
+ *	PORTS
+ */
+
+// accurate mode: a byte of the execution phase every FDC_BYTE_US
+static bool _byte_ready(zx_fdc_t *fdc, uint64_t now) {
+	return fdc->b_instant || now >= fdc->ready_time + fdc->xfer_pos * _byte_time();
+}
+
+// the end of the sector's data passing under the head
+static uint64_t _transfer_end(zx_fdc_t *fdc, uint64_t now) {
+	uint64_t end = fdc->ready_time + fdc->xfer_len * _byte_time();
+	return (fdc->b_instant || now > end) ? now : end;
+}
+
+uint8_t zx_fdc_read_status(zx_fdc_t *fdc, uint32_t tstate) {
+	uint64_t now = fdc->frame_base + tstate;
+	uint8_t msr = 0;
+
+	for (int unit = 0; unit < FDC_MAX_DRIVES; unit++)
+		if (fdc->drives[unit].b_seeking)
+			msr |= 1 << unit;
+
+	switch (fdc->phase) {
+	case FDC_COMMAND:
+		msr |= FDC_MSR_RQM | (fdc->command_len ? FDC_MSR_CB : 0);
+		break;
+	case FDC_EXECUTION_READ:
+		msr |= FDC_MSR_EXM | FDC_MSR_CB | FDC_MSR_DIO | (_byte_ready(fdc, now) ? FDC_MSR_RQM : 0);
+		break;
+	case FDC_EXECUTION_WRITE:
+	case FDC_EXECUTION_FORMAT:
+		msr |= FDC_MSR_EXM | FDC_MSR_CB | (_byte_ready(fdc, now) ? FDC_MSR_RQM : 0);
+		break;
+	case FDC_RESULT:
+		msr |= FDC_MSR_CB | FDC_MSR_DIO | (now >= fdc->ready_time ? FDC_MSR_RQM : 0);
+		break;
+	}
+	return msr;
+}
+
+// (the cpu is expected to poll RQM: bytes taken early are handed out all the same)
+uint8_t zx_fdc_read_data(zx_fdc_t *fdc, uint32_t tstate) {
+	uint64_t now = fdc->frame_base + tstate;
+	uint8_t value = 0xFF;
+
+	switch (fdc->phase) {
+	case FDC_EXECUTION_READ:
+		// short sectors (N larger than the data recorded) read the gap filler beyond the data
+		value = fdc->xfer_pos < fdc->sector->size ? fdc->data[fdc->xfer_pos] : fdc->filler;
+		if (++fdc->xfer_pos == fdc->xfer_len)
+			_sector_done(fdc, _transfer_end(fdc, now));
+		break;
+	case FDC_RESULT:
+		value = fdc->result[fdc->result_pos++];
+		if (fdc->result_pos == fdc->result_len)
+			fdc->phase = FDC_COMMAND;
+		break;
+	default:
+		break;
+	}
+	return value;
+}
+
+void zx_fdc_write_data(zx_fdc_t *fdc, uint32_t tstate, uint8_t value) {
+	uint64_t now = fdc->frame_base + tstate;
+
+	switch (fdc->phase) {
+	case FDC_COMMAND:
+		if (fdc->command_len == 0) {
+			fdc->command_size = COMMAND_SIZES[value & CMD_MASK];
+			if (fdc->command_size == 0) {
+				_result(fdc, (uint8_t[]){ ST0_IC }, 1, now);
+				break;
+			}
+		}
+		fdc->command[fdc->command_len++] = value;
+		if (fdc->command_len == fdc->command_size) {
+			fdc->command_len = 0;
+			_execute(fdc, now);
+		}
+		break;
+	case FDC_EXECUTION_WRITE:
+		if (fdc->xfer_pos < fdc->sector->size)
+			fdc->data[fdc->xfer_pos] = value;
+		if (++fdc->xfer_pos == fdc->xfer_len)
+			_sector_done(fdc, _transfer_end(fdc, now));
+		break;
+	case FDC_EXECUTION_FORMAT:
+		fdc->format_ids[fdc->xfer_pos++] = value;
+		if (fdc->xfer_pos == fdc->xfer_len)
+			_format_track(fdc, now);
+		break;
+	default:
+		break;
+	}
+}
+
+void zx_fdc_motor(zx_fdc_t *fdc, bool b_on) {
+	fdc->b_motor = b_on;
+}
+
+void zx_fdc_end_frame(zx_fdc_t *fdc, uint32_t frame_tstates) {
+	fdc->frame_base += frame_tstates;
+}
+
+
+/**----------------------------------------------------------------------------
+ *	DISKS
+ */
+
+bool zx_fdc_insert(zx_fdc_t *fdc, int unit, const char *dsk_file) {
+	zx_dsk_t *disk = &fdc->drives[unit].disk;
+
+	zx_fdc_eject(fdc, unit);
+
+	FILE *f = fopen(dsk_file, "rb");
+	if (!f) {
+		ltb_printf("fdc: can't open \"%s\"\n", dsk_file);
+		return false;
+	}
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	disk->image = (uint8_t *)malloc(size > 0 ? size : 1);
+	if (!disk->image) {
+		ltb_printf("fdc: can't allocate %ld bytes for \"%s\"\n", size, dsk_file);
+		fclose(f);
+		return false;
+	}
+	bool b_read = size > 0 && fread(disk->image, size, 1, f) == 1;
+	fclose(f);
+
+	snprintf(disk->path, sizeof(disk->path), "%s", dsk_file);
+	if (!b_read) {
+		ltb_printf("fdc: can't read \"%s\"\n", dsk_file);
+		_free_disk(disk);
+		return false;
+	}
+	if (!_parse_image(disk, (size_t)size)) {
+		_free_disk(disk);
+		return false;
+	}
+
+	disk->b_write_protected = access(dsk_file, W_OK) != 0;
+	disk->b_inserted = true;
+	ltb_printf("fdc: %c: \"%s\" %d tracks, %d side(s)%s\n", 'A' + unit, dsk_file,
+		disk->num_tracks, disk->num_sides, disk->b_write_protected ? ", write protected" : "");
+	return true;
+}
+
+// written disks are saved back on eject
+void zx_fdc_eject(zx_fdc_t *fdc, int unit) {
+	zx_dsk_t *disk = &fdc->drives[unit].disk;
+
+	if (!disk->b_inserted)
+		return;
+	if (disk->b_dirty && !_save_image(disk))
+		ltb_printf("fdc: can't save \"%s\"\n", disk->path);
+	_free_disk(disk);
+}
+
+// controller reset: the disks stay in the drives, the heads where they are
+void zx_fdc_reset(zx_fdc_t *fdc) {
+	fdc->phase = FDC_COMMAND;
+	fdc->command_len = 0;
+	fdc->b_motor = false;
+	fdc->step_rate = 0;
+	for (int unit = 0; unit < FDC_MAX_DRIVES; unit++)
+		fdc->drives[unit].b_seeking = false;
+}
+
+void zx_fdc_init(zx_fdc_t *fdc) {
+	memset(fdc, 0, sizeof(zx_fdc_t));
+	fdc->phase = FDC_COMMAND;
+}
+
+// spectrum_fdc.c
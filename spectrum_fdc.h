@@ -0,0 +1,118 @@
+#pragma once
+
+/**----------------------------------------------------------------------------
+ *	spectrum_fdc.c
+ *  +3 floppy disk controller: uPD765 with standard and extended DSK images
+ *  ports 0x2FFD (main status), 0x3FFD (data), the motor is bit 3 of 0x1FFD
+ **/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FDC_MAX_DRIVES		2			// +3 internal drive and the external drive B
+#define DSK_MAX_TRACKS		84
+#define DSK_MAX_SIDES		2
+#define DSK_MAX_SECTORS		29			// sector infos that fit into a DSK track header
+#define DSK_MAX_PATH		256
+
+// main status register
+#define FDC_MSR_RQM			0x80		// data register ready
+#define FDC_MSR_DIO			0x40		// direction: fdc to cpu
+#define FDC_MSR_EXM			0x20		// execution phase (non dma)
+#define FDC_MSR_CB			0x10		// command in progress
+
+// a sector of the in-memory index: data points into the image (or a formatted track)
+typedef struct {
+	uint8_t c, h, r, n;			// id field
+	uint8_t st1, st2;			// fdc status stored with the sector: crc errors, deleted data, ...
+	uint16_t size;				// bytes of data (per copy)
+	uint8_t copies;				// weak sectors: several copies, each read returns the next one
+	uint8_t next_copy;
+	uint8_t *data;
+} zx_dsk_sector_t;
+
+typedef struct {
+	int num_sectors;			// 0: unformatted
+	zx_dsk_sector_t *sectors;	// in physical order
+	uint8_t gap3, filler;
+	uint8_t *format_data;		// data of a track formatted by the emulated machine
+} zx_dsk_track_t;
+
+// a disk image: parsed once on insert into the track/sector index
+typedef struct {
+	bool b_inserted;
+	bool b_write_protected;
+	bool b_dirty;				// written to: saved back on eject
+	bool b_extended;			// the image is an extended DSK (standard otherwise)
+	char path[DSK_MAX_PATH];
+	int num_tracks, num_sides;
+	zx_dsk_track_t tracks[DSK_MAX_TRACKS][DSK_MAX_SIDES];
+	uint8_t *image;				// file contents
+} zx_dsk_t;
+
+typedef struct {
+	zx_dsk_t disk;
+	int track;					// cylinder the head is on
+	bool b_seeking;				// seek/recalibrate issued, no sense interrupt status yet
+	uint8_t seek_st0;
+	uint64_t seek_done;			// time the head arrives (accurate mode)
+	int next_sector;			// instant mode: physical index of the next sector under the head
+} zx_fdc_drive_t;
+
+typedef enum {
+	FDC_COMMAND,
+	FDC_EXECUTION_READ,			// data from the fdc
+	FDC_EXECUTION_WRITE,		// data to the fdc
+	FDC_EXECUTION_FORMAT,		// sector ids to the fdc
+	FDC_RESULT,
+} zx_fdc_phase_t;
+
+typedef struct {
+	zx_fdc_drive_t drives[FDC_MAX_DRIVES];
+	bool b_instant;				// seeks and transfers complete at once (no mechanical timing)
+	bool b_motor;
+	uint8_t step_rate;			// SPECIFY: step rate time
+	uint64_t frame_base;		// time of the current frame's first T-state
+
+	zx_fdc_phase_t phase;
+	uint8_t command[9];
+	int command_len;
+	int command_size;
+	uint8_t result[7];
+	int result_len;
+	int result_pos;
+
+	// execution phase of the read/write/format commands
+	int unit, side;
+	uint8_t id[4];				// c, h, r, n of the current sector
+	uint8_t st0, st1, st2;
+	zx_dsk_sector_t *sector;
+	uint8_t *data;				// copy of the sector being transferred
+	uint8_t filler;				// read beyond the recorded data of short sectors
+	int xfer_pos, xfer_len;
+	int track_index;			// READ TRACK: physical sector index, count of sectors read
+	int track_count;
+	uint64_t ready_time;		// first byte of the transfer / result phase available (accurate mode)
+	uint8_t format_ids[DSK_MAX_SECTORS * 4];
+} zx_fdc_t;
+
+void zx_fdc_init(zx_fdc_t *fdc);
+void zx_fdc_reset(zx_fdc_t *fdc);
+bool zx_fdc_insert(zx_fdc_t *fdc, int unit, const char *dsk_file);
+void zx_fdc_eject(zx_fdc_t *fdc, int unit);
+void zx_fdc_motor(zx_fdc_t *fdc, bool b_on);
+uint8_t zx_fdc_read_status(zx_fdc_t *fdc, uint32_t tstate);
+uint8_t zx_fdc_read_data(zx_fdc_t *fdc, uint32_t tstate);
+void zx_fdc_write_data(zx_fdc_t *fdc, uint32_t tstate, uint8_t value);
+void zx_fdc_end_frame(zx_fdc_t *fdc, uint32_t frame_tstates);
+
+#ifdef __cplusplus
+}
+#endif
+
+// spectrum_fdc.h
@@ -0,0 +1,403 @@
+/**----------------------------------------------------------------------------
+ *	spectrum_if1.c
+ *  Interface 1 with microdrives on MDR cartridge images
+ *
+ *	Memory: the 8k rom lives in IF1_ROM_PAGE and, while paged in, shows at 0x0000 and
+ *	(mirrored) at 0x2000. It pages in on the fetch of 0x0008 (error restart) or 0x1708
+ *	(CLOSE#) from the 48k basic rom: these are paging traps, so the opcode at the trap address
+ *	already comes from the interface 1 rom. It pages out after the fetch of 0x0700.
+ *
+ *	Microdrives: the cartridge images are mmap()'d. A cartridge is a loop of blocks, the header
+ *	(15 bytes) and the record (528 bytes) of each sector, and the head position is a block
+ *	number: the block under the head is at a computed offset into the mapping.
+ *	At real speed the tape keeps moving while the motor runs. Blocks that went past while the
+ *	cpu was busy elsewhere are skipped arithmetically (no stepping round the loop), and the
+ *	WAIT line holds the cpu to the tape byte rate. In fast mode the tape only moves when the
+ *	cpu transfers data, and bytes come straight out of the mapping.
+ *	The gap/sync status follows a fixed poll pattern in both modes.
+ *	Not implemented: rs232 and network.
+ **/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "spectrum.h"
+#include "spectrum_if1.h"
+#include "text_box_l.h"
+
+#define MDR_BYTE_US			80		// ~100 kbit/s
+#define MDR_BLOCK_GAP		60		// gap and preamble ahead of every block, in byte times
+#define MDR_PREAMBLE		12		// written ahead of every block: 10 zeros, 2 0xFF
+#define MDR_STATUS_POLLS	15		// status reads per phase of the gap/sync pattern
+
+// 0xEF control
+#define IF1_COMMS_DATA		0x01	// drive select shift register data (active low)
+#define IF1_COMMS_CLK		0x02
+#define IF1_READ			0x04	// 0: write
+// 0xEF status
+#define IF1_WRITE_PROTECT	0x01	// low: cartridge write protected
+#define IF1_SYNC			0x02
+#define IF1_GAP				0x04
+#define IF1_BUSY			0x10	// network
+
+// basic rom addresses that page the interface 1 in
+static const uint16_t PAGE_IN_ADDRESSES[] = { 0x0008, 0x1708 };
+#define PAGE_OUT_ADDRESS	0x0700
+
+
+/**----------------------------------------------------------------------------
+ *	MEMORY MAPPING
+ */
+
+static void _page(zx_if1_t *if1, bool b_paged) {
+	z80_mmu_t *mmu = &ZXSPECTRUM.mmu;
+
+	if (b_paged == if1->b_paged)
+		return;
+
+	if (b_paged) {
+		// remember what the shadow rom covers up
+		for (int slot = 0; slot < 2; slot++) {
+			if1->saved_pages[slot] = mmu->visible_pages[slot].index;
+			if1->saved_types[slot] = mmu->visible_pages[slot].mapping_type;
+			z80_mmu_PageMap(mmu, slot, IF1_ROM_PAGE, M_READ_ONLY);
+		}
+	}
+	else {
+		for (int slot = 0; slot < 2; slot++)
+			z80_mmu_PageMap(mmu, slot, if1->saved_pages[slot], if1->saved_types[slot]);
+	}
+	if1->b_paged = b_paged;
+}
+
+// port 0x7FFD has just remapped the rom: that's what lies underneath now
+void zx_if1_paging_changed(zx_if1_t *if1) {
+	if (!if1->b_paged)
+		return;
+	if1->b_paged = false;
+	_page(if1, true);
+}
+
+// A persisted session has been resumed: b_paged and what slots 0/1 map underneath are as they
+// were saved. Without the interface 1 attached now the shadow rom goes again
+void zx_if1_restored(zx_if1_t *if1) {
+	if (!if1->b_attached) {
+		_page(if1, false);
+		if1->control = 0;
+	}
+}
+
+static void _trap_page_in(Z80 *z80) {
+	zx_if1_t *if1 = &ZXSPECTRUM.if1;
+	(void)z80;
+	if (if1->b_attached)
+		_page(if1, true);
+}
+
+static void _trap_page_out(Z80 *z80) {
+	// (ROM_3 is shared with the divmmc rom: only while the interface 1 is paged in)
+	(void)z80;
+	_page(&ZXSPECTRUM.if1, false);
+}
+
+
+/**----------------------------------------------------------------------------
+ *	MICRODRIVES
+ */
+
+static uint64_t _byte_time() {
+	return (uint64_t)ZXSPECTRUM.timing.cpu_clock * MDR_BYTE_US / 1000000;
+}
+
+static uint64_t _now(zx_if1_t *if1) {
+	return if1->frame_base + spectrum_tstate();
+}
+
+static int _block_size(int block) {
+	return (block & 1) ? MDR_RECORD_SIZE : MDR_HEADER_SIZE;
+}
+
+static uint8_t *_block_data(zx_microdrive_t *mdr, int block) {
+	return mdr->image + (block / 2) * MDR_SECTOR_SIZE + (block & 1) * MDR_HEADER_SIZE;
+}
+
+// time a block (with its gap) takes to pass the head
+static uint64_t _block_time(int block) {
+	return (uint64_t)(MDR_BLOCK_GAP + _block_size(block)) * _byte_time();
+}
+
+static void _next_block(zx_microdrive_t *mdr) {
+	mdr->block_start += _block_time(mdr->block);
+	mdr->block = (mdr->block + 1) % (mdr->num_sectors * 2);
+	mdr->transferred = 0;
+}
+
+// real speed: move the head to where the running tape is at time now
+static void _rotate(zx_microdrive_t *mdr, uint64_t now) {
+	if (now <= mdr->block_start)
+		return;
+
+	// whole sectors (header and record) in one go, then at most one more block
+	uint64_t sector_time = _block_time(0) + _block_time(1);
+	uint64_t sectors = (now - mdr->block_start) / sector_time;
+	if (sectors) {
+		mdr->block = (int)((mdr->block + 2 * (sectors % mdr->num_sectors)) % (mdr->num_sectors * 2));
+		mdr->block_start += sectors * sector_time;
+		mdr->transferred = 0;
+	}
+	if (mdr->block_start + _block_time(mdr->block) <= now)
+		_next_block(mdr);
+}
+
+// the interface starts a block transfer: at the next block boundary
+static void _start_block(zx_if1_t *if1, zx_microdrive_t *mdr) {
+	if (if1->b_fast) {
+		if (mdr->transferred)
+			_next_block(mdr);
+		return;
+	}
+
+	// the data of the block under the head has started passing already: the next one
+	uint64_t now = _now(if1);
+	_rotate(mdr, now);
+	if (mdr->transferred || now > mdr->block_start + (MDR_BLOCK_GAP - MDR_PREAMBLE) * _byte_time())
+		_next_block(mdr);
+}
+
+// real speed: WAIT holds the cpu until byte number offset (counted from the block's gap) passes
+static void _wait(zx_if1_t *if1, zx_microdrive_t *mdr, int offset) {
+	if (if1->b_fast)
+		return;
+	uint64_t now = _now(if1);
+	uint64_t due = mdr->block_start + offset * _byte_time();
+	if (due > now)
+		ZXSPECTRUM.cpu->cycles += due - now;
+}
+
+static void _motor(zx_if1_t *if1, int drive, bool b_on) {
+	zx_microdrive_t *mdr = &if1->drives[drive];
+	if (b_on && !mdr->b_motor) {
+		// the tape starts moving from where it stopped
+		mdr->block_start = _now(if1);
+		mdr->transferred = 0;
+		mdr->gap = mdr->sync = MDR_STATUS_POLLS;
+	}
+	mdr->b_motor = b_on;
+}
+
+// the drive the data and status ports talk to
+static zx_microdrive_t *_running(zx_if1_t *if1) {
+	for (int drive = 0; drive < IF1_MAX_DRIVES; drive++) {
+		if (if1->drives[drive].b_motor && if1->drives[drive].b_inserted)
+			return &if1->drives[drive];
+	}
+	return NULL;
+}
+
+
+/**----------------------------------------------------------------------------
+ *	I/O PORTS
+ */
+
+// 0xE7: bytes of the block under the head
+static uint8_t _data_read(void *ctx, uint16_t port) {
+	zx_if1_t *if1 = (zx_if1_t*)ctx;
+	zx_microdrive_t *mdr = _running(if1);
+	(void)port;
+
+	if (!mdr || mdr->transferred >= _block_size(mdr->block))
+		return 0xFF;
+	_wait(if1, mdr, MDR_BLOCK_GAP + mdr->transferred);
+	return _block_data(mdr, mdr->block)[mdr->transferred++];
+}
+
+// in write mode: preamble, then the block
+static void _data_write(void *ctx, uint16_t port, uint8_t value) {
+	zx_if1_t *if1 = (zx_if1_t*)ctx;
+	zx_microdrive_t *mdr = _running(if1);
+	(void)port;
+
+	if (!mdr || (if1->control & IF1_READ))
+		return;
+	_wait(if1, mdr, MDR_BLOCK_GAP - MDR_PREAMBLE + mdr->transferred);
+	int offset = mdr->transferred++ - MDR_PREAMBLE;
+	if (offset >= 0 && offset < _block_size(mdr->block) && !mdr->b_write_protected) {
+		_block_data(mdr, mdr->block)[offset] = value;
+		mdr->b_dirty = true;
+	}
+}
+
+// 0xEF: bit 0 write protect, bit 1 sync, bit 2 gap (active low), bit 4 network busy
+static uint8_t _status_read(void *ctx, uint16_t port) {
+	zx_if1_t *if1 = (zx_if1_t*)ctx;
+	zx_microdrive_t *mdr = _running(if1);
+	uint8_t status = 0xFF & ~IF1_BUSY;
+	(void)port;
+
+	if (!mdr)
+		return status;
+	if (mdr->b_write_protected)
+		status &= ~IF1_WRITE_PROTECT;
+
+	// gap and sync high for a number of polls, then both low for as many
+	if (mdr->gap) {
+		mdr->gap--;
+	}
+	else {
+		status &= ~(IF1_GAP | IF1_SYNC);
+		if (mdr->sync)
+			mdr->sync--;
+		else
+			mdr->gap = mdr->sync = MDR_STATUS_POLLS;
+	}
+	return status;
+}
+
+// 0xEF: bit 0 comms data, bit 1 comms clock, bit 2 read/write, bit 3 erase
+static void _control_write(void *ctx, uint16_t port, uint8_t value) {
+	zx_if1_t *if1 = (zx_if1_t*)ctx;
+	(void)port;
+
+	// drive select: a shift register of motor bits clocked on the falling edge of COMMS CLK
+	if ((if1->control & IF1_COMMS_CLK) && !(value & IF1_COMMS_CLK)) {
+		for (int drive = IF1_MAX_DRIVES - 1; drive > 0; drive--)
+			_motor(if1, drive, if1->drives[drive - 1].b_motor);
+		_motor(if1, 0, !(value & IF1_COMMS_DATA));
+	}
+	if1->control = value;
+
+	zx_microdrive_t *mdr = _running(if1);
+	if (mdr)
+		_start_block(if1, mdr);
+}
+
+void zx_if1_end_frame(zx_if1_t *if1, uint32_t frame_tstates) {
+	if1->frame_base += frame_tstates;
+}
+
+
+/**----------------------------------------------------------------------------
+ *	CARTRIDGES
+ */
+
+// Map an MDR image into a microdrive (drive 0-7): read only files are write protected
+bool zx_if1_insert(zx_if1_t *if1, int drive, const char *mdr_file) {
+	zx_microdrive_t *mdr = &if1->drives[drive];
+
+	zx_if1_eject(if1, drive);
+
+	bool b_read_only = false;
+	int fd = open(mdr_file, O_RDWR);
+	if (fd < 0) {
+		fd = open(mdr_file, O_RDONLY);
+		b_read_only = true;
+	}
+	if (fd < 0) {
+		ltb_printf("if1: can't open \"%s\"\n", mdr_file);
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size < MDR_SECTOR_SIZE || st.st_size > MDR_IMAGE_SIZE) {
+		ltb_printf("if1: \"%s\" is not a microdrive cartridge\n", mdr_file);
+		close(fd);
+		return false;
+	}
+	uint8_t *image = mmap(NULL, st.st_size, PROT_READ | (b_read_only ? 0 : PROT_WRITE), MAP_SHARED, fd, 0);
+	close(fd);		// the mapping keeps its own reference
+	if (image == MAP_FAILED) {
+		ltb_printf("if1: can't map \"%s\"\n", mdr_file);
+		return false;
+	}
+
+	mdr->image = image;
+	mdr->image_size = st.st_size;
+	mdr->num_sectors = (int)(st.st_size / MDR_SECTOR_SIZE);
+	// the byte after the last sector is the write protect tab
+	mdr->b_write_protected = b_read_only
+		|| (st.st_size % MDR_SECTOR_SIZE && image[mdr->num_sectors * MDR_SECTOR_SIZE]);
+	mdr->b_dirty = false;
+	mdr->block = 0;
+	mdr->transferred = 0;
+	mdr->b_inserted = true;
+
+	ltb_printf("if1: microdrive %d: \"%s\" (%.10s), %d sectors\n", drive + 1, mdr_file,
+		(const char *)image + 4, mdr->num_sectors);
+	return true;
+}
+
+// Write back and unmap a cartridge
+void zx_if1_eject(zx_if1_t *if1, int drive) {
+	zx_microdrive_t *mdr = &if1->drives[drive];
+
+	if (!mdr->b_inserted)
+		return;
+	if (mdr->b_dirty)
+		msync(mdr->image, mdr->image_size, MS_SYNC);
+	munmap(mdr->image, mdr->image_size);
+	mdr->image = NULL;
+	mdr->b_inserted = false;
+}
+
+
+/**----------------------------------------------------------------------------
+ *	ATTACH / DETACH
+ */
+
+// power on: paged out, motors off (the mmu has just been reset)
+void zx_if1_reset(zx_if1_t *if1) {
+	if1->b_paged = false;
+	if1->control = 0;
+	for (int drive = 0; drive < IF1_MAX_DRIVES; drive++)
+		if1->drives[drive].b_motor = false;
+}
+
+// Load the interface 1 rom and hook it into ports and traps
+// Call after init_spectrum() and spectrum_power()
+bool zx_if1_attach(zx_if1_t *if1) {
+
+	if (if1->b_attached)
+		return false;
+	bool b_fast = if1->b_fast;
+	memset(if1, 0, sizeof(zx_if1_t));
+	if1->b_fast = b_fast;
+
+	if (!spectrum_load_rom_file(IF1_ROM_PAGE, SPECTRUM_IF1_ROM_FILE, MEM_PAGE_SIZE))
+		return false;
+
+	z80_io_bus_t *io = &ZXSPECTRUM.io;
+	if1->io_devices[0] = z80_io_Register(io, "if1 microdrive data", 0x0018, 0x0000, _data_read, _data_write, if1);
+	if1->io_devices[1] = z80_io_Register(io, "if1 control", 0x0018, 0x0008, _status_read, _control_write, if1);
+
+	// the 48k basic rom: 48k rom or 128k rom1
+	static const uint8_t roms[] = { ROM_1_BANK, ROM_2_BANK };
+	for (size_t r = 0; r < sizeof(roms); r++) {
+		for (size_t a = 0; a < sizeof(PAGE_IN_ADDRESSES) / sizeof(uint16_t); a++)
+			z80cpu_add_paging_trap(PAGE_IN_ADDRESSES[a], _trap_page_in, roms[r]);
+	}
+	z80cpu_add_trap(PAGE_OUT_ADDRESS, _trap_page_out, IF1_ROM_PAGE / 2);
+
+	if1->b_attached = true;
+	ltb_printf("if1: attached%s\n", if1->b_fast ? " (fast microdrives)" : "");
+	return true;
+}
+
+// Write back and unmap all cartridges, page the interface 1 out
+void zx_if1_detach(zx_if1_t *if1) {
+
+	if (!if1->b_attached)
+		return;
+
+	for (int drive = 0; drive < IF1_MAX_DRIVES; drive++)
+		zx_if1_eject(if1, drive);
+	_page(if1, false);
+	for (int i = 0; i < 2; i++)
+		z80_io_Enable(&ZXSPECTRUM.io, if1->io_devices[i], false);
+	if1->b_attached = false;
+}
+
+// spectrum_if1.c
@@ -0,0 +1,65 @@
+#pragma once
+
+/**----------------------------------------------------------------------------
+ *	spectrum_if1.c
+ *  Interface 1: shadow rom paged in through cpu traps, microdrives on mmap()'d MDR images
+ *  ports 0xE7 (microdrive data), 0xEF (control/status), decoded on A3/A4 only
+ **/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define IF1_MAX_DRIVES		8
+#define MDR_HEADER_SIZE		15			// sector header block
+#define MDR_RECORD_SIZE		528			// record block: descriptor, 512 bytes data, checksum
+#define MDR_SECTOR_SIZE		(MDR_HEADER_SIZE + MDR_RECORD_SIZE)
+#define MDR_MAX_SECTORS		254
+#define MDR_IMAGE_SIZE		(MDR_MAX_SECTORS * MDR_SECTOR_SIZE + 1)	// plus the write protect flag
+
+typedef struct {
+	// cartridge
+	uint8_t *image;				// mmap()'d MDR file
+	size_t image_size;
+	int num_sectors;
+	bool b_inserted;
+	bool b_write_protected;
+	bool b_dirty;
+
+	bool b_motor;
+	int block;					// block under the head: even blocks are headers, odd blocks records
+	int transferred;			// bytes of the current block transfer (writes: including the preamble)
+	uint64_t block_start;		// real speed: time the block's gap reached the head
+	int gap, sync;				// status polls left in the gap/sync pattern
+} zx_microdrive_t;
+
+typedef struct {
+	bool b_attached;
+	bool b_fast;				// microdrives serve blocks as fast as the cpu takes them
+	bool b_paged;				// shadow rom in slots 0/1
+	int io_devices[2];
+	int saved_pages[2];			// what slots 0/1 map underneath
+	int saved_types[2];
+	uint8_t control;			// last value written to 0xEF
+	uint64_t frame_base;		// time of the current frame's first T-state
+	zx_microdrive_t drives[IF1_MAX_DRIVES];
+} zx_if1_t;
+
+bool zx_if1_attach(zx_if1_t *if1);
+void zx_if1_detach(zx_if1_t *if1);
+void zx_if1_reset(zx_if1_t *if1);
+bool zx_if1_insert(zx_if1_t *if1, int drive, const char *mdr_file);
+void zx_if1_eject(zx_if1_t *if1, int drive);
+void zx_if1_end_frame(zx_if1_t *if1, uint32_t frame_tstates);
+void zx_if1_paging_changed(zx_if1_t *if1);
+void zx_if1_restored(zx_if1_t *if1);
+
+#ifdef __cplusplus
+}
+#endif
+
+// spectrum_if1.h
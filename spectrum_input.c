@@ -0,0 +1,99 @@
+/**----------------------------------------------------------------------------
+ *	spectrum_input.c
+ *  host input as a lock free queue of events, each applied at its own frame and T-state
+ *
+ *	Host events used to go straight into the key matrix whenever SDL got polled: somewhere
+ *	between two frames, up to a frame late and never at the same point twice. Now each event
+ *	is stamped with the frame it belongs to and a T-state in it when it's queued, and
+ *	spectrum_run_frame() splits its cpu steps at the stamps, so the machine sees it at
+ *	exactly that point. An event goes into the next frame as far as it came after the last
+ *	frame was run, in the frame's own time (frame_position), whether the host polls once per
+ *	display frame or every ms: that makes the latency about one frame for all of them. The
+ *	stamps only ever go forward, so the queue stays in order.
+ *
+ *	Single producer/single consumer ring, as in audio.c: the read and write indices are only
+ *	written by their owning side, so no locks are needed.
+ **/
+
+#include <stdatomic.h>
+
+#include "spectrum.h"
+#include "spectrum_input.h"
+
+#define QUEUE_MASK	(INPUT_QUEUE_SIZE - 1)
+
+static input_event_t QUEUE[INPUT_QUEUE_SIZE];
+static atomic_uint QUEUE_READ;			// owned by the consumer (emulation)
+static atomic_uint QUEUE_WRITE;			// owned by the producer (host events)
+
+// producer: the last stamp handed out
+static uint32_t LAST_FRAME, LAST_TSTATE;
+
+// Queue an event for the next frame to run, at frame_position (0..1) of it
+// Returns false if the queue is full (the event is dropped)
+bool spectrum_input_push(uint8_t type, uint8_t code, uint16_t mod, double frame_position) {
+	unsigned int w = atomic_load_explicit(&QUEUE_WRITE, memory_order_relaxed);
+	unsigned int r = atomic_load_explicit(&QUEUE_READ, memory_order_acquire);
+	if (w - r >= INPUT_QUEUE_SIZE)
+		return false;
+
+	const uint32_t frame_tstates = ZXSPECTRUM.timing.frame_tstates;
+	if (frame_position < 0.0)
+		frame_position = 0.0;
+	uint32_t frame = ZXSPECTRUM.frame_no;
+	uint32_t tstate = (uint32_t)(frame_position * frame_tstates);
+	if (tstate >= frame_tstates)
+		tstate = frame_tstates - 1;
+
+	// no earlier than the last event (positions get clamped to the frame)
+	if (frame < LAST_FRAME || (frame == LAST_FRAME && tstate < LAST_TSTATE)) {
+		frame = LAST_FRAME;
+		tstate = LAST_TSTATE;
+	}
+	LAST_FRAME = frame;
+	LAST_TSTATE = tstate;
+
+	QUEUE[w & QUEUE_MASK] = (input_event_t){ frame, tstate, type, code, mod };
+	atomic_store_explicit(&QUEUE_WRITE, w + 1, memory_order_release);
+	return true;
+}
+
+// T-state of the current frame the next event is due at (0: overdue), INPUT_NONE if none is
+uint32_t spectrum_input_next_tstate() {
+	unsigned int r = atomic_load_explicit(&QUEUE_READ, memory_order_relaxed);
+	unsigned int w = atomic_load_explicit(&QUEUE_WRITE, memory_order_acquire);
+	if (r == w)
+		return INPUT_NONE;
+
+	const input_event_t *e = &QUEUE[r & QUEUE_MASK];
+	int32_t frames_ahead = (int32_t)(e->frame - ZXSPECTRUM.frame_no);
+	if (frames_ahead > 0)
+		return INPUT_NONE;
+	return frames_ahead < 0 ? 0 : e->tstate;
+}
+
+static void _apply(const input_event_t *e) {
+	switch (e->type) {
+	case INPUT_KEY_DOWN:
+	case INPUT_KEY_UP:
+		spectrum_process_key(e->code, e->mod, e->type == INPUT_KEY_DOWN);
+		break;
+	case INPUT_KEMPSTON_DOWN:
+		ZXSPECTRUM.kempston |= e->code;
+		break;
+	case INPUT_KEMPSTON_UP:
+		ZXSPECTRUM.kempston &= ~e->code;
+		break;
+	}
+}
+
+// Apply the events due up to tstate of the current frame
+void spectrum_input_run(uint32_t tstate) {
+	while (spectrum_input_next_tstate() <= tstate) {
+		unsigned int r = atomic_load_explicit(&QUEUE_READ, memory_order_relaxed);
+		_apply(&QUEUE[r & QUEUE_MASK]);
+		atomic_store_explicit(&QUEUE_READ, r + 1, memory_order_release);
+	}
+}
+
+// spectrum_input.c
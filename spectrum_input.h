@@ -0,0 +1,42 @@
+#pragma once
+
+/**----------------------------------------------------------------------------
+ *	spectrum_input.c
+ *  host input as a lock free queue of events, each applied at its own frame and T-state
+ **/
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define INPUT_QUEUE_SIZE	256			// events, must be a power of 2
+#define INPUT_NONE			UINT32_MAX	// spectrum_input_next_tstate(): nothing due in this frame
+
+#define INPUT_KEY_DOWN		1			// code: key (see spectrum_process_key()), mod: KEY_MOD_*
+#define INPUT_KEY_UP		2
+#define INPUT_KEMPSTON_DOWN	3			// code: kempston bit(s)
+#define INPUT_KEMPSTON_UP	4
+
+typedef struct {
+	uint32_t frame;			// ZXSPECTRUM.frame_no of the frame it applies in
+	uint32_t tstate;		// T-state in that frame
+	uint8_t type;
+	uint8_t code;
+	uint16_t mod;
+} input_event_t;
+
+// producer side (host event handling)
+bool spectrum_input_push(uint8_t type, uint8_t code, uint16_t mod, double frame_position);
+
+// consumer side (emulation: spectrum_run_frame())
+uint32_t spectrum_input_next_tstate();
+void spectrum_input_run(uint32_t tstate);
+
+#ifdef __cplusplus
+}
+#endif
+
+// spectrum_input.h
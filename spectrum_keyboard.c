@@ -15,6 +15,10 @@
 
 static key_repl_t key_replacements[128];
 
+// characters as typed by the autotyper (spectrum_autotype.c): the spectrum key and the shift
+// to press with it (src_sym is 0 for characters the spectrum keyboard doesn't have)
+static struct _key_repl typed_keys[128];
+
 
 bool KEYMOD(uint8_t source_mod, uint16_t mod_mask) {
 	if ((source_mod & mod_mask) != 0)
@@ -133,6 +137,24 @@ void spectrum_process_key(uint8_t c, uint8_t key_mod, bool b_keydown) {
 
 }
 
+// Which spectrum key (and shift) types character c: false if there isn't one
+bool spectrum_key_for_char(uint8_t c, uint8_t *key, uint8_t *shift) {
+
+	if (c >= 128 || typed_keys[c].src_sym != c || c == 0)
+		return false;
+	*key = typed_keys[c].rep_sym;
+	*shift = typed_keys[c].shift;
+	return true;
+}
+
+static void _define_typed_key(uint8_t c, uint8_t r, uint8_t shift_inject) {
+
+	typed_keys[c].src_sym = c;
+	typed_keys[c].src_mod = KEY_MOD_NONE;
+	typed_keys[c].rep_sym = r;
+	typed_keys[c].shift = shift_inject;
+}
+
 // define a key replacement for code i (with mod m) to be replaced with r and the spectrum shift key to inject
 static void _define_key_replacement(uint8_t i, uint8_t m, uint8_t r, uint8_t shift_inject) {
 	
@@ -158,6 +180,28 @@ void init_spectrum_keyboard() {
 	_define_key_replacement(44, KEY_MOD_LSHIFT|KEY_MOD_RSHIFT, 'o', SPECTRUM_KEY_SYMBOL_SHIFT); // ;
 	_define_key_replacement(46, KEY_MOD_NONE, 'm', SPECTRUM_KEY_SYMBOL_SHIFT); 					// .
 
+	// Typed characters: unshifted keys, then whatever the host keys without modifiers get
+	// replaced with (DELETE, .), then caps-shifted capitals and the symbol-shifted characters
+	memset(typed_keys, 0, sizeof(typed_keys));
+	for (uint8_t c = 'a'; c <= 'z'; c++) {
+		_define_typed_key(c, c, SPECTRUM_KEY_SHIFT_NONE);
+		_define_typed_key(c - 'a' + 'A', c, SPECTRUM_KEY_CAPS_SHIFT);
+	}
+	for (uint8_t c = '0'; c <= '9'; c++)
+		_define_typed_key(c, c, SPECTRUM_KEY_SHIFT_NONE);
+	_define_typed_key(' ', ' ', SPECTRUM_KEY_SHIFT_NONE);
+	_define_typed_key(13, 13, SPECTRUM_KEY_SHIFT_NONE);										// ENTER
+
+	for (int i = 0; i < 128; i++) {
+		struct _key_repl *rp = &key_replacements[i].primary;
+		if (rp->src_sym == i && rp->src_mod == KEY_MOD_NONE)
+			_define_typed_key(i, rp->rep_sym, rp->shift);
+	}
+
+	static const char SYMBOL_SHIFTED[] = "!1@2#3$4%5&6'7(8)9_0<r>t;o\"p=l+k-j^h:z?c/v*b,n.m";
+	for (int i = 0; SYMBOL_SHIFTED[i]; i += 2)
+		_define_typed_key(SYMBOL_SHIFTED[i], SYMBOL_SHIFTED[i + 1], SPECTRUM_KEY_SYMBOL_SHIFT);
+
 #if 0
 
 	// " (key code 52 is ' on a us keyboard)
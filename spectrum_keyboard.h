@@ -38,6 +38,7 @@ extern "C" {
 #endif
 
 void spectrum_process_key(uint8_t hid_key, uint8_t key_mod, bool b_keydown);
+bool spectrum_key_for_char(uint8_t c, uint8_t *key, uint8_t *shift);
 void init_spectrum_keyboard();
 
 #ifdef __cplusplus
@@ -0,0 +1,153 @@
+/**----------------------------------------------------------------------------
+ *	spectrum_layers.c
+ *  ZXX layer 2 and the scanline compositor
+ *
+ *	The ULA line gets rendered as usual. Only if sprites or layer 2 have anything on
+ *	the line, their lines get rendered into separate buffers and the layers get merged
+ *	bottom to top: a pixel of a higher layer wins unless it is transparent (alpha 0,
+ *	or the ARGB value of the global transparent colour). The merge is a masked blend,
+ *	4 pixels at a time with SSE2/NEON.
+ **/
+
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "spectrum.h"
+#include "spectrum_layers.h"
+
+
+/**----------------------------------------------------------------------------
+ *	LAYER 2
+ */
+
+void zx_layers_init(zx_layers_t *layers) {
+	memset(layers, 0, sizeof(zx_layers_t));
+	layers->layer2_bank = ULAX_0_BANK;
+	layers->priority = ZX_LAYERS_SLU;
+	layers->b_sprites_visible = true;
+	layers->transparent = SPRITE_TRANSPARENT;
+	for (int c = 0; c < 256; c++)
+		layers->colours[c] = spectrum_rgb332_argb32(c);
+}
+
+// port 0x123B: bit 1 layer 2 visible
+// (write paging of layer 2 into 0x0000-0x3FFF is not implemented: the ULAX banks can be paged in at 0xC000)
+void zx_layer2_write(zx_layers_t *layers, uint8_t value) {
+	layers->layer2_port = value;
+	layers->b_layer2_visible = (value & 0x02) != 0;
+}
+
+// the 256x192 bitmap occupies the display area of the line, the border is transparent
+static bool _render_layer2_line(const zx_layers_t *layers, int scanline, uint32_t *dp) {
+	const int display_line = scanline - (DISPLAY_HEIGHT - SCREENH) / 2;
+
+	if (!layers->b_layer2_visible || display_line < 0 || display_line >= SCREENH)
+		return false;
+
+	// scrolling wraps around within the 256x192 bitmap
+	const int bitmap_line = (display_line + layers->layer2_scroll_y) % SCREENH;
+	const uint8_t *row = ZXSPECTRUM.mmu.banks[layers->layer2_bank + bitmap_line / 64] + (bitmap_line % 64) * SCREENW;
+	const int left = (DISPLAY_WIDTH - SCREENW) / 2;
+
+	memset(dp, 0, FRAME_WIDTH * sizeof(uint32_t));
+	for (int x = 0; x < SCREENW; x++) {
+		uint8_t v = row[(x + layers->layer2_scroll_x) & (SCREENW - 1)];
+		uint32_t c = (v == layers->transparent) ? 0 : layers->colours[v];
+		dp[(left + x) * 2] = c;
+		dp[(left + x) * 2 + 1] = c;
+	}
+	return true;
+}
+
+
+/**----------------------------------------------------------------------------
+ *	COMPOSITOR
+ */
+
+// dst = over, wherever over is not transparent
+static void _blend(uint32_t *dst, const uint32_t *over, uint32_t key, int count) {
+	int i = 0;
+#if defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i alpha = _mm_set1_epi32((int)0xff000000);
+	const __m128i vkey = _mm_set1_epi32((int)key);
+	for (; i + 4 <= count; i += 4) {
+		__m128i o = _mm_loadu_si128((const __m128i*)(over + i));
+		__m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+		__m128i transparent = _mm_or_si128(_mm_cmpeq_epi32(_mm_and_si128(o, alpha), zero), _mm_cmpeq_epi32(o, vkey));
+		d = _mm_or_si128(_mm_and_si128(transparent, d), _mm_andnot_si128(transparent, o));
+		_mm_storeu_si128((__m128i*)(dst + i), d);
+	}
+#elif defined(__ARM_NEON)
+	const uint32x4_t alpha = vdupq_n_u32(0xff000000);
+	const uint32x4_t vkey = vdupq_n_u32(key);
+	for (; i + 4 <= count; i += 4) {
+		uint32x4_t o = vld1q_u32(over + i);
+		uint32x4_t d = vld1q_u32(dst + i);
+		uint32x4_t transparent = vorrq_u32(vceqq_u32(vandq_u32(o, alpha), vdupq_n_u32(0)), vceqq_u32(o, vkey));
+		vst1q_u32(dst + i, vbslq_u32(transparent, d, o));
+	}
+#endif
+	for (; i < count; i++) {
+		uint32_t o = over[i];
+		if ((o & 0xff000000) && o != key)
+			dst[i] = o;
+	}
+}
+
+// layer order (top to bottom) per priority: 0 sprites, 1 layer 2, 2 ula
+static const uint8_t LAYER_ORDER[6][3] = {
+	[ZX_LAYERS_SLU] = { 0, 1, 2 },
+	[ZX_LAYERS_LSU] = { 1, 0, 2 },
+	[ZX_LAYERS_SUL] = { 0, 2, 1 },
+	[ZX_LAYERS_LUS] = { 1, 2, 0 },
+	[ZX_LAYERS_USL] = { 2, 0, 1 },
+	[ZX_LAYERS_ULS] = { 2, 1, 0 },
+};
+
+// Merge sprites and layer 2 into the finished ULA line of a visible scanline
+void spectrum_compose_scanline(int scanline, uint32_t *LINEBUF) {
+	static uint32_t SPRITE_LINE[FRAME_WIDTH];
+	static uint32_t LAYER2_LINE[FRAME_WIDTH];
+	static uint32_t OUT_LINE[FRAME_WIDTH];
+
+	zx_layers_t *layers = &ZXSPECTRUM.layers;
+	const zx_sprites_t *sprites = &ZXSPECTRUM.sprites;
+
+	// sprite line 32 is the first display line
+	const int sprite_line = scanline - (DISPLAY_HEIGHT - SCREENH) / 2 + 32;
+
+	bool b_sprites = false;
+	if (layers->b_sprites_visible && sprites->num_visible) {
+		memset(SPRITE_LINE, 0, sizeof(SPRITE_LINE));
+		b_sprites = zx_sprites_render_line(sprites, sprite_line, SPRITE_LINE);
+	}
+	bool b_layer2 = _render_layer2_line(layers, scanline, LAYER2_LINE);
+
+	if (!b_sprites && !b_layer2)
+		return;		// ula only
+
+	const uint32_t *lines[3] = { b_sprites ? SPRITE_LINE : NULL, b_layer2 ? LAYER2_LINE : NULL, LINEBUF };
+	const uint8_t *order = LAYER_ORDER[layers->priority];
+	const uint32_t key = layers->colours[layers->transparent];
+
+	// bottom up: with the ula at the bottom (the usual case) the line gets merged in place
+	uint32_t *out = (order[2] == 2) ? LINEBUF : OUT_LINE;
+	if (out != LINEBUF)
+		memcpy(out, lines[order[2]] ? lines[order[2]] : LINEBUF, sizeof(OUT_LINE));
+
+	for (int l = 1; l >= 0; l--) {
+		if (lines[order[l]] && lines[order[l]] != out)
+			_blend(out, lines[order[l]], key, FRAME_WIDTH);
+	}
+	if (out != LINEBUF)
+		memcpy(LINEBUF, out, sizeof(OUT_LINE));
+}
+
+
+// spectrum_layers.c
@@ -0,0 +1,46 @@
+#pragma once
+
+/**----------------------------------------------------------------------------
+ *	spectrum_layers.c
+ *  ZXX layer 2 (256x192 RRRGGGBB bitmap, port 0x123B) and the scanline compositor
+ *  that merges the ULA, layer 2 and sprite lines
+ **/
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// layer priorities, top to bottom (S sprites, L layer 2, U ula)
+typedef enum {
+	ZX_LAYERS_SLU,
+	ZX_LAYERS_LSU,
+	ZX_LAYERS_SUL,
+	ZX_LAYERS_LUS,
+	ZX_LAYERS_USL,
+	ZX_LAYERS_ULS,
+} zx_layer_priority_t;
+
+typedef struct {
+	uint8_t layer2_port;			// last value written to 0x123B
+	bool b_layer2_visible;
+	int layer2_bank;				// first of the three 16k banks holding the bitmap
+	uint8_t layer2_scroll_x;		// next registers 0x16/0x17
+	uint8_t layer2_scroll_y;
+	zx_layer_priority_t priority;
+	bool b_sprites_visible;			// next register 0x15 bit 0
+	uint8_t transparent;			// global transparent colour index
+	uint32_t colours[256];			// RRRGGGBB layer 2 palette
+} zx_layers_t;
+
+void zx_layers_init(zx_layers_t *layers);
+void zx_layer2_write(zx_layers_t *layers, uint8_t value);
+void spectrum_compose_scanline(int scanline, uint32_t *LINEBUF);
+
+#ifdef __cplusplus
+}
+#endif
+
+// spectrum_layers.h
@@ -0,0 +1,116 @@
+/**----------------------------------------------------------------------------
+ *	spectrum_nextreg.c
+ *  ZXX next style register file
+ *
+ *	Registers get selected through port 0x243B and read/written through 0x253B, the copper
+ *	writes them directly (zx_nextreg_set()). Writes take effect immediately, registers
+ *	without a function just store the value.
+ *
+ *	0x14		global transparent colour index (layer 2 and the compositor)
+ *	0x15		bit 0 sprites visible, bits 4-2 layer priority (see zx_layer_priority_t)
+ *	0x16/0x17	layer 2 scroll x/y
+ *	0x40-0x43	palette index, palette value (RRRGGGBB, auto increment), palette select
+ *				(ula: the 16 standard colours, ink, paper and border alike)
+ *	0x50-0x57	MMU: page (0-127) mapped into the 8k slot 0-7. The mapping is a couple of
+ *				slot pointer updates in the mmu (see z80_mmu_PageMap()), memory accesses
+ *				cost the same as with 16k banking. Reads return the page currently mapped,
+ *				so 0x7FFD paging shows up here too.
+ *	0x60-0x63	copper program and control (see spectrum_copper.c)
+ **/
+
+#include <string.h>
+
+#include "spectrum.h"
+#include "spectrum_nextreg.h"
+
+
+void zx_nextreg_init(zx_nextreg_t *nextreg) {
+	memset(nextreg, 0, sizeof(zx_nextreg_t));
+	nextreg->regs[NEXTREG_TRANSPARENCY] = SPRITE_TRANSPARENT;
+	nextreg->regs[NEXTREG_LAYERS] = 0x01;
+}
+
+void zx_nextreg_select(zx_nextreg_t *nextreg, uint8_t reg) {
+	nextreg->selected = reg;
+}
+
+static void _mmu_write(int slot, uint8_t value) {
+	z80_mmu_t *mmu = &ZXSPECTRUM.mmu;
+	int page_no;
+
+	if (value == NEXTREG_MMU_ROM && slot < 2)
+		page_no = mmu->current_rom * 2 + slot;
+	else if (value < MEM_NUM_PAGES)
+		page_no = value;
+	else
+		return;
+
+	z80_mmu_PageMap(mmu, slot, page_no, M_READ_WRITE);
+}
+
+static void _palette_write(zx_nextreg_t *nextreg, uint8_t value) {
+	uint8_t index = nextreg->palette_index++;
+	uint32_t colour = spectrum_rgb332_argb32(value);
+
+	switch ((nextreg->regs[NEXTREG_PALETTE_CONTROL] >> 4) & 7) {
+	case 0:
+		ZXSPECTRUM.spectrum_palette[index & 15] = colour;
+		spectrum_update_colour_table();
+		break;
+	case 1:
+		ZXSPECTRUM.layers.colours[index] = colour;
+		break;
+	case 2:
+		ZXSPECTRUM.sprites.colours[index] = colour;
+		break;
+	default:
+		break;
+	}
+}
+
+// write a register (port 0x253B or copper MOVE)
+void zx_nextreg_set(zx_nextreg_t *nextreg, uint8_t reg, uint8_t value) {
+	zx_layers_t *layers = &ZXSPECTRUM.layers;
+	nextreg->regs[reg] = value;
+
+	switch (reg) {
+	case NEXTREG_TRANSPARENCY:		layers->transparent = value; break;
+	case NEXTREG_LAYERS:
+		layers->b_sprites_visible = (value & 0x01) != 0;
+		layers->priority = (zx_layer_priority_t)((value >> 2) & 7);
+		if (layers->priority > ZX_LAYERS_ULS)
+			layers->priority = ZX_LAYERS_SLU;
+		break;
+	case NEXTREG_LAYER2_X:			layers->layer2_scroll_x = value; break;
+	case NEXTREG_LAYER2_Y:			layers->layer2_scroll_y = value % SCREENH; break;
+	case NEXTREG_PALETTE_INDEX:		nextreg->palette_index = value; break;
+	case NEXTREG_PALETTE_VALUE:		_palette_write(nextreg, value); break;
+	case NEXTREG_COPPER_DATA:
+	case NEXTREG_COPPER_DATA_16:	zx_copper_write_data(&ZXSPECTRUM.copper, value); break;
+	case NEXTREG_COPPER_ADDR:		zx_copper_write_addr_lo(&ZXSPECTRUM.copper, value); break;
+	case NEXTREG_COPPER_CONTROL:	zx_copper_write_control(&ZXSPECTRUM.copper, value); break;
+	default:
+		if (reg >= NEXTREG_MMU_0 && reg <= NEXTREG_MMU_7)
+			_mmu_write(reg - NEXTREG_MMU_0, value);
+		break;
+	}
+}
+
+void zx_nextreg_write(zx_nextreg_t *nextreg, uint8_t value) {
+	zx_nextreg_set(nextreg, nextreg->selected, value);
+}
+
+uint8_t zx_nextreg_read(const zx_nextreg_t *nextreg) {
+	uint8_t reg = nextreg->selected;
+
+	if (reg >= NEXTREG_MMU_0 && reg <= NEXTREG_MMU_7)
+		return (uint8_t)ZXSPECTRUM.mmu.visible_pages[reg - NEXTREG_MMU_0].index;
+	if (reg == NEXTREG_PALETTE_INDEX)
+		return nextreg->palette_index;
+	if (reg == NEXTREG_COPPER_CONTROL)
+		return zx_copper_control(&ZXSPECTRUM.copper);
+	return nextreg->regs[reg];
+}
+
+
+// spectrum_nextreg.c
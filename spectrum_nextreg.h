@@ -0,0 +1,46 @@
+#pragma once
+
+/**----------------------------------------------------------------------------
+ *	spectrum_nextreg.c
+ *  ZXX next style register file: 0x243B register select, 0x253B register data
+ **/
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define NEXTREG_TRANSPARENCY	0x14	// global transparent colour index
+#define NEXTREG_LAYERS			0x15	// bit 0 sprites visible, bits 4-2 layer priority
+#define NEXTREG_LAYER2_X		0x16	// layer 2 scroll
+#define NEXTREG_LAYER2_Y		0x17
+#define NEXTREG_PALETTE_INDEX	0x40
+#define NEXTREG_PALETTE_VALUE	0x41	// RRRGGGBB, the index auto increments
+#define NEXTREG_PALETTE_CONTROL	0x43	// bits 6-4 palette: 000 ula, 001 layer 2, 010 sprites
+#define NEXTREG_MMU_0			0x50	// 0x50-0x57: 8k page mapped into slot 0-7 (0x0000, 0x2000, ... 0xE000)
+#define NEXTREG_MMU_7			0x57
+#define NEXTREG_COPPER_DATA		0x60	// see spectrum_copper.c
+#define NEXTREG_COPPER_ADDR		0x61
+#define NEXTREG_COPPER_CONTROL	0x62
+#define NEXTREG_COPPER_DATA_16	0x63
+
+#define NEXTREG_MMU_ROM			0xFF	// written to MMU 0/1: map the current rom back in
+
+typedef struct {
+	uint8_t selected;			// last value written to 0x243B
+	uint8_t regs[256];			// last value written to each register
+	uint8_t palette_index;
+} zx_nextreg_t;
+
+void zx_nextreg_init(zx_nextreg_t *nextreg);
+void zx_nextreg_select(zx_nextreg_t *nextreg, uint8_t reg);
+void zx_nextreg_write(zx_nextreg_t *nextreg, uint8_t value);
+void zx_nextreg_set(zx_nextreg_t *nextreg, uint8_t reg, uint8_t value);
+uint8_t zx_nextreg_read(const zx_nextreg_t *nextreg);
+
+#ifdef __cplusplus
+}
+#endif
+
+// spectrum_nextreg.h
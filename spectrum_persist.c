@@ -0,0 +1,282 @@
+/**----------------------------------------------------------------------------
+ *	spectrum_persist.c
+ *  file backed spectrum memory: instant resume of a previous session
+ *
+ *	- the complete mmu memory pool (all ram and rom banks) gets mmap()'d from a file
+ *	- cpu registers, mmu slot mappings and the paging state of the devices that page memory
+ *	  in are stored in a small sidecar file (<ram_file>.state) when the emulator closes
+ *	- on startup both get picked up again and the machine simply continues where it left off:
+ *	  no rom boot, no ram clear, no re-loading of software
+ **/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "spectrum.h"
+#include "spectrum_persist.h"
+#include "text_box_l.h"
+
+#define PERSIST_MAGIC	0x52534753	// "SGSR"
+#define PERSIST_VERSION	9
+
+// sidecar file contents
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t pool_size;
+	int32_t zx_type;
+
+	// cpu
+	uint16_t pc, sp, ix, iy, af, bc, de, hl;
+	uint16_t af_, bc_, de_, hl_, memptr;
+	uint8_t i, r, r7, im, iff1, iff2, halt_line;
+
+	// mmu
+	z80_mmu_mapping_t visible_banks[4];
+	z80_mmu_mapping_t visible_pages[MEM_NUM_SLOTS];
+	int32_t current_rom;
+	int32_t display_bank;
+	uint8_t last_7ffd;
+	uint8_t last_1ffd;
+	uint8_t enable_128k_banking;
+	uint8_t b_all_ram;
+
+	uint8_t border;
+	uint8_t timex_port;
+	zx_ulaplus_t ulaplus;
+
+	// divmmc: what it has paged in and what that covers up
+	uint8_t divmmc_control;
+	uint8_t divmmc_automapped;
+	uint8_t divmmc_mapped;
+	int32_t divmmc_saved_pages[2];
+	int32_t divmmc_saved_types[2];
+
+	// interface 1: the shadow rom
+	uint8_t if1_paged;
+	uint8_t if1_control;
+	int32_t if1_saved_pages[2];
+	int32_t if1_saved_types[2];
+
+	// ay: registers as the cpu wrote them and where the envelope is
+	uint8_t ay_regs[16];
+	uint8_t ay_selected;
+	uint8_t ay_env_step;
+	uint8_t ay_env_attack;
+	uint8_t ay_env_holding;
+	uint32_t ay_env_count;
+} persist_state_t;
+
+static uint8_t *MAPPING = NULL;
+static char STATE_FILE[SPECTRUM_MAX_FILE_DIR_LEN];
+
+
+static bool _read_state(persist_state_t *state) {
+	FILE *f = fopen(STATE_FILE, "rb");
+	if (!f)
+		return false;
+	size_t n = fread(state, sizeof(persist_state_t), 1, f);
+	fclose(f);
+
+	return n == 1 && state->magic == PERSIST_MAGIC && state->version == PERSIST_VERSION
+		&& state->pool_size == MEM_POOL_SIZE && state->zx_type == (int32_t)ZXSPECTRUM.zx_type;
+}
+
+static void _restore_state(const persist_state_t *s) {
+	Z80 *z80 = ZXSPECTRUM.cpu;
+	Z80_PC(*z80) = s->pc; Z80_SP(*z80) = s->sp;
+	Z80_IX(*z80) = s->ix; Z80_IY(*z80) = s->iy;
+	Z80_AF(*z80) = s->af; Z80_BC(*z80) = s->bc; Z80_DE(*z80) = s->de; Z80_HL(*z80) = s->hl;
+	Z80_AF_(*z80) = s->af_; Z80_BC_(*z80) = s->bc_; Z80_DE_(*z80) = s->de_; Z80_HL_(*z80) = s->hl_;
+	Z80_MEMPTR(*z80) = s->memptr;
+	z80->i = s->i; z80->r = s->r; z80->r7 = s->r7; z80->im = s->im;
+	z80->iff1 = s->iff1; z80->iff2 = s->iff2; z80->halt_line = s->halt_line;
+
+	z80_mmu_t *mmu = &ZXSPECTRUM.mmu;
+	// the 8k page mappings are authoritative (ZXX can map pages independently)
+	for (int slot = 0; slot < MEM_NUM_SLOTS; slot++)
+		z80_mmu_PageMap(mmu, slot, s->visible_pages[slot].index, s->visible_pages[slot].mapping_type);
+	memcpy(mmu->visible_banks, s->visible_banks, sizeof(mmu->visible_banks));
+	mmu->current_rom = s->current_rom;
+	mmu->display_bank = s->display_bank;
+	mmu->last_7ffd = s->last_7ffd;
+	mmu->last_1ffd = s->last_1ffd;
+	mmu->enable_128k_banking = s->enable_128k_banking;
+	mmu->b_all_ram = s->b_all_ram;
+
+	ZXSPECTRUM.border = s->border;
+	ZXSPECTRUM.beam.border_colour = s->border;
+	spectrum_set_display_mode(s->timex_port);
+	spectrum_ulaplus_set(&s->ulaplus);
+
+	// slots 0/1 may show divmmc pages: the divmmc has to know (or drop them if it isn't attached)
+	zx_divmmc_t *divmmc = &ZXSPECTRUM.divmmc;
+	divmmc->control = s->divmmc_control;
+	divmmc->b_automapped = s->divmmc_automapped;
+	divmmc->b_mapped = s->divmmc_mapped;
+	for (int slot = 0; slot < 2; slot++) {
+		divmmc->saved_pages[slot] = s->divmmc_saved_pages[slot];
+		divmmc->saved_types[slot] = s->divmmc_saved_types[slot];
+	}
+	zx_divmmc_restored(divmmc);
+
+	// same for the interface 1 shadow rom
+	zx_if1_t *if1 = &ZXSPECTRUM.if1;
+	if1->b_paged = s->if1_paged;
+	if1->control = s->if1_control;
+	for (int slot = 0; slot < 2; slot++) {
+		if1->saved_pages[slot] = s->if1_saved_pages[slot];
+		if1->saved_types[slot] = s->if1_saved_types[slot];
+	}
+	zx_if1_restored(if1);
+
+	// the registers go back through the ports, as the cpu would write them
+	zx_ay_t *ay = &ZXSPECTRUM.ay;
+	for (int reg = 0; reg < 16; reg++) {
+		zx_ay_select(ay, reg);
+		zx_ay_write(ay, 0, s->ay_regs[reg]);
+	}
+	zx_ay_select(ay, s->ay_selected);
+	zx_ay_restore_envelope(ay, s->ay_env_count, s->ay_env_step, s->ay_env_attack, s->ay_env_holding);
+}
+
+static void _capture_state(persist_state_t *s) {
+	memset(s, 0, sizeof(persist_state_t));
+	s->magic = PERSIST_MAGIC;
+	s->version = PERSIST_VERSION;
+	s->pool_size = MEM_POOL_SIZE;
+	s->zx_type = ZXSPECTRUM.zx_type;
+
+	Z80 *z80 = ZXSPECTRUM.cpu;
+	s->pc = Z80_PC(*z80); s->sp = Z80_SP(*z80);
+	s->ix = Z80_IX(*z80); s->iy = Z80_IY(*z80);
+	s->af = Z80_AF(*z80); s->bc = Z80_BC(*z80); s->de = Z80_DE(*z80); s->hl = Z80_HL(*z80);
+	s->af_ = Z80_AF_(*z80); s->bc_ = Z80_BC_(*z80); s->de_ = Z80_DE_(*z80); s->hl_ = Z80_HL_(*z80);
+	s->memptr = Z80_MEMPTR(*z80);
+	s->i = z80->i; s->r = z80->r; s->r7 = z80->r7; s->im = z80->im;
+	s->iff1 = z80->iff1; s->iff2 = z80->iff2; s->halt_line = z80->halt_line;
+
+	z80_mmu_t *mmu = &ZXSPECTRUM.mmu;
+	memcpy(s->visible_banks, mmu->visible_banks, sizeof(mmu->visible_banks));
+	memcpy(s->visible_pages, mmu->visible_pages, sizeof(mmu->visible_pages));
+	s->current_rom = mmu->current_rom;
+	s->display_bank = mmu->display_bank;
+	s->last_7ffd = mmu->last_7ffd;
+	s->last_1ffd = mmu->last_1ffd;
+	s->enable_128k_banking = mmu->enable_128k_banking;
+	s->b_all_ram = mmu->b_all_ram;
+
+	s->border = ZXSPECTRUM.border;
+	s->timex_port = ZXSPECTRUM.timex_port;
+	s->ulaplus = ZXSPECTRUM.ulaplus;
+
+	const zx_divmmc_t *divmmc = &ZXSPECTRUM.divmmc;
+	s->divmmc_control = divmmc->control;
+	s->divmmc_automapped = divmmc->b_automapped;
+	s->divmmc_mapped = divmmc->b_mapped;
+	for (int slot = 0; slot < 2; slot++) {
+		s->divmmc_saved_pages[slot] = divmmc->saved_pages[slot];
+		s->divmmc_saved_types[slot] = divmmc->saved_types[slot];
+	}
+
+	const zx_if1_t *if1 = &ZXSPECTRUM.if1;
+	s->if1_paged = if1->b_paged;
+	s->if1_control = if1->control;
+	for (int slot = 0; slot < 2; slot++) {
+		s->if1_saved_pages[slot] = if1->saved_pages[slot];
+		s->if1_saved_types[slot] = if1->saved_types[slot];
+	}
+
+	const zx_ay_t *ay = &ZXSPECTRUM.ay;
+	memcpy(s->ay_regs, ay->regs, sizeof(s->ay_regs));
+	s->ay_selected = ay->selected;
+	s->ay_env_step = ay->env_step;
+	s->ay_env_attack = ay->env_attack;
+	s->ay_env_holding = ay->env_holding;
+	s->ay_env_count = ay->env_count;
+}
+
+// Map ram_file as the mmu backing store. Call after init_spectrum() and spectrum_power().
+// If the file (and its sidecar) is from a previous session the machine state gets restored,
+// otherwise the file is (re)initialized from the freshly powered up machine.
+// Returns true if a previous session has been resumed.
+bool spectrum_persist_open(const char *ram_file) {
+
+	if (MAPPING)
+		return false;
+
+	snprintf(STATE_FILE, sizeof(STATE_FILE), "%s.state", ram_file);
+
+	int fd = open(ram_file, O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		ltb_printf("persist: can't open \"%s\"\n", ram_file);
+		return false;
+	}
+
+	struct stat st;
+	bool b_existing = (fstat(fd, &st) == 0 && st.st_size == MEM_POOL_SIZE);
+	if (!b_existing && ftruncate(fd, MEM_POOL_SIZE) != 0) {
+		ltb_printf("persist: can't size \"%s\"\n", ram_file);
+		close(fd);
+		return false;
+	}
+
+	uint8_t *mapping = mmap(NULL, MEM_POOL_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);		// the mapping keeps its own reference
+	if (mapping == MAP_FAILED) {
+		ltb_printf("persist: can't map \"%s\"\n", ram_file);
+		return false;
+	}
+	MAPPING = mapping;
+
+	persist_state_t state;
+	bool b_resume = b_existing && _read_state(&state);
+
+	// fresh file (or stale/foreign sidecar): start from the current power on state
+	// roms are not part of the session state: always refresh them from the current banks
+	int first_bank = b_resume ? FIRST_ROM_BANK : 0;
+	for (int bank = first_bank; bank < MEM_NUM_BANKS; bank++)
+		memcpy(MAPPING + bank * MEM_BANK_SIZE, ZXSPECTRUM.mmu.banks[bank], MEM_BANK_SIZE);
+
+	z80_mmu_Rebind(&ZXSPECTRUM.mmu, MAPPING);
+
+	if (b_resume) {
+		_restore_state(&state);
+		ltb_printf("persist: resumed session from \"%s\"\n", ram_file);
+	}
+
+	// the sidecar is only valid together with the memory contents it was written with:
+	// drop it now so that a crashed session won't be resumed with stale cpu state
+	remove(STATE_FILE);
+
+	return b_resume;
+}
+
+// Store the sidecar state and flush/unmap the memory file
+// Call this on exit before the devices get detached (their paging is part of the state):
+// spectrum memory must not be accessed anymore afterwards (paging only moves pointers)
+void spectrum_persist_close() {
+
+	if (!MAPPING)
+		return;
+
+	persist_state_t state;
+	_capture_state(&state);
+
+	FILE *f = fopen(STATE_FILE, "wb");
+	if (f) {
+		fwrite(&state, sizeof(persist_state_t), 1, f);
+		fclose(f);
+	}
+
+	msync(MAPPING, MEM_POOL_SIZE, MS_SYNC);
+	munmap(MAPPING, MEM_POOL_SIZE);
+	MAPPING = NULL;
+}
+
+// spectrum_persist.c
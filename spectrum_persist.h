@@ -0,0 +1,21 @@
+#pragma once
+
+/**----------------------------------------------------------------------------
+ *	spectrum_persist.c
+ *  file backed spectrum memory: instant resume of a previous session
+ **/
+
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+bool spectrum_persist_open(const char *ram_file);
+void spectrum_persist_close();
+
+#ifdef __cplusplus
+}
+#endif
+
+// spectrum_persist.h
@@ -0,0 +1,359 @@
+/**----------------------------------------------------------------------------
+ *	spectrum_snapshot.c
+ *  .sna and .z80 snapshots (also gzipped or zipped), streamed straight into the ram banks
+ *
+ *	- the snapshot is read front to back through an instream: memory goes directly into the
+ *	  mmu's ram banks (z80_mmu_WriteBank()), .z80 pages get unpacked on the way in
+ *	- 48k snapshots load on any model (a 128k model gets locked to the 48k rom, the way
+ *	  USR 0 leaves it), 128k ones need a 128k model
+ *	- 128k .sna: the bank paged in at 0xC000 comes with the first 48k, but which one it is
+ *	  only follows after: it goes into bank 0 and moves once the paging byte is known
+ *	  (bank 0 itself always comes later in that case)
+ *	- call after spectrum_power(): the machine is expected to be freshly set up
+ **/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+#include "spectrum.h"
+#include "spectrum_snapshot.h"
+#include "instream.h"
+#include "text_box_l.h"
+
+#define SNA_HEADER_SIZE		27
+#define SNA_48K_SIZE		(SNA_HEADER_SIZE + 3 * MEM_BANK_SIZE)
+#define Z80_HEADER_SIZE		30
+#define Z80_MAX_EXTRA		56
+
+// buffered byte input for the .z80 unpacker
+typedef struct {
+	instream_t stream;
+	uint8_t buf[4096];
+	size_t len, pos;
+} snap_input_t;
+
+static int _getc(snap_input_t *in) {
+	if (in->pos == in->len) {
+		in->len = instream_read(&in->stream, in->buf, sizeof(in->buf));
+		in->pos = 0;
+		if (!in->len)
+			return -1;
+	}
+	return in->buf[in->pos++];
+}
+
+static bool _read(snap_input_t *in, uint8_t *dest, size_t len) {
+	size_t n = 0;
+	while (in->pos < in->len && n < len)
+		dest[n++] = in->buf[in->pos++];
+	return n + instream_read(&in->stream, dest + n, len - n) == len;
+}
+
+static bool _skip(snap_input_t *in, size_t len) {
+	size_t n = in->len - in->pos < len ? in->len - in->pos : len;
+	in->pos += n;
+	return n + instream_skip(&in->stream, len - n) == len;
+}
+
+static uint16_t _word(const uint8_t *p) {
+	return p[0] | p[1] << 8;
+}
+
+static uint8_t *_bank(int bank_no) {
+	uint8_t *bank = z80_mmu_WriteBank(&ZXSPECTRUM.mmu, bank_no);
+	if (!bank)
+		ltb_printf("snapshot: no ram bank %d on this model\n", bank_no);
+	return bank;
+}
+
+// 48k snapshots on a 128k model: 48k rom, paging locked (the +3 needs its high rom bit for that rom)
+static void _page_48k() {
+	z80_mmu_t *mmu = &ZXSPECTRUM.mmu;
+	if (ZXSPECTRUM.zx_type == ZX_TYPE_48K)
+		return;
+	if (ZXSPECTRUM.zx_type == ZX_TYPE_PLUS3)
+		_zx_MMU_update_memory_map_plus3(mmu, 0x04);
+	_zx_MMU_update_memory_map_zx128(mmu, 0x30);
+}
+
+static void _page_128k(uint8_t port_7ffd, uint8_t port_1ffd) {
+	z80_mmu_t *mmu = &ZXSPECTRUM.mmu;
+	if (ZXSPECTRUM.zx_type == ZX_TYPE_PLUS3)
+		_zx_MMU_update_memory_map_plus3(mmu, port_1ffd);
+	_zx_MMU_update_memory_map_zx128(mmu, port_7ffd);
+}
+
+static void _set_border(uint8_t border) {
+	ZXSPECTRUM.border = border & 7;
+	ZXSPECTRUM.beam.border_colour = border & 7;
+}
+
+/**----------------------------------------------------------------------------
+ *	.SNA
+ **/
+
+static bool _load_sna(snap_input_t *in) {
+	static const int BANKS_48K[3] = { RAM_5_BANK, RAM_2_BANK, RAM_0_BANK };
+	Z80 *z80 = ZXSPECTRUM.cpu;
+	uint8_t h[SNA_HEADER_SIZE];
+
+	// 48k: 49179 bytes, 128k: 131103 (or 147487 with the paged bank repeated)
+	bool b_128k = in->stream.size > SNA_48K_SIZE;
+	if (b_128k && ZXSPECTRUM.zx_type == ZX_TYPE_48K) {
+		ltb_printf("snapshot: 128k snapshot, needs a 128k model\n");
+		return false;
+	}
+	if (!_read(in, h, sizeof(h)))
+		return false;
+
+	for (int i = 0; i < 3; i++) {
+		uint8_t *bank = _bank(BANKS_48K[i]);
+		if (!bank || !_read(in, bank, MEM_BANK_SIZE))
+			return false;
+	}
+
+	z80->i = h[0];
+	Z80_HL_(*z80) = _word(h + 1); Z80_DE_(*z80) = _word(h + 3);
+	Z80_BC_(*z80) = _word(h + 5); Z80_AF_(*z80) = _word(h + 7);
+	Z80_HL(*z80) = _word(h + 9); Z80_DE(*z80) = _word(h + 11); Z80_BC(*z80) = _word(h + 13);
+	Z80_IY(*z80) = _word(h + 15); Z80_IX(*z80) = _word(h + 17);
+	z80->iff1 = z80->iff2 = (h[19] >> 2) & 1;
+	z80->r = z80->r7 = h[20];
+	Z80_AF(*z80) = _word(h + 21);
+	Z80_SP(*z80) = _word(h + 23);
+	z80->im = h[25] & 3;
+	z80->halt_line = 0;
+	_set_border(h[26]);
+
+	if (!b_128k) {
+		// the pc is on the stack (the snapshot was taken in an interrupt: RETN continues)
+		_page_48k();
+		Z80_PC(*z80) = z80_mmu_GetWord(&ZXSPECTRUM.mmu, Z80_SP(*z80));
+		Z80_SP(*z80) += 2;
+		return true;
+	}
+
+	uint8_t t[4];
+	if (!_read(in, t, sizeof(t)))
+		return false;
+	Z80_PC(*z80) = _word(t);
+	uint8_t port_7ffd = t[2];
+	int paged = port_7ffd & 7;
+
+	// the third 16k went into bank 0: it belongs to the paged bank
+	if (paged != RAM_0_BANK) {
+		uint8_t *bank = _bank(paged), *bank_0 = _bank(RAM_0_BANK);
+		if (!bank || !bank_0)
+			return false;
+		memcpy(bank, bank_0, MEM_BANK_SIZE);
+	}
+
+	// then the other banks in order (the paged one isn't repeated)
+	for (int bank_no = RAM_0_BANK; bank_no <= RAM_7_BANK; bank_no++) {
+		if (bank_no == RAM_5_BANK || bank_no == RAM_2_BANK || bank_no == paged)
+			continue;
+		uint8_t *bank = _bank(bank_no);
+		if (!bank || !_read(in, bank, MEM_BANK_SIZE))
+			return false;
+	}
+	_page_128k(port_7ffd, 0);
+	return true;
+}
+
+/**----------------------------------------------------------------------------
+ *	.Z80
+ **/
+
+// Fill banks (16k each, in order) from the input: ED ED nn bb repeats bb nn times
+// in_len: bytes of input to use, -1 for as many as it takes to fill the banks
+static bool _unpack(snap_input_t *in, uint8_t *const *banks, int num_banks, long in_len, bool b_packed) {
+	uint32_t out_len = num_banks * MEM_BANK_SIZE;
+	uint32_t pos = 0;
+	bool b_bounded = in_len >= 0;
+
+	#define PUT(b)	(banks[pos / MEM_BANK_SIZE][pos % MEM_BANK_SIZE] = (b), pos++)
+
+	if (!b_packed) {
+		for (int i = 0; i < num_banks; i++)
+			if (!_read(in, banks[i], MEM_BANK_SIZE))
+				return false;
+		return true;
+	}
+
+	while (pos < out_len && (!b_bounded || in_len > 0)) {
+		int c = _getc(in);
+		if (c < 0)
+			return false;
+		if (b_bounded)
+			in_len--;
+		if (c != 0xED || (b_bounded && in_len == 0)) {
+			PUT(c);
+			continue;
+		}
+		int d = _getc(in);
+		if (d < 0)
+			return false;
+		if (b_bounded)
+			in_len--;
+		if (d != 0xED) {
+			// a single ED: the byte after it is never the start of a repeat
+			PUT(0xED);
+			if (pos < out_len)
+				PUT(d);
+			continue;
+		}
+		// a repeat can't run past the end of the page
+		if (b_bounded && in_len < 2)
+			return false;
+		int count = _getc(in);
+		int value = _getc(in);
+		if (count < 0 || value < 0)
+			return false;
+		if (b_bounded)
+			in_len -= 2;
+		while (count-- && pos < out_len)
+			PUT(value);
+	}
+	#undef PUT
+
+	// whatever is left of the page (a v1 snapshot's end marker) isn't needed
+	return !b_bounded || in_len == 0 || _skip(in, in_len);
+}
+
+// hardware types (byte 34) of the 128k models: version 2 and version 3 differ
+static bool _is_128k_hardware(uint8_t hw, bool b_v2) {
+	if (b_v2)
+		return hw == 3 || hw == 4;
+	// 128k, +3, pentagon, scorpion, +2, +2A (11 is the didaktik, a 48k)
+	return hw >= 4 && hw <= 13 && hw != 11;
+}
+
+static bool _load_z80(snap_input_t *in) {
+	Z80 *z80 = ZXSPECTRUM.cpu;
+	uint8_t h[Z80_HEADER_SIZE];
+	uint8_t x[Z80_MAX_EXTRA] = { 0 };
+
+	if (!_read(in, h, sizeof(h)))
+		return false;
+
+	uint8_t flags = h[12] == 0xFF ? 1 : h[12];
+	uint16_t pc = _word(h + 6);
+	bool b_128k = false;
+
+	if (pc != 0) {
+		// version 1: 48k, packed unless flags says it isn't
+		uint8_t *banks[3] = { _bank(RAM_5_BANK), _bank(RAM_2_BANK), _bank(RAM_0_BANK) };
+		if (!banks[0] || !banks[1] || !banks[2] || !_unpack(in, banks, 3, -1, flags & 0x20))
+			return false;
+	}
+	else {
+		// version 2 and 3: an extra header, then the pages one by one
+		uint8_t l[2];
+		if (!_read(in, l, 2))
+			return false;
+		uint16_t extra_len = _word(l);
+		uint16_t n = extra_len < sizeof(x) ? extra_len : sizeof(x);
+		if (!_read(in, x, n) || !_skip(in, extra_len - n))
+			return false;
+		pc = _word(x);
+		b_128k = _is_128k_hardware(x[2], extra_len == 23);
+		if (b_128k && ZXSPECTRUM.zx_type == ZX_TYPE_48K) {
+			ltb_printf("snapshot: 128k snapshot, needs a 128k model\n");
+			return false;
+		}
+
+		uint8_t p[3];
+		while (_read(in, p, sizeof(p))) {
+			uint16_t len = _word(p);
+			int page = p[2];
+			// 48k: page 8 is 0x4000, 4 is 0x8000, 5 is 0xC000; 128k: pages 3-10 are the banks 0-7
+			int bank_no = b_128k ? (page >= 3 && page <= 10 ? page - 3 : -1)
+				: page == 8 ? RAM_5_BANK : page == 4 ? RAM_2_BANK : page == 5 ? RAM_0_BANK : -1;
+			long in_len = len == 0xFFFF ? MEM_BANK_SIZE : len;
+			if (bank_no < 0) {
+				// roms and such
+				if (!_skip(in, in_len))
+					return false;
+				continue;
+			}
+			uint8_t *bank = _bank(bank_no);
+			if (!bank || !_unpack(in, &bank, 1, in_len, len != 0xFFFF))
+				return false;
+		}
+	}
+
+	Z80_AF(*z80) = h[0] << 8 | h[1];
+	Z80_BC(*z80) = _word(h + 2);
+	Z80_HL(*z80) = _word(h + 4);
+	Z80_PC(*z80) = pc;
+	Z80_SP(*z80) = _word(h + 8);
+	z80->i = h[10];
+	z80->r = z80->r7 = (h[11] & 0x7F) | (flags & 1) << 7;
+	Z80_DE(*z80) = _word(h + 13);
+	Z80_BC_(*z80) = _word(h + 15);
+	Z80_DE_(*z80) = _word(h + 17);
+	Z80_HL_(*z80) = _word(h + 19);
+	Z80_AF_(*z80) = h[21] << 8 | h[22];
+	Z80_IY(*z80) = _word(h + 23);
+	Z80_IX(*z80) = _word(h + 25);
+	z80->iff1 = h[27] != 0;
+	z80->iff2 = h[28] != 0;
+	z80->im = h[29] & 3;
+	z80->halt_line = 0;
+	_set_border(flags >> 1);
+
+	if (!b_128k) {
+		_page_48k();
+		return true;
+	}
+
+	// the ay registers (then the one last selected), the +3 paging port comes with version 3 only
+	for (int reg = 0; reg < 16; reg++) {
+		zx_ay_select(&ZXSPECTRUM.ay, reg);
+		zx_ay_write(&ZXSPECTRUM.ay, 0, x[7 + reg]);
+	}
+	zx_ay_select(&ZXSPECTRUM.ay, x[6]);
+	_page_128k(x[3], x[54]);
+	return true;
+}
+
+/**----------------------------------------------------------------------------
+ *	LOADING
+ **/
+
+// Load a .sna or .z80 snapshot: "file.zip" takes the first snapshot in the zip, "file.zip:entry" a given one
+// The format goes by the name (of the file, the zip entry or the gzipped file)
+bool spectrum_snapshot_load(const char *file) {
+	static const char *const EXTS[] = { ".sna", ".z80", NULL };
+	static snap_input_t in;
+
+	if (!instream_open(&in.stream, file, EXTS)) {
+		ltb_printf("snapshot: can't open \"%s\"\n", file);
+		return false;
+	}
+	in.len = in.pos = 0;
+
+	const char *ext = strrchr(in.stream.name, '.');
+	bool b_ok = false;
+	if (ext && !strcasecmp(ext, ".sna"))
+		b_ok = _load_sna(&in);
+	else if (ext && !strcasecmp(ext, ".z80"))
+		b_ok = _load_z80(&in);
+	else {
+		ltb_printf("snapshot: \"%s\" is neither .sna nor .z80\n", in.stream.name);
+		instream_close(&in.stream);
+		return false;
+	}
+
+	// a failed load leaves the machine half loaded: it starts over from power on instead
+	ltb_printf(b_ok ? "snapshot: loaded \"%s\"\n" : "snapshot: can't load \"%s\"\n", in.stream.name);
+	if (!b_ok)
+		spectrum_power(1);
+
+	instream_close(&in.stream);
+	return b_ok;
+}
+
+// spectrum_snapshot.c
@@ -0,0 +1,20 @@
+#pragma once
+
+/**----------------------------------------------------------------------------
+ *	spectrum_snapshot.c
+ *  .sna and .z80 snapshots (also gzipped or zipped), streamed straight into the ram banks
+ **/
+
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+bool spectrum_snapshot_load(const char *file);
+
+#ifdef __cplusplus
+}
+#endif
+
+// spectrum_snapshot.h
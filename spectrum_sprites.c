@@ -0,0 +1,160 @@
+/**----------------------------------------------------------------------------
+ *	spectrum_sprites.c
+ *  ZXX hardware sprites
+ *
+ *	Attribute layout (port 0x57, auto incrementing, 4 or 5 bytes per sprite):
+ *	  0: X bits 0-7
+ *	  1: Y bits 0-7
+ *	  2: bits 4-7 palette offset, bit 3 X mirror, bit 2 Y mirror, bit 1 rotate, bit 0 X bit 8
+ *	  3: bit 7 visible, bit 6 byte 4 follows, bits 0-5 pattern
+ *	  4: bit 7 4 bit pattern, bit 6 second half of the pattern (4 bit), bit 0 Y bit 8
+ *
+ *	The per line sprite sets are maintained whenever a sprite's attributes are complete,
+ *	so the renderer only ever visits the sprites that are actually on a line.
+ **/
+
+#include <string.h>
+
+#include "spectrum.h"
+#include "spectrum_sprites.h"
+
+
+/**----------------------------------------------------------------------------
+ *	ATTRIBUTES
+ */
+
+// add (or remove) a sprite to the sets of the lines it covers
+static void _set_lines(zx_sprites_t *sprites, int n, const zx_sprite_t *sp, bool b_set) {
+	const uint64_t bit = 1ull << (n & 63);
+
+	for (int i = 0; i < SPRITE_SIZE; i++) {
+		int line = (sp->y + i) & 511;
+		if (line >= SPRITE_LINES)
+			continue;
+		if (b_set)
+			sprites->line_sprites[line][n >> 6] |= bit;
+		else
+			sprites->line_sprites[line][n >> 6] &= ~bit;
+	}
+}
+
+// decode a sprite once all of its attribute bytes are in
+static void _update_sprite(zx_sprites_t *sprites, int n) {
+	zx_sprite_t *sp = &sprites->sprites[n];
+	const uint8_t *a = sp->attr;
+	const bool b_ext = (a[3] & 0x40) != 0;
+
+	if (sp->b_visible) {
+		_set_lines(sprites, n, sp, false);
+		sprites->num_visible--;
+	}
+
+	sp->x = a[0] | ((a[2] & 1) << 8);
+	sp->y = a[1] | (b_ext ? (a[4] & 1) << 8 : 0);
+	sp->palette_offset = a[2] & 0xF0;
+	sp->b_mirror_x = (a[2] & 0x08) != 0;
+	sp->b_mirror_y = (a[2] & 0x04) != 0;
+	sp->b_rotate = (a[2] & 0x02) != 0;
+	sp->b_visible = (a[3] & 0x80) != 0;
+	sp->b_4bit = b_ext && (a[4] & 0x80);
+	sp->pattern = (a[3] & 0x3F) * 256 + ((sp->b_4bit && (a[4] & 0x40)) ? 128 : 0);
+
+	if (sp->b_visible) {
+		_set_lines(sprites, n, sp, true);
+		sprites->num_visible++;
+	}
+}
+
+void zx_sprites_init(zx_sprites_t *sprites) {
+	memset(sprites, 0, sizeof(zx_sprites_t));
+	sprites->transparent = SPRITE_TRANSPARENT;
+	for (int c = 0; c < 256; c++)
+		sprites->colours[c] = spectrum_rgb332_argb32(c);
+}
+
+// port 0x303B: bits 0-6 attribute slot, bits 0-5 pattern (bit 7: second half)
+void zx_sprites_select(zx_sprites_t *sprites, uint8_t value) {
+	sprites->attr_slot = value & 0x7F;
+	sprites->attr_index = 0;
+	sprites->pattern_pos = (value & 0x3F) * 256 + ((value & 0x80) ? 128 : 0);
+}
+
+// port 0x57
+void zx_sprites_write_attr(zx_sprites_t *sprites, uint8_t value) {
+	int n = sprites->attr_slot;
+	zx_sprite_t *sp = &sprites->sprites[n];
+
+	sp->attr[sprites->attr_index++] = value;
+
+	// byte 3 tells whether there is a byte 4
+	if (sprites->attr_index == 5 || (sprites->attr_index == 4 && !(sp->attr[3] & 0x40))) {
+		if (sprites->attr_index == 4)
+			sp->attr[4] = 0;
+		_update_sprite(sprites, n);
+		sprites->attr_slot = (n + 1) & (SPRITE_COUNT - 1);
+		sprites->attr_index = 0;
+	}
+}
+
+// port 0x5B
+void zx_sprites_write_pattern(zx_sprites_t *sprites, uint8_t value) {
+	sprites->patterns[sprites->pattern_pos++ & (SPRITE_PATTERN_MEMORY - 1)] = value;
+}
+
+
+/**----------------------------------------------------------------------------
+ *	RENDERING
+ */
+
+// Draw the sprites covering sprite_line into dp (FRAME_WIDTH pixels, pixels doubled, sprite X 0
+// is the left edge of the visible display). Later sprites are drawn over earlier ones.
+// RETURN: false if there are no sprites on the line (dp has not been touched)
+bool zx_sprites_render_line(const zx_sprites_t *sprites, int sprite_line, uint32_t *dp) {
+
+	if (sprites->num_visible == 0 || sprite_line < 0 || sprite_line >= SPRITE_LINES)
+		return false;
+
+	const uint64_t *set = sprites->line_sprites[sprite_line];
+	if (!set[0] && !set[1])
+		return false;
+
+	for (int w = 0; w < SPRITE_COUNT / 64; w++) {
+		for (uint64_t bits = set[w]; bits; bits &= bits - 1) {
+			const zx_sprite_t *sp = &sprites->sprites[w * 64 + __builtin_ctzll(bits)];
+			const uint8_t *pattern = sprites->patterns + sp->pattern;
+			int row = (sprite_line - sp->y) & 511;
+
+			for (int c = 0; c < SPRITE_SIZE; c++) {
+				int vx = (sp->x + c) & 511;
+				if (vx >= DISPLAY_WIDTH)
+					continue;
+
+				// mirroring in display space, then rotate 90 degrees clockwise
+				int dx = sp->b_mirror_x ? SPRITE_SIZE - 1 - c : c;
+				int dy = sp->b_mirror_y ? SPRITE_SIZE - 1 - row : row;
+				int px = sp->b_rotate ? dy : dx;
+				int py = sp->b_rotate ? SPRITE_SIZE - 1 - dx : dy;
+
+				uint8_t index;
+				if (sp->b_4bit) {
+					uint8_t b = pattern[py * 8 + px / 2];
+					uint8_t nibble = (px & 1) ? (b & 0x0F) : (b >> 4);
+					if (nibble == (sprites->transparent & 0x0F))
+						continue;
+					index = sp->palette_offset | nibble;
+				}
+				else {
+					uint8_t v = pattern[py * SPRITE_SIZE + px];
+					if (v == sprites->transparent)
+						continue;
+					index = (uint8_t)(v + sp->palette_offset);
+				}
+				dp[vx * 2] = dp[vx * 2 + 1] = sprites->colours[index];
+			}
+		}
+	}
+	return true;
+}
+
+
+// spectrum_sprites.c
@@ -0,0 +1,61 @@
+#pragma once
+
+/**----------------------------------------------------------------------------
+ *	spectrum_sprites.c
+ *  ZXX hardware sprites: 128 16x16 sprites, 8 bit or 4 bit patterns
+ *  ports 0x303B (slot select), 0x57 (attributes), 0x5B (pattern data)
+ **/
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SPRITE_COUNT			128
+#define SPRITE_SIZE				16
+#define SPRITE_PATTERN_MEMORY	16384		// 64 8 bit patterns (or 128 4 bit patterns)
+#define SPRITE_LINES			256			// sprite coordinate lines that can be visible
+#define SPRITE_TRANSPARENT		0xE3		// default transparent colour index
+
+typedef struct {
+	uint8_t attr[5];			// as written through port 0x57
+
+	// decoded from attr
+	int16_t x, y;				// 9 bit, (32,32) is the top left pixel of the 256x192 display
+	uint16_t pattern;			// offset into the pattern memory
+	uint8_t palette_offset;		// added to the upper nibble of the colour index
+	bool b_visible;
+	bool b_4bit;
+	bool b_mirror_x, b_mirror_y, b_rotate;
+} zx_sprite_t;
+
+typedef struct {
+	zx_sprite_t sprites[SPRITE_COUNT];
+	uint8_t patterns[SPRITE_PATTERN_MEMORY];
+
+	// bit n of line_sprites[y]: sprite n covers sprite line y (kept up to date on attribute writes)
+	uint64_t line_sprites[SPRITE_LINES][SPRITE_COUNT / 64];
+	int num_visible;
+
+	// port write positions
+	uint8_t attr_slot;
+	uint8_t attr_index;
+	uint16_t pattern_pos;
+
+	uint8_t transparent;		// transparent colour index
+	uint32_t colours[256];		// RRRGGGBB sprite palette
+} zx_sprites_t;
+
+void zx_sprites_init(zx_sprites_t *sprites);
+void zx_sprites_select(zx_sprites_t *sprites, uint8_t value);
+void zx_sprites_write_attr(zx_sprites_t *sprites, uint8_t value);
+void zx_sprites_write_pattern(zx_sprites_t *sprites, uint8_t value);
+bool zx_sprites_render_line(const zx_sprites_t *sprites, int sprite_line, uint32_t *dp);
+
+#ifdef __cplusplus
+}
+#endif
+
+// spectrum_sprites.h
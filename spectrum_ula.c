@@ -178,5 +178,32 @@ uint8_t zx_ULA_get_key_row(zx_ula_t *ula, uint8_t row) {
 
 }
 
+// ULA port write: only changes to border, MIC or EAR get logged
+void zx_ULA_out(zx_ula_t *ula, uint32_t tstate, uint8_t value) {
+    zx_ula_log_t *log = &ula->out;
+
+    value &= 0x1F;
+    if (value == log->value)
+        return;
+    log->value = value;
+
+    zx_ula_out_t *e = &log->events[log->head++ & (ULA_OUT_LOG_SIZE - 1)];
+    e->tstate = tstate;
+    e->value = value;
+}
+
+// End of frame (all readers have caught up with frame_tstates): writes made during the
+// overshoot of the last instruction move over into the next frame
+void zx_ULA_end_frame(zx_ula_t *ula, uint32_t frame_tstates) {
+    zx_ula_log_t *log = &ula->out;
+
+    for (uint32_t i = log->head; i-- != log->head - ULA_OUT_LOG_SIZE; ) {
+        zx_ula_out_t *e = &log->events[i & (ULA_OUT_LOG_SIZE - 1)];
+        if (e->tstate < frame_tstates)
+            break;
+        e->tstate -= frame_tstates;
+    }
+}
+
 
 // spectrum_ula.c
\ No newline at end of file
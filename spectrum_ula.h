@@ -1,15 +1,46 @@
 #pragma once
 
+#include <stdint.h>
+
+#define ULA_OUT_LOG_SIZE	8192	// power of 2, more than the OUTs a frame can hold (~6350 at 11 T-states each)
+
+// a write to the ULA port (border, MIC, EAR) and when it happened
+typedef struct {
+	uint32_t tstate;			// frame relative
+	uint8_t value;				// bits 0-2 border, bit 3 MIC, bit 4 EAR
+} zx_ula_out_t;
+
+// Per frame ring of ULA port writes: the renderer (border) and the beeper (MIC/EAR)
+// read it with their own read index, both catch up with it at least once per frame
+typedef struct {
+	zx_ula_out_t events[ULA_OUT_LOG_SIZE];
+	uint32_t head;				// free running write index
+	uint8_t value;				// last value written
+} zx_ula_log_t;
+
 typedef struct {
 
 	// keyboard: 1 = key not pressed, 0 = key pressed
 	// http://www.breakintoprogram.co.uk/hardware/computers/zx-spectrum/keyboard
 	uint8_t key_matrix[8];		// keys encoded in bits 0-4
 
+	zx_ula_log_t out;			// port 0xFE writes
+
 } zx_ula_t;
 
 uint8_t zx_ULA_get_key_row(zx_ula_t *ula, uint8_t row);
 void zx_ULA_key_up(zx_ula_t *ula, uint8_t keysym);
 void zx_ULA_key_down(zx_ula_t *ula, uint8_t keysym);
+void zx_ULA_out(zx_ula_t *ula, uint32_t tstate, uint8_t value);
+void zx_ULA_end_frame(zx_ula_t *ula, uint32_t frame_tstates);
+
+// oldest event a reader at index read hasn't seen yet, if it happened before tstate
+static inline const zx_ula_out_t *zx_ULA_next_out(const zx_ula_log_t *log, uint32_t *read, uint32_t tstate) {
+	if (log->head - *read > ULA_OUT_LOG_SIZE)
+		*read = log->head - ULA_OUT_LOG_SIZE;		// reader fell behind: lost the oldest events
+	if (*read == log->head || log->events[*read & (ULA_OUT_LOG_SIZE - 1)].tstate >= tstate)
+		return 0;
+	return &log->events[(*read)++ & (ULA_OUT_LOG_SIZE - 1)];
+}
 
 // spectrum_ula.h
\ No newline at end of file
@@ -0,0 +1,394 @@
+/**----------------------------------------------------------------------------
+ *	tapcatalog.c
+ *  Tape catalog for LOAD "$"
+ *
+ *	The catalog lists every .tap/.tzx file of the tape directory (also gzipped, or the first
+ *	tape in a .zip) with its header blocks
+ *	(name, type, length, autostart/start address). It is kept in an index file in the tape
+ *	directory, so a run only looks at the files that changed since the last one: a file
+ *	whose mtime and size are still the same keeps its headers from the index.
+ *	The directory is rescanned when its mtime changes (files added or removed) or after
+ *	a SAVE has written to a tape file. Files changed in place by other programs show up
+ *	with the next rescan.
+ *	The listing program is built whenever the catalog changes: LOAD "$" itself only
+ *	copies it into memory, however many tapes there are.
+ **/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <dirent.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+
+#include "spectrum.h"
+#include "tapfile.h"
+#include "tapcatalog.h"
+#include "text_box_l.h"
+
+#define CATALOG_MAGIC		"TAPCAT01"
+#define REM					0xEA		// basic token
+
+// a header block on a tape
+typedef struct {
+	char name[10];
+	uint8_t type;				// program, number array, character array, bytes
+	uint16_t length;
+	uint16_t param1;			// autostart line / start address
+} tap_catalog_header_t;
+
+// a tape file
+typedef struct {
+	char file_name[TAP_CATALOG_NAME_SIZE];
+	int64_t mtime;				// ns
+	int64_t size;
+	uint32_t first_header;		// into the header table
+	uint32_t num_headers;
+} tap_catalog_entry_t;
+
+// the index file: magic, directory mtime, counts, then the two tables
+typedef struct {
+	char magic[8];
+	int64_t dir_mtime;
+	uint32_t num_entries;
+	uint32_t num_headers;
+} tap_catalog_index_t;
+
+static struct {
+	bool b_loaded;				// the index file has been read
+	atomic_bool b_stale;		// a tape file has been written to: check all of them
+	int64_t dir_mtime;			// the tape directory as of the last scan
+	tap_catalog_entry_t *entries;	// sorted by file name
+	uint32_t num_entries;
+	tap_catalog_header_t *headers;
+	uint32_t num_headers;
+	uint8_t program[TAP_CATALOG_MAX_PROGRAM];	// LOAD "$": the listing as a basic program
+	uint16_t program_size;
+} CATALOG;
+
+
+/**----------------------------------------------------------------------------
+ *	INDEX
+ */
+
+static int64_t _mtime(const struct stat *st) {
+	return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+static void _index_path(char *path, size_t size, const char *suffix) {
+	snprintf(path, size, "%s/%s%s", SPECTRUM_TAP_DIR, TAP_CATALOG_FILE, suffix);
+}
+
+// An index from a crash, an older build or somewhere else entirely: every entry has to name its
+// file and stay inside the header table, names in order (they get binary searched)
+static bool _index_valid(const tap_catalog_entry_t *entries, uint32_t num_entries, uint32_t num_headers) {
+	for (uint32_t i = 0; i < num_entries; i++) {
+		const tap_catalog_entry_t *entry = &entries[i];
+		if (!memchr(entry->file_name, 0, TAP_CATALOG_NAME_SIZE)
+			|| entry->first_header > num_headers || entry->num_headers > num_headers - entry->first_header)
+			return false;
+		if (i > 0 && strcmp(entries[i - 1].file_name, entry->file_name) >= 0)
+			return false;
+	}
+	return true;
+}
+
+static void _load_index() {
+	char path[SPECTRUM_MAX_FILE_DIR_LEN];
+	tap_catalog_index_t index;
+
+	_index_path(path, sizeof(path), "");
+	FILE *f = fopen(path, "rb");
+	if (!f)
+		return;
+	if (fread(&index, sizeof(index), 1, f) == 1 && !memcmp(index.magic, CATALOG_MAGIC, 8)) {
+		tap_catalog_entry_t *entries = malloc(index.num_entries * sizeof(tap_catalog_entry_t) + 1);
+		tap_catalog_header_t *headers = malloc(index.num_headers * sizeof(tap_catalog_header_t) + 1);
+		if (entries && headers
+			&& fread(entries, sizeof(tap_catalog_entry_t), index.num_entries, f) == index.num_entries
+			&& fread(headers, sizeof(tap_catalog_header_t), index.num_headers, f) == index.num_headers
+			&& _index_valid(entries, index.num_entries, index.num_headers)) {
+			CATALOG.entries = entries;
+			CATALOG.num_entries = index.num_entries;
+			CATALOG.headers = headers;
+			CATALOG.num_headers = index.num_headers;
+			CATALOG.dir_mtime = index.dir_mtime;
+		}
+		else {
+			free(entries);
+			free(headers);
+		}
+	}
+	fclose(f);
+}
+
+// written next to it and renamed over the old one: a crash never leaves half an index
+static void _save_index() {
+	char path[SPECTRUM_MAX_FILE_DIR_LEN], tmp_path[SPECTRUM_MAX_FILE_DIR_LEN];
+	tap_catalog_index_t index = { CATALOG_MAGIC, 0, CATALOG.num_entries, CATALOG.num_headers };
+
+	_index_path(path, sizeof(path), "");
+	_index_path(tmp_path, sizeof(tmp_path), ".tmp");
+	FILE *f = fopen(tmp_path, "wb");
+	if (!f)
+		return;
+	bool b_ok = fwrite(&index, sizeof(index), 1, f) == 1
+		&& fwrite(CATALOG.entries, sizeof(tap_catalog_entry_t), CATALOG.num_entries, f) == CATALOG.num_entries
+		&& fwrite(CATALOG.headers, sizeof(tap_catalog_header_t), CATALOG.num_headers, f) == CATALOG.num_headers;
+	b_ok &= fclose(f) == 0;
+	if (!b_ok || rename(tmp_path, path) != 0) {
+		remove(tmp_path);
+		return;
+	}
+
+	// the rename itself has changed the directory: that's the state the index is of
+	struct stat st;
+	if (stat(SPECTRUM_TAP_DIR, &st) == 0)
+		CATALOG.dir_mtime = _mtime(&st);
+	f = fopen(path, "r+b");
+	if (f) {
+		index.dir_mtime = CATALOG.dir_mtime;
+		fwrite(&index, sizeof(index), 1, f);
+		fclose(f);
+	}
+}
+
+
+/**----------------------------------------------------------------------------
+ *	SCAN
+ */
+
+typedef struct {
+	tap_catalog_entry_t *entries;
+	uint32_t num_entries, max_entries;
+	tap_catalog_header_t *headers;
+	uint32_t num_headers, max_headers;
+} catalog_build_t;
+
+static bool _grow(void **table, uint32_t *max, uint32_t count, size_t item_size) {
+	if (count < *max)
+		return true;
+	uint32_t new_max = *max ? *max * 2 : 256;
+	void *p = realloc(*table, new_max * item_size);
+	if (!p)
+		return false;
+	*table = p;
+	*max = new_max;
+	return true;
+}
+
+static int _compare_entries(const void *a, const void *b) {
+	return strcmp(((const tap_catalog_entry_t *)a)->file_name, ((const tap_catalog_entry_t *)b)->file_name);
+}
+
+static bool _is_tape_file(const char *name) {
+	static const char *EXTS[] = { ".tap", ".tzx", ".tap.gz", ".tzx.gz", ".zip" };
+	size_t len = strlen(name);
+	for (int i = 0; i < (int)(sizeof(EXTS) / sizeof(EXTS[0])); i++) {
+		size_t ext_len = strlen(EXTS[i]);
+		if (len > ext_len && !strcasecmp(name + len - ext_len, EXTS[i]))
+			return true;
+	}
+	return false;
+}
+
+// the headers of a tape file: 17 byte blocks with flag 0
+static void _scan_file(catalog_build_t *build, const char *path) {
+	static tap_reader_t reader;
+	uint32_t len;
+	const uint8_t *block;
+
+	if (!TAP_OpenReader(&reader, path))
+		return;
+	// only the first 19 bytes of a block are wanted: the rest is skipped, not copied
+	while ((block = TAP_ReadBlock(&reader, &len, 19))) {
+		if (len != 19 || block[0] != 0x00)
+			continue;
+		if (!_grow((void **)&build->headers, &build->max_headers, build->num_headers, sizeof(tap_catalog_header_t)))
+			break;
+		tap_catalog_header_t *header = &build->headers[build->num_headers++];
+		header->type = block[1];
+		memcpy(header->name, block + 2, 10);
+		header->length = block[12] | block[13] << 8;
+		header->param1 = block[14] | block[15] << 8;
+	}
+	TAP_CloseReader(&reader);
+}
+
+// Bring the catalog in line with the tape directory: only changed files are read
+static bool _rescan(int64_t dir_mtime) {
+	catalog_build_t build = { 0 };
+	char path[SPECTRUM_MAX_FILE_DIR_LEN];
+	struct dirent *de;
+	struct stat st;
+	int num_scanned = 0;
+
+	DIR *dir = opendir(SPECTRUM_TAP_DIR);
+	if (!dir)
+		return false;
+
+	while ((de = readdir(dir))) {
+		if (!_is_tape_file(de->d_name) || strlen(de->d_name) >= TAP_CATALOG_NAME_SIZE)
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", SPECTRUM_TAP_DIR, de->d_name);
+		if (stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+			continue;
+		if (!_grow((void **)&build.entries, &build.max_entries, build.num_entries, sizeof(tap_catalog_entry_t)))
+			break;
+
+		tap_catalog_entry_t *entry = &build.entries[build.num_entries++];
+		memset(entry, 0, sizeof(tap_catalog_entry_t));
+		strcpy(entry->file_name, de->d_name);
+		entry->mtime = _mtime(&st);
+		entry->size = st.st_size;
+		entry->first_header = build.num_headers;
+
+		const tap_catalog_entry_t *known = CATALOG.num_entries
+			? bsearch(entry, CATALOG.entries, CATALOG.num_entries, sizeof(tap_catalog_entry_t), _compare_entries)
+			: NULL;
+		if (known && known->mtime == entry->mtime && known->size == entry->size) {
+			for (uint32_t i = 0; i < known->num_headers; i++) {
+				if (!_grow((void **)&build.headers, &build.max_headers, build.num_headers, sizeof(tap_catalog_header_t)))
+					break;
+				build.headers[build.num_headers++] = CATALOG.headers[known->first_header + i];
+			}
+		}
+		else {
+			_scan_file(&build, path);
+			num_scanned++;
+		}
+		entry->num_headers = build.num_headers - entry->first_header;
+	}
+	closedir(dir);
+
+	qsort(build.entries, build.num_entries, sizeof(tap_catalog_entry_t), _compare_entries);
+	free(CATALOG.entries);
+	free(CATALOG.headers);
+	CATALOG.entries = build.entries;
+	CATALOG.num_entries = build.num_entries;
+	CATALOG.headers = build.headers;
+	CATALOG.num_headers = build.num_headers;
+	CATALOG.dir_mtime = dir_mtime;
+
+	ltb_printf("tape catalog: %u tapes, %d read\n", CATALOG.num_entries, num_scanned);
+	return true;
+}
+
+
+/**----------------------------------------------------------------------------
+ *	LISTING PROGRAM
+ */
+
+// a basic line: [number, big endian][length][REM text][ENTER], false when it doesn't fit
+static bool _add_line(uint16_t number, const char *text, uint16_t reserve) {
+	size_t len = strlen(text);
+	if (number > 9999 || CATALOG.program_size + 6 + len + reserve > TAP_CATALOG_MAX_PROGRAM)
+		return false;
+
+	uint8_t *p = CATALOG.program + CATALOG.program_size;
+	*p++ = number >> 8;
+	*p++ = number & 0xff;
+	*p++ = (len + 2) & 0xff;
+	*p++ = (len + 2) >> 8;
+	*p++ = REM;
+	for (size_t i = 0; i < len; i++) {
+		// no tokens, no control codes
+		uint8_t c = text[i];
+		*p++ = (c < 0x20 || c > 0x7f) ? '?' : c;
+	}
+	*p++ = 0x0D;
+	CATALOG.program_size = p - CATALOG.program;
+	return true;
+}
+
+static void _build_program() {
+	static const char *TYPES[] = { "Program", "Number array", "Character array", "Bytes" };
+	char text[128];
+	uint16_t line = 1;
+
+	CATALOG.program_size = 0;
+	snprintf(text, sizeof(text), " %u tapes in %s", CATALOG.num_entries, SPECTRUM_TAP_DIR);
+	_add_line(line++, text, 0);
+	_add_line(line++, " LOAD \"$name\" mounts name.tap", 0);
+	_add_line(line++, " (.tzx .gz .zip, \"$zip:entry\")", 0);
+
+	uint32_t e = 0;
+	for (; e < CATALOG.num_entries; e++) {
+		const tap_catalog_entry_t *entry = &CATALOG.entries[e];
+		uint16_t program_size = CATALOG.program_size;
+		uint16_t first_line = line;
+
+		// a tape goes in whole or not at all (room for the "more" line stays)
+		bool b_fits = _add_line(line++, entry->file_name, 32);
+		for (uint32_t h = 0; b_fits && h < entry->num_headers; h++) {
+			const tap_catalog_header_t *header = &CATALOG.headers[entry->first_header + h];
+			const char *type = header->type < 4 ? TYPES[header->type] : "?";
+			int n = snprintf(text, sizeof(text), "  %s: %.10s", type, header->name);
+			if (header->type == 0 && header->param1 < 10000)
+				snprintf(text + n, sizeof(text) - n, " LINE %u", header->param1);
+			else if (header->type == 3)
+				snprintf(text + n, sizeof(text) - n, " CODE %u,%u", header->param1, header->length);
+			b_fits = _add_line(line++, text, 32);
+		}
+		if (!b_fits) {
+			CATALOG.program_size = program_size;
+			line = first_line;
+			break;
+		}
+	}
+	if (e < CATALOG.num_entries) {
+		snprintf(text, sizeof(text), " ... and %u more", CATALOG.num_entries - e);
+		_add_line(line, text, 0);
+	}
+}
+
+
+/**----------------------------------------------------------------------------
+ *	API
+ */
+
+// Bring the catalog up to date
+// Nothing but a stat() of the tape directory when nothing has changed
+bool TAP_CatalogRefresh() {
+	struct stat st;
+
+	if (!CATALOG.b_loaded) {
+		_load_index();
+		_build_program();
+		CATALOG.b_loaded = true;
+	}
+	if (stat(SPECTRUM_TAP_DIR, &st) != 0)
+		return false;
+	if (_mtime(&st) == CATALOG.dir_mtime && !atomic_exchange(&CATALOG.b_stale, false))
+		return true;
+
+	if (!_rescan(_mtime(&st)))
+		return false;
+	_save_index();
+	_build_program();
+	return true;
+}
+
+// A tape file has changed (called by the tap writer thread)
+void TAP_CatalogInvalidate() {
+	atomic_store(&CATALOG.b_stale, true);
+}
+
+// LD-BYTES for LOAD "$": the header, then the listing program
+int TAP_CatalogLoadBlock(zx_spectrum_t *zx, uint8_t block_type, uint16_t block_len, uint16_t va) {
+
+	if (block_type == 0x00) {
+		if (block_len != 17)
+			return TAP_ERR_BLOCK_LEN;
+		// no autostart, no variables
+		TAP_CreateHeaderBlock(zx, 0, va, "catalog", CATALOG.program_size, 0x8000, CATALOG.program_size);
+		return TAP_OK;
+	}
+
+	for (uint16_t i = 0; i < block_len && i < CATALOG.program_size; i++)
+		z80_mmu_PutByte(&zx->mmu, CATALOG.program[i], va + i);
+	return block_len == CATALOG.program_size ? TAP_OK : TAP_ERR_BLOCK_LEN;
+}
+
+// tapcatalog.c
@@ -0,0 +1,29 @@
+#pragma once
+
+/**----------------------------------------------------------------------------
+ *	tapcatalog.c
+ *  Tape catalog: the header blocks of all .tap/.tzx files in SPECTRUM_TAP_DIR, for LOAD "$"
+ **/
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TAP_CATALOG_FILE		".catalog"		// the index, kept in SPECTRUM_TAP_DIR
+#define TAP_CATALOG_NAME_SIZE	64				// longest tape file name in the catalog (incl. 0)
+#define TAP_CATALOG_MAX_PROGRAM	30000			// the LOAD "$" listing has to fit a 48k machine
+
+struct zx_spectrum;
+
+bool TAP_CatalogRefresh();
+void TAP_CatalogInvalidate();
+int TAP_CatalogLoadBlock(struct zx_spectrum *zx, uint8_t block_type, uint16_t block_len, uint16_t va);
+
+#ifdef __cplusplus
+}
+#endif
+
+// tapcatalog.h
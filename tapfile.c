@@ -6,89 +6,119 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <stddef.h>
 
 #include "spectrum.h"
 #include "tapfile.h"
+#include "tapcatalog.h"
 //#include <fatfs/ff.h>
 
 
-// file functions: here for now
-// will move to a dedicated source file at some point
-
-#define P_ERR_FILE_OK	        0
-#define P_ERR_FILE_OPEN_ERROR   -1
-#define P_ERR_FILE_SEEK_ERROR   -2
-#define P_ERR_FILE_READ_ERROR   -3
-#define P_ERR_FILE_WRITE_ERROR  -4
-#define P_ERR_FILE_CACHE_ERROR  -5
-#define P_ERR_FILE_MODE_ERROR   -6
-
-#define P_FILE_WRITE_MODE_CREATE 0      // create if doesn't exist, overwrite otherwise
-#define P_FILE_WRITE_MODE_APPEND 1
-
-// Write data to file
-//	- either creates a new file (overwrites existing) or appends to given file
-//  - if NULL is passed in for fname and a file is open, append mode is always used
-//	- the file pointer is being cached inbetween calls so that several
-//		write calls to the same file can re-use it without having to re-open the file
-//	- file_name must be properly 0 terminated
-// Return: number of bytes written or negative error code
-
-static FILE *CUR_FILE = NULL;
-
-int P_WriteFileData(const char *fname, int mode, void *data, size_t len) {
-
-	if(!CUR_FILE) {
-		if(!fname) {
-			return P_ERR_FILE_CACHE_ERROR;
-		} else {
-			if(mode == P_FILE_WRITE_MODE_CREATE)
-				CUR_FILE = fopen(fname, "wb");
-			else if(mode == P_FILE_WRITE_MODE_APPEND)
-				CUR_FILE = fopen(fname, "wb+");
-			else
-				return P_ERR_FILE_MODE_ERROR;
-
-			if(!CUR_FILE)
-				return P_ERR_FILE_OPEN_ERROR;
-		}
+/**----------------------------------------------------------------------------
+ *	BACKGROUND WRITER
+ *	SAVE must not stall the emulation on file io: the traps hand complete .tap blocks
+ *	(length, flag, data, checksum) to a writer thread, which appends each with a single
+ *	write(). The file gets fsync'd when it's closed: for the next file or on TAP_Close().
+ **/
+
+typedef struct tap_write {
+	struct tap_write *next;
+	char file_name[SPECTRUM_MAX_FILE_DIR_LEN];
+	bool b_create;				// truncate the file first
+	size_t size;
+	uint8_t data[];
+} tap_write_t;
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+	bool b_running;
+	bool b_quit;
+	bool b_error;				// a write failed: reported by the next TAP_WriteBlock()
+	tap_write_t *head, *tail;
+
+	// writer thread only
+	int fd;
+	char file_name[SPECTRUM_MAX_FILE_DIR_LEN];
+} WRITER = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, .fd = -1 };
+
+static void _close_file() {
+	if (WRITER.fd < 0)
+		return;
+	fsync(WRITER.fd);
+	close(WRITER.fd);
+	WRITER.fd = -1;
+}
 
-		
+static bool _write_block(tap_write_t *w) {
+	if (w->b_create || WRITER.fd < 0 || strcmp(w->file_name, WRITER.file_name)) {
+		_close_file();
+		mkdir(SPECTRUM_TAP_DIR, 0755);
+		WRITER.fd = open(w->file_name, O_WRONLY | O_CREAT | O_APPEND | (w->b_create ? O_TRUNC : 0), 0644);
+		if (WRITER.fd < 0)
+			return false;
+		strcpy(WRITER.file_name, w->file_name);
 	}
+	for (size_t done = 0; done < w->size; ) {
+		ssize_t n = write(WRITER.fd, w->data + done, w->size - done);
+		if (n < 0)
+			return false;
+		done += n;
+	}
+	return true;
+}
 
-
-	return 0;
-	
-#if 0
-	static FIL *cur_file = NULL;
-    static FIL file;
-    UINT n_written = 0;
-
-    // note: only "create new" implemented right now
-    if(!cur_file) {
-    	FRESULT Result = f_open(&file, fname, FA_WRITE | FA_CREATE_ALWAYS);
-	    if (Result != FR_OK) {
-		    return P_ERR_FILE_OPEN_ERROR;
-	    }
-        cur_file = &file;
-    }
-
-	if (f_write(cur_file, data, (UINT)len, &n_written) != FR_OK || n_written != len) {
-        return P_ERR_FILE_WRITE_ERROR;
-    }
-	return (int)n_written;
-#endif
-
+static void *_writer_thread(void *arg) {
+	(void)arg;
+	pthread_mutex_lock(&WRITER.lock);
+	for (;;) {
+		while (!WRITER.head && !WRITER.b_quit)
+			pthread_cond_wait(&WRITER.cond, &WRITER.lock);
+		if (!WRITER.head)
+			break;		// quit, and everything has been written
+
+		tap_write_t *w = WRITER.head;
+		WRITER.head = w->next;
+		if (!WRITER.head)
+			WRITER.tail = NULL;
+		pthread_mutex_unlock(&WRITER.lock);
+
+		bool b_ok = _write_block(w);
+		free(w);
+
+		// the file has changed under the tape catalog
+		TAP_CatalogInvalidate();
+
+		pthread_mutex_lock(&WRITER.lock);
+		WRITER.b_error |= !b_ok;
+	}
+	pthread_mutex_unlock(&WRITER.lock);
+	_close_file();
+	return NULL;
 }
 
-// maximum block size for tap IO is 64k
-//static uint8_t IOBUF[0xffff];
+// Wait for all queued blocks to be written and close the file
+void TAP_Close() {
+	if (!WRITER.b_running)
+		return;
+	pthread_mutex_lock(&WRITER.lock);
+	WRITER.b_quit = true;
+	pthread_cond_signal(&WRITER.cond);
+	pthread_mutex_unlock(&WRITER.lock);
+	pthread_join(WRITER.thread, NULL);
+	WRITER.b_running = WRITER.b_quit = false;
+}
 
 // write a word to spectrum memory in the std. lo->hi order
-static void _write_word(Z80 *z80, uint16_t va, uint16_t word) {
+static void _write_word(z80_mmu_t *mmu, uint16_t va, uint16_t word) {
 
-    z80->write(0, va,   (word & 0x00ff));
-    z80->write(0, va+1,((word & 0xff00)>>8));
+    z80_mmu_PutByte(mmu, (word & 0x00ff), va);
+    z80_mmu_PutByte(mmu, ((word & 0xff00)>>8), va+1);
 
 }
 
@@ -106,144 +136,290 @@ static void _write_word(Z80 *z80, uint16_t va, uint16_t word) {
 // Note that block_type encodes: Program (0), Number array (1), Character Array (2) or Code (3) here (not header/data)
 void TAP_CreateHeaderBlock (
 	zx_spectrum_t *zx, uint8_t block_type, uint16_t va, 
-	char *name, uint16_t data_len, uint16_t p1, uint16_t p2) {
+	const char *name, uint16_t data_len, uint16_t p1, uint16_t p2) {
 	
-    Z80 *z80 = zx->cpu;
-	z80->write(0, va++, block_type);
+    z80_mmu_t *mmu = &zx->mmu;
+	z80_mmu_PutByte(mmu, block_type, va++);
 	int name_len = (int)strlen(name);
 	if (name_len > 10) name_len = 10;
 	int i = 0;
 	
 	for(; i < name_len; i++) 
-		z80->write(0, va++, name[i]);
+		z80_mmu_PutByte(mmu, name[i], va++);
 	
 	if (i < 10) {
 		// need to pad with spaces
 		for (; i < 10; i++)
-			z80->write(0, va++, ' ');
+			z80_mmu_PutByte(mmu, ' ', va++);
 	}
 
-	_write_word(z80, va, data_len); va += 2;
-	_write_word(z80, va, p1); va += 2;
-	_write_word(z80, va, p2); va += 2;
+	_write_word(mmu, va, data_len); va += 2;
+	_write_word(mmu, va, p1); va += 2;
+	_write_word(mmu, va, p2); va += 2;
 }
 
-void *_get_physical_address(zx_spectrum_t *zx, uint16_t va) {
-    //return &zx->spectrum_memory[va];
-	return 0;
+// Write a tap block from spectrum memory to filename (in SPECTRUM_TAP_DIR), in the background
+// - va, block_len: the block in spectrum memory (no flag byte), as in IX and DE for SA-BYTES
+// - b_create: start a new file, otherwise the block gets appended
+// The block is copied out (and its checksum computed) right away: spectrum memory is free
+// to change as soon as this returns
+int TAP_WriteBlock(zx_spectrum_t *zx, const char *filename, bool b_create, uint8_t block_type, uint16_t block_len, uint16_t va) {
+
+	if (block_len > 0xFFFF - 2)
+		return TAP_ERR_BLOCK_LEN;
+
+	tap_write_t *w = malloc(sizeof(tap_write_t) + block_len + 4);
+	if (!w)
+		return TAP_ERR_FILE_ERROR;
+	w->next = NULL;
+	w->b_create = b_create;
+	snprintf(w->file_name, sizeof(w->file_name), "%s/%s", SPECTRUM_TAP_DIR, filename);
+
+	// [2 bytes block len][1 byte flag][data][1 byte XOR checksum]
+	uint8_t *p = w->data;
+	uint16_t file_block_len = block_len + 2;
+	*p++ = file_block_len & 0xff;
+	*p++ = file_block_len >> 8;
+	*p++ = block_type;
+	uint8_t check = block_type;
+	for (int i = 0; i < block_len; i++) {
+		uint8_t byte = z80_mmu_GetByte(&zx->mmu, va++);
+		check ^= byte;
+		*p++ = byte;
+	}
+	*p++ = check;
+	w->size = p - w->data;
+
+	pthread_mutex_lock(&WRITER.lock);
+	bool b_error = WRITER.b_error;
+	WRITER.b_error = false;
+	if (!WRITER.b_running)
+		WRITER.b_running = pthread_create(&WRITER.thread, NULL, _writer_thread, NULL) == 0;
+	if (WRITER.b_running) {
+		if (WRITER.tail)
+			WRITER.tail->next = w;
+		else
+			WRITER.head = w;
+		WRITER.tail = w;
+		pthread_cond_signal(&WRITER.cond);
+	}
+	else {
+		free(w);
+		b_error = true;
+	}
+	pthread_mutex_unlock(&WRITER.lock);
+
+	// a previous block didn't make it to the file
+	return b_error ? TAP_ERR_FILE_ERROR : TAP_OK;
 }
 
-// write a tap block from spectrum memory to a file 
-// note that "va" is the virtual address of the tap data block inside spectrum memory space
-int TAP_WriteBlock(zx_spectrum_t *zx, char *filename, uint8_t block_type, uint16_t block_len, uint8_t check, uint16_t va) {
 
-	char fname[SPECTRUM_MAX_FILE_DIR_LEN];
+/**----------------------------------------------------------------------------
+ *	READING
+ *	Tapes are read front to back through an instream (so they can be gzipped or sit in a
+ *	zip): a block at a time into the reader's buffer, the only memory a tape needs
+ **/
 
-	// complete the filename
-	strcpy(fname, "./tap");     // add some setting for a "tap file dir" or something
-	strcat(fname, "/");
-	strcat(fname, filename);
+static const char *const TAPE_EXTS[] = { ".tap", ".tzx", NULL };
 
-    uint8_t *data = (uint8_t*)_get_physical_address(zx, va);
+// a few bytes that were read ahead (the .tzx signature check) come first
+static size_t _read(tap_reader_t *reader, uint8_t *buf, size_t len) {
+	size_t n = 0;
+	while (reader->peek_pos < reader->peek_len && n < len)
+		buf[n++] = reader->peek[reader->peek_pos++];
+	n += instream_read(&reader->stream, buf + n, len - n);
+	reader->position += (uint32_t)n;
+	return n;
+}
 
-	uint16_t file_block_len = block_len + 2;
-	if (block_type == 0x00) {
-		P_WriteFileData(fname, P_FILE_WRITE_MODE_CREATE, &file_block_len, 2);	// write total block length (check byte order?)
-		P_WriteFileData(fname, P_FILE_WRITE_MODE_APPEND, &block_type, 1);
-		P_WriteFileData(fname, P_FILE_WRITE_MODE_APPEND, data, block_len);
-		P_WriteFileData(fname, P_FILE_WRITE_MODE_APPEND, &check, 1);
+static size_t _skip(tap_reader_t *reader, size_t len) {
+	size_t n = 0;
+	while (reader->peek_pos < reader->peek_len && n < len) {
+		reader->peek_pos++;
+		n++;
 	}
-	else if (block_type == 0xff) {
-		P_WriteFileData(fname, P_FILE_WRITE_MODE_APPEND, &file_block_len, 2);	// write total block length (check byte order?)
-		P_WriteFileData(fname, P_FILE_WRITE_MODE_APPEND, &block_type, 1);
-		for (int i = 0; i < block_len; i++) {
-			check = check ^ *((uint8_t *)data);
-			P_WriteFileData(fname, P_FILE_WRITE_MODE_APPEND, data++, 1);
-		}
-		P_WriteFileData(fname, P_FILE_WRITE_MODE_APPEND, &check, 1);
-
-		// P_WriteFileData() caches it's filehandle between calls so that, as long
-		// as filename remains the same, it can re-use it for appending more data 
-		// and does not need to reopen the file on each call
-		// Here we want the file forcibly closed though so that another .tap write with
-		// the same name causes an overwrite and not an append
-		//P_CloseFile();
+	n += instream_skip(&reader->stream, len - n);
+	reader->position += (uint32_t)n;
+	return n;
+}
+
+// Open a .tap or .tzx file (gzipped, or the first tape in a zip unless it's "file.zip:entry")
+bool TAP_OpenReader(tap_reader_t *reader, const char *path) {
+	memset(reader, 0, offsetof(tap_reader_t, block));
+	if (!instream_open(&reader->stream, path, TAPE_EXTS))
+		return false;
+	reader->peek_len = (int)instream_read(&reader->stream, reader->peek, sizeof(reader->peek));
+	reader->b_tzx = reader->peek_len == sizeof(reader->peek) && !memcmp(reader->peek, "ZXTape!\x1A", 8);
+	if (reader->b_tzx) {
+		reader->peek_pos = reader->peek_len;
+		reader->position = reader->peek_len;
 	}
+	reader->b_open = true;
+	return true;
+}
 
-    return TAP_OK;
+void TAP_CloseReader(tap_reader_t *reader) {
+	if (reader->b_open)
+		instream_close(&reader->stream);
+	reader->b_open = false;
 }
 
+// bytes of a tzx block (after its id) up to and including its length field
+static uint32_t _tzx_head(uint8_t id) {
+	static const uint8_t HEAD[256] = {
+		[0x10] = 0x04, [0x11] = 0x12, [0x12] = 0x04, [0x13] = 0x01, [0x14] = 0x0A, [0x15] = 0x08,
+		[0x20] = 0x02, [0x21] = 0x01, [0x23] = 0x02, [0x24] = 0x02, [0x26] = 0x02, [0x28] = 0x02,
+		[0x2A] = 0x04, [0x2B] = 0x05, [0x30] = 0x01, [0x31] = 0x02, [0x32] = 0x02, [0x33] = 0x01,
+		[0x35] = 0x14, [0x5A] = 0x09,
+	};
+	bool b_empty = id == 0x22 || id == 0x25 || id == 0x27;
+	return HEAD[id] ? HEAD[id] : b_empty ? 0 : 4;
+}
 
-// Load a block of data from a mounted tap file
-// 
+// Length of the tzx block with head p (after its id)
+// b_data: the types that carry a [flag][data][checksum] block, it follows the head
+static uint64_t _tzx_block(const uint8_t *p, uint8_t id, bool *b_data) {
+	#define W(o)	((uint32_t)p[o] | (uint32_t)p[(o)+1] << 8)
+	#define T(o)	(W(o) | (uint32_t)p[(o)+2] << 16)
+	#define D(o)	(W(o) | W((o)+2) << 16)
+
+	*b_data = id == 0x10 || id == 0x11 || id == 0x14;
+	switch (id) {
+	case 0x10: return 0x04 + W(0x02);	// standard speed data
+	case 0x11: return 0x12 + T(0x0F);	// turbo speed data
+	case 0x14: return 0x0A + T(0x07);	// pure data
+	case 0x13: return 0x01 + p[0] * 2;
+	case 0x15: return 0x08 + T(0x05);
+	case 0x21: case 0x30: return 0x01 + p[0];
+	case 0x26: return 0x02 + W(0) * 2;
+	case 0x28: case 0x32: return 0x02 + W(0);
+	case 0x31: return 0x02 + p[1];
+	case 0x33: return 0x01 + p[0] * 3;
+	case 0x35: return 0x14 + (uint64_t)D(0x10);
+	case 0x12: case 0x20: case 0x23: case 0x24: case 0x2A: case 0x2B: case 0x5A:
+		return _tzx_head(id);
+	default:
+		// 0x18, 0x19 and the ones of later versions of the format start with their length
+		return _tzx_head(id) ? 4 + (uint64_t)D(0) : 0;
+	}
+	#undef W
+	#undef T
+	#undef D
+}
+
+// Read the next tape block ([flag][data][checksum]), *len bytes long
+// Only up to max_len bytes go into the buffer (the rest is skipped): the catalog just wants headers
+// Returns the block or NULL at the end of the tape
+const uint8_t *TAP_ReadBlock(tap_reader_t *reader, uint32_t *len, uint32_t max_len) {
+	uint8_t head[0x20];
+	uint64_t block_len;
+
+	if (max_len > sizeof(reader->block))
+		max_len = sizeof(reader->block);
+
+	while (reader->b_open) {
+		if (reader->b_tzx) {
+			if (_read(reader, head, 1) != 1)
+				break;
+			uint8_t id = head[0];
+			uint32_t head_len = _tzx_head(id);
+			bool b_data;
+			if (_read(reader, head, head_len) != head_len)
+				break;
+			block_len = _tzx_block(head, id, &b_data) - head_len;
+			if (!b_data || !block_len) {
+				if (_skip(reader, block_len) != block_len)
+					break;
+				continue;
+			}
+		}
+		else {
+			// .tap: [2 bytes block len][block]
+			if (_read(reader, head, 2) != 2)
+				break;
+			block_len = head[0] | head[1] << 8;
+			if (!block_len)
+				continue;
+		}
+
+		uint32_t n = block_len < max_len ? (uint32_t)block_len : max_len;
+		if (_read(reader, reader->block, n) != n || _skip(reader, block_len - n) != block_len - n)
+			break;
+		*len = block_len < UINT32_MAX ? (uint32_t)block_len : UINT32_MAX;
+		return reader->block;
+	}
+	return NULL;
+}
+
+// the mounted tape stays open from block to block
+static tap_reader_t READER;
+static char READER_FILE[SPECTRUM_MAX_FILE_DIR_LEN];
+
+// Load a block of data from a mounted tap (or tzx) file
+//
 // tap data block format on tape/file: {[blocklen:2][blocktype:1] |[datatype:1][data:blocklen-1]| [xor byte]}
 //                                      ------- file header ----- ---- actual data block -------- -checksum-
 //
 // https://worldofspectrum.org/faq/reference/48kreference.htm
 
 // block_type is 0x00 for header blocks or 0xff for data blocks
-// block_len is the length of the block expected: this is actual length, not including the file-block-len prefix 
-// va is the virtual address to which the block shall be loaded
+// block_len is the length of the block expected: this is actual length, not including the file-block-len prefix
+// va is the virtual address to which the block shall be loaded (b_verify: compared with)
+// The next block on the tape is used up whatever it is, the way the rom lets it pass
 // We check whether the tap is in mounted state, the block type and its len as well as the XOR code
 // Returns TAP_OK (0) or an error code (see header)
 
-int TAP_LoadBlock(zx_spectrum_t *zx, tap_t *tap, uint8_t block_type, uint16_t block_len, uint16_t va) {
-#if 0
-	int err;
-	uint16_t file_block_len;
-	uint8_t file_block_type, xor_check;
-	char fname[SPECTRUM_MAX_FILE_DIR_LEN];
+int TAP_LoadBlock(zx_spectrum_t *zx, tap_t *tap, uint8_t block_type, uint16_t block_len, uint16_t va, bool b_verify) {
 
+	char fname[SPECTRUM_MAX_FILE_DIR_LEN];
+	uint32_t len;
+	const uint8_t *block;
 
 	// check mount state
 	if (tap->state != TAP_MOUNTED)
 		return TAP_ERR_NOT_MOUNTED;
 
-	// prepare filename
-	strcpy(fname, zx->settings.tap_file_dir);
-	strcat(fname, "/");
-	strcat(fname, tap->tap_file_name);
-
-	// check file block len
-	if ((err = P_ReadFileData(fname, tap->read_index, 2, (pointer_t)&file_block_len)) != P_ERR_OK) {
-		//printf("ERROR: platform file error, code=%d", err);
-		return TAP_ERR_FILE_ERROR;
+	// a fresh mount starts over (the file may have been saved since), so does a tape that isn't where we left it
+	snprintf(fname, sizeof(fname), "%s/%s", SPECTRUM_TAP_DIR, tap->tap_file_name);
+	if (!READER.b_open || tap->read_index == 0 || READER.position != tap->read_index || strcmp(READER_FILE, fname)) {
+		TAP_CloseReader(&READER);
+		if (!TAP_OpenReader(&READER, fname))
+			return TAP_ERR_FILE_ERROR;
+		strcpy(READER_FILE, fname);
+		while (READER.position < tap->read_index && TAP_ReadBlock(&READER, &len, 0))
+			;
 	}
-	tap->read_index += 2;
 
-	if (file_block_len != block_len + 2)
-		return TAP_ERR_BLOCK_LEN;
+	block = TAP_ReadBlock(&READER, &len, sizeof(READER.block));
+	tap->read_index = READER.position;
 
-	// check block type
-	if ((err = P_ReadFileData(fname, tap->read_index, 1, (pointer_t)&file_block_type)) != P_ERR_OK) {
-		//printf("ERROR: platform file error, code=%d", err);
-		return TAP_ERR_FILE_ERROR;
+	int err = TAP_OK;
+	if (!block) {
+		TAP_CloseReader(&READER);
+		err = TAP_ERR_END_OF_TAPE;
 	}
-	tap->read_index += 1;
-
-	if (file_block_type != block_type)
-		return TAP_ERR_BLOCK_TYPE;
-
-	// read block data + trailing XOR byte
-	if ((err = P_ReadFileData(fname, tap->read_index, block_len+1, (pointer_t)IOBUF)) != P_ERR_OK) {
-		//printf("ERROR: platform file error, code=%d", err);
-		return TAP_ERR_FILE_ERROR;
+	else if (len < 2 || len > sizeof(READER.block) || block[0] != block_type) {
+		err = TAP_ERR_BLOCK_TYPE;
 	}
-	tap->read_index += block_len + 1;
-
-	// copy the data to the destination and do the XOR test at the same time
-	xor_check = block_type;
-	for (int i = 0; i < block_len; i++) {
-		xor_check = xor_check ^ IOBUF[i];
-		zx_MMU_PutByte(&zx->mmu, IOBUF[i], va++);
+	else {
+		// copy the data to the destination (or compare), XOR test over the whole block
+		uint32_t data_len = len - 2;
+		uint8_t xor_check = 0;
+		for (uint32_t i = 0; i < len; i++)
+			xor_check ^= block[i];
+		for (uint32_t i = 0; i < data_len && i < block_len; i++, va++) {
+			if (!b_verify)
+				z80_mmu_PutByte(&zx->mmu, block[1 + i], va);
+			else if (z80_mmu_GetByte(&zx->mmu, va) != block[1 + i])
+				err = TAP_ERR_CHECKSUM;
+		}
+		if (data_len != block_len)
+			err = TAP_ERR_BLOCK_LEN;
+		else if (xor_check)
+			err = TAP_ERR_CHECKSUM;
 	}
 
-	// XOR check
-	if (xor_check != IOBUF[block_len])
-		return TAP_ERR_CHECKSUM;
-#endif
-	return TAP_OK;
+	return err;
 }
 
-
 // tapfile.c
\ No newline at end of file
@@ -4,7 +4,10 @@
 #pragma once
 
 #include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include "z80cpu.h"
+#include "instream.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -20,20 +23,43 @@ extern "C" {
 #define TAP_ERR_CHECKSUM      3
 #define TAP_ERR_NOT_MOUNTED   4
 #define TAP_ERR_FILE_ERROR    5       // some error occured in the underlying platform file io code
+#define TAP_ERR_END_OF_TAPE   6
 
-enum tapstate { TAP_UN_MOUNTED, TAP_REQUEST_MOUNT, TAP_MOUNTED, TAP_REQUEST_DIRECTORY };
+// TAP_REQUEST_CREATE: SAVE "$name" has named a new .tap, the next header block creates it
+enum tapstate { TAP_UN_MOUNTED, TAP_REQUEST_MOUNT, TAP_MOUNTED, TAP_REQUEST_DIRECTORY, TAP_REQUEST_CREATE };
 
 typedef struct {
     char tap_base_name[MAX_TAP_NAME_SIZE + 1];      // this is the filename "inside" the tap as used by the ROM
     char tap_file_name[MAX_TAP_FILE_NAME_SIZE + 1]; // tap filename on disk
     uint32_t read_index, write_index;
     enum tapstate state;
+    bool b_save_data;                               // a header has been saved: its data block follows
+    bool b_writable;                                // a plain .tap: SAVE can append to it
 } tap_t;
 
+#define TAP_MAX_BLOCK_SIZE  0x10000                 // [flag][data][checksum]: a .tap length field can't say more
 
-void TAP_CreateHeaderBlock (zx_spectrum_t *zx, uint8_t block_type, uint16_t va, char *name, uint16_t data_len, uint16_t p1, uint16_t p2);
-int TAP_LoadBlock(zx_spectrum_t *zx, tap_t *tap, uint8_t block_type, uint16_t block_len, uint16_t va);
-int TAP_WriteBlock(zx_spectrum_t *zx, char *filename, uint8_t block_type, uint16_t block_len, uint8_t check, uint16_t va);
+// a tape being read sequentially (see TAP_OpenReader())
+typedef struct {
+    instream_t stream;
+    bool b_open;
+    bool b_tzx;
+    uint8_t peek[10];                               // read ahead to check for the .tzx signature
+    int peek_len, peek_pos;
+    uint32_t position;                              // bytes of the (decompressed) file read so far
+    uint8_t block[TAP_MAX_BLOCK_SIZE];              // the last block read: has to be the last member
+} tap_reader_t;
+
+
+struct zx_spectrum;
+
+void TAP_CreateHeaderBlock (struct zx_spectrum *zx, uint8_t block_type, uint16_t va, const char *name, uint16_t data_len, uint16_t p1, uint16_t p2);
+int TAP_LoadBlock(struct zx_spectrum *zx, tap_t *tap, uint8_t block_type, uint16_t block_len, uint16_t va, bool b_verify);
+bool TAP_OpenReader(tap_reader_t *reader, const char *path);
+const uint8_t *TAP_ReadBlock(tap_reader_t *reader, uint32_t *len, uint32_t max_len);
+void TAP_CloseReader(tap_reader_t *reader);
+int TAP_WriteBlock(struct zx_spectrum *zx, const char *filename, bool b_create, uint8_t block_type, uint16_t block_len, uint16_t va);
+void TAP_Close();
 
 #ifdef __cplusplus
 } // extern "C"
@@ -22,21 +22,94 @@ uint32_t tStatesPerMilliSecond();
  **/
 
 
-static cpu_trap_t TRAPS[] = {
-	{ 0x04c2, _trap_SA_BYTES, ROM_2_BANK },		// Spectrum 48k ROM tape save routine
-	{ 0x0556, _trap_LD_BYTES, ROM_2_BANK },		// load header&data blocks
+#define MAX_TRAPS   128
+
+static const cpu_trap_t BUILTIN_TRAPS[] = {
+	{ 0x04c2, _trap_SA_BYTES, ROM_2_BANK, true },	// Spectrum 48k ROM tape save routine
+	{ 0x0556, _trap_LD_BYTES, ROM_2_BANK, true },	// load header&data blocks
 	// 0x0621 traps SA-SPACE: at that point the rom has moved the filename to the calc. stack
 	{ 0x0621, _trap_SA_SPACE, ROM_2_BANK },		// save, verify, load, merge main entry point original 48k rom 
+	{ 0x0976, _trap_SA_CONTRL, ROM_2_BANK, true },	// SAVE: "press any key" prompt
+	{ 0x0991, _trap_SA_1_SEC, ROM_2_BANK, true },	// SAVE: pause between header and data
+	{ 0x10a8, _trap_KEY_INPUT, ROM_2_BANK },		// the editor waits for a key
 
+	// 128k rom1 (the 48k basic) has the tape routines at the same addresses
+	{ 0x04c2, _trap_SA_BYTES, ROM_1_BANK, true },
+	{ 0x0556, _trap_LD_BYTES, ROM_1_BANK, true },
+	{ 0x0621, _trap_SA_SPACE, ROM_1_BANK },
+	{ 0x0976, _trap_SA_CONTRL, ROM_1_BANK, true },
+	{ 0x0991, _trap_SA_1_SEC, ROM_1_BANK, true },
+	{ 0x10a8, _trap_KEY_INPUT, ROM_1_BANK },
 };
 
-static int NUM_TRAPS = sizeof(TRAPS) / sizeof(cpu_trap_t);
+// builtin traps plus the ones peripherals add (see z80cpu_add_trap())
+static cpu_trap_t TRAPS[MAX_TRAPS];
+static int NUM_TRAPS = 0;
+
+// bit per address: is there any trap at all (whatever its bank)
+static uint8_t TRAP_ADDRESSES[0x10000 / 8];
+
+// a trap only fires while its rom bank is actually mapped at the trap address
+// (slot_traps[] keeps this to one flag test per opcode fetch, whatever the page mappings)
+// returns true if a refetch trap fired: the opcode has to be fetched again
+static bool _check_traps(zx_spectrum_t *zx, uint16_t address) {
+    if (!(TRAP_ADDRESSES[address >> 3] & (1 << (address & 7))))
+        return false;
 
+    int bank_no = zx->mmu.visible_pages[address >> MEM_SLOT_SHIFT].index / 2;
+    bool b_refetch = false;
+
+    for(int i = 0; i < NUM_TRAPS; i++) {
+        if(TRAPS[i].trap_addr == address && TRAPS[i].rom_no == bank_no) {
+            //ltb_printf("cpu trap hit!\n");
+            TRAPS[i].trap_func(&Z80CPU);
+            b_refetch |= TRAPS[i].b_refetch;
+        }
+    }
+    return b_refetch;
+}
 
+static uint64_t _trap_banks() {
+    uint64_t banks = 0;
+    for(int i = 0; i < NUM_TRAPS; i++)
+        banks |= 1ull << TRAPS[i].rom_no;
+    return banks;
+}
+
+// Trap the opcode fetch at address while bank rom_no is mapped there
+// The trap function runs after the opcode has been fetched (and before it executes)
+static bool _add_trap(uint16_t address, void (*trap_func)(Z80 *z80), uint8_t rom_no, bool b_refetch) {
+    if (NUM_TRAPS == MAX_TRAPS)
+        return false;
+
+    TRAPS[NUM_TRAPS++] = (cpu_trap_t){ address, trap_func, rom_no, b_refetch };
+    TRAP_ADDRESSES[address >> 3] |= 1 << (address & 7);
+    z80_mmu_SetTrapBanks(&ZXSPECTRUM.mmu, _trap_banks());
+    return true;
+}
+
+bool z80cpu_add_trap(uint16_t address, void (*trap_func)(Z80 *z80), uint8_t rom_no) {
+    return _add_trap(address, trap_func, rom_no, false);
+}
+
+// Like z80cpu_add_trap(), but for traps that page memory in at address or redirect execution
+// (set PC): the opcode is fetched again at PC (the interface 1 pages in during the fetch)
+bool z80cpu_add_paging_trap(uint16_t address, void (*trap_func)(Z80 *z80), uint8_t rom_no) {
+    return _add_trap(address, trap_func, rom_no, true);
+}
+
+
+
+static uint32_t ACCESS_TSTATE;
 
 uint32_t z80cpu_step(uint32_t tstates) {  
 
+    ACCESS_TSTATE = ZXSPECTRUM.frame_tstate;
     const uint32_t k = z80_run(&Z80CPU, tstates);
+
+    // keep the frame clock going: spectrum_tstate() adds Z80CPU.cycles while running
+    ZXSPECTRUM.frame_tstate += k;
+    Z80CPU.cycles = 0;
     return k;
 }
   
@@ -51,13 +124,10 @@ void z80cpu_reset() {
 static  uint8_t _fetch_opcode(void *context, uint16_t address) {
     zx_spectrum_t *zx = (zx_spectrum_t*)context;
 
-    for(int i = 0; i < NUM_TRAPS; i++) {
-        if(TRAPS[i].trap_addr == address) {
-            //ltb_printf("cpu trap hit!\n");
-            TRAPS[i].trap_func(0);
-        }
-    }
-    return z80_mmu_GetByte(&zx->mmu, address);
+    uint8_t opcode = z80_mmu_GetByte(&zx->mmu, address);
+    if (zx->mmu.slot_traps[address >> MEM_SLOT_SHIFT] && _check_traps(zx, address))
+        opcode = z80_mmu_GetByte(&zx->mmu, Z80_PC(*zx->cpu));
+    return opcode;
 }
 
 static  uint8_t _read_memory(void *context, uint16_t address) {
@@ -67,25 +137,123 @@ static  uint8_t _read_memory(void *context, uint16_t address) {
 
 static void _write_memory(void *context, uint16_t address, uint8_t value) {
     zx_spectrum_t *zx = (zx_spectrum_t*)context;
+    if (zx->beam.b_display_line)
+        spectrum_display_write(zx, address);
     z80_mmu_PutByte(&zx->mmu, value, address);
 }
 
+// port devices register with the I/O bus (see spectrum.c): one table lookup per IN/OUT
 static  uint8_t _read_port(void *context, uint16_t address) {
     zx_spectrum_t *zx = (zx_spectrum_t*)context;
+    return z80_io_Read(&zx->io, address);
+}
+
+static void _write_port(void *context, uint16_t address, uint8_t value) {
+    zx_spectrum_t *zx = (zx_spectrum_t*)context;
+    z80_io_Write(&zx->io, address, value);
+}
+
+/**----------------------------------------------------------------------------
+ *	ULA contention (optional, see z80cpu_set_contention())
+ *
+ *  The core only tells us where an instruction starts (Z80CPU.cycles), so the
+ *  T-state of each access is tracked in ACCESS_TSTATE using the standard M-cycle
+ *  lengths (internal cycles are not modelled). Delays get added to Z80CPU.cycles.
+ **/
+
+// wait for the ula at the current access T-state, then run an n T-states bus cycle
+static inline void _contend_at(zx_spectrum_t *zx, uint32_t n) {
+    uint32_t delay = zx->contention[ACCESS_TSTATE & (SPECTRUM_CONTENTION_TABLE_SIZE - 1)];
+    Z80CPU.cycles += delay;
+    ACCESS_TSTATE += delay + n;
+}
+
+static inline void _contend(zx_spectrum_t *zx, uint16_t address, uint32_t n) {
+    if (zx->mmu.slot_contended[address >> MEM_SLOT_SHIFT])
+        _contend_at(zx, n);
+    else
+        ACCESS_TSTATE += n;
+}
 
-    if(!(address & 1)) {
-        //sto_printf("addr=$%04x ", address);
-        // all even ports: ULA read
-  		uint16_t row_mask = (~(address >> 8)) & 0x00FF;
-		uint8_t data = zx_ULA_get_key_row(&ZXSPECTRUM.ula, (uint8_t)row_mask) & 0xBF;
-		return data;
+// the access patterns of the ula port and of ports that look like contended memory
+static void _contend_io(zx_spectrum_t *zx, uint16_t port) {
+    bool b_contended = zx->mmu.slot_contended[port >> MEM_SLOT_SHIFT];
+
+    if (!zx->timing.b_io_contention) {
+        // +3: N:4
+        ACCESS_TSTATE += 4;
+        return;
+    }
+
+    if (port & 1) {
+        if (b_contended) {
+            // C:1, C:1, C:1, C:1
+            for (int i = 0; i < 4; i++)
+                _contend_at(zx, 1);
+        }
+        else {
+            // N:4
+            ACCESS_TSTATE += 4;
+        }
+    }
+    else {
+        // N:1 or C:1, then C:3
+        if (b_contended)
+            _contend_at(zx, 1);
+        else
+            ACCESS_TSTATE += 1;
+        _contend_at(zx, 3);
     }
-    return 255;    
 }
 
-static void _write_port(void *context, uint16_t address, uint8_t value) {
-    return;
- }
+static uint8_t _fetch_opcode_contended(void *context, uint16_t address) {
+    zx_spectrum_t *zx = (zx_spectrum_t*)context;
+
+    // a new instruction starts at Z80CPU.cycles, prefixed opcodes continue the current one
+    uint32_t t = spectrum_tstate();
+    if (t > ACCESS_TSTATE)
+        ACCESS_TSTATE = t;
+    _contend(zx, address, 4);
+    return _fetch_opcode(context, address);
+}
+
+static uint8_t _read_memory_contended(void *context, uint16_t address) {
+    zx_spectrum_t *zx = (zx_spectrum_t*)context;
+    _contend(zx, address, 3);
+    return z80_mmu_GetByte(&zx->mmu, address);
+}
+
+static void _write_memory_contended(void *context, uint16_t address, uint8_t value) {
+    zx_spectrum_t *zx = (zx_spectrum_t*)context;
+    _contend(zx, address, 3);
+    if (zx->beam.b_display_line)
+        spectrum_display_write(zx, address);
+    z80_mmu_PutByte(&zx->mmu, value, address);
+}
+
+static uint8_t _read_port_contended(void *context, uint16_t address) {
+    zx_spectrum_t *zx = (zx_spectrum_t*)context;
+    _contend_io(zx, address);
+    return z80_io_Read(&zx->io, address);
+}
+
+static void _write_port_contended(void *context, uint16_t address, uint8_t value) {
+    zx_spectrum_t *zx = (zx_spectrum_t*)context;
+    _contend_io(zx, address);
+    z80_io_Write(&zx->io, address, value);
+}
+
+// Contention is off by default: with it disabled the plain callbacks are installed
+// and memory/io accesses don't pay anything for it
+void z80cpu_set_contention(bool enable) {
+    Z80CPU.fetch_opcode = enable ? _fetch_opcode_contended : _fetch_opcode;
+    Z80CPU.fetch =
+    Z80CPU.nop =
+    Z80CPU.read = enable ? _read_memory_contended : _read_memory;
+    Z80CPU.write = enable ? _write_memory_contended : _write_memory;
+    Z80CPU.in = enable ? _read_port_contended : _read_port;
+    Z80CPU.out = enable ? _write_port_contended : _write_port;
+}
 
 #if 0
 static uint8_t _int_ack(void * context, uint16_t address) {
@@ -113,6 +281,11 @@ void z80cpu_init(void *ctx) {
     
     Z80CPU.context = ctx;
     // Z80CPU.inta = _int_ack;
+
+    NUM_TRAPS = 0;
+    memset(TRAP_ADDRESSES, 0, sizeof(TRAP_ADDRESSES));
+    for (size_t i = 0; i < sizeof(BUILTIN_TRAPS) / sizeof(cpu_trap_t); i++)
+        _add_trap(BUILTIN_TRAPS[i].trap_addr, BUILTIN_TRAPS[i].trap_func, BUILTIN_TRAPS[i].rom_no, BUILTIN_TRAPS[i].b_refetch);
 }
 
 // z80cpu.c
\ No newline at end of file
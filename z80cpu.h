@@ -17,6 +17,9 @@ void z80cpu_init(void *ctx);
 uint32_t z80cpu_step(uint32_t tstates);
 void z80cpu_power(bool state);
 void z80cpu_reset();
+void z80cpu_set_contention(bool enable);
+bool z80cpu_add_trap(uint16_t address, void (*trap_func)(Z80 *z80), uint8_t rom_no);
+bool z80cpu_add_paging_trap(uint16_t address, void (*trap_func)(Z80 *z80), uint8_t rom_no);
 
 #ifdef __cplusplus
 }
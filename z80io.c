@@ -0,0 +1,164 @@
+/**----------------------------------------------------------------------------
+ *	z80io.c
+ *  table driven I/O port bus
+ *
+ *  Registration is rare (machine setup, device enable/disable) and rebuilds
+ *  the 64k port index. IN/OUT never have to walk the device list.
+ **/
+
+#include <string.h>
+#include <stdio.h>
+
+#include "z80io.h"
+
+
+/**----------------------------------------------------------------------------
+ *	UNMAPPED PORTS AND OVERLAPPING DECODES
+ */
+
+// nobody drives the data bus: floating bus reads 0xFF
+static uint8_t _read_unmapped(void *ctx, uint16_t port) {
+	(void)ctx; (void)port;
+	return 0xFF;
+}
+
+static void _write_unmapped(void *ctx, uint16_t port, uint8_t value) {
+	(void)ctx; (void)port; (void)value;
+}
+
+// several devices drive the bus at the same time: open collector, so the result is the AND
+static uint8_t _read_multi(void *ctx, uint16_t port) {
+	const z80_io_entry_t *e = (const z80_io_entry_t*)ctx;
+	uint8_t data = 0xFF;
+	for (uint32_t set = e->devices; set; set &= set - 1) {
+		const z80_io_device_t *d = &e->bus->devices[__builtin_ctz(set)];
+		data &= d->read(d->ctx, port);
+	}
+	return data;
+}
+
+// ... and all of them see the write
+static void _write_multi(void *ctx, uint16_t port, uint8_t value) {
+	const z80_io_entry_t *e = (const z80_io_entry_t*)ctx;
+	for (uint32_t set = e->devices; set; set &= set - 1) {
+		const z80_io_device_t *d = &e->bus->devices[__builtin_ctz(set)];
+		d->write(d->ctx, port, value);
+	}
+}
+
+
+/**----------------------------------------------------------------------------
+ *	DECODE TABLE COMPILATION
+ */
+
+// find (or create) the entry for a given device set
+static int _entry_for(z80_io_bus_t *bus, uint32_t set, bool b_write) {
+	z80_io_entry_t *entries = b_write ? bus->write_entries : bus->read_entries;
+	int *num_entries = b_write ? &bus->num_write_entries : &bus->num_read_entries;
+
+	for (int i = 0; i < *num_entries; i++) {
+		if (entries[i].devices == set)
+			return i;
+	}
+	if (*num_entries == Z80_IO_MAX_ENTRIES) {
+		printf("z80io: too many overlapping port decodes\n");
+		return 0;
+	}
+
+	z80_io_entry_t *e = &entries[*num_entries];
+	e->devices = set;
+	e->bus = bus;
+	if (set & (set - 1)) {
+		e->read = _read_multi;
+		e->write = _write_multi;
+		e->ctx = e;
+	}
+	else {
+		const z80_io_device_t *d = &bus->devices[__builtin_ctz(set)];
+		e->read = d->read;
+		e->write = d->write;
+		e->ctx = d->ctx;
+	}
+	return (*num_entries)++;
+}
+
+static void _compile(z80_io_bus_t *bus) {
+
+	// entry 0: nobody responds
+	memset(bus->read_entries, 0, sizeof(bus->read_entries));
+	memset(bus->write_entries, 0, sizeof(bus->write_entries));
+	bus->read_entries[0] = (z80_io_entry_t){ 0, _read_unmapped, _write_unmapped, NULL, bus };
+	bus->write_entries[0] = bus->read_entries[0];
+	bus->num_read_entries = bus->num_write_entries = 1;
+
+	// neighbouring ports almost always decode to the same device set: only search on change
+	uint32_t last_rset = 0, last_wset = 0;
+	int rindex = 0, windex = 0;
+
+	for (uint32_t port = 0; port < 65536; port++) {
+		uint32_t rset = 0, wset = 0;
+		for (int i = 0; i < bus->num_devices; i++) {
+			const z80_io_device_t *d = &bus->devices[i];
+			if (!d->enabled || (port & d->mask) != d->value)
+				continue;
+			if (d->read)
+				rset |= 1u << i;
+			if (d->write)
+				wset |= 1u << i;
+		}
+		if (rset != last_rset) {
+			rindex = rset ? _entry_for(bus, rset, false) : 0;
+			last_rset = rset;
+		}
+		if (wset != last_wset) {
+			windex = wset ? _entry_for(bus, wset, true) : 0;
+			last_wset = wset;
+		}
+		bus->read_index[port] = (uint8_t)rindex;
+		bus->write_index[port] = (uint8_t)windex;
+	}
+}
+
+
+/**----------------------------------------------------------------------------
+ *	API
+ */
+
+void z80_io_Init(z80_io_bus_t *bus) {
+	memset(bus, 0, sizeof(z80_io_bus_t));
+	_compile(bus);
+}
+
+// Register a device for all ports where (port & mask) == value
+// RETURN: device handle for z80_io_Enable(), -1 if the bus is full
+int z80_io_Register(z80_io_bus_t *bus, const char *name, uint16_t mask, uint16_t value,
+	z80_io_read_fn read, z80_io_write_fn write, void *ctx) {
+
+	if (bus->num_devices == Z80_IO_MAX_DEVICES) {
+		printf("z80io: can't register %s: too many devices\n", name);
+		return -1;
+	}
+
+	z80_io_device_t *d = &bus->devices[bus->num_devices];
+	d->name = name;
+	d->mask = mask;
+	d->value = value & mask;
+	d->read = read;
+	d->write = write;
+	d->ctx = ctx;
+	d->enabled = true;
+	bus->num_devices++;
+
+	_compile(bus);
+	return bus->num_devices - 1;
+}
+
+// devices that can be switched off (paged out interfaces etc.) stay registered
+void z80_io_Enable(z80_io_bus_t *bus, int device, bool enabled) {
+	if (device < 0 || device >= bus->num_devices || bus->devices[device].enabled == enabled)
+		return;
+	bus->devices[device].enabled = enabled;
+	_compile(bus);
+}
+
+// z80io.c
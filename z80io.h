@@ -0,0 +1,77 @@
+#pragma once
+
+/**----------------------------------------------------------------------------
+ *	z80io.c
+ *  table driven I/O port bus: devices register partial address decodes
+ *  (port & mask) == value, which get compiled into a 64k port index so that
+ *  every IN/OUT is a table lookup plus one indirect call
+ **/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define Z80_IO_MAX_DEVICES	32		// device sets are tracked as bits in an uint32_t
+#define Z80_IO_MAX_ENTRIES	256		// distinct device combinations (port index is an uint8_t)
+
+typedef uint8_t (*z80_io_read_fn)(void *ctx, uint16_t port);
+typedef void (*z80_io_write_fn)(void *ctx, uint16_t port, uint8_t value);
+
+typedef struct {
+	const char *name;
+	uint16_t mask;					// address lines decoded by the device
+	uint16_t value;					// ... and the value they need to have
+	z80_io_read_fn read;			// NULL: device doesn't respond to IN
+	z80_io_write_fn write;			// NULL: device doesn't respond to OUT
+	void *ctx;
+	bool enabled;
+} z80_io_device_t;
+
+struct z80_io_bus_s;
+
+// one entry per distinct set of responding devices
+// single devices get called directly, overlapping decodes go through a thunk
+typedef struct {
+	uint32_t devices;				// bit n: device n responds
+	z80_io_read_fn read;
+	z80_io_write_fn write;
+	void *ctx;						// device context, or the entry itself for the thunks
+	struct z80_io_bus_s *bus;
+} z80_io_entry_t;
+
+typedef struct z80_io_bus_s {
+	z80_io_device_t devices[Z80_IO_MAX_DEVICES];
+	int num_devices;
+
+	// compiled decode: port -> entry, entry 0 is the unmapped (floating bus) entry
+	z80_io_entry_t read_entries[Z80_IO_MAX_ENTRIES];
+	z80_io_entry_t write_entries[Z80_IO_MAX_ENTRIES];
+	int num_read_entries;
+	int num_write_entries;
+	uint8_t read_index[65536];
+	uint8_t write_index[65536];
+} z80_io_bus_t;
+
+void z80_io_Init(z80_io_bus_t *bus);
+int z80_io_Register(z80_io_bus_t *bus, const char *name, uint16_t mask, uint16_t value,
+	z80_io_read_fn read, z80_io_write_fn write, void *ctx);
+void z80_io_Enable(z80_io_bus_t *bus, int device, bool enabled);
+
+static inline uint8_t z80_io_Read(z80_io_bus_t *bus, uint16_t port) {
+	const z80_io_entry_t *e = &bus->read_entries[bus->read_index[port]];
+	return e->read(e->ctx, port);
+}
+
+static inline void z80_io_Write(z80_io_bus_t *bus, uint16_t port, uint8_t value) {
+	const z80_io_entry_t *e = &bus->write_entries[bus->write_index[port]];
+	e->write(e->ctx, port, value);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+// z80io.h
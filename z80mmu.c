@@ -2,11 +2,14 @@
 // zx_mmu.c
 // memory management for the ZXx emulator
 /*
-	- We allocate one big chunk of memory from platform
-	- This then gets subdivided by storing pointers into the memory in PAGES[] and BANKS[] arrays
+	- Banks are allocated from platform on demand (first write), untouched banks share one zero bank
+	- Alternatively one big chunk of memory (a mapped file) gets subdivided into the BANKS[] (see z80_mmu_Rebind())
+	- The PAGES[] array always mirrors the BANKS[] array (two pages per bank)
 	- Standard PAGE size is 8k, standard BANK size is 16k
 	- The Spectrum 128 style memory management uses BANKS
 	- The Spectrum Next style memory management uses PAGES
+	- Internally the Z80 address space is always eight 8k slots: a 16k bank mapping
+	  simply maps both of its pages, so 8k and 16k mappings can be mixed freely
 
 	Reference: http://www.breakintoprogram.co.uk/hardware/computers/zx-spectrum/memory-map
 
@@ -27,9 +30,18 @@
 	 -----------------------------------------------------------
 
 	 ROM2 is the original 48k rom, ROM0 and ROM1 are the 128k roms
+
+	 +3: the four roms sit in ROM0 (editor), ROM4 (syntax), ROM5 (+3DOS) and ROM1 (48k basic,
+	 so the 128k tape traps apply), port 0x1FFD selects the high rom bit or one of four
+	 special configurations with ram in all four slots (CP/M style)
+
+	 ZXX only: any of the 128 pages can be mapped into any of the eight 8k slots through
+	 the next registers 0x50-0x57 (see spectrum_nextreg.c). Pages of the rom banks are
+	 always mapped read only.
 */
 
 #include <stdio.h>
+#include <stdlib.h>		// calloc/free
 
 #if defined(__circle__)
 #include <circle/util.h>
@@ -40,42 +52,194 @@
 #include "spectrum.h"
 #include "text_box_l.h"
 
-// Maps a bank into slot and returns the previous bank number mapped into slot
+// shared backing store for all banks that have not been written to yet
+// this is never written to: slot_write[] is always NULL for slots mapping it
+static uint8_t ZERO_BANK[MEM_BANK_SIZE];
+
+#define BANK_BIT(bank_no)	(1ull << (bank_no))
+
+static void _bind_bank(z80_mmu_t *mmu, int bank_no, uint8_t *base) {
+	mmu->banks[bank_no] = base;
+	mmu->pages[bank_no*2] = base;
+	mmu->pages[bank_no*2+1] = base + MEM_PAGE_SIZE;
+}
+
+// recalculate the physical read/write base addresses for a visible (8k) slot
+static void _update_slot(z80_mmu_t *mmu, int slot) {
+	int page_no = mmu->visible_pages[slot].index;
+	int bank_no = page_no / 2;
+	mmu->slot_read[slot] = mmu->pages[page_no];
+	mmu->slot_write[slot] = (mmu->visible_pages[slot].mapping_type == M_READ_WRITE
+		&& (mmu->banks_allocated & BANK_BIT(bank_no))) ? mmu->pages[page_no] : NULL;
+	mmu->slot_contended[slot] = (mmu->contended_banks & BANK_BIT(bank_no)) != 0;
+	mmu->slot_traps[slot] = (mmu->trap_banks & BANK_BIT(bank_no)) != 0;
+}
+
+static void _update_slots(z80_mmu_t *mmu) {
+	for (int slot = 0; slot < MEM_NUM_SLOTS; slot++)
+		_update_slot(mmu, slot);
+}
+
+// give a bank its own memory (contents initially zero)
+// Returns false if there's no memory for it: the bank stays on the zero bank
+static bool _allocate_bank(z80_mmu_t *mmu, int bank_no) {
+	if (mmu->banks_allocated & BANK_BIT(bank_no))
+		return true;
+	uint8_t *memory = (uint8_t *)calloc(1, MEM_BANK_SIZE);
+	if (!memory) {
+		ltb_printf("mmu: can't allocate bank %d\n", bank_no);
+		return false;
+	}
+	_bind_bank(mmu, bank_no, memory);
+	mmu->banks_allocated |= BANK_BIT(bank_no);
+	return true;
+}
+
+// return a bank back to the zero bank
+static void _release_bank(z80_mmu_t *mmu, int bank_no) {
+	if (!(mmu->banks_allocated & BANK_BIT(bank_no)))
+		return;
+	free(mmu->banks[bank_no]);
+	_bind_bank(mmu, bank_no, ZERO_BANK);
+	mmu->banks_allocated &= ~BANK_BIT(bank_no);
+}
+
+// Slow path of z80_mmu_PutByte(): the (8k) slot has no write pointer
+// Returns true (and makes slot_write valid) if the write should go ahead, 
+// false if it has to be dropped (ROM, a bank that doesn't exist on this model or no memory for it)
+bool z80_mmu_FaultWrite(z80_mmu_t *mmu, int slot) {
+	int bank_no = mmu->visible_pages[slot].index / 2;
+
+	if (mmu->visible_pages[slot].mapping_type != M_READ_WRITE)
+		return false;
+	if (bank_no >= mmu->num_ram_banks && !(mmu->device_banks & BANK_BIT(bank_no)))
+		return false;
+
+	// allocation is per bank: both pages of the bank get their memory
+	if (!_allocate_bank(mmu, bank_no))
+		return false;
+
+	// the bank might be visible in more than one slot
+	_update_slots(mmu);
+	return true;
+}
+
+// Physical memory of a ram bank for a loader to fill directly (given its own memory first)
+// NULL for banks the model doesn't have (or if there's no memory for it)
+uint8_t *z80_mmu_WriteBank(z80_mmu_t *mmu, int bank_no) {
+	if (bank_no < 0 || (bank_no >= mmu->num_ram_banks && !(mmu->device_banks & BANK_BIT(bank_no))))
+		return NULL;
+	if (!(mmu->banks_allocated & BANK_BIT(bank_no))) {
+		if (!_allocate_bank(mmu, bank_no))
+			return NULL;
+		_update_slots(mmu);
+	}
+	return mmu->banks[bank_no];
+}
+
+// Copy a ROM image into a (rom) bank
+void z80_mmu_LoadROM(z80_mmu_t *mmu, int bank_no, const uint8_t *data, size_t size) {
+	z80_mmu_LoadROMPage(mmu, bank_no * 2, data, size);
+}
+
+// Copy a ROM image into (rom) pages starting at page_no: 8k roms share a bank
+void z80_mmu_LoadROMPage(z80_mmu_t *mmu, int page_no, const uint8_t *data, size_t size) {
+	size_t max_size = (page_no & 1) ? MEM_PAGE_SIZE : MEM_BANK_SIZE;
+	if (!mmu->memory && !_allocate_bank(mmu, page_no / 2))
+		return;
+	memcpy(mmu->pages[page_no], data, size < max_size ? size : max_size);
+	_update_slots(mmu);
+}
+
+// Ram of a peripheral (num_banks banks from bank_no): allocated on first write like model ram
+void z80_mmu_AddDeviceBanks(z80_mmu_t *mmu, int bank_no, int num_banks) {
+	for (int bank = bank_no; bank < bank_no + num_banks; bank++)
+		mmu->device_banks |= BANK_BIT(bank);
+}
+
+// Maps an 8k page into an 8k slot (0-7) and returns the previous page number mapped there
+// Pages of the rom banks are always read only
+int z80_mmu_PageMap(z80_mmu_t *mmu, int slot, int page_no, enum MEM_MAPPING_TYPE mapping_type) {
+	int prev_page_no = mmu->visible_pages[slot].index;
+	mmu->visible_pages[slot].index = page_no;
+	mmu->visible_pages[slot].mapping_type = (page_no >= FIRST_ROM_BANK * 2) ? M_READ_ONLY : mapping_type;
+	_update_slot(mmu, slot);
+	return prev_page_no;
+}
+
+// Maps a 16k bank into a 16k slot (0-3) and returns the previous bank number mapped into slot
 int z80_mmu_MemMap(z80_mmu_t *mmu, int slot, int bank_no, enum MEM_MAPPING_TYPE mapping_type) {
 	int prev_bank_no = mmu->visible_banks[slot].index;
 	mmu->visible_banks[slot].index = bank_no;
 	mmu->visible_banks[slot].mapping_type = mapping_type;
+	z80_mmu_PageMap(mmu, slot * 2, bank_no * 2, mapping_type);
+	z80_mmu_PageMap(mmu, slot * 2 + 1, bank_no * 2 + 1, mapping_type);
 	return prev_bank_no;
 }
 
-// Called from user code (write to ULA port 0x7FFD) and from the ROM paging routine 
-// FIXME: video bank switch not implemented yet
+// Banks holding code the cpu traps in (see z80cpu.c): slot_traps[] flags the slots mapping one
+void z80_mmu_SetTrapBanks(z80_mmu_t *mmu, uint64_t trap_banks) {
+	mmu->trap_banks = trap_banks;
+	_update_slots(mmu);
+}
+
+// +3 special paging: the four ram banks of the 16k slots for 0x1FFD bits 1-2
+static const uint8_t PLUS3_SPECIAL_BANKS[4][4] = {
+	{ RAM_0_BANK, RAM_1_BANK, RAM_2_BANK, RAM_3_BANK },
+	{ RAM_4_BANK, RAM_5_BANK, RAM_6_BANK, RAM_7_BANK },
+	{ RAM_4_BANK, RAM_5_BANK, RAM_6_BANK, RAM_3_BANK },
+	{ RAM_4_BANK, RAM_7_BANK, RAM_6_BANK, RAM_3_BANK },
+};
+
+// map the paged slots from the last values written to both paging ports
+static void _apply_paging(z80_mmu_t *mmu) {
+
+	// +3 special paging: bit 0 of 0x1FFD replaces the whole map with ram
+	if (mmu->last_1ffd & 1) {
+		const uint8_t *banks = PLUS3_SPECIAL_BANKS[(mmu->last_1ffd >> 1) & 3];
+		for (int slot = 0; slot < 4; slot++)
+			z80_mmu_MemMap(mmu, slot, banks[slot], M_READ_WRITE);
+		mmu->b_all_ram = true;
+		return;
+	}
+	if (mmu->b_all_ram) {
+		// back to normal paging: the middle slots are fixed again
+		z80_mmu_MemMap(mmu, 1, RAM_5_BANK, M_READ_WRITE);
+		z80_mmu_MemMap(mmu, 2, RAM_2_BANK, M_READ_WRITE);
+		mmu->b_all_ram = false;
+	}
+
+	// only last memory slot is mappable: bits 0-2 select the ram bank
+	// the mmu physical banks numbering matches the 128k ram page numbering
+	// (the 128k rom pages in RAM7 for its own workspace most of the time, RAM0 is the 48k basic default)
+	int bank_no = mmu->last_7ffd & 0x7;
+
+	// ZXX: bits 6 and 7 extend the bank number (pentagon 512 style) so the ULAX banks can be reached
+	if (mmu->num_ram_banks > RAM_7_BANK + 1)
+		bank_no |= (mmu->last_7ffd >> 3) & 0x18;
+
+	z80_mmu_MemMap(mmu, 3, bank_no, M_READ_WRITE);
+
+	// bit 4 of 0x7FFD selects ROM0 or ROM1, on the +3 bit 2 of 0x1FFD adds the high rom bit
+	int rom = ((mmu->last_7ffd >> 4) & 1) | ((mmu->last_1ffd >> 1) & 2);
+	mmu->current_rom = mmu->rom_banks[rom];
+	z80_mmu_MemMap(mmu, 0, mmu->current_rom, M_READ_ONLY);
+}
+
+// Called from user code (write to port 0x7FFD) and from the ROM paging routine 
+// Every change is just a couple of slot pointer updates: memory accesses don't pay for banking
 void _zx_MMU_update_memory_map_zx128(z80_mmu_t *mmu, uint8_t data) {
 	
 	// switching to the 48k rom from 128k mode disables any further banking until reset
 	if (mmu->enable_128k_banking == false)
 		return;
 
+	mmu->last_7ffd = data;
+
 	// bit 3 defines the video scanout memory bank (5 or 7)
-	//sys->display_ram_bank = (data & (1 << 3)) ? 7 : 5;
-
-	// only last memory slot is mappable
-	// the mmu physical banks numbering matches the virtual banks numbering
-	// NOTE: I believe the logic here is wrong, the three bits should be inverted
-	// because right now the rom pages in RAM7 here all the time and afaik it should be RAM0
-	z80_mmu_MemMap(mmu, 3, data & 0x7, M_READ_WRITE);
-
-	// ROM0 or ROM1
-	if (data & (1 << 4)) {
-		// bit 4 set: ROM1
-		z80_mmu_MemMap(mmu, 0, ROM_1_BANK, M_READ_ONLY);
-		mmu->current_rom = ROM_1_BANK;
-	}
-	else {
-		// bit 4 clear: ROM0
-		z80_mmu_MemMap(mmu, 0, ROM_0_BANK, M_READ_ONLY);
-		mmu->current_rom = ROM_0_BANK;
-	}
+	mmu->display_bank = (data & (1 << 3)) ? RAM_7_BANK : RAM_5_BANK;
+
+	_apply_paging(mmu);
 
 	if (data & (1 << 5)) {
 		// bit 5 prevents further changes to memory pages
@@ -87,6 +251,18 @@ void _zx_MMU_update_memory_map_zx128(z80_mmu_t *mmu, uint8_t data) {
 
 }
 
+// Port 0x1FFD (+3 only): bit 0 special paging, bits 1-2 special configuration or high rom bit
+// (bit 3 disk motor and bit 4 printer strobe are none of the mmu's business)
+// the lock bit of 0x7FFD covers this port as well
+void _zx_MMU_update_memory_map_plus3(z80_mmu_t *mmu, uint8_t data) {
+
+	if (mmu->enable_128k_banking == false)
+		return;
+
+	mmu->last_1ffd = data;
+	_apply_paging(mmu);
+}
+
 // ----------------------------------------------------------------------------
 
 static void _setup_boot_mappings(z80_mmu_t *mmu, zx_type_t system_type) {
@@ -105,58 +281,98 @@ static void _setup_boot_mappings(z80_mmu_t *mmu, zx_type_t system_type) {
 	z80_mmu_MemMap(mmu, 2, RAM_2_BANK, M_READ_WRITE);
 	z80_mmu_MemMap(mmu, 3, RAM_0_BANK, M_READ_WRITE);
 
+	mmu->display_bank = RAM_5_BANK;
+	mmu->last_7ffd = 0;
+	mmu->last_1ffd = 0;
+	mmu->b_all_ram = false;
+}
 
-	/*
-	mmu->visible_pages[0].index = 0;
-	mmu->visible_pages[0].mapping_type = M_READ_ONLY;
-	mmu->visible_pages[1].index = 1;
-	mmu->visible_pages[1].mapping_type = M_READ_ONLY;
-	mmu->visible_pages[2].index = 2;
-	mmu->visible_pages[2].mapping_type = M_READ_WRITE;
-	mmu->visible_pages[3].index = 3;
-	mmu->visible_pages[3].mapping_type = M_READ_WRITE;
-	mmu->visible_pages[4].index = 4;
-	mmu->visible_pages[4].mapping_type = M_READ_WRITE;
-	mmu->visible_pages[5].index = 5;
-	mmu->visible_pages[5].mapping_type = M_READ_WRITE;
-	mmu->visible_pages[6].index = 6;
-	mmu->visible_pages[6].mapping_type = M_READ_WRITE;
-	mmu->visible_pages[7].index = 7;
-	mmu->visible_pages[7].mapping_type = M_READ_WRITE;
-	*/
+// roms selectable through the paging ports (see _apply_paging())
+static void _setup_rom_banks(z80_mmu_t *mmu, zx_type_t system_type) {
+	static const int ROMS_128K[4] = { ROM_0_BANK, ROM_1_BANK, ROM_0_BANK, ROM_1_BANK };
+	static const int ROMS_PLUS3[4] = { ROM_0_BANK, ROM_4_BANK, ROM_5_BANK, ROM_1_BANK };
+	memcpy(mmu->rom_banks, system_type == ZX_TYPE_PLUS3 ? ROMS_PLUS3 : ROMS_128K, sizeof(mmu->rom_banks));
+}
+
+// number of ram banks the model actually has
+static int _num_ram_banks(zx_type_t system_type) {
+	switch (system_type) {
+	case ZX_TYPE_48K:	return RAM_5_BANK + 1;		// only 0, 2 and 5 ever get mapped
+	case ZX_TYPE_128K:
+	case ZX_TYPE_PLUS3:	return RAM_7_BANK + 1;
+	default:			return DIVMMC_RAM_BANK;		// everything up to the peripheral ram
+	}
+}
+
+// banks the ula competes with the cpu for
+static uint64_t _contended_banks(zx_type_t system_type) {
+	if (system_type == ZX_TYPE_48K)
+		return BANK_BIT(RAM_5_BANK);
+	// +3: the gate array contends the top four banks
+	if (system_type == ZX_TYPE_PLUS3)
+		return BANK_BIT(RAM_4_BANK) | BANK_BIT(RAM_5_BANK) | BANK_BIT(RAM_6_BANK) | BANK_BIT(RAM_7_BANK);
+	// 128k: the odd banks (which includes both screens)
+	return BANK_BIT(RAM_1_BANK) | BANK_BIT(RAM_3_BANK) | BANK_BIT(RAM_5_BANK) | BANK_BIT(RAM_7_BANK);
 }
 
 void z80_mmu_Reset(z80_mmu_t *mmu, zx_type_t system_type) {
+	
+	mmu->num_ram_banks = _num_ram_banks(system_type);
+	mmu->contended_banks = _contended_banks(system_type);
+	_setup_rom_banks(mmu, system_type);
+
+	// clear ram: only banks that have actually been written need any work
+	// (note that FIRST_ROM_BANK will always be the first non ram bank)
+	// with a mapped pool we can't tell, so all banks of the model get cleared
+	if (mmu->memory) {
+		for(int bank = 0; bank < mmu->num_ram_banks; bank++)
+			memset((void*)mmu->banks[bank], 0, MEM_BANK_SIZE);
+	}
+	else {
+		for(int bank = 0; bank < FIRST_ROM_BANK; bank++)
+			_release_bank(mmu, bank);
+	}
+
 	// create the default startup mappings
 	_setup_boot_mappings(mmu, system_type);
 
-	// clear ram (note that ROM_0 will always be the first non ram bank)
-	for(int bank = 0; bank < ROM_0_BANK; bank++)
-		memset((void*)mmu->banks[bank], 0, MEM_BANK_SIZE);
+	mmu->enable_128k_banking = (system_type != ZX_TYPE_48K);
+}
 
-	if (system_type == ZX_TYPE_128K)
-		mmu->enable_128k_banking = true;
+// Switch the mmu over to a contiguous backing store of MEM_POOL_SIZE bytes
+// (for example a memory mapped file): contents are NOT copied, the caller takes care of that.
+// Any privately allocated banks are released. The slot mappings remain the same.
+void z80_mmu_Rebind(z80_mmu_t *mmu, uint8_t *memory) {
 
+	for (int bank = 0; bank < MEM_NUM_BANKS; bank++) {
+		if (!mmu->memory)
+			_release_bank(mmu, bank);
+		_bind_bank(mmu, bank, memory + bank * MEM_BANK_SIZE);
+	}
+	mmu->memory = memory;
+	mmu->banks_allocated = ~0ull;
+
+	_update_slots(mmu);
 }
 
 void z80_mmu_Init(z80_mmu_t *mmu, zx_type_t system_type) {
 
-	memset((void*)mmu->memory, 0, MEM_BANK_SIZE*MEM_NUM_BANKS);
+	// nothing is allocated yet: all banks read as zero
+	mmu->memory = NULL;
+	mmu->banks_allocated = 0;
+	mmu->trap_banks = 0;
+	mmu->device_banks = 0;
+	for (int bank = 0; bank < MEM_NUM_BANKS; bank++)
+		_bind_bank(mmu, bank, ZERO_BANK);
 
-	// create mappings for banks and pages
-	// we simply map consecutive chunks of the allocated memory into the bank/page slots
-	for (int bank = 0; bank < MEM_NUM_BANKS; bank++) {
-		mmu->banks[bank] = (uint8_t *)mmu->memory + bank * MEM_BANK_SIZE;
-	}
-	for (int page = 0; page < MEM_NUM_PAGES; page++) {
-		mmu->pages[page] = (uint8_t *)mmu->memory + page * MEM_PAGE_SIZE;
-	}
+	mmu->num_ram_banks = _num_ram_banks(system_type);
+	mmu->contended_banks = _contended_banks(system_type);
+	_setup_rom_banks(mmu, system_type);
 
 	// create the default startup mappings
 	_setup_boot_mappings(mmu, system_type);
 
-	if (system_type == ZX_TYPE_128K)
-		mmu->enable_128k_banking = true;
+	mmu->enable_128k_banking = (system_type != ZX_TYPE_48K);
 }
 
 
@@ -5,6 +5,7 @@ extern "C" {
 #endif
 
 #include <stdint.h>
+#include <stddef.h>
 #include "spectrum.h"
 
 enum MEM_MAPPING_TYPE { M_READ_WRITE, M_READ_ONLY};
@@ -14,13 +15,19 @@ enum MEM_MAPPING_TYPE { M_READ_WRITE, M_READ_ONLY};
 #define MEM_PAGE_SIZE   (MEM_BANK_SIZE/2)
 #define MEM_NUM_BANKS   64                  // 64 banks = 1024k (more is not possible without changing bios banking)
 #define MEM_NUM_PAGES   (MEM_NUM_BANKS*2)
+#define MEM_POOL_SIZE   (MEM_BANK_SIZE*MEM_NUM_BANKS)
+#define MEM_NUM_SLOTS   8                   // the Z80 address space as seen by the mmu: 8 slots of 8k
+#define MEM_SLOT_SHIFT  13
 
 // Note: when changing this scheme (adding more rom banks for example)
-// make sure that ROM_0_BANK remains the first non ram bank
-#define ROM_3_BANK (MEM_NUM_BANKS-1)	// the interface 1 rom
+// make sure that FIRST_ROM_BANK remains the first non ram bank
+#define ROM_3_BANK (MEM_NUM_BANKS-1)	// 8k roms of peripherals: interface 1 and divmmc (see below)
 #define ROM_2_BANK (MEM_NUM_BANKS-2)	// the original 48k rom
-#define ROM_1_BANK (MEM_NUM_BANKS-3)	// 128k rom1 (basically a 48k rom)
-#define ROM_0_BANK (MEM_NUM_BANKS-4)	// 128k rom0
+#define ROM_1_BANK (MEM_NUM_BANKS-3)	// 128k rom1 (basically a 48k rom), +3 rom 3 (48k basic)
+#define ROM_0_BANK (MEM_NUM_BANKS-4)	// 128k rom0, +3 rom 0 (editor)
+#define ROM_4_BANK (MEM_NUM_BANKS-5)	// +3 rom 1 (syntax checker)
+#define ROM_5_BANK (MEM_NUM_BANKS-6)	// +3 rom 2 (+3DOS)
+#define FIRST_ROM_BANK	ROM_5_BANK
 
 #define RAM_0_BANK 0
 #define RAM_1_BANK 1
@@ -35,6 +42,13 @@ enum MEM_MAPPING_TYPE { M_READ_WRITE, M_READ_ONLY};
 #define ULAX_1_BANK 9	// extended ULA: bank 2 for display mode 2
 #define ULAX_2_BANK 10	// extended ULA: bank 3 for display mode 2
 
+// peripherals: their 8k roms share ROM_3, their ram sits right below the rom banks
+#define IF1_ROM_PAGE		(ROM_3_BANK*2)			// interface 1 rom
+#define DIVMMC_ROM_PAGE		(ROM_3_BANK*2+1)		// divmmc (esxdos) rom
+#define DIVMMC_RAM_BANKS	8						// 128k: 16 pages of 8k
+#define DIVMMC_RAM_BANK		(FIRST_ROM_BANK-DIVMMC_RAM_BANKS)
+#define DIVMMC_RAM_PAGE		(DIVMMC_RAM_BANK*2)
+
 
 typedef struct {
 	int index;
@@ -43,26 +57,63 @@ typedef struct {
 
 // we manage memory in banks of 16k and pages of 8k
 // the 16k bank is mostly required for spectrum 128k compatibility
+//
+// Banks are allocated lazily: until a bank is written to for the first time it is backed
+// by a shared (read only) zero bank. Only banks that exist on the emulated model (zx_type_t)
+// are allocated at all, writes to any other bank are dropped.
 typedef struct {
 
-	// overall memory pool
-	uint8_t memory[MEM_BANK_SIZE*MEM_NUM_BANKS];	// raw memory
+	// overall memory pool: NULL unless a memory mapped file has been bound via z80_mmu_Rebind()
+	// (see spectrum_persist.c), in which case all banks live inside this pool
+	uint8_t *memory;	// raw memory (MEM_POOL_SIZE bytes)
 
 	uint8_t *banks[MEM_NUM_BANKS];	// tables of bank and page physical start adresses
 	uint8_t *pages[MEM_NUM_PAGES];
 
+	uint64_t banks_allocated;		// bit n set: bank n is backed by its own memory (has been written)
+	int num_ram_banks;				// ram banks 0..num_ram_banks-1 exist on this model
+	uint64_t device_banks;			// ram of attached peripherals: writable on any model
+
 	// memory actually "visible" to the Z80 (mapped from the overall pool)
+	// visible_pages is authoritative, visible_banks remembers the last 16k mapping per 16k slot
 	z80_mmu_mapping_t visible_banks[4];
-	z80_mmu_mapping_t visible_pages[8];
+	z80_mmu_mapping_t visible_pages[MEM_NUM_SLOTS];
+
+	// physical base address per visible 8k slot, recalculated whenever a mapping changes
+	// slot_write is NULL for read only slots and for banks that have not been allocated yet
+	uint8_t *slot_read[MEM_NUM_SLOTS];
+	uint8_t *slot_write[MEM_NUM_SLOTS];
+
+	// ula contention: banks shared with the video scanout, and whether a slot currently maps one
+	uint64_t contended_banks;
+	bool slot_contended[MEM_NUM_SLOTS];
+
+	// cpu traps: banks with trapped rom routines, and whether a slot currently maps one
+	uint64_t trap_banks;
+	bool slot_traps[MEM_NUM_SLOTS];
 
 	int current_rom;
+	int rom_banks[4];				// roms selectable through the paging ports
+	int display_bank;				// RAM_5_BANK or RAM_7_BANK (128k shadow screen)
+	uint8_t last_7ffd;				// last value written to the 128k paging port
+	uint8_t last_1ffd;				// last value written to the +3 paging port
 	bool enable_128k_banking;
+	bool b_all_ram;					// +3 special paging: ram in all four 16k slots
 
 } z80_mmu_t;
 
 
 void z80_mmu_Init(z80_mmu_t *mmu, zx_type_t system_type);
 void z80_mmu_Reset(z80_mmu_t *mmu, zx_type_t system_type);
+void z80_mmu_Rebind(z80_mmu_t *mmu, uint8_t *memory);
+int z80_mmu_MemMap(z80_mmu_t *mmu, int slot, int bank_no, enum MEM_MAPPING_TYPE mapping_type);
+int z80_mmu_PageMap(z80_mmu_t *mmu, int slot, int page_no, enum MEM_MAPPING_TYPE mapping_type);
+void z80_mmu_SetTrapBanks(z80_mmu_t *mmu, uint64_t trap_banks);
+void z80_mmu_LoadROM(z80_mmu_t *mmu, int bank_no, const uint8_t *data, size_t size);
+void z80_mmu_LoadROMPage(z80_mmu_t *mmu, int page_no, const uint8_t *data, size_t size);
+void z80_mmu_AddDeviceBanks(z80_mmu_t *mmu, int bank_no, int num_banks);
+bool z80_mmu_FaultWrite(z80_mmu_t *mmu, int slot);
+uint8_t *z80_mmu_WriteBank(z80_mmu_t *mmu, int bank_no);
 
 #if 0
 // convert a virtual address into an actual physical address in the host machines memory address space
@@ -84,23 +135,19 @@ void z80_mm_PutWord(z80_mmu_t *mmu, uint16_t word, uint16_t virtual_address);
 
 static inline void *z80_mmu_GetPhysicalAddress(z80_mmu_t *mmu, uint16_t virtual_address) {
 	
-	// determine visible (bank) slot and offset from va
-	int bank = virtual_address / MEM_BANK_SIZE;
-	int offset = virtual_address % MEM_BANK_SIZE;
+	// determine visible (page) slot and offset from va
+	int slot = virtual_address / MEM_PAGE_SIZE;
+	int offset = virtual_address % MEM_PAGE_SIZE;
 
-	uint8_t *base_address = mmu->banks[mmu->visible_banks[bank].index];
-	return (void*)(base_address + offset);
+	return (void*)(mmu->slot_read[slot] + offset);
 }
 
 static inline uint8_t z80_mmu_GetByte(z80_mmu_t *mmu, uint16_t virtual_address) {
-	uint8_t *addr = (uint8_t*)z80_mmu_GetPhysicalAddress(mmu, virtual_address);
-	return *addr;
+	return mmu->slot_read[virtual_address / MEM_PAGE_SIZE][virtual_address % MEM_PAGE_SIZE];
 }
 
 static inline uint16_t z80_mmu_GetWord(z80_mmu_t *mmu, uint16_t virtual_address) {
-	uint8_t *addr0 = (uint8_t *)z80_mmu_GetPhysicalAddress(mmu, virtual_address);
-	uint8_t *addr1 = (uint8_t *)z80_mmu_GetPhysicalAddress(mmu, virtual_address+1);
-	return (*addr0) + *(addr1) * 256;
+	return z80_mmu_GetByte(mmu, virtual_address) + z80_mmu_GetByte(mmu, virtual_address+1) * 256;
 }
 
 // Copy a block of memory from emulation virtual memory space to host memory space
@@ -116,33 +163,28 @@ void *z80_mmu_GetMultiByte(z80_mmu_t *mmu, uint16_t virtual_address, pointer_t d
 } */
 
 static inline void z80_mmu_PutByte(z80_mmu_t *mmu, uint8_t byte, uint16_t virtual_address) {
-	int bank = virtual_address / MEM_BANK_SIZE;
+	int slot = virtual_address / MEM_PAGE_SIZE;
 
-	// prevent writing to ROM (RAM under ROM not yet implemented)
-	if (mmu->visible_banks[bank].mapping_type == M_READ_WRITE) {
-		uint8_t *addr = (uint8_t*)z80_mmu_GetPhysicalAddress(mmu, virtual_address);
-		*addr = byte;
-	}
+	// slot_write is NULL for ROM (writes are dropped, RAM under ROM not yet implemented)
+	// and for banks that are still backed by the zero bank (these get allocated now)
+	if (mmu->slot_write[slot] || z80_mmu_FaultWrite(mmu, slot))
+		mmu->slot_write[slot][virtual_address % MEM_PAGE_SIZE] = byte;
 }
 
 // as usual: low byte then high byte
 static inline void z80_mmu_PutWord(z80_mmu_t *mmu, uint16_t word, uint16_t virtual_address) {
-	int bank = virtual_address / MEM_BANK_SIZE;
-
-	// prevent writing to ROM (RAM under ROM not yet implemented)
-	if (mmu->visible_banks[bank].mapping_type == M_READ_WRITE) {
-		uint8_t *addr = (uint8_t*)z80_mmu_GetPhysicalAddress(mmu, virtual_address);
-		*addr = (word & 0x00ff);
-		*(addr+1) = ((word & 0xff00)>>8);
-	}
+	z80_mmu_PutByte(mmu, (word & 0x00ff), virtual_address);
+	z80_mmu_PutByte(mmu, ((word & 0xff00)>>8), virtual_address+1);
 }
 
 
 // NOTE: this one is fast but potentially dangerous (see source code comments)
 //extern pointer_t zx_MMU_GetMultiByte(zx_mmu_t *mmu, uint16_t virtual_address, pointer_t dest_addr, uint16_t size);
 
-// 128k style BANK mapping
-//void _zx_MMU_update_memory_map_zx128(zx_mmu_t *mmu, uint8_t data);
+// 128k style BANK mapping (port 0x7FFD)
+void _zx_MMU_update_memory_map_zx128(z80_mmu_t *mmu, uint8_t data);
+// +3 rom selection and special (all ram) paging (port 0x1FFD)
+void _zx_MMU_update_memory_map_plus3(z80_mmu_t *mmu, uint8_t data);
 
 // use with care
 //extern int zx_MMU_MemMap(zx_mmu_t *mmu, int slot, int bank_no, enum MEM_MAPPING_TYPE mapping_type);